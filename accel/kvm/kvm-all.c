@@ -53,6 +53,7 @@
 
 #include "hw/boards.h"
 #include "system/stats.h"
+#include "block/thread-pool.h"
 
 /* This check must be after config-host.h is included */
 #ifdef CONFIG_EVENTFD
@@ -178,6 +179,31 @@ void kvm_resample_fd_notify(int gsi)
     }
 }
 
+/* Called with KVMMemoryListener.slots_lock held */
+static void kvm_slot_insert(KVMMemoryListener *kml, KVMSlot *mem)
+{
+    mem->gpa_node.start = mem->start_addr;
+    mem->gpa_node.last = mem->start_addr + mem->memory_size - 1;
+    interval_tree_insert(&mem->gpa_node, &kml->slots_by_gpa);
+
+    mem->hva_node.start = (uintptr_t)mem->ram;
+    mem->hva_node.last = (uintptr_t)mem->ram + mem->memory_size - 1;
+    interval_tree_insert(&mem->hva_node, &kml->slots_by_hva);
+
+    set_bit(mem - kml->slots, kml->slots_used);
+    kml->nr_slots_used++;
+}
+
+/* Called with KVMMemoryListener.slots_lock held */
+static void kvm_slot_remove(KVMMemoryListener *kml, KVMSlot *mem)
+{
+    interval_tree_remove(&mem->gpa_node, &kml->slots_by_gpa);
+    interval_tree_remove(&mem->hva_node, &kml->slots_by_hva);
+
+    clear_bit(mem - kml->slots, kml->slots_used);
+    kml->nr_slots_used--;
+}
+
 /**
  * kvm_slots_grow(): Grow the slots[] array in the KVMMemoryListener
  *
@@ -219,8 +245,20 @@ static bool kvm_slots_grow(KVMMemoryListener *kml, unsigned int nr_slots_new)
 
     kml->slots = slots;
     kml->nr_slots_allocated = nr_slots_new;
+    kml->slots_used = bitmap_zero_extend(kml->slots_used, cur, nr_slots_new);
     trace_kvm_slots_grow(cur, nr_slots_new);
 
+    /* The slots moved, rebuild the trees */
+    kml->slots_by_gpa = (IntervalTreeRoot) {};
+    kml->slots_by_hva = (IntervalTreeRoot) {};
+    kml->nr_slots_used = 0;
+    bitmap_zero(kml->slots_used, nr_slots_new);
+    for (i = 0; i < cur; i++) {
+        if (slots[i].memory_size) {
+            kvm_slot_insert(kml, &slots[i]);
+        }
+    }
+
     return true;
 }
 
@@ -258,12 +296,10 @@ unsigned int kvm_get_free_memslots(void)
 static KVMSlot *kvm_get_free_slot(KVMMemoryListener *kml)
 {
     unsigned int n;
-    int i;
 
-    for (i = 0; i < kml->nr_slots_allocated; i++) {
-        if (kml->slots[i].memory_size == 0) {
-            return &kml->slots[i];
-        }
+    n = find_first_zero_bit(kml->slots_used, kml->nr_slots_allocated);
+    if (n < kml->nr_slots_allocated) {
+        return &kml->slots[n];
     }
 
     /*
@@ -297,10 +333,17 @@ static KVMSlot *kvm_lookup_matching_slot(KVMMemoryListener *kml,
                                          hwaddr start_addr,
                                          hwaddr size)
 {
-    int i;
+    IntervalTreeNode *node;
 
-    for (i = 0; i < kml->nr_slots_allocated; i++) {
-        KVMSlot *mem = &kml->slots[i];
+    if (!size) {
+        return NULL;
+    }
+
+    /* The slots of an address space don't overlap */
+    node = interval_tree_iter_first(&kml->slots_by_gpa, start_addr,
+                                    start_addr + size - 1);
+    if (node) {
+        KVMSlot *mem = container_of(node, KVMSlot, gpa_node);
 
         if (start_addr == mem->start_addr && size == mem->memory_size) {
             return mem;
@@ -338,17 +381,17 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
                                        hwaddr *phys_addr)
 {
     KVMMemoryListener *kml = &s->memory_listener;
-    int i, ret = 0;
+    IntervalTreeNode *node;
+    int ret = 0;
 
     kvm_slots_lock();
-    for (i = 0; i < kml->nr_slots_allocated; i++) {
-        KVMSlot *mem = &kml->slots[i];
+    node = interval_tree_iter_first(&kml->slots_by_hva, (uintptr_t)ram,
+                                    (uintptr_t)ram);
+    if (node) {
+        KVMSlot *mem = container_of(node, KVMSlot, hva_node);
 
-        if (ram >= mem->ram && ram < mem->ram + mem->memory_size) {
-            *phys_addr = mem->start_addr + (ram - mem->ram);
-            ret = 1;
-            break;
-        }
+        *phys_addr = mem->start_addr + (ram - mem->ram);
+        ret = 1;
     }
     kvm_slots_unlock();
 
@@ -541,6 +584,8 @@ static int do_kvm_destroy_vcpu(CPUState *cpu)
         cpu->kvm_dirty_gfns = NULL;
     }
 
+    g_clear_pointer(&cpu->kvm_mmio_cache, g_free);
+
     kvm_park_vcpu(cpu);
 err:
     return ret;
@@ -615,7 +660,9 @@ int kvm_init_vcpu(CPUState *cpu, Error **errp)
         error_setg_errno(errp, -ret,
                          "kvm_init_vcpu: kvm_arch_init_vcpu failed (%lu)",
                          kvm_arch_vcpu_id(cpu));
+        goto err;
     }
+    cpu->kvm_mmio_cache = g_new0(MMIOCache, 1);
     cpu->kvm_vcpu_stats_fd = kvm_vcpu_ioctl(cpu, KVM_GET_STATS_FD, NULL);
 
 err:
@@ -820,7 +867,10 @@ static bool kvm_slot_get_dirty_log(KVMState *s, KVMSlot *slot)
     return ret == 0;
 }
 
-/* Should be with all slots_lock held for the address spaces. */
+/*
+ * Should be with all slots_lock held for the address spaces.  The rings
+ * may be reaped in parallel, so set the bits atomically.
+ */
 static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
                                      uint32_t slot_id, uint64_t offset)
 {
@@ -839,7 +889,7 @@ static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
         return;
     }
 
-    set_bit(offset, mem->dirty_bmap);
+    set_bit_atomic(offset, mem->dirty_bmap);
 }
 
 static bool dirty_gfn_is_dirtied(struct kvm_dirty_gfn *gfn)
@@ -912,6 +962,76 @@ static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
     return count;
 }
 
+/* Minimum number of vCPUs worth giving to a reaping thread */
+#define KVM_DIRTY_RING_REAP_BATCH 32
+
+typedef struct KVMDirtyRingReapJob {
+    KVMState *s;
+    CPUState **cpus;
+    unsigned nr_cpus;
+    uint64_t count;
+} KVMDirtyRingReapJob;
+
+static int kvm_dirty_ring_reap_job(void *opaque)
+{
+    KVMDirtyRingReapJob *job = opaque;
+    unsigned i;
+
+    for (i = 0; i < job->nr_cpus; i++) {
+        job->count += kvm_dirty_ring_reap_one(job->s, job->cpus[i]);
+    }
+    return 0;
+}
+
+/*
+ * Reap the rings of all vCPUs, splitting them between the threads of the
+ * reaper pool.  The caller holds the BQL, so the vCPU list can't change.
+ */
+static uint64_t kvm_dirty_ring_reap_all(KVMState *s)
+{
+    struct KVMDirtyRingReaper *r = &s->reaper;
+    g_autoptr(GPtrArray) cpus = g_ptr_array_new();
+    g_autofree KVMDirtyRingReapJob *jobs = NULL;
+    unsigned nr_jobs, per_job, i;
+    uint64_t total = 0;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        g_ptr_array_add(cpus, cpu);
+    }
+
+    nr_jobs = MIN(r->threads,
+                  DIV_ROUND_UP(cpus->len, KVM_DIRTY_RING_REAP_BATCH));
+    if (!r->pool || nr_jobs <= 1) {
+        for (i = 0; i < cpus->len; i++) {
+            total += kvm_dirty_ring_reap_one(s, cpus->pdata[i]);
+        }
+        return total;
+    }
+
+    jobs = g_new0(KVMDirtyRingReapJob, nr_jobs);
+    per_job = DIV_ROUND_UP(cpus->len, nr_jobs);
+    for (i = 0; i < nr_jobs; i++) {
+        jobs[i].s = s;
+        jobs[i].cpus = (CPUState **)cpus->pdata + i * per_job;
+        jobs[i].nr_cpus = MIN(per_job, cpus->len - i * per_job);
+    }
+
+    /* The calling thread takes the first batch */
+    for (i = 1; i < nr_jobs; i++) {
+        thread_pool_submit(r->pool, kvm_dirty_ring_reap_job, &jobs[i], NULL);
+    }
+    kvm_dirty_ring_reap_job(&jobs[0]);
+    thread_pool_wait(r->pool);
+
+    for (i = 0; i < nr_jobs; i++) {
+        total += jobs[i].count;
+    }
+    trace_kvm_dirty_ring_reap_parallel(nr_jobs, cpus->len);
+
+    return total;
+}
+
 /* Must be with slots_lock held */
 static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
 {
@@ -924,9 +1044,7 @@ static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
     if (cpu) {
         total = kvm_dirty_ring_reap_one(s, cpu);
     } else {
-        CPU_FOREACH(cpu) {
-            total += kvm_dirty_ring_reap_one(s, cpu);
-        }
+        total = kvm_dirty_ring_reap_all(s);
     }
 
     if (total) {
@@ -1181,8 +1299,9 @@ static int kvm_physical_log_clear(KVMMemoryListener *kml,
 {
     KVMState *s = kvm_state;
     uint64_t start, size, offset, count;
+    IntervalTreeNode *node;
     KVMSlot *mem;
-    int ret = 0, i;
+    int ret = 0;
 
     if (!s->manual_dirty_log_protect) {
         /* No need to do explicit clear */
@@ -1199,14 +1318,11 @@ static int kvm_physical_log_clear(KVMMemoryListener *kml,
 
     kvm_slots_lock();
 
-    for (i = 0; i < kml->nr_slots_allocated; i++) {
-        mem = &kml->slots[i];
-        /* Discard slots that are empty or do not overlap the section */
-        if (!mem->memory_size ||
-            mem->start_addr > start + size - 1 ||
-            start > mem->start_addr + mem->memory_size - 1) {
-            continue;
-        }
+    for (node = interval_tree_iter_first(&kml->slots_by_gpa, start,
+                                         start + size - 1);
+         node;
+         node = interval_tree_iter_next(node, start, start + size - 1)) {
+        mem = container_of(node, KVMSlot, gpa_node);
 
         if (start >= mem->start_addr) {
             /* The slot starts before section or is aligned to it.  */
@@ -1567,6 +1683,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             }
 
             /* unregister the slot */
+            kvm_slot_remove(kml, mem);
             g_free(mem->dirty_bmap);
             mem->dirty_bmap = NULL;
             mem->memory_size = 0;
@@ -1579,7 +1696,6 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             }
             start_addr += slot_size;
             size -= slot_size;
-            kml->nr_slots_used--;
         } while (size);
         return;
     }
@@ -1614,11 +1730,12 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             }
         }
 
+        kvm_slot_insert(kml, mem);
+
         start_addr += slot_size;
         ram_start_offset += slot_size;
         ram += slot_size;
         size -= slot_size;
-        kml->nr_slots_used++;
     } while (size);
 }
 
@@ -1657,10 +1774,22 @@ static void *kvm_dirty_ring_reaper_thread(void *data)
     g_assert_not_reached();
 }
 
-static void kvm_dirty_ring_reaper_init(KVMState *s)
+static void kvm_dirty_ring_reaper_init(KVMState *s, MachineState *ms)
 {
     struct KVMDirtyRingReaper *r = &s->reaper;
 
+    r->threads = s->kvm_dirty_ring_reap_threads;
+    if (!r->threads) {
+        r->threads = MIN(DIV_ROUND_UP(ms->smp.max_cpus,
+                                      KVM_DIRTY_RING_REAP_BATCH),
+                         g_get_num_processors());
+    }
+    if (r->threads > 1) {
+        r->pool = thread_pool_new();
+        /* The thread asking for the rings to be reaped does its share */
+        thread_pool_set_max_threads(r->pool, r->threads - 1);
+    }
+
     qemu_thread_create(&r->reaper_thr, "kvm-reaper",
                        kvm_dirty_ring_reaper_thread,
                        s, QEMU_THREAD_JOINABLE);
@@ -2808,7 +2937,7 @@ static int kvm_init(AccelState *as, MachineState *ms)
     }
 
     if (s->kvm_dirty_ring_size) {
-        kvm_dirty_ring_reaper_init(s);
+        kvm_dirty_ring_reaper_init(s, ms);
     }
 
     if (kvm_check_extension(kvm_state, KVM_CAP_BINARY_STATS_FD)) {
@@ -2837,16 +2966,16 @@ void kvm_set_sigmask_len(KVMState *s, unsigned int sigmask_len)
     s->sigmask_len = sigmask_len;
 }
 
-static void kvm_handle_io(uint16_t port, MemTxAttrs attrs, void *data, int direction,
-                          int size, uint32_t count)
+static void kvm_handle_io(CPUState *cpu, uint16_t port, MemTxAttrs attrs,
+                          void *data, int direction, int size, uint32_t count)
 {
     int i;
     uint8_t *ptr = data;
 
     for (i = 0; i < count; i++) {
-        address_space_rw(&address_space_io, port, attrs,
-                         ptr, size,
-                         direction == KVM_EXIT_IO_OUT);
+        address_space_rw_mmio(&address_space_io, cpu->kvm_mmio_cache,
+                              port, attrs, ptr, size,
+                              direction == KVM_EXIT_IO_OUT);
         ptr += size;
     }
 }
@@ -3243,7 +3372,7 @@ int kvm_cpu_exec(CPUState *cpu)
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
             /* Called outside BQL */
-            kvm_handle_io(run->io.port, attrs,
+            kvm_handle_io(cpu, run->io.port, attrs,
                           (uint8_t *)run + run->io.data_offset,
                           run->io.direction,
                           run->io.size,
@@ -3252,11 +3381,12 @@ int kvm_cpu_exec(CPUState *cpu)
             break;
         case KVM_EXIT_MMIO:
             /* Called outside BQL */
-            address_space_rw(&address_space_memory,
-                             run->mmio.phys_addr, attrs,
-                             run->mmio.data,
-                             run->mmio.len,
-                             run->mmio.is_write);
+            address_space_rw_mmio(&address_space_memory,
+                                  cpu->kvm_mmio_cache,
+                                  run->mmio.phys_addr, attrs,
+                                  run->mmio.data,
+                                  run->mmio.len,
+                                  run->mmio.is_write);
             ret = 0;
             break;
         case KVM_EXIT_IRQ_WINDOW_OPEN:
@@ -3280,6 +3410,7 @@ int kvm_cpu_exec(CPUState *cpu)
              * still full.  Got kicked by KVM_RESET_DIRTY_RINGS.
              */
             trace_kvm_dirty_ring_full(cpu->cpu_index);
+            cpu->dirty_ring_full_exits++;
             bql_lock();
             /*
              * We throttle vCPU by making it sleep once it exit from kernel
@@ -3951,6 +4082,35 @@ static void kvm_set_dirty_ring_size(Object *obj, Visitor *v,
     s->kvm_dirty_ring_size = value;
 }
 
+static void kvm_get_dirty_ring_reap_threads(Object *obj, Visitor *v,
+                                            const char *name, void *opaque,
+                                            Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value = s->kvm_dirty_ring_reap_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void kvm_set_dirty_ring_reap_threads(Object *obj, Visitor *v,
+                                            const char *name, void *opaque,
+                                            Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value;
+
+    if (s->fd != -1) {
+        error_setg(errp, "Cannot set properties after the accelerator has been initialized");
+        return;
+    }
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+
+    s->kvm_dirty_ring_reap_threads = value;
+}
+
 static char *kvm_get_device(Object *obj,
                             Error **errp G_GNUC_UNUSED)
 {
@@ -3996,6 +4156,7 @@ static void kvm_accel_instance_init(Object *obj)
     /* KVM dirty ring is by default off */
     s->kvm_dirty_ring_size = 0;
     s->kvm_dirty_ring_with_bitmap = false;
+    s->kvm_dirty_ring_reap_threads = 0;
     s->kvm_eager_split_size = 0;
     s->notify_vmexit = NOTIFY_VMEXIT_OPTION_RUN;
     s->notify_window = 0;
@@ -4044,6 +4205,13 @@ static void kvm_accel_class_init(ObjectClass *oc, const void *data)
     object_class_property_set_description(oc, "dirty-ring-size",
         "Size of KVM dirty page ring buffer (default: 0, i.e. use bitmap)");
 
+    object_class_property_add(oc, "dirty-ring-reap-threads", "uint32",
+        kvm_get_dirty_ring_reap_threads, kvm_set_dirty_ring_reap_threads,
+        NULL, NULL);
+    object_class_property_set_description(oc, "dirty-ring-reap-threads",
+        "Number of threads reaping the KVM dirty rings "
+        "(default: 0, i.e. one per 32 vCPUs)");
+
     object_class_property_add_str(oc, "device", kvm_get_device, kvm_set_device);
     object_class_property_set_description(oc, "device",
         "Path to the device node to use (default: /dev/kvm)");
@@ -4150,6 +4318,59 @@ static StatsList *add_kvmstat_entry(struct kvm_stats_desc *pdesc,
     return stats_list;
 }
 
+/* Statistics kept by QEMU itself, reported along with the vCPU ones */
+static StatsList *add_qemu_vcpu_stats(CPUState *cpu, strList *names,
+                                      StatsList *stats_list)
+{
+    const struct {
+        const char *name;
+        uint64_t value;
+    } qemu_stats[] = {
+        { "dirty_ring_full_exits", cpu->dirty_ring_full_exits },
+        { "dirty_ring_pages", cpu->dirty_pages },
+    };
+    Stats *stats;
+    int i;
+
+    if (!kvm_dirty_ring_enabled()) {
+        return stats_list;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(qemu_stats); i++) {
+        if (!apply_str_list_filter(qemu_stats[i].name, names)) {
+            continue;
+        }
+        stats = g_new0(Stats, 1);
+        stats->name = g_strdup(qemu_stats[i].name);
+        stats->value = g_new0(StatsValue, 1);
+        stats->value->type = QTYPE_QNUM;
+        stats->value->u.scalar = qemu_stats[i].value;
+        QAPI_LIST_PREPEND(stats_list, stats);
+    }
+    return stats_list;
+}
+
+static StatsSchemaValueList *add_qemu_vcpu_schema(StatsSchemaValueList *list)
+{
+    static const char *const names[] = {
+        "dirty_ring_full_exits", "dirty_ring_pages",
+    };
+    StatsSchemaValue *value;
+    int i;
+
+    if (!kvm_dirty_ring_enabled()) {
+        return list;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(names); i++) {
+        value = g_new0(StatsSchemaValue, 1);
+        value->name = g_strdup(names[i]);
+        value->type = STATS_TYPE_CUMULATIVE;
+        QAPI_LIST_PREPEND(list, value);
+    }
+    return list;
+}
+
 static StatsSchemaValueList *add_kvmschema_entry(struct kvm_stats_desc *pdesc,
                                                  StatsSchemaValueList *list,
                                                  Error **errp)
@@ -4343,6 +4564,10 @@ static void query_stats(StatsResultList **result, StatsTarget target,
         stats_list = add_kvmstat_entry(pdesc, stats, stats_list, errp);
     }
 
+    if (target == STATS_TARGET_VCPU) {
+        stats_list = add_qemu_vcpu_stats(cpu, names, stats_list);
+    }
+
     if (!stats_list) {
         return;
     }
@@ -4387,6 +4612,10 @@ static void query_stats_schema(StatsSchemaList **result, StatsTarget target,
         stats_list = add_kvmschema_entry(pdesc, stats_list, errp);
     }
 
+    if (target == STATS_TARGET_VCPU) {
+        stats_list = add_qemu_vcpu_schema(stats_list);
+    }
+
     add_stats_schema(result, STATS_PROVIDER_KVM, target, stats_list);
 }
 
@@ -261,6 +261,9 @@ static void file_backend_unparent(Object *obj)
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
     HostMemoryBackendFile *fb = MEMORY_BACKEND_FILE(obj);
 
+    /* Stop preallocating before the data is discarded */
+    object_class_by_name(TYPE_MEMORY_BACKEND)->unparent(obj);
+
     if (host_memory_backend_mr_inited(backend) && fb->discard_data) {
         void *ptr = memory_region_get_ram_ptr(&backend->mr);
         uint64_t sz = memory_region_size(&backend->mr);
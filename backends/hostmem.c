@@ -21,7 +21,12 @@
 #include "qemu/mmap-alloc.h"
 #include "qemu/madvise.h"
 #include "qemu/cutils.h"
+#include "qemu/thread-context.h"
+#include "qemu/error-report.h"
 #include "hw/qdev-core.h"
+#include "migration/misc.h"
+#include "system/runstate.h"
+#include "trace.h"
 
 #ifdef CONFIG_NUMA
 #include <numaif.h>
@@ -221,6 +226,185 @@ static void host_memory_backend_set_dump(Object *obj, bool value, Error **errp)
     backend->dump = value;
 }
 
+#ifdef CONFIG_NUMA
+static bool host_node_has_cpus(unsigned long node)
+{
+    struct bitmask *cpus = numa_allocate_cpumask();
+    bool ret = !numa_node_to_cpus(node, cpus) && numa_bitmask_weight(cpus);
+
+    numa_free_cpumask(cpus);
+    return ret;
+}
+#endif
+
+static void host_memory_backend_free_prealloc_areas(HostMemoryBackend *backend,
+                                                    PreallocArea *areas,
+                                                    int nr_areas)
+{
+    int i;
+
+    /* The threads are created already, they don't need their context */
+    for (i = 0; i < nr_areas; i++) {
+        if (areas[i].tc && areas[i].tc != backend->prealloc_context) {
+            object_unparent(OBJECT(areas[i].tc));
+        }
+    }
+    g_free(areas);
+}
+
+/*
+ * Split the memory into the areas to preallocate, each with the context
+ * of the threads that touch it.  Return the number of areas, or 0 and set
+ * @errp on error.
+ */
+static int host_memory_backend_prealloc_areas(HostMemoryBackend *backend,
+                                              void *ptr, uint64_t sz,
+                                              PreallocArea **areasp,
+                                              Error **errp)
+{
+    PreallocArea *areas;
+#ifdef CONFIG_NUMA
+    int nr_nodes = bitmap_count_one(backend->host_nodes, MAX_NODES);
+
+    /*
+     * With several nodes, the pages come from the node of the CPU that
+     * touches them first.  Unless the user placed the threads, split the
+     * memory between the nodes and touch each part from the CPUs of its
+     * node, so that it is spread evenly and zeroed by local CPUs.
+     */
+    if (!backend->prealloc_context && nr_nodes > 1 &&
+        (backend->policy == HOST_MEM_POLICY_BIND ||
+         backend->policy == HOST_MEM_POLICY_PREFERRED)) {
+        size_t pagesize = qemu_ram_pagesize(backend->mr.ram_block);
+        uint64_t offset = 0, end;
+        unsigned long node;
+        int i;
+
+        areas = g_new0(PreallocArea, nr_nodes);
+        node = find_first_bit(backend->host_nodes, MAX_NODES);
+        for (i = 0; i < nr_nodes; i++) {
+            g_autofree char *name = g_strdup_printf("prealloc-node%lu", node);
+            g_autofree char *affinity = g_strdup_printf("%lu", node);
+
+            end = i == nr_nodes - 1 ? sz :
+                  QEMU_ALIGN_DOWN(sz / nr_nodes * (i + 1), pagesize);
+            areas[i].area = ptr + offset;
+            areas[i].size = end - offset;
+            /* Nodes without CPUs are touched by threads running anywhere */
+            if (host_node_has_cpus(node)) {
+                areas[i].tc = (ThreadContext *)
+                    object_new_with_props(TYPE_THREAD_CONTEXT,
+                                          OBJECT(backend), name, errp,
+                                          "node-affinity", affinity, NULL);
+                if (!areas[i].tc) {
+                    host_memory_backend_free_prealloc_areas(backend, areas,
+                                                            nr_nodes);
+                    return 0;
+                }
+            }
+            trace_host_memory_backend_prealloc_node(backend, node, offset,
+                                                    areas[i].size);
+
+            offset = end;
+            node = find_next_bit(backend->host_nodes, MAX_NODES, node + 1);
+        }
+        *areasp = areas;
+        return nr_nodes;
+    }
+#endif
+    areas = g_new0(PreallocArea, 1);
+    areas[0].area = ptr;
+    areas[0].size = sz;
+    areas[0].tc = backend->prealloc_context;
+    *areasp = areas;
+    return 1;
+}
+
+static bool host_memory_backend_prealloc(HostMemoryBackend *backend,
+                                         void *ptr, uint64_t sz, bool async,
+                                         Error **errp)
+{
+    PreallocArea *areas;
+    int nr_areas;
+    bool ret;
+
+    nr_areas = host_memory_backend_prealloc_areas(backend, ptr, sz, &areas,
+                                                  errp);
+    if (!nr_areas) {
+        return false;
+    }
+    ret = qemu_prealloc_mem_areas(memory_region_get_fd(&backend->mr), areas,
+                                  nr_areas, backend->prealloc_threads, async,
+                                  errp);
+    host_memory_backend_free_prealloc_areas(backend, areas, nr_areas);
+    return ret;
+}
+
+static void host_memory_backend_prealloc_background(HostMemoryBackend *backend)
+{
+    void *ptr = memory_region_get_ram_ptr(&backend->mr);
+    uint64_t sz = memory_region_size(&backend->mr);
+    int fd = memory_region_get_fd(&backend->mr);
+    Error *local_err = NULL;
+    PreallocArea *areas;
+    int nr_areas;
+
+    /* Postcopy needs the pages missing until they are received */
+    if (migration_incoming_postcopy_advised()) {
+        trace_host_memory_backend_prealloc_background(backend, false);
+        return;
+    }
+
+    nr_areas = host_memory_backend_prealloc_areas(backend, ptr, sz, &areas,
+                                                  &local_err);
+    if (!nr_areas) {
+        error_report_err(local_err);
+        return;
+    }
+    backend->prealloc_bg =
+        qemu_prealloc_mem_background(fd, areas, nr_areas,
+                                     backend->prealloc_threads);
+    trace_host_memory_backend_prealloc_background(backend,
+                                                  !!backend->prealloc_bg);
+    if (!backend->prealloc_bg) {
+        g_autofree char *id = host_memory_backend_get_name(backend);
+
+        warn_report("memory backend '%s' can't be preallocated in the "
+                    "background, preallocating it now", id);
+        if (!qemu_prealloc_mem_areas(fd, areas, nr_areas,
+                                     backend->prealloc_threads, false,
+                                     &local_err)) {
+            error_report_err(local_err);
+        }
+    }
+    host_memory_backend_free_prealloc_areas(backend, areas, nr_areas);
+}
+
+static void host_memory_backend_prealloc_stop(HostMemoryBackend *backend)
+{
+    if (backend->prealloc_vmstate) {
+        qemu_del_vm_change_state_handler(backend->prealloc_vmstate);
+        backend->prealloc_vmstate = NULL;
+    }
+    if (backend->prealloc_bg) {
+        qemu_prealloc_mem_background_stop(backend->prealloc_bg);
+        backend->prealloc_bg = NULL;
+    }
+}
+
+static void host_memory_backend_prealloc_vm_state(void *opaque, bool running,
+                                                  RunState state)
+{
+    HostMemoryBackend *backend = opaque;
+
+    if (!running) {
+        return;
+    }
+    qemu_del_vm_change_state_handler(backend->prealloc_vmstate);
+    backend->prealloc_vmstate = NULL;
+    host_memory_backend_prealloc_background(backend);
+}
+
 static bool host_memory_backend_get_prealloc(Object *obj, Error **errp)
 {
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
@@ -244,18 +428,53 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
     }
 
     if (value && !backend->prealloc) {
-        int fd = memory_region_get_fd(&backend->mr);
         void *ptr = memory_region_get_ram_ptr(&backend->mr);
         uint64_t sz = memory_region_size(&backend->mr);
 
-        if (!qemu_prealloc_mem(fd, ptr, sz, backend->prealloc_threads,
-                               backend->prealloc_context, false, errp)) {
+        if (!host_memory_backend_prealloc(backend, ptr, sz, false, errp)) {
             return;
         }
         backend->prealloc = true;
     }
 }
 
+static bool host_memory_backend_get_prealloc_background(Object *obj,
+                                                        Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    return backend->prealloc_background;
+}
+
+static void host_memory_backend_set_prealloc_background(Object *obj,
+                                                        bool value,
+                                                        Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    if (host_memory_backend_mr_inited(backend)) {
+        error_setg(errp, "cannot change property 'prealloc-background' of %s",
+                   object_get_typename(obj));
+        return;
+    }
+    backend->prealloc_background = value;
+}
+
+static void host_memory_backend_get_prealloc_populated(Object *obj,
+                                                       Visitor *v,
+                                                       const char *name,
+                                                       void *opaque,
+                                                       Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    uint64_t value = 0;
+
+    if (backend->prealloc_bg) {
+        value = qemu_prealloc_mem_background_progress(backend->prealloc_bg);
+    }
+    visit_type_size(v, name, &value, errp);
+}
+
 static void host_memory_backend_get_prealloc_threads(Object *obj, Visitor *v,
     const char *name, void *opaque, Error **errp)
 {
@@ -422,15 +641,39 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
      * This is necessary to guarantee memory is allocated with
      * specified NUMA policy in place.
      */
-    if (backend->prealloc && !qemu_prealloc_mem(memory_region_get_fd(&backend->mr),
-                                                ptr, sz,
-                                                backend->prealloc_threads,
-                                                backend->prealloc_context,
-                                                async, errp)) {
+    if (backend->prealloc && backend->prealloc_background) {
+        /*
+         * Let the guest start right away, the memory is populated while it
+         * runs.  Backends created with the machine wait until it starts, in
+         * case it is the destination of a postcopy migration.
+         */
+        if (runstate_is_running()) {
+            host_memory_backend_prealloc_background(backend);
+        } else {
+            backend->prealloc_vmstate = qemu_add_vm_change_state_handler(
+                host_memory_backend_prealloc_vm_state, backend);
+        }
+    } else if (backend->prealloc &&
+               !host_memory_backend_prealloc(backend, ptr, sz, async, errp)) {
         return;
     }
 }
 
+static void host_memory_backend_unparent(Object *obj)
+{
+    /*
+     * The memory region is a child of the backend, so the RAM is freed
+     * before instance_finalize runs.  Stop the threads that populate it
+     * while it is still mapped.
+     */
+    host_memory_backend_prealloc_stop(MEMORY_BACKEND(obj));
+}
+
+static void host_memory_backend_finalize(Object *obj)
+{
+    host_memory_backend_prealloc_stop(MEMORY_BACKEND(obj));
+}
+
 static bool
 host_memory_backend_can_be_deleted(UserCreatable *uc)
 {
@@ -507,6 +750,7 @@ host_memory_backend_class_init(ObjectClass *oc, const void *data)
 
     ucc->complete = host_memory_backend_memory_complete;
     ucc->can_be_deleted = host_memory_backend_can_be_deleted;
+    oc->unparent = host_memory_backend_unparent;
 
     object_class_property_add_bool(oc, "merge",
         host_memory_backend_get_merge,
@@ -529,6 +773,16 @@ host_memory_backend_class_init(ObjectClass *oc, const void *data)
         NULL, NULL);
     object_class_property_set_description(oc, "prealloc-threads",
         "Number of CPU threads to use for prealloc");
+    object_class_property_add_bool(oc, "prealloc-background",
+        host_memory_backend_get_prealloc_background,
+        host_memory_backend_set_prealloc_background);
+    object_class_property_set_description(oc, "prealloc-background",
+        "Preallocate memory while the guest runs");
+    object_class_property_add(oc, "prealloc-populated", "size",
+        host_memory_backend_get_prealloc_populated,
+        NULL, NULL, NULL);
+    object_class_property_set_description(oc, "prealloc-populated",
+        "Bytes preallocated in the background so far");
     object_class_property_add_link(oc, "prealloc-context",
         TYPE_THREAD_CONTEXT, offsetof(HostMemoryBackend, prealloc_context),
         object_property_allow_set_link, OBJ_PROP_LINK_STRONG);
@@ -586,6 +840,7 @@ static const TypeInfo host_memory_backend_info = {
     .instance_size = sizeof(HostMemoryBackend),
     .instance_init = host_memory_backend_init,
     .instance_post_init = host_memory_backend_post_init,
+    .instance_finalize = host_memory_backend_finalize,
     .interfaces = (const InterfaceInfo[]) {
         { TYPE_USER_CREATABLE },
         { }
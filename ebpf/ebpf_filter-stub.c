@@ -0,0 +1,45 @@
+/*
+ * eBPF packet filter stub file
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "ebpf/ebpf_filter.h"
+
+void ebpf_filter_init(struct EBPFFilterContext *ctx)
+{
+
+}
+
+bool ebpf_filter_is_loaded(struct EBPFFilterContext *ctx)
+{
+    return false;
+}
+
+bool ebpf_filter_load(struct EBPFFilterContext *ctx, uint32_t max_macs,
+                      Error **errp)
+{
+    error_setg(errp, "eBPF support is not compiled in");
+    return false;
+}
+
+bool ebpf_filter_set_config(struct EBPFFilterContext *ctx,
+                            const struct EBPFFilterConfig *config,
+                            Error **errp)
+{
+    error_setg(errp, "eBPF support is not compiled in");
+    return false;
+}
+
+bool ebpf_filter_add_mac(struct EBPFFilterContext *ctx, const uint8_t *mac,
+                         Error **errp)
+{
+    error_setg(errp, "eBPF support is not compiled in");
+    return false;
+}
+
+void ebpf_filter_unload(struct EBPFFilterContext *ctx)
+{
+
+}
@@ -0,0 +1,306 @@
+/*
+ * eBPF packet filter for tap devices
+ *
+ * The program is attached with TUNSETFILTEREBPF and runs in the kernel
+ * for every packet the tap device is about to hand to QEMU or vhost-net,
+ * i.e. for the traffic received by the guest.  It drops the frames whose
+ * destination MAC address or VLAN ID aren't allowed and rate limits the
+ * rest with a token bucket.
+ *
+ * The program is small enough to be assembled here rather than built
+ * from C like the RSS program, so it needs neither clang nor BTF.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "net/eth.h"
+
+#include <bpf/bpf.h>
+
+#include "ebpf/ebpf_filter.h"
+
+#include "trace.h"
+
+/* Instruction encoding helpers, as in the kernel's include/linux/filter.h */
+#define BPF_ALU64_REG(OP, DST, SRC) \
+    ((struct bpf_insn) { .code = BPF_ALU64 | BPF_OP(OP) | BPF_X, \
+                         .dst_reg = DST, .src_reg = SRC })
+#define BPF_ALU64_IMM(OP, DST, IMM) \
+    ((struct bpf_insn) { .code = BPF_ALU64 | BPF_OP(OP) | BPF_K, \
+                         .dst_reg = DST, .imm = IMM })
+#define BPF_MOV64_REG(DST, SRC) BPF_ALU64_REG(BPF_MOV, DST, SRC)
+#define BPF_MOV64_IMM(DST, IMM) BPF_ALU64_IMM(BPF_MOV, DST, IMM)
+#define BPF_ENDIAN_BE(DST, LEN) \
+    ((struct bpf_insn) { .code = BPF_ALU | BPF_END | BPF_TO_BE, \
+                         .dst_reg = DST, .imm = LEN })
+#define BPF_LDX_MEM(SIZE, DST, SRC, OFF) \
+    ((struct bpf_insn) { .code = BPF_LDX | BPF_SIZE(SIZE) | BPF_MEM, \
+                         .dst_reg = DST, .src_reg = SRC, .off = OFF })
+#define BPF_STX_MEM(SIZE, DST, SRC, OFF) \
+    ((struct bpf_insn) { .code = BPF_STX | BPF_SIZE(SIZE) | BPF_MEM, \
+                         .dst_reg = DST, .src_reg = SRC, .off = OFF })
+#define BPF_ST_MEM(SIZE, DST, OFF, IMM) \
+    ((struct bpf_insn) { .code = BPF_ST | BPF_SIZE(SIZE) | BPF_MEM, \
+                         .dst_reg = DST, .off = OFF, .imm = IMM })
+#define BPF_JMP_REG(OP, DST, SRC, OFF) \
+    ((struct bpf_insn) { .code = BPF_JMP | BPF_OP(OP) | BPF_X, \
+                         .dst_reg = DST, .src_reg = SRC, .off = OFF })
+#define BPF_JMP_IMM(OP, DST, IMM, OFF) \
+    ((struct bpf_insn) { .code = BPF_JMP | BPF_OP(OP) | BPF_K, \
+                         .dst_reg = DST, .off = OFF, .imm = IMM })
+#define BPF_JMP_A(OFF) \
+    ((struct bpf_insn) { .code = BPF_JMP | BPF_JA, .off = OFF })
+#define BPF_LD_MAP_FD(DST, FD) \
+    ((struct bpf_insn) { .code = BPF_LD | BPF_DW | BPF_IMM, \
+                         .dst_reg = DST, .src_reg = BPF_PSEUDO_MAP_FD, \
+                         .imm = FD }), \
+    ((struct bpf_insn) { .imm = 0 })
+#define BPF_CALL_FUNC(FUNC) \
+    ((struct bpf_insn) { .code = BPF_JMP | BPF_CALL, .imm = FUNC })
+#define BPF_EXIT_INSN() \
+    ((struct bpf_insn) { .code = BPF_JMP | BPF_EXIT })
+
+#define CFG(field) offsetof(struct EBPFFilterConfig, field)
+#define SKB(field) offsetof(struct __sk_buff, field)
+
+/*
+ * R6 holds the socket buffer, R7 the configuration, R8 its flags and R9
+ * the VLAN ID.  The stack holds the map key at -4, the destination MAC
+ * address at -16 and the VLAN header at -24.
+ *
+ * The token bucket isn't updated atomically: packets processed at the
+ * same time on several CPUs may be accounted only once.
+ */
+static int ebpf_filter_load_program(int map_configuration, int map_macs)
+{
+    const struct bpf_insn insns[] = {
+        BPF_MOV64_REG(BPF_REG_6, BPF_REG_1),
+        BPF_ST_MEM(BPF_W, BPF_REG_10, -4, 0),
+        BPF_MOV64_REG(BPF_REG_2, BPF_REG_10),
+        BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, -4),
+        BPF_LD_MAP_FD(BPF_REG_1, map_configuration),
+        BPF_CALL_FUNC(BPF_FUNC_map_lookup_elem),
+        BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 80),             /* pass */
+        BPF_MOV64_REG(BPF_REG_7, BPF_REG_0),
+        BPF_LDX_MEM(BPF_B, BPF_REG_8, BPF_REG_7, CFG(flags)),
+
+        /* destination MAC address */
+        BPF_MOV64_REG(BPF_REG_1, BPF_REG_8),
+        BPF_ALU64_IMM(BPF_AND, BPF_REG_1, EBPF_FILTER_MAC),
+        BPF_JMP_IMM(BPF_JEQ, BPF_REG_1, 0, 19),             /* vlan */
+        BPF_ST_MEM(BPF_DW, BPF_REG_10, -16, 0),
+        BPF_MOV64_REG(BPF_REG_1, BPF_REG_6),
+        BPF_MOV64_IMM(BPF_REG_2, 0),
+        BPF_MOV64_REG(BPF_REG_3, BPF_REG_10),
+        BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, -16),
+        BPF_MOV64_IMM(BPF_REG_4, ETH_ALEN),
+        BPF_CALL_FUNC(BPF_FUNC_skb_load_bytes),
+        BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 69),             /* drop */
+        BPF_MOV64_REG(BPF_REG_1, BPF_REG_8),
+        BPF_ALU64_IMM(BPF_AND, BPF_REG_1, EBPF_FILTER_MULTICAST),
+        BPF_JMP_IMM(BPF_JEQ, BPF_REG_1, 0, 2),              /* mac_lookup */
+        BPF_LDX_MEM(BPF_B, BPF_REG_1, BPF_REG_10, -16),
+        BPF_JMP_IMM(BPF_JSET, BPF_REG_1, 1, 6),             /* vlan */
+        /* mac_lookup: */
+        BPF_LD_MAP_FD(BPF_REG_1, map_macs),
+        BPF_MOV64_REG(BPF_REG_2, BPF_REG_10),
+        BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, -16),
+        BPF_CALL_FUNC(BPF_FUNC_map_lookup_elem),
+        BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 58),             /* drop */
+
+        /* vlan: */
+        BPF_MOV64_REG(BPF_REG_1, BPF_REG_8),
+        BPF_ALU64_IMM(BPF_AND, BPF_REG_1, EBPF_FILTER_VLAN),
+        BPF_JMP_IMM(BPF_JEQ, BPF_REG_1, 0, 30),             /* rate */
+        BPF_LDX_MEM(BPF_W, BPF_REG_9, BPF_REG_6, SKB(vlan_present)),
+        BPF_JMP_IMM(BPF_JEQ, BPF_REG_9, 0, 2),              /* inband */
+        BPF_LDX_MEM(BPF_W, BPF_REG_9, BPF_REG_6, SKB(vlan_tci)),
+        BPF_JMP_A(15),                                      /* vlan_check */
+        /* inband: the tag wasn't offloaded, look for it in the frame */
+        BPF_ST_MEM(BPF_W, BPF_REG_10, -24, 0),
+        BPF_MOV64_REG(BPF_REG_1, BPF_REG_6),
+        BPF_MOV64_IMM(BPF_REG_2, ETH_ALEN * 2),
+        BPF_MOV64_REG(BPF_REG_3, BPF_REG_10),
+        BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, -24),
+        BPF_MOV64_IMM(BPF_REG_4, 4),
+        BPF_CALL_FUNC(BPF_FUNC_skb_load_bytes),
+        BPF_MOV64_IMM(BPF_REG_9, 0),
+        BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 6),              /* vlan_check */
+        BPF_LDX_MEM(BPF_H, BPF_REG_1, BPF_REG_10, -24),
+        BPF_ENDIAN_BE(BPF_REG_1, 16),
+        BPF_JMP_IMM(BPF_JEQ, BPF_REG_1, ETH_P_VLAN, 1),      /* tagged */
+        BPF_JMP_IMM(BPF_JNE, BPF_REG_1, ETH_P_DVLAN, 2),     /* vlan_check */
+        /* tagged: */
+        BPF_LDX_MEM(BPF_H, BPF_REG_9, BPF_REG_10, -22),
+        BPF_ENDIAN_BE(BPF_REG_9, 16),
+        /* vlan_check: test the VLAN ID in the bitmap */
+        BPF_ALU64_IMM(BPF_AND, BPF_REG_9, VLAN_VID_MASK),
+        BPF_MOV64_REG(BPF_REG_1, BPF_REG_9),
+        BPF_ALU64_IMM(BPF_RSH, BPF_REG_1, 6),
+        BPF_ALU64_IMM(BPF_LSH, BPF_REG_1, 3),
+        BPF_MOV64_REG(BPF_REG_2, BPF_REG_7),
+        BPF_ALU64_REG(BPF_ADD, BPF_REG_2, BPF_REG_1),
+        BPF_LDX_MEM(BPF_DW, BPF_REG_2, BPF_REG_2, CFG(vlans)),
+        BPF_ALU64_IMM(BPF_AND, BPF_REG_9, 63),
+        BPF_ALU64_REG(BPF_RSH, BPF_REG_2, BPF_REG_9),
+        BPF_ALU64_IMM(BPF_AND, BPF_REG_2, 1),
+        BPF_JMP_IMM(BPF_JEQ, BPF_REG_2, 0, 25),             /* drop */
+
+        /*
+         * rate: refill the bucket with the time elapsed since the last
+         * packet, it is full again after a second without traffic.
+         */
+        BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_7, CFG(rate)),
+        BPF_JMP_IMM(BPF_JEQ, BPF_REG_1, 0, 21),             /* pass */
+        BPF_CALL_FUNC(BPF_FUNC_ktime_get_ns),
+        BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_7, CFG(last)),
+        BPF_STX_MEM(BPF_DW, BPF_REG_7, BPF_REG_0, CFG(last)),
+        BPF_ALU64_REG(BPF_SUB, BPF_REG_0, BPF_REG_1),
+        BPF_LDX_MEM(BPF_DW, BPF_REG_2, BPF_REG_7, CFG(burst)),
+        BPF_JMP_IMM(BPF_JGE, BPF_REG_0, NANOSECONDS_PER_SECOND, 7), /* full */
+        BPF_ALU64_IMM(BPF_DIV, BPF_REG_0, SCALE_US),
+        BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_7, CFG(rate)),
+        BPF_ALU64_REG(BPF_MUL, BPF_REG_0, BPF_REG_1),
+        BPF_ALU64_IMM(BPF_DIV, BPF_REG_0, G_USEC_PER_SEC),
+        BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_7, CFG(tokens)),
+        BPF_ALU64_REG(BPF_ADD, BPF_REG_0, BPF_REG_1),
+        BPF_JMP_REG(BPF_JLE, BPF_REG_0, BPF_REG_2, 1),      /* consume */
+        /* full: */
+        BPF_MOV64_REG(BPF_REG_0, BPF_REG_2),
+        /* consume: */
+        BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_6, SKB(len)),
+        BPF_JMP_REG(BPF_JLT, BPF_REG_0, BPF_REG_1, 3),      /* over */
+        BPF_ALU64_REG(BPF_SUB, BPF_REG_0, BPF_REG_1),
+        BPF_STX_MEM(BPF_DW, BPF_REG_7, BPF_REG_0, CFG(tokens)),
+        BPF_JMP_A(2),                                       /* pass */
+        /* over: */
+        BPF_STX_MEM(BPF_DW, BPF_REG_7, BPF_REG_0, CFG(tokens)),
+        BPF_JMP_A(2),                                       /* drop */
+
+        /* pass: keep the whole packet */
+        BPF_LDX_MEM(BPF_W, BPF_REG_0, BPF_REG_6, SKB(len)),
+        BPF_EXIT_INSN(),
+        /* drop: */
+        BPF_MOV64_IMM(BPF_REG_0, 0),
+        BPF_EXIT_INSN(),
+    };
+
+    return bpf_prog_load(BPF_PROG_TYPE_SOCKET_FILTER, "tap_filter", "GPL",
+                         insns, ARRAY_SIZE(insns), NULL);
+}
+
+void ebpf_filter_init(struct EBPFFilterContext *ctx)
+{
+    ctx->program_fd = -1;
+    ctx->map_configuration = -1;
+    ctx->map_macs = -1;
+}
+
+bool ebpf_filter_is_loaded(struct EBPFFilterContext *ctx)
+{
+    return ctx->program_fd >= 0;
+}
+
+bool ebpf_filter_load(struct EBPFFilterContext *ctx, uint32_t max_macs,
+                      Error **errp)
+{
+    if (ebpf_filter_is_loaded(ctx)) {
+        return false;
+    }
+
+    ctx->map_configuration = bpf_map_create(BPF_MAP_TYPE_ARRAY,
+                                            "filter_config", sizeof(uint32_t),
+                                            sizeof(struct EBPFFilterConfig),
+                                            1, NULL);
+    if (ctx->map_configuration < 0) {
+        error_setg_errno(errp, errno, "Unable to create eBPF filter "
+                         "configuration map");
+        goto error;
+    }
+
+    ctx->map_macs = bpf_map_create(BPF_MAP_TYPE_HASH, "filter_macs",
+                                   sizeof(uint64_t), sizeof(uint8_t),
+                                   MAX(max_macs, 1), NULL);
+    if (ctx->map_macs < 0) {
+        error_setg_errno(errp, errno, "Unable to create eBPF filter MAC map");
+        goto error;
+    }
+
+    ctx->program_fd = ebpf_filter_load_program(ctx->map_configuration,
+                                               ctx->map_macs);
+    if (ctx->program_fd < 0) {
+        trace_ebpf_filter_load_error(ctx, errno);
+        error_setg_errno(errp, errno, "Unable to load eBPF filter program");
+        goto error;
+    }
+
+    trace_ebpf_filter_load(ctx, ctx->program_fd, ctx->map_configuration,
+                           ctx->map_macs);
+    return true;
+
+error:
+    ebpf_filter_unload(ctx);
+    return false;
+}
+
+bool ebpf_filter_set_config(struct EBPFFilterContext *ctx,
+                            const struct EBPFFilterConfig *config,
+                            Error **errp)
+{
+    uint32_t key = 0;
+
+    if (!ebpf_filter_is_loaded(ctx)) {
+        error_setg(errp, "eBPF filter is not loaded");
+        return false;
+    }
+
+    if (bpf_map_update_elem(ctx->map_configuration, &key, config, BPF_ANY)) {
+        error_setg_errno(errp, errno, "Unable to set eBPF filter "
+                         "configuration");
+        return false;
+    }
+
+    trace_ebpf_filter_set_config(ctx, config->flags, config->rate,
+                                 config->burst);
+    return true;
+}
+
+bool ebpf_filter_add_mac(struct EBPFFilterContext *ctx, const uint8_t *mac,
+                         Error **errp)
+{
+    uint64_t key = 0;
+    uint8_t value = 1;
+
+    if (!ebpf_filter_is_loaded(ctx)) {
+        error_setg(errp, "eBPF filter is not loaded");
+        return false;
+    }
+
+    /* The program looks up the address as it is laid out in the frame */
+    memcpy(&key, mac, ETH_ALEN);
+    if (bpf_map_update_elem(ctx->map_macs, &key, &value, BPF_ANY)) {
+        error_setg_errno(errp, errno, "Unable to add MAC address to the "
+                         "eBPF filter");
+        return false;
+    }
+
+    return true;
+}
+
+void ebpf_filter_unload(struct EBPFFilterContext *ctx)
+{
+    if (ctx->program_fd >= 0) {
+        close(ctx->program_fd);
+    }
+    if (ctx->map_macs >= 0) {
+        close(ctx->map_macs);
+    }
+    if (ctx->map_configuration >= 0) {
+        close(ctx->map_configuration);
+    }
+
+    trace_ebpf_filter_unload(ctx);
+    ebpf_filter_init(ctx);
+}
@@ -0,0 +1,56 @@
+/*
+ * eBPF packet filter for tap devices
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef QEMU_EBPF_FILTER_H
+#define QEMU_EBPF_FILTER_H
+
+#include "qapi/error.h"
+
+/* EBPFFilterConfig.flags */
+#define EBPF_FILTER_MAC         (1 << 0)
+#define EBPF_FILTER_MULTICAST   (1 << 1)
+#define EBPF_FILTER_VLAN        (1 << 2)
+
+#define EBPF_FILTER_VLAN_IDS    4096
+#define EBPF_FILTER_VLAN_WORDS  (EBPF_FILTER_VLAN_IDS / 64)
+
+struct EBPFFilterContext {
+    int program_fd;
+    int map_configuration;
+    int map_macs;
+};
+
+/* Layout of the configuration map shared with the program */
+struct EBPFFilterConfig {
+    uint8_t flags;
+    uint8_t padding[7];
+    /* RX rate limit in bytes per second, 0 for none */
+    uint64_t rate;
+    uint64_t burst;
+    /* token bucket state, updated by the program */
+    uint64_t tokens;
+    uint64_t last;
+    /* allowed VLAN IDs, ID 0 stands for untagged frames */
+    uint64_t vlans[EBPF_FILTER_VLAN_WORDS];
+};
+
+void ebpf_filter_init(struct EBPFFilterContext *ctx);
+
+bool ebpf_filter_is_loaded(struct EBPFFilterContext *ctx);
+
+bool ebpf_filter_load(struct EBPFFilterContext *ctx, uint32_t max_macs,
+                      Error **errp);
+
+bool ebpf_filter_set_config(struct EBPFFilterContext *ctx,
+                            const struct EBPFFilterConfig *config,
+                            Error **errp);
+
+bool ebpf_filter_add_mac(struct EBPFFilterContext *ctx, const uint8_t *mac,
+                         Error **errp);
+
+void ebpf_filter_unload(struct EBPFFilterContext *ctx);
+
+#endif /* QEMU_EBPF_FILTER_H */
@@ -510,6 +510,21 @@ SRST
     Show current migration parameters.
 ERST
 
+    {
+        .name       = "migrate_profile",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show time and bytes per device and RAM block "
+                      "for each round of the last migration",
+        .cmd        = hmp_info_migrate_profile,
+    },
+
+SRST
+  ``info migrate_profile``
+    Show the time spent and the bytes transferred per device state
+    section and per RAM block, for each round of the last migration.
+ERST
+
     {
         .name       = "balloon",
         .args_type  = "",
@@ -126,6 +126,10 @@ void hmp_info_memdev(Monitor *mon, const QDict *qdict)
                        m->value->dump ? "true" : "false");
         monitor_printf(mon, "  prealloc: %s\n",
                        m->value->prealloc ? "true" : "false");
+        if (m->value->has_prealloc_populated) {
+            monitor_printf(mon, "  prealloc populated: %" PRIu64 "\n",
+                           m->value->prealloc_populated);
+        }
         monitor_printf(mon, "  share: %s\n",
                        m->value->share ? "true" : "false");
         if (m->value->has_reserve) {
@@ -185,6 +185,12 @@ static int query_memdev(Object *obj, void *opaque)
         m->merge = object_property_get_bool(obj, "merge", &error_abort);
         m->dump = object_property_get_bool(obj, "dump", &error_abort);
         m->prealloc = object_property_get_bool(obj, "prealloc", &error_abort);
+        if (object_property_get_bool(obj, "prealloc-background",
+                                     &error_abort)) {
+            m->has_prealloc_populated = true;
+            m->prealloc_populated = object_property_get_uint(obj,
+                                        "prealloc-populated", &error_abort);
+        }
         m->share = object_property_get_bool(obj, "share", &error_abort);
         m->reserve = object_property_get_bool(obj, "reserve", &err);
         if (err) {
@@ -13,7 +13,9 @@
 
 #include "qemu/osdep.h"
 #include "qemu/atomic.h"
+#include "qemu/bitmap.h"
 #include "qemu/iov.h"
+#include "qemu/lockable.h"
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
@@ -23,6 +25,7 @@
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
+#include "qemu/xxhash.h"
 #include "qemu/option.h"
 #include "qemu/option_int.h"
 #include "qemu/config-file.h"
@@ -31,6 +34,8 @@
 #include "net/vhost_net.h"
 #include "net/announce.h"
 #include "hw/virtio/virtio-bus.h"
+#include "hw/virtio/iothread-vq-mapping.h"
+#include "block/aio-wait.h"
 #include "qapi/error.h"
 #include "qapi/qapi-events-net.h"
 #include "hw/qdev-properties.h"
@@ -59,6 +64,9 @@
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 #define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
 
+/* TX buffers popped at once, capped by the tx_burst property */
+#define VIRTIO_NET_TX_POP_BATCH 32
+
 #define VIRTIO_NET_IP4_ADDR_SIZE   8        /* ipv4 saddr + daddr */
 
 #define VIRTIO_NET_TCP_FLAG         0x3F
@@ -374,17 +382,196 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+/* Queues running in an IOThread must signal the guest through irqfd */
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    if (n->ioeventfd_started) {
+        virtio_notify_irqfd(vdev, vq);
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
 static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
     unsigned int dropped = virtqueue_drop_all(vq);
     if (dropped) {
-        virtio_notify(vdev, vq);
+        virtio_net_notify(VIRTIO_NET(vdev), vq);
     }
 }
 
+/*
+ * With iothread-vq-mapping, each queue pair and its backend are served by
+ * the AioContext of the queue pair while ioeventfd is started.  Before the
+ * main loop touches state used by the datapath, e.g. to process a control
+ * command, the queue pair is detached and served by the main loop again.
+ */
+
+/* Context: BQL held */
+static void virtio_net_queue_attach(VirtIONet *n, int index)
+{
+    VirtIONetQueue *q = &n->vqs[index];
+    NetClientState *nc = qemu_get_subqueue(n->nic, index);
+    AioContext *ctx = n->vq_aio_context[index];
+
+    if (nc->aio_context) {
+        return;
+    }
+
+    nc->aio_context = ctx;
+    qemu_set_aio_context(nc->peer, ctx);
+
+    if (q->tx_waiting) {
+        if (q->tx_timer) {
+            timer_mod(q->tx_timer,
+                      qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
+        } else {
+            replay_bh_schedule_event(q->tx_bh);
+        }
+    }
+
+    qemu_mutex_lock(&q->rss_lock);
+    q->rss_attached = true;
+    if (q->rss_pending) {
+        qemu_bh_schedule(q->rss_bh);
+    }
+    qemu_mutex_unlock(&q->rss_lock);
+
+    /* rx handler does not pop all elements, don't poll */
+    virtio_queue_aio_attach_host_notifier_no_poll(q->rx_vq, ctx);
+    virtio_queue_aio_attach_host_notifier(q->tx_vq, ctx);
+}
+
+/* Context: BH in IOThread */
+static void virtio_net_queue_detach_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+    NetClientState *nc = qemu_get_subqueue(n->nic, q - n->vqs);
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    virtio_queue_aio_detach_host_notifier(q->rx_vq, ctx);
+    virtio_queue_aio_detach_host_notifier(q->tx_vq, ctx);
+
+    /*
+     * Test and clear notifiers after disabling events, in case poll
+     * callback didn't have time to run.
+     */
+    virtio_queue_host_notifier_read(virtio_queue_get_host_notifier(q->rx_vq));
+    virtio_queue_host_notifier_read(virtio_queue_get_host_notifier(q->tx_vq));
+
+    /* Pending transmissions are rescheduled by virtio_net_queue_attach() */
+    if (q->tx_timer) {
+        timer_del(q->tx_timer);
+    } else {
+        qemu_bh_cancel(q->tx_bh);
+    }
+
+    /* Forwarded packets wait in rss_packets until the next attach */
+    qemu_mutex_lock(&q->rss_lock);
+    q->rss_attached = false;
+    qemu_bh_cancel(q->rss_bh);
+    qemu_mutex_unlock(&q->rss_lock);
+
+    qemu_set_aio_context(nc->peer, NULL);
+    nc->aio_context = NULL;
+}
+
+/* Context: BQL held */
+static void virtio_net_queue_detach(VirtIONet *n, int index)
+{
+    NetClientState *nc = qemu_get_subqueue(n->nic, index);
+
+    if (nc->aio_context) {
+        aio_wait_bh_oneshot(nc->aio_context, virtio_net_queue_detach_bh,
+                            &n->vqs[index]);
+    }
+}
+
+/*
+ * A timer or bottom half of a queue pair may fire in the IOThread while
+ * the queue pair is detached, or the other way round.  Returns true if
+ * @cb was rescheduled in the event loop currently serving the queue pair.
+ */
+static bool virtio_net_queue_bounce(VirtIONetQueue *q, QEMUBHFunc *cb)
+{
+    VirtIONet *n = q->n;
+    AioContext *ctx;
+
+    if (!n->vq_aio_context) {
+        return false;
+    }
+
+    ctx = qemu_get_subqueue(n->nic, q - n->vqs)->aio_context;
+    if (!ctx) {
+        ctx = qemu_get_aio_context();
+    }
+    if (ctx == qemu_get_current_aio_context()) {
+        return false;
+    }
+
+    aio_bh_schedule_oneshot(ctx, cb, q);
+    return true;
+}
+
+/*
+ * Detach the queue pairs before the main loop changes state used by the
+ * datapath.  Returns the queue pairs that virtio_net_datapath_resume()
+ * attaches again if they are active by then: those that were attached,
+ * and those that only weren't because they were inactive.  Queue pairs
+ * reset by the guest stay detached until the guest enables them again.
+ *
+ * Context: BQL held
+ */
+static unsigned long *virtio_net_datapath_pause(VirtIONet *n)
+{
+    int queue_pairs = n->multiqueue ? n->curr_queue_pairs : 1;
+    unsigned long *resume;
+    int i;
+
+    /* Nested calls, e.g. set_status while handling a control command */
+    if (!n->ioeventfd_started || n->datapath_paused) {
+        return NULL;
+    }
+
+    n->datapath_paused = true;
+    resume = bitmap_new(n->max_queue_pairs);
+    for (i = 0; i < n->max_queue_pairs; i++) {
+        if (qemu_get_subqueue(n->nic, i)->aio_context) {
+            virtio_net_queue_detach(n, i);
+            set_bit(i, resume);
+        } else if (i >= queue_pairs && !n->vqs[i].reset) {
+            set_bit(i, resume);
+        }
+    }
+    return resume;
+}
+
+/* Context: BQL held */
+static void virtio_net_datapath_resume(VirtIONet *n, unsigned long *resume)
+{
+    int queue_pairs = n->multiqueue ? n->curr_queue_pairs : 1;
+    int i;
+
+    if (!resume) {
+        return;
+    }
+
+    n->datapath_paused = false;
+    for (i = 0; n->ioeventfd_started && i < queue_pairs; i++) {
+        if (test_bit(i, resume)) {
+            virtio_net_queue_attach(n, i);
+        }
+    }
+    g_free(resume);
+}
+
 static int virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
+    unsigned long *resume;
     VirtIONetQueue *q;
     int i;
     uint8_t queue_status;
@@ -392,6 +579,9 @@ static int virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
+    /* The queues and their timers and bottom halves are touched below */
+    resume = virtio_net_datapath_pause(n);
+
     for (i = 0; i < n->max_queue_pairs; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
         bool queue_started;
@@ -437,6 +627,8 @@ static int virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+
+    virtio_net_datapath_resume(n, resume);
     return 0;
 }
 
@@ -561,6 +753,11 @@ static void virtio_net_queue_reset(VirtIODevice *vdev, uint32_t queue_index)
         return;
     }
 
+    n->vqs[vq2q(queue_index)].reset = true;
+    if (n->ioeventfd_started) {
+        virtio_net_queue_detach(n, vq2q(queue_index));
+    }
+
     nc = qemu_get_subqueue(n->nic, vq2q(queue_index));
 
     if (!nc->peer) {
@@ -586,6 +783,12 @@ static void virtio_net_queue_enable(VirtIODevice *vdev, uint32_t queue_index)
         return;
     }
 
+    n->vqs[vq2q(queue_index)].reset = false;
+    if (n->ioeventfd_started) {
+        virtio_net_queue_attach(n, vq2q(queue_index));
+        return;
+    }
+
     nc = qemu_get_subqueue(n->nic, vq2q(queue_index));
 
     if (!nc->peer || !vdev->vhost_started) {
@@ -803,6 +1006,27 @@ uint64_t virtio_net_supported_guest_offloads(const VirtIONet *n)
     return virtio_net_guest_offloads_by_features(vdev->guest_features);
 }
 
+/*
+ * Without vnet header support in the peer, TSO packets for the guest are
+ * built by virtio_net_rsc_receive().
+ */
+static bool virtio_net_gro_supported(VirtIONet *n)
+{
+    NetClientState *nc = qemu_get_queue(n->nic);
+
+    return n->guest_gro && !peer_has_vnet_hdr(n) && !get_vhost_net(nc->peer);
+}
+
+static void virtio_net_apply_gro(VirtIONet *n)
+{
+    bool csum = n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_CSUM);
+
+    n->rsc4_enabled = csum &&
+        (n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_TSO4));
+    n->rsc6_enabled = csum &&
+        (n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_TSO6));
+}
+
 typedef struct {
     VirtIONet *n;
     DeviceState *dev;
@@ -912,6 +1136,10 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
         n->curr_guest_offloads =
             virtio_net_guest_offloads_by_features(features);
         virtio_net_apply_guest_offloads(n);
+    } else if (virtio_net_gro_supported(n)) {
+        n->curr_guest_offloads =
+            virtio_net_guest_offloads_by_features(features);
+        virtio_net_apply_gro(n);
     }
 
     for (i = 0;  i < n->max_queue_pairs; i++) {
@@ -1002,7 +1230,7 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
 
         offloads = virtio_ldq_p(vdev, &offloads);
 
-        if (!n->has_vnet_hdr) {
+        if (!n->has_vnet_hdr && !virtio_net_gro_supported(n)) {
             return VIRTIO_NET_ERR;
         }
 
@@ -1018,7 +1246,11 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
         }
 
         n->curr_guest_offloads = offloads;
-        virtio_net_apply_guest_offloads(n);
+        if (n->has_vnet_hdr) {
+            virtio_net_apply_guest_offloads(n);
+        } else {
+            virtio_net_apply_gro(n);
+        }
 
         return VIRTIO_NET_OK;
     } else {
@@ -1534,8 +1766,13 @@ size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
 
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
+    VirtIONet *n = VIRTIO_NET(vdev);
+    unsigned long *resume;
     VirtQueueElement *elem;
 
+    /* Commands change state used by the datapath, pause it meanwhile */
+    resume = virtio_net_datapath_pause(n);
+
     for (;;) {
         size_t written;
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
@@ -1548,13 +1785,15 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         if (written > 0) {
             virtqueue_push(vq, elem, written);
             virtio_notify(vdev, vq);
-            g_free(elem);
+            virtqueue_element_free(vq, elem);
         } else {
             virtqueue_detach_element(vq, elem, 0);
-            g_free(elem);
+            virtqueue_element_free(vq, elem);
             break;
         }
     }
+
+    virtio_net_datapath_resume(n, resume);
 }
 
 /* RX */
@@ -1655,7 +1894,8 @@ static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
 }
 
 static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
-                           const void *buf, size_t size)
+                           const void *buf, size_t size,
+                           const struct virtio_net_hdr *gro_hdr)
 {
     if (n->has_vnet_hdr) {
         /* FIXME this cast is evil */
@@ -1672,7 +1912,7 @@ static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
             .flags = 0,
             .gso_type = VIRTIO_NET_HDR_GSO_NONE
         };
-        iov_from_buf(iov, iov_cnt, 0, &hdr, sizeof hdr);
+        iov_from_buf(iov, iov_cnt, 0, gro_hdr ?: &hdr, sizeof hdr);
     }
 }
 
@@ -1793,7 +2033,7 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     unsigned int index = nc->queue_index, new_index = index;
-    struct NetRxPkt *pkt = n->rx_pkt;
+    struct NetRxPkt *pkt = virtio_net_get_subqueue(nc)->rx_pkt;
     uint8_t net_hash_type;
     uint32_t hash;
     bool hasip4, hasip6;
@@ -1841,8 +2081,87 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
     return (index == new_index) ? -1 : new_index;
 }
 
-static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
+static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
+                                     size_t size);
+
+struct VirtIONetRssPacket {
+    QSIMPLEQ_ENTRY(VirtIONetRssPacket) next;
+    size_t size;
+    uint8_t buf[];
+};
+
+/* Context: BH in the AioContext of the queue pair, while attached */
+static void virtio_net_rss_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    NetClientState *nc = qemu_get_subqueue(q->n->nic, q - q->n->vqs);
+    QSIMPLEQ_HEAD(, VirtIONetRssPacket) packets;
+    VirtIONetRssPacket *packet;
+
+    QSIMPLEQ_INIT(&packets);
+    qemu_mutex_lock(&q->rss_lock);
+    QSIMPLEQ_CONCAT(&packets, &q->rss_packets);
+    q->rss_pending = 0;
+    qemu_mutex_unlock(&q->rss_lock);
+
+    while ((packet = QSIMPLEQ_FIRST(&packets))) {
+        QSIMPLEQ_REMOVE_HEAD(&packets, next);
+        virtio_net_do_receive(nc, packet->buf, packet->size);
+        g_free(packet);
+    }
+}
+
+/* Drop the packets that were forwarded to @q and not received yet */
+static void virtio_net_rss_purge(VirtIONetQueue *q)
+{
+    VirtIONetRssPacket *packet;
+
+    qemu_mutex_lock(&q->rss_lock);
+    while ((packet = QSIMPLEQ_FIRST(&q->rss_packets))) {
+        QSIMPLEQ_REMOVE_HEAD(&q->rss_packets, next);
+        g_free(packet);
+    }
+    q->rss_pending = 0;
+    qemu_mutex_unlock(&q->rss_lock);
+}
+
+/*
+ * Software RSS picked a queue that runs in another thread.  Hand it a copy
+ * of the packet; like a NIC whose ring is full, the target queue drops the
+ * packet if it has no buffers left or too many packets are pending.
+ */
+static ssize_t virtio_net_rss_forward(NetClientState *nc, const uint8_t *buf,
                                       size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIONetRssPacket *packet;
+
+    QEMU_LOCK_GUARD(&q->rss_lock);
+
+    if (q->rss_pending >= n->net_conf.rx_queue_size) {
+        return size;
+    }
+
+    packet = g_malloc(sizeof(*packet) + size);
+    packet->size = size;
+    memcpy(packet->buf, buf, size);
+    QSIMPLEQ_INSERT_TAIL(&q->rss_packets, packet, next);
+    q->rss_pending++;
+
+    if (q->rss_attached) {
+        qemu_bh_schedule(q->rss_bh);
+    }
+    return size;
+}
+
+/*
+ * @gro_hdr is the header given to the guest for a packet coalesced by
+ * virtio-net itself, see virtio_net_rsc_receive_gro().
+ */
+static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
+                                      size_t size,
+                                      const struct virtio_net_hdr *gro_hdr)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q;
@@ -1860,7 +2179,13 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     if (n->rss_data.enabled && n->rss_data.enabled_software_rss) {
         int index = virtio_net_process_rss(nc, buf, size, &extra_hdr);
         if (index >= 0) {
-            nc = qemu_get_subqueue(n->nic, index % n->curr_queue_pairs);
+            NetClientState *target =
+                qemu_get_subqueue(n->nic, index % n->curr_queue_pairs);
+
+            if (target->aio_context != nc->aio_context) {
+                return virtio_net_rss_forward(target, buf, size);
+            }
+            nc = target;
         }
     }
 
@@ -1912,7 +2237,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             virtio_error(vdev,
                          "virtio-net receive queue contains no in buffers");
             virtqueue_detach_element(q->rx_vq, elem, 0);
-            g_free(elem);
+            virtqueue_element_free(q->rx_vq, elem);
             err = -1;
             goto err;
         }
@@ -1929,7 +2254,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
                 extra_hdr.hdr.num_buffers = cpu_to_le16(1);
             }
 
-            receive_header(n, sg, elem->in_num, buf, size);
+            receive_header(n, sg, elem->in_num, buf, size, gro_hdr);
             if (n->rss_data.populate_hash) {
                 offset = offsetof(typeof(extra_hdr), hash_value);
                 iov_from_buf(sg, elem->in_num, offset,
@@ -1954,7 +2279,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
          * Otherwise, drop it. */
         if (!n->mergeable_rx_bufs && offset < size) {
             virtqueue_unpop(q->rx_vq, elem, total);
-            g_free(elem);
+            virtqueue_element_free(q->rx_vq, elem);
             err = size;
             goto err;
         }
@@ -1974,19 +2299,23 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
 
     for (j = 0; j < i; j++) {
         /* signal other side */
-        virtqueue_fill(q->rx_vq, elems[j], lens[j], j);
-        g_free(elems[j]);
+        virtqueue_fill(q->rx_vq, elems[j], lens[j], q->rx_batch_used + j);
+        virtqueue_element_free(q->rx_vq, elems[j]);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (q->rx_batching) {
+        q->rx_batch_used += i;
+    } else {
+        virtqueue_flush(q->rx_vq, i);
+        virtio_net_notify(n, q->rx_vq);
+    }
 
     return size;
 
 err:
     for (j = 0; j < i; j++) {
         virtqueue_detach_element(q->rx_vq, elems[j], lens[j]);
-        g_free(elems[j]);
+        virtqueue_element_free(q->rx_vq, elems[j]);
     }
 
     return err;
@@ -1997,7 +2326,7 @@ static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
 {
     RCU_READ_LOCK_GUARD();
 
-    return virtio_net_receive_rcu(nc, buf, size);
+    return virtio_net_receive_rcu(nc, buf, size, NULL);
 }
 
 /*
@@ -2022,7 +2351,7 @@ static void virtio_net_rsc_extract_unit4(VirtioNetRscChain *chain,
     uint16_t ip_hdrlen;
     struct ip_header *ip;
 
-    ip = (struct ip_header *)(buf + chain->n->guest_hdr_len
+    ip = (struct ip_header *)(buf + chain->n->host_hdr_len
                               + sizeof(struct eth_header));
     unit->ip = (void *)ip;
     ip_hdrlen = (ip->ip_ver_len & 0xF) << 2;
@@ -2038,7 +2367,7 @@ static void virtio_net_rsc_extract_unit6(VirtioNetRscChain *chain,
 {
     struct ip6_header *ip6;
 
-    ip6 = (struct ip6_header *)(buf + chain->n->guest_hdr_len
+    ip6 = (struct ip6_header *)(buf + chain->n->host_hdr_len
                                  + sizeof(struct eth_header));
     unit->ip = ip6;
     unit->ip_plen = &(ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
@@ -2051,29 +2380,173 @@ static void virtio_net_rsc_extract_unit6(VirtioNetRscChain *chain,
     unit->payload = read_unit_ip_len(unit) - unit->tcp_hdrlen;
 }
 
+/*
+ * Without a vnet header the peer can't pass large packets to the guest,
+ * virtio-net coalesces the TCP segments itself for any guest that accepts
+ * TSO packets.  The segments of a packet delivered this way all have the
+ * size of the first one, except for the last one, like a packet built by
+ * GRO in the host kernel.
+ */
+static bool virtio_net_rsc_gro(VirtioNetRscChain *chain)
+{
+    return !chain->n->has_vnet_hdr;
+}
+
+static uint32_t virtio_net_rsc_flow_hash(VirtioNetRscChain *chain,
+                                         VirtioNetRscUnit *unit)
+{
+    /* source and destination ports */
+    uint32_t ports = ldl_he_p(&unit->tcp->th_sport);
+
+    if (chain->proto == ETH_P_IP) {
+        struct ip_header *ip = unit->ip;
+
+        return qemu_xxhash5(ldl_he_p(&ip->ip_src), ldl_he_p(&ip->ip_dst),
+                            ports);
+    } else {
+        struct ip6_header *ip6 = unit->ip;
+        uint8_t *src = (uint8_t *)&ip6->ip6_src;
+        uint8_t *dst = (uint8_t *)&ip6->ip6_dst;
+
+        return qemu_xxhash8(ldq_he_p(src), ldq_he_p(src + 8),
+                            ldq_he_p(dst) ^ ldq_he_p(dst + 8), ports, 0);
+    }
+}
+
+static bool virtio_net_rsc_match_flow(VirtioNetRscChain *chain,
+                                      VirtioNetRscSeg *seg, uint32_t hash,
+                                      VirtioNetRscUnit *unit)
+{
+    if (seg->flow_hash != hash ||
+        (unit->tcp->th_sport ^ seg->unit.tcp->th_sport) ||
+        (unit->tcp->th_dport ^ seg->unit.tcp->th_dport)) {
+        return false;
+    }
+
+    if (chain->proto == ETH_P_IP) {
+        struct ip_header *ip1 = unit->ip;
+        struct ip_header *ip2 = seg->unit.ip;
+
+        return !(ip1->ip_src ^ ip2->ip_src) && !(ip1->ip_dst ^ ip2->ip_dst);
+    } else {
+        struct ip6_header *ip1 = unit->ip;
+        struct ip6_header *ip2 = seg->unit.ip;
+
+        return !memcmp(&ip1->ip6_src, &ip2->ip6_src,
+                       sizeof(struct in6_address)) &&
+               !memcmp(&ip1->ip6_dst, &ip2->ip6_dst,
+                       sizeof(struct in6_address));
+    }
+}
+
+static VirtioNetRscSeg *virtio_net_rsc_lookup_flow(VirtioNetRscChain *chain,
+                                                   VirtioNetRscUnit *unit)
+{
+    uint32_t hash = virtio_net_rsc_flow_hash(chain, unit);
+    VirtioNetRscSeg *seg;
+
+    QLIST_FOREACH(seg, &chain->flows[hash & (VIRTIO_NET_RSC_FLOW_BUCKETS - 1)],
+                  flow_next) {
+        if (virtio_net_rsc_match_flow(chain, seg, hash, unit)) {
+            return seg;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * A peer without vnet header passes packets with checksums that nobody
+ * has verified yet.  Only packets with a good checksum are coalesced, the
+ * guest is told not to verify them again.
+ */
+static bool virtio_net_rsc_csum_valid(VirtioNetRscChain *chain,
+                                      VirtioNetRscUnit *unit)
+{
+    uint16_t tcp_len = unit->tcp_hdrlen + unit->payload;
+    uint32_t sum;
+
+    if (chain->proto == ETH_P_IP) {
+        struct ip_header *ip = unit->ip;
+
+        if (net_raw_checksum((uint8_t *)ip, sizeof(struct ip_header))) {
+            return false;
+        }
+        sum = net_checksum_add(VIRTIO_NET_IP4_ADDR_SIZE,
+                               (uint8_t *)&ip->ip_src);
+    } else {
+        struct ip6_header *ip6 = unit->ip;
+
+        sum = net_checksum_add(VIRTIO_NET_IP6_ADDR_SIZE,
+                               (uint8_t *)&ip6->ip6_src);
+    }
+
+    sum += net_checksum_add(tcp_len, (uint8_t *)unit->tcp);
+    sum += IPPROTO_TCP + tcp_len;
+
+    return net_checksum_finish(sum) == 0;
+}
+
+static ssize_t virtio_net_rsc_receive_gro(VirtioNetRscChain *chain,
+                                          VirtioNetRscSeg *seg)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(chain->n);
+    struct virtio_net_hdr hdr = {
+        .flags = VIRTIO_NET_HDR_F_DATA_VALID,
+        .gso_type = VIRTIO_NET_HDR_GSO_NONE,
+    };
+
+    if (seg->is_coalesced && chain->proto == ETH_P_IP) {
+        struct ip_header *ip = seg->unit.ip;
+
+        ip->ip_sum = 0;
+        ip->ip_sum = cpu_to_be16(net_raw_checksum((uint8_t *)ip,
+                                                  sizeof(struct ip_header)));
+    }
+
+    if (seg->mss && seg->unit.payload > seg->mss) {
+        hdr.gso_type = chain->gso_type;
+        virtio_stw_p(vdev, &hdr.hdr_len,
+                     (uint8_t *)seg->unit.tcp + seg->unit.tcp_hdrlen -
+                     (uint8_t *)seg->buf);
+        virtio_stw_p(vdev, &hdr.gso_size, seg->mss);
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    return virtio_net_receive_rcu(seg->nc, seg->buf, seg->size, &hdr);
+}
+
 static size_t virtio_net_rsc_drain_seg(VirtioNetRscChain *chain,
                                        VirtioNetRscSeg *seg)
 {
     int ret;
     struct virtio_net_hdr_v1 *h;
 
-    h = (struct virtio_net_hdr_v1 *)seg->buf;
-    h->flags = 0;
-    h->gso_type = VIRTIO_NET_HDR_GSO_NONE;
-
-    if (seg->is_coalesced) {
-        h->rsc.segments = seg->packets;
-        h->rsc.dup_acks = seg->dup_ack;
-        h->flags = VIRTIO_NET_HDR_F_RSC_INFO;
-        if (chain->proto == ETH_P_IP) {
-            h->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
-        } else {
-            h->gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+    if (virtio_net_rsc_gro(chain)) {
+        ret = virtio_net_rsc_receive_gro(chain, seg);
+    } else {
+        h = (struct virtio_net_hdr_v1 *)seg->buf;
+        h->flags = 0;
+        h->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+
+        if (seg->is_coalesced) {
+            h->rsc.segments = seg->packets;
+            h->rsc.dup_acks = seg->dup_ack;
+            h->flags = VIRTIO_NET_HDR_F_RSC_INFO;
+            if (chain->proto == ETH_P_IP) {
+                h->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+            } else {
+                h->gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+            }
         }
+
+        ret = virtio_net_do_receive(seg->nc, seg->buf, seg->size);
     }
 
-    ret = virtio_net_do_receive(seg->nc, seg->buf, seg->size);
     QTAILQ_REMOVE(&chain->buffers, seg, next);
+    QLIST_REMOVE(seg, flow_next);
+    chain->nr_flows--;
     g_free(seg->buf);
     g_free(seg);
 
@@ -2124,7 +2597,15 @@ static void virtio_net_rsc_cache_buf(VirtioNetRscChain *chain,
     uint16_t hdr_len;
     VirtioNetRscSeg *seg;
 
-    hdr_len = chain->n->guest_hdr_len;
+    if (chain->nr_flows >= VIRTIO_NET_RSC_MAX_FLOWS) {
+        chain->stat.flow_evicted++;
+        if (virtio_net_rsc_drain_seg(chain,
+                                     QTAILQ_FIRST(&chain->buffers)) == 0) {
+            chain->stat.drain_failed++;
+        }
+    }
+
+    hdr_len = chain->n->host_hdr_len;
     seg = g_new(VirtioNetRscSeg, 1);
     seg->buf = g_malloc(hdr_len + sizeof(struct eth_header)
         + sizeof(struct ip6_header) + VIRTIO_NET_MAX_TCP_PAYLOAD);
@@ -2148,6 +2629,13 @@ static void virtio_net_rsc_cache_buf(VirtioNetRscChain *chain,
     default:
         g_assert_not_reached();
     }
+
+    seg->mss = seg->unit.payload;
+    seg->flow_hash = virtio_net_rsc_flow_hash(chain, &seg->unit);
+    QLIST_INSERT_HEAD(&chain->flows[seg->flow_hash &
+                                    (VIRTIO_NET_RSC_FLOW_BUCKETS - 1)],
+                      seg, flow_next);
+    chain->nr_flows++;
 }
 
 static int32_t virtio_net_rsc_handle_ack(VirtioNetRscChain *chain,
@@ -2207,11 +2695,20 @@ static int32_t virtio_net_rsc_coalesce_data(VirtioNetRscChain *chain,
         return RSC_FINAL;
     }
 
+    /* The coalesced packet keeps the options of the first one */
+    if (n_unit->tcp_hdrlen != o_unit->tcp_hdrlen ||
+        memcmp(n_unit->tcp + 1, o_unit->tcp + 1,
+               n_unit->tcp_hdrlen - sizeof(struct tcp_header))) {
+        chain->stat.tcp_option++;
+        return RSC_FINAL;
+    }
+
     data = ((uint8_t *)n_unit->tcp) + n_unit->tcp_hdrlen;
     if (nseq == oseq) {
         if ((o_unit->payload == 0) && n_unit->payload) {
             /* From no payload to payload, normal case, not a dup ack or etc */
             chain->stat.data_after_pure_ack++;
+            seg->mss = n_unit->payload;
             goto coalesce;
         } else {
             return virtio_net_rsc_handle_ack(chain, seg, buf,
@@ -2228,6 +2725,13 @@ coalesce:
             return RSC_FINAL;
         }
 
+        /* The guest resegments GSO packets in mss sized chunks */
+        if (virtio_net_rsc_gro(chain) &&
+            (n_unit->payload > seg->mss || o_unit->payload % seg->mss)) {
+            chain->stat.over_size++;
+            return RSC_FINAL;
+        }
+
         /* Here comes the right data, the payload length in v4/v6 is different,
            so use the field value to update and record the new data len */
         o_unit->payload += n_unit->payload; /* update new data len */
@@ -2251,45 +2755,6 @@ coalesce:
     }
 }
 
-static int32_t virtio_net_rsc_coalesce4(VirtioNetRscChain *chain,
-                                        VirtioNetRscSeg *seg,
-                                        const uint8_t *buf, size_t size,
-                                        VirtioNetRscUnit *unit)
-{
-    struct ip_header *ip1, *ip2;
-
-    ip1 = (struct ip_header *)(unit->ip);
-    ip2 = (struct ip_header *)(seg->unit.ip);
-    if ((ip1->ip_src ^ ip2->ip_src) || (ip1->ip_dst ^ ip2->ip_dst)
-        || (unit->tcp->th_sport ^ seg->unit.tcp->th_sport)
-        || (unit->tcp->th_dport ^ seg->unit.tcp->th_dport)) {
-        chain->stat.no_match++;
-        return RSC_NO_MATCH;
-    }
-
-    return virtio_net_rsc_coalesce_data(chain, seg, buf, unit);
-}
-
-static int32_t virtio_net_rsc_coalesce6(VirtioNetRscChain *chain,
-                                        VirtioNetRscSeg *seg,
-                                        const uint8_t *buf, size_t size,
-                                        VirtioNetRscUnit *unit)
-{
-    struct ip6_header *ip1, *ip2;
-
-    ip1 = (struct ip6_header *)(unit->ip);
-    ip2 = (struct ip6_header *)(seg->unit.ip);
-    if (memcmp(&ip1->ip6_src, &ip2->ip6_src, sizeof(struct in6_address))
-        || memcmp(&ip1->ip6_dst, &ip2->ip6_dst, sizeof(struct in6_address))
-        || (unit->tcp->th_sport ^ seg->unit.tcp->th_sport)
-        || (unit->tcp->th_dport ^ seg->unit.tcp->th_dport)) {
-            chain->stat.no_match++;
-            return RSC_NO_MATCH;
-    }
-
-    return virtio_net_rsc_coalesce_data(chain, seg, buf, unit);
-}
-
 /* Packets with 'SYN' should bypass, other flag should be sent after drain
  * to prevent out of order */
 static int virtio_net_rsc_tcp_ctrl_check(VirtioNetRscChain *chain,
@@ -2306,12 +2771,21 @@ static int virtio_net_rsc_tcp_ctrl_check(VirtioNetRscChain *chain,
         return RSC_BYPASS;
     }
 
+    if (tcp_hdr < sizeof(struct tcp_header)) {
+        chain->stat.ip_hacked++;
+        return RSC_BYPASS;
+    }
+
     if (tcp_flag & (TH_FIN | TH_URG | TH_RST | TH_ECE | TH_CWR)) {
         chain->stat.tcp_ctrl_drain++;
         return RSC_FINAL;
     }
 
-    if (tcp_hdr > sizeof(struct tcp_header)) {
+    /*
+     * Linux senders use timestamps on every segment, GRO coalesces
+     * segments with identical options.
+     */
+    if (tcp_hdr > sizeof(struct tcp_header) && !virtio_net_rsc_gro(chain)) {
         chain->stat.tcp_all_opt++;
         return RSC_FINAL;
     }
@@ -2319,13 +2793,43 @@ static int virtio_net_rsc_tcp_ctrl_check(VirtioNetRscChain *chain,
     return RSC_CANDIDATE;
 }
 
+/* Drain a connection data, this is to avoid out of order segments */
+static size_t virtio_net_rsc_drain_flow(VirtioNetRscChain *chain,
+                                        NetClientState *nc,
+                                        const uint8_t *buf, size_t size,
+                                        VirtioNetRscUnit *unit)
+{
+    VirtioNetRscSeg *seg;
+
+    seg = virtio_net_rsc_lookup_flow(chain, unit);
+    if (seg && virtio_net_rsc_drain_seg(chain, seg) == 0) {
+        chain->stat.drain_failed++;
+    }
+
+    return virtio_net_do_receive(nc, buf, size);
+}
+
 static size_t virtio_net_rsc_do_coalesce(VirtioNetRscChain *chain,
                                          NetClientState *nc,
                                          const uint8_t *buf, size_t size,
                                          VirtioNetRscUnit *unit)
 {
     int ret;
-    VirtioNetRscSeg *seg, *nseg;
+    VirtioNetRscSeg *seg;
+    bool push = htons(unit->tcp->th_offset_flags) & TH_PUSH;
+
+    if (virtio_net_rsc_gro(chain)) {
+        if (!virtio_net_rsc_csum_valid(chain, unit)) {
+            chain->stat.csum_failed++;
+            return virtio_net_rsc_drain_flow(chain, nc, buf, size, unit);
+        }
+
+        /* Don't hold back acks and the end of a burst, like GRO */
+        if (!unit->payload ||
+            (push && !virtio_net_rsc_lookup_flow(chain, unit))) {
+            return virtio_net_rsc_drain_flow(chain, nc, buf, size, unit);
+        }
+    }
 
     if (QTAILQ_EMPTY(&chain->buffers)) {
         chain->stat.empty_cache++;
@@ -2335,61 +2839,35 @@ static size_t virtio_net_rsc_do_coalesce(VirtioNetRscChain *chain,
         return size;
     }
 
-    QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, nseg) {
-        if (chain->proto == ETH_P_IP) {
-            ret = virtio_net_rsc_coalesce4(chain, seg, buf, size, unit);
-        } else {
-            ret = virtio_net_rsc_coalesce6(chain, seg, buf, size, unit);
-        }
-
-        if (ret == RSC_FINAL) {
-            if (virtio_net_rsc_drain_seg(chain, seg) == 0) {
-                /* Send failed */
-                chain->stat.final_failed++;
-                return 0;
-            }
-
-            /* Send current packet */
-            return virtio_net_do_receive(nc, buf, size);
-        } else if (ret == RSC_NO_MATCH) {
-            continue;
-        } else {
-            /* Coalesced, mark coalesced flag to tell calc cksum for ipv4 */
-            seg->is_coalesced = 1;
-            return size;
-        }
+    seg = virtio_net_rsc_lookup_flow(chain, unit);
+    if (!seg) {
+        chain->stat.no_match++;
+        chain->stat.no_match_cache++;
+        virtio_net_rsc_cache_buf(chain, nc, buf, size);
+        return size;
     }
 
-    chain->stat.no_match_cache++;
-    virtio_net_rsc_cache_buf(chain, nc, buf, size);
-    return size;
-}
-
-/* Drain a connection data, this is to avoid out of order segments */
-static size_t virtio_net_rsc_drain_flow(VirtioNetRscChain *chain,
-                                        NetClientState *nc,
-                                        const uint8_t *buf, size_t size,
-                                        uint16_t ip_start, uint16_t ip_size,
-                                        uint16_t tcp_port)
-{
-    VirtioNetRscSeg *seg, *nseg;
-    uint32_t ppair1, ppair2;
-
-    ppair1 = *(uint32_t *)(buf + tcp_port);
-    QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, nseg) {
-        ppair2 = *(uint32_t *)(seg->buf + tcp_port);
-        if (memcmp(buf + ip_start, seg->buf + ip_start, ip_size)
-            || (ppair1 != ppair2)) {
-            continue;
-        }
+    ret = virtio_net_rsc_coalesce_data(chain, seg, buf, unit);
+    if (ret == RSC_FINAL) {
         if (virtio_net_rsc_drain_seg(chain, seg) == 0) {
-            chain->stat.drain_failed++;
+            /* Send failed */
+            chain->stat.final_failed++;
+            return 0;
         }
 
-        break;
+        /* Send current packet */
+        return virtio_net_do_receive(nc, buf, size);
     }
 
-    return virtio_net_do_receive(nc, buf, size);
+    /* Coalesced, mark coalesced flag to tell calc cksum for ipv4 */
+    seg->is_coalesced = 1;
+
+    if (virtio_net_rsc_gro(chain) && push &&
+        virtio_net_rsc_drain_seg(chain, seg) == 0) {
+        chain->stat.drain_failed++;
+    }
+
+    return size;
 }
 
 static int32_t virtio_net_rsc_sanity_check4(VirtioNetRscChain *chain,
@@ -2429,7 +2907,7 @@ static int32_t virtio_net_rsc_sanity_check4(VirtioNetRscChain *chain,
 
     ip_len = htons(ip->ip_len);
     if (ip_len < (sizeof(struct ip_header) + sizeof(struct tcp_header))
-        || ip_len > (size - chain->n->guest_hdr_len -
+        || ip_len > (size - chain->n->host_hdr_len -
                      sizeof(struct eth_header))) {
         chain->stat.ip_hacked++;
         return RSC_BYPASS;
@@ -2446,7 +2924,7 @@ static size_t virtio_net_rsc_receive4(VirtioNetRscChain *chain,
     uint16_t hdr_len;
     VirtioNetRscUnit unit;
 
-    hdr_len = ((VirtIONet *)(chain->n))->guest_hdr_len;
+    hdr_len = ((VirtIONet *)(chain->n))->host_hdr_len;
 
     if (size < (hdr_len + sizeof(struct eth_header) + sizeof(struct ip_header)
         + sizeof(struct tcp_header))) {
@@ -2464,10 +2942,7 @@ static size_t virtio_net_rsc_receive4(VirtioNetRscChain *chain,
     if (ret == RSC_BYPASS) {
         return virtio_net_do_receive(nc, buf, size);
     } else if (ret == RSC_FINAL) {
-        return virtio_net_rsc_drain_flow(chain, nc, buf, size,
-                ((hdr_len + sizeof(struct eth_header)) + 12),
-                VIRTIO_NET_IP4_ADDR_SIZE,
-                hdr_len + sizeof(struct eth_header) + sizeof(struct ip_header));
+        return virtio_net_rsc_drain_flow(chain, nc, buf, size, &unit);
     }
 
     return virtio_net_rsc_do_coalesce(chain, nc, buf, size, &unit);
@@ -2492,7 +2967,7 @@ static int32_t virtio_net_rsc_sanity_check6(VirtioNetRscChain *chain,
 
     ip_len = htons(ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
     if (ip_len < sizeof(struct tcp_header) ||
-        ip_len > (size - chain->n->guest_hdr_len - sizeof(struct eth_header)
+        ip_len > (size - chain->n->host_hdr_len - sizeof(struct eth_header)
                   - sizeof(struct ip6_header))) {
         chain->stat.ip_hacked++;
         return RSC_BYPASS;
@@ -2516,7 +2991,7 @@ static size_t virtio_net_rsc_receive6(void *opq, NetClientState *nc,
     VirtioNetRscUnit unit;
 
     chain = opq;
-    hdr_len = ((VirtIONet *)(chain->n))->guest_hdr_len;
+    hdr_len = ((VirtIONet *)(chain->n))->host_hdr_len;
 
     if (size < (hdr_len + sizeof(struct eth_header) + sizeof(struct ip6_header)
         + sizeof(tcp_header))) {
@@ -2533,11 +3008,7 @@ static size_t virtio_net_rsc_receive6(void *opq, NetClientState *nc,
     if (ret == RSC_BYPASS) {
         return virtio_net_do_receive(nc, buf, size);
     } else if (ret == RSC_FINAL) {
-        return virtio_net_rsc_drain_flow(chain, nc, buf, size,
-                ((hdr_len + sizeof(struct eth_header)) + 8),
-                VIRTIO_NET_IP6_ADDR_SIZE,
-                hdr_len + sizeof(struct eth_header)
-                + sizeof(struct ip6_header));
+        return virtio_net_rsc_drain_flow(chain, nc, buf, size, &unit);
     }
 
     return virtio_net_rsc_do_coalesce(chain, nc, buf, size, &unit);
@@ -2559,7 +3030,7 @@ static VirtioNetRscChain *virtio_net_rsc_lookup_chain(VirtIONet *n,
         }
     }
 
-    chain = g_malloc(sizeof(*chain));
+    chain = g_malloc0(sizeof(*chain));
     chain->n = n;
     chain->proto = proto;
     if (proto == (uint16_t)ETH_P_IP) {
@@ -2571,7 +3042,6 @@ static VirtioNetRscChain *virtio_net_rsc_lookup_chain(VirtIONet *n,
     }
     chain->drain_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
                                       virtio_net_rsc_purge, chain);
-    memset(&chain->stat, 0, sizeof(chain->stat));
 
     QTAILQ_INIT(&chain->buffers);
     QTAILQ_INSERT_TAIL(&n->rsc_chains, chain, next);
@@ -2593,7 +3063,7 @@ static ssize_t virtio_net_rsc_receive(NetClientState *nc,
         return virtio_net_do_receive(nc, buf, size);
     }
 
-    eth = (struct eth_header *)(buf + n->guest_hdr_len);
+    eth = (struct eth_header *)(buf + n->host_hdr_len);
     proto = htons(eth->h_proto);
 
     chain = virtio_net_rsc_lookup_chain(n, nc, proto);
@@ -2619,19 +3089,67 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
     }
 }
 
+/*
+ * Receive packets in order, with a single used index update and guest
+ * notification for the whole batch.
+ */
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const NetPacketIOV *pkts, int count,
+                                    ssize_t *rets)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    ssize_t ret;
+    int i;
+
+    q->rx_batching = true;
+
+    for (i = 0; i < count; i++) {
+        size_t size = iov_size(pkts[i].iov, pkts[i].iovcnt);
+
+        if (pkts[i].iovcnt == 1) {
+            ret = virtio_net_receive(nc, pkts[i].iov[0].iov_base, size);
+        } else if (size > NET_BUFSIZE) {
+            ret = -1;
+        } else {
+            if (!q->rx_batch_buf) {
+                q->rx_batch_buf = g_malloc(NET_BUFSIZE);
+            }
+            iov_to_buf(pkts[i].iov, pkts[i].iovcnt, 0, q->rx_batch_buf, size);
+            ret = virtio_net_receive(nc, q->rx_batch_buf, size);
+        }
+
+        rets[i] = ret;
+        if (ret == 0) {
+            break;
+        }
+    }
+
+    q->rx_batching = false;
+
+    if (q->rx_batch_used) {
+        WITH_RCU_READ_LOCK_GUARD() {
+            virtqueue_flush(q->rx_vq, q->rx_batch_used);
+        }
+        q->rx_batch_used = 0;
+        virtio_net_notify(n, q->rx_vq);
+    }
+
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
     int ret;
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(n, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_element_free(q->tx_vq, q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
@@ -2654,13 +3172,38 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 }
 
 /* TX */
+
+/* Give back elements popped in a batch but not processed */
+static void virtio_net_tx_unpop(VirtIONetQueue *q, VirtQueueElement **elems,
+                                unsigned int num)
+{
+    while (num--) {
+        virtqueue_unpop(q->tx_vq, elems[num], 0);
+        virtqueue_element_free(q->tx_vq, elems[num]);
+    }
+}
+
+/*
+ * Packets whose header is passed on unchanged can be sent straight from
+ * the guest buffers, and so in batches.
+ */
+static bool virtio_net_tx_can_batch(VirtIONet *n, VirtQueueElement *elem)
+{
+    return elem->out_num >= 1 && !n->needs_vnet_hdr_swap &&
+           n->host_hdr_len == n->guest_hdr_len;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     VirtQueueElement *elem;
+    VirtQueueElement *elems[VIRTIO_NET_TX_POP_BATCH];
+    NetPacketIOV pkts[VIRTIO_NET_TX_POP_BATCH];
+    unsigned int i = 0, num = 0;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *nc = qemu_get_subqueue(n->nic, queue_index);
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
@@ -2676,10 +3219,59 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
         struct virtio_net_hdr vhdr;
 
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
-            break;
+        if (i == num) {
+            /* Don't pop more than tx_burst allows us to send */
+            num = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                      (void **)elems,
+                                      MIN(ARRAY_SIZE(elems),
+                                          n->tx_burst - num_packets));
+            i = 0;
+            if (!num) {
+                break;
+            }
+        }
+
+        if (virtio_net_tx_can_batch(n, elems[i])) {
+            unsigned int count = 0, sent, j;
+
+            do {
+                pkts[count].iov = elems[i + count]->out_sg;
+                pkts[count].iovcnt = elems[i + count]->out_num;
+                count++;
+            } while (i + count < num &&
+                     virtio_net_tx_can_batch(n, elems[i + count]));
+
+            sent = qemu_sendv_packet_batch_async(nc, pkts, count,
+                                                 virtio_net_tx_complete);
+            if (sent) {
+                WITH_RCU_READ_LOCK_GUARD() {
+                    for (j = 0; j < sent; j++) {
+                        virtqueue_fill(q->tx_vq, elems[i + j], 0, j);
+                    }
+                    virtqueue_flush(q->tx_vq, sent);
+                }
+                virtio_net_notify(n, q->tx_vq);
+            }
+            for (j = 0; j < sent; j++) {
+                virtqueue_element_free(q->tx_vq, elems[i + j]);
+            }
+            i += sent;
+            num_packets += sent;
+
+            if (sent < count) {
+                /* The next packet got queued */
+                virtio_queue_set_notification(q->tx_vq, 0);
+                q->async_tx.elem = elems[i++];
+                virtio_net_tx_unpop(q, elems + i, num - i);
+                return -EBUSY;
+            }
+
+            if (num_packets >= n->tx_burst) {
+                break;
+            }
+            continue;
         }
+        elem = elems[i++];
 
         out_num = elem->out_num;
         out_sg = elem->out_sg;
@@ -2731,18 +3323,19 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             }
         }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
+        ret = qemu_sendv_packet_async(nc, out_sg, out_num,
+                                      virtio_net_tx_complete);
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
+            virtio_net_tx_unpop(q, elems + i, num - i);
             return -EBUSY;
         }
 
 drop:
         virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
+        virtio_net_notify(n, q->tx_vq);
+        virtqueue_element_free(q->tx_vq, elem);
 
         if (++num_packets >= n->tx_burst) {
             break;
@@ -2752,7 +3345,8 @@ drop:
 
 detach:
     virtqueue_detach_element(q->tx_vq, elem, 0);
-    g_free(elem);
+    virtqueue_element_free(q->tx_vq, elem);
+    virtio_net_tx_unpop(q, elems + i, num - i);
     return -EINVAL;
 }
 
@@ -2820,6 +3414,10 @@ static void virtio_net_tx_timer(void *opaque)
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     int ret;
 
+    if (virtio_net_queue_bounce(q, virtio_net_tx_timer)) {
+        return;
+    }
+
     /* This happens when device was stopped but BH wasn't. */
     if (!vdev->vm_running) {
         /* Make sure tx waiting is set, so we'll run when restarted. */
@@ -2870,6 +3468,10 @@ static void virtio_net_tx_bh(void *opaque)
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     int32_t ret;
 
+    if (virtio_net_queue_bounce(q, virtio_net_tx_bh)) {
+        return;
+    }
+
     /* This happens when device was stopped but BH wasn't. */
     if (!vdev->vm_running) {
         /* Make sure tx waiting is set, so we'll run when restarted. */
@@ -2915,6 +3517,7 @@ static void virtio_net_tx_bh(void *opaque)
 static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    AioContext *ctx = n->vq_aio_context ? n->vq_aio_context[index] : NULL;
 
     n->vqs[index].rx_vq = virtio_add_queue(vdev, n->net_conf.rx_queue_size,
                                            virtio_net_handle_rx);
@@ -2923,18 +3526,41 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
         n->vqs[index].tx_vq =
             virtio_add_queue(vdev, n->net_conf.tx_queue_size,
                              virtio_net_handle_tx_timer);
-        n->vqs[index].tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
-                                              virtio_net_tx_timer,
-                                              &n->vqs[index]);
+        if (ctx) {
+            n->vqs[index].tx_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL,
+                                                   SCALE_NS,
+                                                   virtio_net_tx_timer,
+                                                   &n->vqs[index]);
+        } else {
+            n->vqs[index].tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                                  virtio_net_tx_timer,
+                                                  &n->vqs[index]);
+        }
     } else {
         n->vqs[index].tx_vq =
             virtio_add_queue(vdev, n->net_conf.tx_queue_size,
                              virtio_net_handle_tx_bh);
-        n->vqs[index].tx_bh = qemu_bh_new_guarded(virtio_net_tx_bh, &n->vqs[index],
-                                                  &DEVICE(vdev)->mem_reentrancy_guard);
+        if (ctx) {
+            n->vqs[index].tx_bh =
+                aio_bh_new_guarded(ctx, virtio_net_tx_bh, &n->vqs[index],
+                                   &DEVICE(vdev)->mem_reentrancy_guard);
+        } else {
+            n->vqs[index].tx_bh =
+                qemu_bh_new_guarded(virtio_net_tx_bh, &n->vqs[index],
+                                    &DEVICE(vdev)->mem_reentrancy_guard);
+        }
     }
 
+    net_rx_pkt_init(&n->vqs[index].rx_pkt);
+    qemu_mutex_init(&n->vqs[index].rss_lock);
+    QSIMPLEQ_INIT(&n->vqs[index].rss_packets);
+    if (ctx) {
+        n->vqs[index].rss_bh =
+            aio_bh_new_guarded(ctx, virtio_net_rss_bh, &n->vqs[index],
+                               &DEVICE(vdev)->mem_reentrancy_guard);
+    }
     n->vqs[index].tx_waiting = 0;
+    n->vqs[index].reset = false;
     n->vqs[index].n = n;
 }
 
@@ -2956,6 +3582,18 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     }
     q->tx_waiting = 0;
     virtio_del_queue(vdev, index * 2 + 1);
+    net_rx_pkt_uninit(q->rx_pkt);
+    q->rx_pkt = NULL;
+    g_clear_pointer(&q->rx_batch_buf, g_free);
+
+    /* The queue pair is detached, rss_bh can't be scheduled anymore */
+    assert(!q->rss_attached);
+    if (q->rss_bh) {
+        qemu_bh_delete(q->rss_bh);
+        q->rss_bh = NULL;
+    }
+    virtio_net_rss_purge(q);
+    qemu_mutex_destroy(&q->rss_lock);
 }
 
 static void virtio_net_change_num_queues(VirtIONet *n, int new_num_queues)
@@ -3044,6 +3682,14 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_USO6);
 
         virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
+
+        if (virtio_net_gro_supported(n)) {
+            features |= n->host_features &
+                ((1ULL << VIRTIO_NET_F_GUEST_CSUM) |
+                 (1ULL << VIRTIO_NET_F_GUEST_TSO4) |
+                 (1ULL << VIRTIO_NET_F_GUEST_TSO6));
+            virtio_clear_feature(&features, VIRTIO_NET_F_RSC_EXT);
+        }
     }
 
     if (!peer_has_vnet_hdr(n) || !peer_has_ufo(n)) {
@@ -3181,6 +3827,8 @@ static int virtio_net_post_load_virtio(VirtIODevice *vdev)
     n->curr_guest_offloads = n->saved_guest_offloads;
     if (peer_has_vnet_hdr(n)) {
         virtio_net_apply_guest_offloads(n);
+    } else if (virtio_net_gro_supported(n)) {
+        virtio_net_apply_gro(n);
     }
 
     return 0;
@@ -3556,6 +4204,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_iov_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
     .announce = virtio_net_announce,
@@ -3625,6 +4274,170 @@ static void virtio_net_guest_notifier_mask(VirtIODevice *vdev, int idx,
     vhost_net_virtqueue_mask(get_vhost_net(nc->peer), vdev, idx, mask);
 }
 
+/* Context: BQL held */
+static bool virtio_net_vq_aio_context_init(VirtIONet *n, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    IOThreadVirtQueueMappingList *list = n->net_conf.iothread_vq_mapping_list;
+    int i;
+
+    if (!list) {
+        return true;
+    }
+
+    if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+        error_setg(errp,
+                   "device is incompatible with iothread "
+                   "(transport does not support notifiers)");
+        return false;
+    }
+    if (!virtio_device_ioeventfd_enabled(vdev)) {
+        error_setg(errp, "ioeventfd is required for iothread");
+        return false;
+    }
+    if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSC_EXT)) {
+        error_setg(errp, "guest_rsc_ext is not supported with iothread");
+        return false;
+    }
+    if (n->guest_gro) {
+        error_setg(errp, "guest_gro is not supported with iothread");
+        return false;
+    }
+
+    for (i = 0; i < n->nic_conf.peers.queues; i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+        if (get_vhost_net(peer) || !peer->info->set_aio_context) {
+            error_setg(errp, "netdev '%s' cannot be used with iothread",
+                       peer->name);
+            return false;
+        }
+    }
+
+    /* vqs in the mapping are queue pair indices */
+    n->vq_aio_context = g_new(AioContext *, n->max_queue_pairs);
+    if (!iothread_vq_mapping_apply(list, n->vq_aio_context,
+                                   n->max_queue_pairs, errp)) {
+        g_free(n->vq_aio_context);
+        n->vq_aio_context = NULL;
+        return false;
+    }
+
+    /* Guest notifiers are routed through irqfd, there is nothing to mask */
+    vdev->use_guest_notifier_mask = false;
+    return true;
+}
+
+/* Context: BQL held */
+static void virtio_net_vq_aio_context_cleanup(VirtIONet *n)
+{
+    assert(!n->ioeventfd_started);
+
+    if (n->vq_aio_context) {
+        iothread_vq_mapping_cleanup(n->net_conf.iothread_vq_mapping_list);
+        g_free(n->vq_aio_context);
+        n->vq_aio_context = NULL;
+    }
+}
+
+/* Context: BQL held */
+static int virtio_net_start_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int nvqs = virtio_get_num_queues(vdev);
+    int queue_pairs = n->multiqueue ? n->max_queue_pairs : 1;
+    int i, r;
+
+    if (!n->vq_aio_context) {
+        return virtio_device_start_ioeventfd_impl(vdev);
+    }
+
+    for (i = 0; i < queue_pairs; i++) {
+        NetClientState *peer = qemu_get_subqueue(n->nic, i)->peer;
+
+        if (peer && !qemu_can_set_aio_context(peer)) {
+            error_report("virtio-net: netdev '%s' has filters, "
+                         "not using iothread", peer->name);
+            return -ENOTSUP;
+        }
+    }
+
+    /* Set up guest notifier (irq) */
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifier (%d), "
+                     "ensure -accel kvm is set.", r);
+        return r;
+    }
+
+    r = virtio_device_start_ioeventfd_impl(vdev);
+    if (r < 0) {
+        k->set_guest_notifiers(qbus->parent, nvqs, false);
+        return r;
+    }
+
+    n->ioeventfd_started = true;
+
+    for (i = 0; i < queue_pairs; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        /* Take the data queues over from the main loop */
+        event_notifier_set_handler(virtio_queue_get_host_notifier(q->rx_vq),
+                                   NULL);
+        event_notifier_set_handler(virtio_queue_get_host_notifier(q->tx_vq),
+                                   NULL);
+        /* Inactive queue pairs are attached once the guest uses them */
+        if (i < n->curr_queue_pairs && !q->reset) {
+            virtio_net_queue_attach(n, i);
+        }
+    }
+    return 0;
+}
+
+/* Context: BQL held */
+static void virtio_net_stop_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queue_pairs = n->multiqueue ? n->max_queue_pairs : 1;
+    int i;
+
+    if (!n->vq_aio_context) {
+        virtio_device_stop_ioeventfd_impl(vdev);
+        return;
+    }
+
+    assert(n->ioeventfd_started);
+
+    for (i = 0; i < queue_pairs; i++) {
+        virtio_net_queue_detach(n, i);
+    }
+    n->ioeventfd_started = false;
+
+    virtio_device_stop_ioeventfd_impl(vdev);
+
+    /*
+     * The net layer skipped the clients while they were running in the
+     * IOThreads, complete the queued packets now if the VM is stopping.
+     */
+    for (i = 0; !vdev->vm_running && i < queue_pairs; i++) {
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+
+        qemu_flush_or_purge_queued_packets(nc, true);
+        if (nc->peer) {
+            qemu_flush_or_purge_queued_packets(nc->peer, true);
+        }
+    }
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, virtio_get_num_queues(vdev), false);
+}
+
 static void virtio_net_set_config_size(VirtIONet *n, uint64_t host_features)
 {
     virtio_add_feature(&host_features, VIRTIO_NET_F_MAC);
@@ -3883,6 +4696,11 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         virtio_cleanup(vdev);
         return;
     }
+    if (!virtio_net_vq_aio_context_init(n, errp)) {
+        virtio_cleanup(vdev);
+        return;
+    }
+
     n->vqs = g_new0(VirtIONetQueue, n->max_queue_pairs);
     n->curr_queue_pairs = 1;
     n->tx_timeout = n->net_conf.txtimer;
@@ -3957,7 +4775,6 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     QTAILQ_INIT(&n->rsc_chains);
     n->qdev = dev;
 
-    net_rx_pkt_init(&n->rx_pkt);
 
     if (qemu_get_vnet_hash_supported_types(qemu_get_queue(n->nic)->peer,
                                            &n->rss_data.peer_hash_types)) {
@@ -4013,7 +4830,7 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     qemu_del_nic(n->nic);
     virtio_net_rsc_cleanup(n);
     g_free(n->rss_data.indirections_table);
-    net_rx_pkt_uninit(n->rx_pkt);
+    virtio_net_vq_aio_context_cleanup(n);
     virtio_cleanup(vdev);
 }
 
@@ -4047,6 +4864,8 @@ static void virtio_net_reset(VirtIODevice *vdev)
     /* Flush any async TX */
     for (i = 0;  i < n->max_queue_pairs; i++) {
         flush_or_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+        virtio_net_rss_purge(&n->vqs[i]);
+        n->vqs[i].reset = false;
     }
 
     virtio_net_disable_rss(n);
@@ -4164,6 +4983,7 @@ static const Property virtio_net_properties[] = {
                     VIRTIO_NET_F_RSC_EXT, false),
     DEFINE_PROP_UINT32("rsc_interval", VirtIONet, rsc_timeout,
                        VIRTIO_NET_RSC_DEFAULT_INTERVAL),
+    DEFINE_PROP_BOOL("guest_gro", VirtIONet, guest_gro, false),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                        TX_TIMER_INTERVAL),
@@ -4179,6 +4999,8 @@ static const Property virtio_net_properties[] = {
     DEFINE_PROP_INT32("speed", VirtIONet, net_conf.speed, SPEED_UNKNOWN),
     DEFINE_PROP_STRING("duplex", VirtIONet, net_conf.duplex_str),
     DEFINE_PROP_BOOL("failover", VirtIONet, failover, false),
+    DEFINE_PROP_IOTHREAD_VQ_MAPPING_LIST("iothread-vq-mapping", VirtIONet,
+                                         net_conf.iothread_vq_mapping_list),
     DEFINE_PROP_BIT64("guest_uso4", VirtIONet, host_features,
                       VIRTIO_NET_F_GUEST_USO4, true),
     DEFINE_PROP_BIT64("guest_uso6", VirtIONet, host_features,
@@ -4244,6 +5066,8 @@ static void virtio_net_class_init(ObjectClass *klass, const void *data)
     vdc->set_status = virtio_net_set_status;
     vdc->guest_notifier_mask = virtio_net_guest_notifier_mask;
     vdc->guest_notifier_pending = virtio_net_guest_notifier_pending;
+    vdc->start_ioeventfd = virtio_net_start_ioeventfd;
+    vdc->stop_ioeventfd = virtio_net_stop_ioeventfd;
     vdc->legacy_features |= (0x1 << VIRTIO_NET_F_GSO);
     vdc->pre_load_queues = virtio_net_pre_load_queues;
     vdc->post_load = virtio_net_post_load_virtio;
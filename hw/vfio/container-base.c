@@ -20,6 +20,7 @@
 #include "qemu/error-report.h"
 #include "hw/vfio/vfio-container-base.h"
 #include "hw/vfio/vfio-device.h" /* vfio_device_reset_handler */
+#include "system/system.h"
 #include "system/reset.h"
 #include "vfio-helpers.h"
 
@@ -45,6 +46,7 @@ VFIOAddressSpace *vfio_address_space_get(AddressSpace *as)
 
     if (QLIST_EMPTY(&vfio_address_spaces)) {
         qemu_register_reset(vfio_device_reset_handler, NULL);
+        qemu_add_exit_notifier(&vfio_device_exit_notifier);
     }
 
     QLIST_INSERT_HEAD(&vfio_address_spaces, space, list);
@@ -63,6 +65,7 @@ void vfio_address_space_put(VFIOAddressSpace *space)
 
     if (QLIST_EMPTY(&vfio_address_spaces)) {
         qemu_unregister_reset(vfio_device_reset_handler, NULL);
+        qemu_remove_exit_notifier(&vfio_device_exit_notifier);
     }
 }
 
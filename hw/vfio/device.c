@@ -22,10 +22,12 @@
 #include <sys/ioctl.h>
 
 #include "hw/vfio/vfio-device.h"
+#include "hw/vfio/vfio-container.h"
 #include "hw/vfio/pci.h"
 #include "hw/hw.h"
 #include "trace.h"
 #include "qapi/error.h"
+#include "qemu/async-teardown.h"
 #include "qemu/error-report.h"
 #include "qemu/units.h"
 #include "migration/cpr.h"
@@ -71,6 +73,35 @@ void vfio_device_reset_handler(void *opaque)
     }
 }
 
+/*
+ * With asynchronous teardown, the cleanup process closes the files that
+ * hold the DMA mappings once QEMU is gone.  Dropping the last reference to
+ * them unpins the guest memory, which takes a while for large guests.
+ *
+ * The device files are not handed over, so devices are released when QEMU
+ * exits.  With iommufd the mappings belong to the iommufd file alone.  A
+ * legacy container is only released with its last group, so the groups
+ * stay in use until the cleanup process is done.
+ */
+static void vfio_device_exit_notify(Notifier *n, void *data)
+{
+    VFIODevice *vbasedev;
+
+    QLIST_FOREACH(vbasedev, &vfio_device_list, global_next) {
+        if (vbasedev->group) {
+            async_teardown_add_fd(vbasedev->group->fd);
+            async_teardown_add_fd(vbasedev->group->container->fd);
+        }
+        if (vbasedev->iommufd) {
+            async_teardown_add_fd(vbasedev->iommufd->fd);
+        }
+    }
+}
+
+Notifier vfio_device_exit_notifier = {
+    .notify = vfio_device_exit_notify,
+};
+
 /*
  * Common VFIO interrupt disable
  */
@@ -11,6 +11,7 @@
 #include "hw/virtio/vhost-shadow-virtqueue.h"
 
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "qapi/error.h"
 #include "qemu/main-loop.h"
 #include "qemu/log.h"
@@ -34,6 +35,8 @@ bool vhost_svq_valid_features(uint64_t features, Error **errp)
         switch (b) {
         case VIRTIO_F_ANY_LAYOUT:
         case VIRTIO_RING_F_EVENT_IDX:
+        case VIRTIO_F_RING_PACKED:
+        case VIRTIO_F_IN_ORDER:
             continue;
 
         case VIRTIO_F_ACCESS_PLATFORM:
@@ -218,6 +221,8 @@ static bool vhost_svq_add_split(VhostShadowVirtqueue *svq,
     ok = vhost_svq_vring_write_descs(svq, sgs, in_sg, in_num, in_addr, false,
                                      true);
     if (unlikely(!ok)) {
+        /* Keep the free descriptors contiguous for in order devices */
+        svq->free_head = *head;
         return false;
     }
 
@@ -236,7 +241,111 @@ static bool vhost_svq_add_split(VhostShadowVirtqueue *svq,
     return true;
 }
 
-static void vhost_svq_kick(VhostShadowVirtqueue *svq)
+static uint16_t vhost_svq_packed_desc_flags(bool wrap_counter)
+{
+    return wrap_counter << VRING_PACKED_DESC_F_AVAIL |
+           !wrap_counter << VRING_PACKED_DESC_F_USED;
+}
+
+static bool vhost_svq_add_packed(VhostShadowVirtqueue *svq,
+                                 const struct iovec *out_sg, size_t out_num,
+                                 const hwaddr *out_addr,
+                                 const struct iovec *in_sg, size_t in_num,
+                                 const hwaddr *in_addr, unsigned *head)
+{
+    struct vring_packed_desc *descs = svq->vring_packed.desc;
+    uint16_t head_idx = svq->shadow_avail_idx, i = head_idx;
+    bool wrap_counter = svq->avail_wrap_counter;
+    size_t num = out_num + in_num;
+    uint16_t id, head_flags = 0;
+    g_autofree hwaddr *sgs = g_new(hwaddr, num);
+
+    /* We need some descriptors here */
+    if (unlikely(!num)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "Guest provided element with no descriptors");
+        return false;
+    }
+
+    if (unlikely(!vhost_svq_translate_addr(svq, sgs, out_sg, out_num,
+                                           out_addr) ||
+                 !vhost_svq_translate_addr(svq, sgs + out_num, in_sg, in_num,
+                                           in_addr))) {
+        return false;
+    }
+
+    /*
+     * In order devices use the buffers in ring order, so the ring position
+     * of the first descriptor is a free id.
+     */
+    id = svq->in_order ? head_idx : svq->free_head;
+
+    for (size_t n = 0; n < num; n++) {
+        const struct iovec *iov = n < out_num ? &out_sg[n]
+                                              : &in_sg[n - out_num];
+        uint16_t flags = vhost_svq_packed_desc_flags(wrap_counter);
+
+        if (n >= out_num) {
+            flags |= VRING_DESC_F_WRITE;
+        }
+        if (n + 1 < num) {
+            flags |= VRING_DESC_F_NEXT;
+        }
+
+        descs[i].addr = cpu_to_le64(sgs[n]);
+        descs[i].len = cpu_to_le32(iov->iov_len);
+        descs[i].id = cpu_to_le16(id);
+        if (n == 0) {
+            /* Exposed last, once the whole chain is written */
+            head_flags = flags;
+        } else {
+            descs[i].flags = cpu_to_le16(flags);
+        }
+
+        if (++i == svq->vring.num) {
+            i = 0;
+            wrap_counter = !wrap_counter;
+        }
+    }
+
+    if (!svq->in_order) {
+        svq->free_head = svq->desc_next[id];
+    }
+    svq->shadow_avail_idx = i;
+    svq->avail_wrap_counter = wrap_counter;
+    *head = id;
+
+    /* Update the head flags after write the rest of the chain */
+    smp_wmb();
+    descs[head_idx].flags = cpu_to_le16(head_flags);
+
+    return true;
+}
+
+/* Called after adding a chain of @ndescs descriptors to a packed vring */
+static bool vhost_svq_packed_needs_kick(const VhostShadowVirtqueue *svq,
+                                        uint16_t ndescs)
+{
+    const struct vring_packed_desc_event *device = svq->vring_packed.device;
+    uint16_t flags = le16_to_cpu(device->flags);
+    uint16_t off_wrap, event_idx;
+
+    if (flags != VRING_PACKED_EVENT_FLAG_DESC) {
+        return flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+    }
+
+    off_wrap = le16_to_cpu(device->off_wrap);
+    event_idx = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+    if ((off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) !=
+        svq->avail_wrap_counter) {
+        event_idx -= svq->vring.num;
+    }
+
+    return vring_need_event(event_idx, svq->shadow_avail_idx,
+                            svq->shadow_avail_idx - ndescs);
+}
+
+static void vhost_svq_kick(VhostShadowVirtqueue *svq, uint16_t ndescs)
 {
     bool needs_kick;
 
@@ -246,7 +355,9 @@ static void vhost_svq_kick(VhostShadowVirtqueue *svq)
      */
     smp_mb();
 
-    if (virtio_vdev_has_feature(svq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (svq->is_packed) {
+        needs_kick = vhost_svq_packed_needs_kick(svq, ndescs);
+    } else if (virtio_vdev_has_feature(svq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         uint16_t avail_event = le16_to_cpu(
                 *(uint16_t *)(&svq->vring.used->ring[svq->vring.num]));
         needs_kick = vring_need_event(avail_event, svq->shadow_avail_idx, svq->shadow_avail_idx - 1);
@@ -280,8 +391,13 @@ int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
         return -ENOSPC;
     }
 
-    ok = vhost_svq_add_split(svq, out_sg, out_num, out_addr, in_sg, in_num,
-                             in_addr, &qemu_head);
+    if (svq->is_packed) {
+        ok = vhost_svq_add_packed(svq, out_sg, out_num, out_addr, in_sg,
+                                  in_num, in_addr, &qemu_head);
+    } else {
+        ok = vhost_svq_add_split(svq, out_sg, out_num, out_addr, in_sg,
+                                 in_num, in_addr, &qemu_head);
+    }
     if (unlikely(!ok)) {
         return -EINVAL;
     }
@@ -289,7 +405,7 @@ int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
     svq->num_free -= ndescs;
     svq->desc_state[qemu_head].elem = elem;
     svq->desc_state[qemu_head].ndescs = ndescs;
-    vhost_svq_kick(svq);
+    vhost_svq_kick(svq, ndescs);
     return 0;
 }
 
@@ -381,16 +497,49 @@ static void vhost_handle_guest_kick_notifier(EventNotifier *n)
     vhost_handle_guest_kick(svq);
 }
 
+static bool vhost_svq_packed_more_used(const VhostShadowVirtqueue *svq)
+{
+    uint16_t flags = le16_to_cpu(
+        qatomic_read(&svq->vring_packed.desc[svq->last_used_idx].flags));
+    bool avail = flags & BIT(VRING_PACKED_DESC_F_AVAIL);
+    bool used = flags & BIT(VRING_PACKED_DESC_F_USED);
+
+    if (avail != used || used != svq->used_wrap_counter) {
+        return false;
+    }
+
+    /* Only read the used descriptor after its flags */
+    smp_rmb();
+    return true;
+}
+
 static bool vhost_svq_more_used(VhostShadowVirtqueue *svq)
 {
     uint16_t *used_idx = &svq->vring.used->idx;
+
+    if (svq->batch_pending) {
+        return true;
+    }
+
+    if (svq->is_packed) {
+        return vhost_svq_packed_more_used(svq);
+    }
+
     if (svq->last_used_idx != svq->shadow_used_idx) {
         return true;
     }
 
     svq->shadow_used_idx = le16_to_cpu(*(volatile uint16_t *)used_idx);
+    if (svq->last_used_idx == svq->shadow_used_idx) {
+        return false;
+    }
 
-    return svq->last_used_idx != svq->shadow_used_idx;
+    /*
+     * Only get used array entries after they have been exposed by dev.  One
+     * barrier covers all the entries up to shadow_used_idx.
+     */
+    smp_rmb();
+    return true;
 }
 
 /**
@@ -404,7 +553,10 @@ static bool vhost_svq_more_used(VhostShadowVirtqueue *svq)
  */
 static bool vhost_svq_enable_notification(VhostShadowVirtqueue *svq)
 {
-    if (virtio_vdev_has_feature(svq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (svq->is_packed) {
+        svq->vring_packed.driver->flags =
+            cpu_to_le16(VRING_PACKED_EVENT_FLAG_ENABLE);
+    } else if (virtio_vdev_has_feature(svq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         uint16_t *used_event = (uint16_t *)&svq->vring.avail->ring[svq->vring.num];
         *used_event = cpu_to_le16(svq->shadow_used_idx);
     } else {
@@ -418,6 +570,12 @@ static bool vhost_svq_enable_notification(VhostShadowVirtqueue *svq)
 
 static void vhost_svq_disable_notification(VhostShadowVirtqueue *svq)
 {
+    if (svq->is_packed) {
+        svq->vring_packed.driver->flags =
+            cpu_to_le16(VRING_PACKED_EVENT_FLAG_DISABLE);
+        return;
+    }
+
     /*
      * No need to disable notification in the event idx case, since used event
      * index is already an index too far away.
@@ -437,47 +595,137 @@ static uint16_t vhost_svq_last_desc_of_chain(const VhostShadowVirtqueue *svq,
     return i;
 }
 
+static void vhost_svq_packed_advance_used(VhostShadowVirtqueue *svq,
+                                          uint16_t num)
+{
+    svq->last_used_idx += num;
+    if (svq->last_used_idx >= svq->vring.num) {
+        svq->last_used_idx -= svq->vring.num;
+        svq->used_wrap_counter = !svq->used_wrap_counter;
+    }
+}
+
+/*
+ * Read the next used entry.  Called after vhost_svq_more_used() returned
+ * true.
+ */
+static bool vhost_svq_read_used(VhostShadowVirtqueue *svq, uint16_t *id,
+                                uint32_t *len)
+{
+    uint32_t used_id;
+
+    if (svq->is_packed) {
+        const struct vring_packed_desc *desc =
+            &svq->vring_packed.desc[svq->last_used_idx];
+
+        used_id = le16_to_cpu(desc->id);
+        *len = le32_to_cpu(desc->len);
+    } else {
+        const vring_used_t *used = svq->vring.used;
+        uint16_t last_used = svq->last_used_idx & (svq->vring.num - 1);
+
+        used_id = le32_to_cpu(used->ring[last_used].id);
+        *len = le32_to_cpu(used->ring[last_used].len);
+        svq->last_used_idx++;
+    }
+
+    if (unlikely(used_id >= svq->vring.num ||
+                 !svq->desc_state[used_id].ndescs)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+            "Device %s says index %u is used, but it was not available",
+            svq->vdev->name, used_id);
+        if (svq->is_packed) {
+            /* Skip the entry, as the split vring does */
+            vhost_svq_packed_advance_used(svq, 1);
+        }
+        return false;
+    }
+
+    *id = used_id;
+    return true;
+}
+
+/* Return the descriptors of buffer @id to the free ones */
+static VirtQueueElement *vhost_svq_detach_buf(VhostShadowVirtqueue *svq,
+                                              uint16_t id)
+{
+    uint16_t num = svq->desc_state[id].ndescs, last_used_chain;
+
+    svq->desc_state[id].ndescs = 0;
+
+    if (svq->is_packed) {
+        vhost_svq_packed_advance_used(svq, num);
+        if (!svq->in_order) {
+            svq->desc_next[id] = svq->free_head;
+            svq->free_head = id;
+        }
+    } else if (!svq->in_order) {
+        last_used_chain = vhost_svq_last_desc_of_chain(svq, num, id);
+        svq->desc_next[last_used_chain] = svq->free_head;
+        svq->free_head = id;
+    }
+    /*
+     * In order devices release the descriptors in ring order, right after
+     * the free ones, so the free descriptors stay contiguous.
+     */
+    svq->num_free += num;
+
+    return g_steal_pointer(&svq->desc_state[id].elem);
+}
+
+/* The id of the oldest buffer in flight, for in order devices */
+static uint16_t vhost_svq_in_order_next_id(const VhostShadowVirtqueue *svq)
+{
+    if (svq->is_packed) {
+        return svq->last_used_idx;
+    }
+    return (svq->free_head + svq->num_free) % svq->vring.num;
+}
+
 G_GNUC_WARN_UNUSED_RESULT
 static VirtQueueElement *vhost_svq_get_buf(VhostShadowVirtqueue *svq,
                                            uint32_t *len)
 {
-    const vring_used_t *used = svq->vring.used;
-    vring_used_elem_t used_elem;
-    uint16_t last_used, last_used_chain, num;
+    uint16_t id;
 
     if (!vhost_svq_more_used(svq)) {
         return NULL;
     }
 
-    /* Only get used array entries after they have been exposed by dev */
-    smp_rmb();
-    last_used = svq->last_used_idx & (svq->vring.num - 1);
-    used_elem.id = le32_to_cpu(used->ring[last_used].id);
-    used_elem.len = le32_to_cpu(used->ring[last_used].len);
-
-    svq->last_used_idx++;
-    if (unlikely(used_elem.id >= svq->vring.num)) {
-        qemu_log_mask(LOG_GUEST_ERROR, "Device %s says index %u is used",
-                      svq->vdev->name, used_elem.id);
-        return NULL;
+    if (!svq->in_order) {
+        if (!vhost_svq_read_used(svq, &id, len)) {
+            return NULL;
+        }
+        return vhost_svq_detach_buf(svq, id);
     }
 
-    if (unlikely(!svq->desc_state[used_elem.id].ndescs)) {
+    if (!svq->batch_pending) {
+        if (!vhost_svq_read_used(svq, &svq->batch_last_id,
+                                 &svq->batch_last_len)) {
+            return NULL;
+        }
+        svq->batch_pending = true;
+    }
+
+    /* All the buffers up to the last one of the batch have been used */
+    id = vhost_svq_in_order_next_id(svq);
+    if (unlikely(!svq->desc_state[id].ndescs)) {
         qemu_log_mask(LOG_GUEST_ERROR,
-            "Device %s says index %u is used, but it was not available",
-            svq->vdev->name, used_elem.id);
+                      "Device %s used buffers out of order",
+                      svq->vdev->name);
+        svq->batch_pending = false;
         return NULL;
     }
 
-    num = svq->desc_state[used_elem.id].ndescs;
-    svq->desc_state[used_elem.id].ndescs = 0;
-    last_used_chain = vhost_svq_last_desc_of_chain(svq, num, used_elem.id);
-    svq->desc_next[last_used_chain] = svq->free_head;
-    svq->free_head = used_elem.id;
-    svq->num_free += num;
+    if (id == svq->batch_last_id) {
+        *len = svq->batch_last_len;
+        svq->batch_pending = false;
+    } else {
+        /* The device doesn't tell how much it wrote in the skipped ones */
+        *len = 0;
+    }
 
-    *len = used_elem.len;
-    return g_steal_pointer(&svq->desc_state[used_elem.id].elem);
+    return vhost_svq_detach_buf(svq, id);
 }
 
 /**
@@ -524,8 +772,11 @@ static void vhost_svq_flush(VhostShadowVirtqueue *svq,
             virtqueue_fill(vq, elem, len, i++);
         }
 
-        virtqueue_flush(vq, i);
-        event_notifier_set(&svq->svq_call);
+        if (i) {
+            /* Return the whole batch to the guest with a single call */
+            virtqueue_flush(vq, i);
+            event_notifier_set(&svq->svq_call);
+        }
 
         if (check_for_avail_queue && svq->next_guest_avail_elem) {
             /*
@@ -541,6 +792,9 @@ static void vhost_svq_flush(VhostShadowVirtqueue *svq,
  * Poll the SVQ to wait for the device to use the specified number
  * of elements and return the total length written by the device.
  *
+ * An in order device may only report the length of the last element of a
+ * batch, the others count as 0.
+ *
  * This function race with main event loop SVQ polling, so extra
  * synchronization is needed.
  *
@@ -620,17 +874,53 @@ void vhost_svq_set_svq_call_fd(VhostShadowVirtqueue *svq, int call_fd)
 void vhost_svq_get_vring_addr(const VhostShadowVirtqueue *svq,
                               struct vhost_vring_addr *addr)
 {
+    if (svq->is_packed) {
+        addr->desc_user_addr = (uint64_t)(uintptr_t)svq->vring_packed.desc;
+        addr->avail_user_addr = (uint64_t)(uintptr_t)svq->vring_packed.driver;
+        addr->used_user_addr = (uint64_t)(uintptr_t)svq->vring_packed.device;
+        return;
+    }
+
     addr->desc_user_addr = (uint64_t)(uintptr_t)svq->vring.desc;
     addr->avail_user_addr = (uint64_t)(uintptr_t)svq->vring.avail;
     addr->used_user_addr = (uint64_t)(uintptr_t)svq->vring.used;
 }
 
+/**
+ * Get the start of the memory areas holding the vring parts that only the
+ * driver writes (of vhost_svq_driver_area_size() bytes) and the ones the
+ * device writes (of vhost_svq_device_area_size() bytes).
+ *
+ * In a packed vring the device writes the descriptors, so they are in the
+ * device area.
+ *
+ * @svq: Shadow virtqueue
+ * @driver_addr: Start of the driver area
+ * @device_addr: Start of the device area
+ */
+void vhost_svq_get_vring_areas(const VhostShadowVirtqueue *svq,
+                               uint64_t *driver_addr, uint64_t *device_addr)
+{
+    if (svq->is_packed) {
+        *driver_addr = (uint64_t)(uintptr_t)svq->vring_packed.driver;
+        *device_addr = (uint64_t)(uintptr_t)svq->vring_packed.desc;
+    } else {
+        *driver_addr = (uint64_t)(uintptr_t)svq->vring.desc;
+        *device_addr = (uint64_t)(uintptr_t)svq->vring.used;
+    }
+}
+
 size_t vhost_svq_driver_area_size(const VhostShadowVirtqueue *svq)
 {
     size_t desc_size = sizeof(vring_desc_t) * svq->vring.num;
     size_t avail_size = offsetof(vring_avail_t, ring[svq->vring.num]) +
                                                               sizeof(uint16_t);
 
+    if (svq->is_packed) {
+        return ROUND_UP(sizeof(struct vring_packed_desc_event),
+                        qemu_real_host_page_size());
+    }
+
     return ROUND_UP(desc_size + avail_size, qemu_real_host_page_size());
 }
 
@@ -638,6 +928,12 @@ size_t vhost_svq_device_area_size(const VhostShadowVirtqueue *svq)
 {
     size_t used_size = offsetof(vring_used_t, ring[svq->vring.num]) +
                                                               sizeof(uint16_t);
+
+    if (svq->is_packed) {
+        used_size = sizeof(struct vring_packed_desc) * svq->vring.num +
+                    sizeof(struct vring_packed_desc_event);
+    }
+
     return ROUND_UP(used_size, qemu_real_host_page_size());
 }
 
@@ -683,26 +979,42 @@ void vhost_svq_start(VhostShadowVirtqueue *svq, VirtIODevice *vdev,
                      VirtQueue *vq, VhostIOVATree *iova_tree)
 {
     size_t desc_size;
+    void *driver_area, *device_area;
 
     event_notifier_set_handler(&svq->hdev_call, vhost_svq_handle_call);
     svq->next_guest_avail_elem = NULL;
     svq->shadow_avail_idx = 0;
     svq->shadow_used_idx = 0;
     svq->last_used_idx = 0;
+    svq->free_head = 0;
+    svq->avail_wrap_counter = true;
+    svq->used_wrap_counter = true;
+    svq->batch_pending = false;
     svq->vdev = vdev;
     svq->vq = vq;
     svq->iova_tree = iova_tree;
+    svq->is_packed = virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED);
+    svq->in_order = virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER);
 
     svq->vring.num = virtio_queue_get_num(vdev, virtio_get_queue_index(vq));
     svq->num_free = svq->vring.num;
-    svq->vring.desc = mmap(NULL, vhost_svq_driver_area_size(svq),
-                           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
-                           -1, 0);
-    desc_size = sizeof(vring_desc_t) * svq->vring.num;
-    svq->vring.avail = (void *)((char *)svq->vring.desc + desc_size);
-    svq->vring.used = mmap(NULL, vhost_svq_device_area_size(svq),
-                           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
-                           -1, 0);
+    driver_area = mmap(NULL, vhost_svq_driver_area_size(svq),
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                       -1, 0);
+    device_area = mmap(NULL, vhost_svq_device_area_size(svq),
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                       -1, 0);
+    if (svq->is_packed) {
+        desc_size = sizeof(struct vring_packed_desc) * svq->vring.num;
+        svq->vring_packed.driver = driver_area;
+        svq->vring_packed.desc = device_area;
+        svq->vring_packed.device = (void *)((char *)device_area + desc_size);
+    } else {
+        desc_size = sizeof(vring_desc_t) * svq->vring.num;
+        svq->vring.desc = driver_area;
+        svq->vring.avail = (void *)((char *)driver_area + desc_size);
+        svq->vring.used = device_area;
+    }
     svq->desc_state = g_new0(SVQDescState, svq->vring.num);
     svq->desc_next = g_new0(uint16_t, svq->vring.num);
     for (unsigned i = 0; i < svq->vring.num - 1; i++) {
@@ -718,6 +1030,7 @@ void vhost_svq_stop(VhostShadowVirtqueue *svq)
 {
     vhost_svq_set_svq_kick_fd(svq, VHOST_FILE_UNBIND);
     g_autofree VirtQueueElement *next_avail_elem = NULL;
+    uint64_t driver_addr, device_addr;
 
     if (!svq->vq) {
         return;
@@ -745,8 +1058,9 @@ void vhost_svq_stop(VhostShadowVirtqueue *svq)
     svq->vq = NULL;
     g_free(svq->desc_next);
     g_free(svq->desc_state);
-    munmap(svq->vring.desc, vhost_svq_driver_area_size(svq));
-    munmap(svq->vring.used, vhost_svq_device_area_size(svq));
+    vhost_svq_get_vring_areas(svq, &driver_addr, &device_addr);
+    munmap((void *)(uintptr_t)driver_addr, vhost_svq_driver_area_size(svq));
+    munmap((void *)(uintptr_t)device_addr, vhost_svq_device_area_size(svq));
     event_notifier_set_handler(&svq->hdev_call, NULL);
 }
 
@@ -51,6 +51,19 @@ typedef struct VhostShadowVirtqueue {
     /* Shadow vring */
     struct vring vring;
 
+    /* Shadow packed vring, of vring.num descriptors */
+    struct {
+        struct vring_packed_desc *desc;
+        struct vring_packed_desc_event *driver;
+        struct vring_packed_desc_event *device;
+    } vring_packed;
+
+    /* The shadow vring uses the packed layout */
+    bool is_packed;
+
+    /* The device uses the buffers in the order they were made available */
+    bool in_order;
+
     /* Shadow kick notifier, sent to vhost */
     EventNotifier hdev_kick;
     /* Shadow call notifier, sent to vhost */
@@ -96,20 +109,39 @@ typedef struct VhostShadowVirtqueue {
     /* Caller callbacks opaque */
     void *ops_opaque;
 
-    /* Next head to expose to the device */
+    /*
+     * Next head to expose to the device.  For a packed vring, the position
+     * of the next descriptor in the ring.
+     */
     uint16_t shadow_avail_idx;
 
-    /* Next free descriptor */
+    /* Next free descriptor, or buffer id for a packed vring */
     uint16_t free_head;
 
     /* Last seen used idx */
     uint16_t shadow_used_idx;
 
-    /* Next head to consume from the device */
+    /*
+     * Next head to consume from the device.  For a packed vring, the
+     * position of the next used descriptor in the ring.
+     */
     uint16_t last_used_idx;
 
     /* Size of SVQ vring free descriptors */
     uint16_t num_free;
+
+    /* Packed vring wrap counters of shadow_avail_idx and last_used_idx */
+    bool avail_wrap_counter;
+    bool used_wrap_counter;
+
+    /*
+     * In order devices can mark a batch of buffers used with a single used
+     * entry, for the last buffer of the batch.  Set while the buffers of
+     * such a batch are being returned.
+     */
+    bool batch_pending;
+    uint16_t batch_last_id;
+    uint32_t batch_last_len;
 } VhostShadowVirtqueue;
 
 bool vhost_svq_valid_features(uint64_t features, Error **errp);
@@ -127,6 +159,8 @@ void vhost_svq_set_svq_kick_fd(VhostShadowVirtqueue *svq, int svq_kick_fd);
 void vhost_svq_set_svq_call_fd(VhostShadowVirtqueue *svq, int call_fd);
 void vhost_svq_get_vring_addr(const VhostShadowVirtqueue *svq,
                               struct vhost_vring_addr *addr);
+void vhost_svq_get_vring_areas(const VhostShadowVirtqueue *svq,
+                               uint64_t *driver_addr, uint64_t *device_addr);
 size_t vhost_svq_driver_area_size(const VhostShadowVirtqueue *svq);
 size_t vhost_svq_device_area_size(const VhostShadowVirtqueue *svq);
 
@@ -1122,6 +1122,23 @@ static int vhost_user_get_features(struct vhost_dev *dev, uint64_t *features)
     return 0;
 }
 
+/*
+ * Unlike vhost_user_get_features(), which is also used to wait for the
+ * backend, don't ask again what the backend told during the handshake.
+ */
+static int vhost_user_get_backend_features(struct vhost_dev *dev,
+                                           uint64_t *features)
+{
+    struct vhost_user *u = dev->opaque;
+
+    if (u->user->handshake_done) {
+        *features = u->user->backend_features;
+        return 0;
+    }
+
+    return vhost_user_get_features(dev, features);
+}
+
 /* Note: "msg->hdr.flags" may be modified. */
 static int vhost_user_write_sync(struct vhost_dev *dev, VhostUserMsg *msg,
                                  bool wait_for_reply)
@@ -1232,18 +1249,23 @@ static int vhost_user_set_vring_base(struct vhost_dev *dev,
 
 static int vhost_user_set_vring_enable(struct vhost_dev *dev, int enable)
 {
-    int i;
+    bool reply_supported = virtio_has_feature(dev->protocol_features,
+                                              VHOST_USER_PROTOCOL_F_REPLY_ACK);
+    VhostUserMsg msg = {
+        .hdr.request = VHOST_USER_SET_VRING_ENABLE,
+        .hdr.flags = VHOST_USER_VERSION,
+        .hdr.size = sizeof(msg.payload.state),
+    };
+    uint64_t dummy;
+    int i, ret, err = 0;
 
     if (!virtio_has_feature(dev->features, VHOST_USER_F_PROTOCOL_FEATURES)) {
         return -EINVAL;
     }
 
     for (i = 0; i < dev->nvqs; ++i) {
-        int ret;
-        struct vhost_vring_state state = {
-            .index = dev->vq_index + i,
-            .num   = enable,
-        };
+        msg.payload.state.index = dev->vq_index + i;
+        msg.payload.state.num = enable;
 
         /*
          * SET_VRING_ENABLE travels from guest to QEMU to vhost-user backend /
@@ -1256,10 +1278,15 @@ static int vhost_user_set_vring_enable(struct vhost_dev *dev, int enable)
          * data plane thread to discard the virtio request (it arrived on a
          * seemingly disabled queue). To prevent this out-of-order delivery,
          * don't let the guest proceed to pushing the virtio request until the
-         * backend control plane acknowledges enabling the queue -- IOW, pass
-         * wait_for_reply=true below.
+         * backend control plane acknowledges enabling the queue.
+         *
+         * The requests for all the queues are sent before waiting, so that
+         * a device with many queues pays for a single round trip.
          */
-        ret = vhost_set_vring(dev, VHOST_USER_SET_VRING_ENABLE, &state, true);
+        if (reply_supported) {
+            msg.hdr.flags |= VHOST_USER_NEED_REPLY_MASK;
+        }
+        ret = vhost_user_write(dev, &msg, NULL, 0);
         if (ret < 0) {
             /*
              * Restoring the previous state is likely infeasible, as well as
@@ -1270,7 +1297,23 @@ static int vhost_user_set_vring_enable(struct vhost_dev *dev, int enable)
         }
     }
 
-    return 0;
+    if (!reply_supported) {
+        /* GET_FEATURES makes all backends send a reply */
+        return vhost_user_get_features(dev, &dummy);
+    }
+
+    /* Consume all the replies to keep the channel in sync */
+    msg.hdr.flags |= VHOST_USER_NEED_REPLY_MASK;
+    for (i = 0; i < dev->nvqs; ++i) {
+        ret = process_message_reply(dev, &msg);
+        if (ret == -EIO) {
+            err = err ? err : ret;
+        } else if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return err;
 }
 
 static VhostUserHostNotifier *fetch_notifier(VhostUserState *u,
@@ -2161,6 +2204,7 @@ static int vhost_user_backend_init(struct vhost_dev *dev, void *opaque,
     uint64_t features, ram_slots;
     struct vhost_user *u;
     VhostUserState *vus = (VhostUserState *) opaque;
+    bool cached;
     int err;
 
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
@@ -2170,10 +2214,22 @@ static int vhost_user_backend_init(struct vhost_dev *dev, void *opaque,
     u->dev = dev;
     dev->opaque = u;
 
-    err = vhost_user_get_features(dev, &features);
-    if (err < 0) {
-        error_setg_errno(errp, -err, "vhost_backend_init failed");
-        return err;
+    /*
+     * Every vhost_dev is cleaned up when the connection is lost, which
+     * forgets the handshake: the first one initialized on a connection,
+     * whatever its queues, asks the backend again.
+     */
+    cached = vus->handshake_done;
+
+    if (cached) {
+        features = vus->backend_features;
+    } else {
+        err = vhost_user_get_features(dev, &features);
+        if (err < 0) {
+            error_setg_errno(errp, -err, "vhost_backend_init failed");
+            return err;
+        }
+        vus->backend_features = features;
     }
 
     if (virtio_has_feature(features, VHOST_USER_F_PROTOCOL_FEATURES)) {
@@ -2183,11 +2239,16 @@ static int vhost_user_backend_init(struct vhost_dev *dev, void *opaque,
 
         dev->backend_features |= 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
 
-        err = vhost_user_get_u64(dev, VHOST_USER_GET_PROTOCOL_FEATURES,
-                                 &protocol_features);
-        if (err < 0) {
-            error_setg_errno(errp, EPROTO, "vhost_backend_init failed");
-            return -EPROTO;
+        if (cached) {
+            protocol_features = vus->protocol_features;
+        } else {
+            err = vhost_user_get_u64(dev, VHOST_USER_GET_PROTOCOL_FEATURES,
+                                     &protocol_features);
+            if (err < 0) {
+                error_setg_errno(errp, EPROTO, "vhost_backend_init failed");
+                return -EPROTO;
+            }
+            vus->protocol_features = protocol_features;
         }
 
         /*
@@ -2216,19 +2277,28 @@ static int vhost_user_backend_init(struct vhost_dev *dev, void *opaque,
 
         /* final set of protocol features */
         dev->protocol_features = protocol_features;
-        err = vhost_user_set_protocol_features(dev, dev->protocol_features);
-        if (err < 0) {
-            error_setg_errno(errp, EPROTO, "vhost_backend_init failed");
-            return -EPROTO;
+        if (!cached || vus->acked_protocol_features != protocol_features) {
+            err = vhost_user_set_protocol_features(dev,
+                                                   dev->protocol_features);
+            if (err < 0) {
+                error_setg_errno(errp, EPROTO, "vhost_backend_init failed");
+                return -EPROTO;
+            }
+            vus->acked_protocol_features = protocol_features;
         }
 
         /* query the max queues we support if backend supports Multiple Queue */
         if (dev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_MQ)) {
-            err = vhost_user_get_u64(dev, VHOST_USER_GET_QUEUE_NUM,
-                                     &dev->max_queues);
-            if (err < 0) {
-                error_setg_errno(errp, EPROTO, "vhost_backend_init failed");
-                return -EPROTO;
+            if (cached) {
+                dev->max_queues = vus->max_queues;
+            } else {
+                err = vhost_user_get_u64(dev, VHOST_USER_GET_QUEUE_NUM,
+                                         &dev->max_queues);
+                if (err < 0) {
+                    error_setg_errno(errp, EPROTO, "vhost_backend_init failed");
+                    return -EPROTO;
+                }
+                vus->max_queues = dev->max_queues;
             }
         } else {
             dev->max_queues = 1;
@@ -2254,7 +2324,7 @@ static int vhost_user_backend_init(struct vhost_dev *dev, void *opaque,
         if (!virtio_has_feature(dev->protocol_features,
                                 VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS)) {
             u->user->memory_slots = VHOST_MEMORY_BASELINE_NREGIONS;
-        } else {
+        } else if (!cached) {
             err = vhost_user_get_max_memslots(dev, &ram_slots);
             if (err < 0) {
                 error_setg_errno(errp, EPROTO, "vhost_backend_init failed");
@@ -2292,6 +2362,9 @@ static int vhost_user_backend_init(struct vhost_dev *dev, void *opaque,
     u->postcopy_notifier.notify = vhost_user_postcopy_notifier;
     postcopy_add_notifier(&u->postcopy_notifier);
 
+    vus->handshake_done = true;
+    trace_vhost_user_backend_init(dev->vq_index, cached);
+
     return 0;
 }
 
@@ -2302,6 +2375,7 @@ static int vhost_user_backend_cleanup(struct vhost_dev *dev)
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
 
     u = dev->opaque;
+    u->user->handshake_done = false;
     if (u->postcopy_notifier.notify) {
         postcopy_remove_notifier(&u->postcopy_notifier);
         u->postcopy_notifier.notify = NULL;
@@ -3027,7 +3101,7 @@ const VhostOps user_ops = {
         .vhost_set_vring_call = vhost_user_set_vring_call,
         .vhost_set_vring_err = vhost_user_set_vring_err,
         .vhost_set_features = vhost_user_set_features,
-        .vhost_get_features = vhost_user_get_features,
+        .vhost_get_features = vhost_user_get_backend_features,
         .vhost_set_owner = vhost_user_set_owner,
         .vhost_reset_device = vhost_user_reset_device,
         .vhost_get_vq_index = vhost_user_get_vq_index,
@@ -388,7 +388,9 @@ static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
                 continue;
             }
 
-            ram_block_discard_range(rb, ram_offset, size);
+            if (!ram_block_discard_range(rb, ram_offset, size)) {
+                qemu_guest_free_page_report(addr, size);
+            }
         }
 
 skip_element:
@@ -563,6 +563,21 @@ static void virtio_mem_deactivate_unplugged_memslots(VirtIOMEM *vmem,
     memory_region_transaction_commit();
 }
 
+/*
+ * Preallocate using the threads configured for the memory backend, a
+ * single thread takes a while to populate hundreds of GiB.
+ */
+static bool virtio_mem_prealloc(VirtIOMEM *vmem, uint64_t offset,
+                                uint64_t size, Error **errp)
+{
+    HostMemoryBackend *backend = vmem->memdev;
+    void *area = memory_region_get_ram_ptr(&backend->mr) + offset;
+    int fd = memory_region_get_fd(&backend->mr);
+
+    return qemu_prealloc_mem(fd, area, size, backend->prealloc_threads,
+                             backend->prealloc_context, false, errp);
+}
+
 static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
                                       uint64_t size, bool plug)
 {
@@ -588,11 +603,9 @@ static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
     }
 
     if (vmem->prealloc) {
-        void *area = memory_region_get_ram_ptr(&vmem->memdev->mr) + offset;
-        int fd = memory_region_get_fd(&vmem->memdev->mr);
         Error *local_err = NULL;
 
-        if (!qemu_prealloc_mem(fd, area, size, 1, NULL, false, &local_err)) {
+        if (!virtio_mem_prealloc(vmem, offset, size, &local_err)) {
             static bool warned;
 
             /*
@@ -638,9 +651,8 @@ static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
 }
 
 static int virtio_mem_state_change_request(VirtIOMEM *vmem, uint64_t gpa,
-                                           uint16_t nb_blocks, bool plug)
+                                           uint64_t size, bool plug)
 {
-    const uint64_t size = nb_blocks * vmem->block_size;
     int ret;
 
     if (!virtio_mem_valid_range(vmem, gpa, size)) {
@@ -670,28 +682,109 @@ static int virtio_mem_state_change_request(VirtIOMEM *vmem, uint64_t gpa,
     return VIRTIO_MEM_RESP_ACK;
 }
 
-static void virtio_mem_plug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
-                                    struct virtio_mem_req *req)
+/*
+ * Plug or unplug requests for consecutive ranges that are queued together
+ * are handled as a single range: the memory is discarded or preallocated,
+ * and the listeners (e.g. VFIO) are notified, once for the whole range.
+ */
+#define VIRTIO_MEM_MAX_BATCH 64
+
+typedef struct VirtIOMEMBatch {
+    bool plug;
+    uint64_t gpa;
+    uint64_t size;
+    unsigned int nr;
+    VirtQueueElement *elems[VIRTIO_MEM_MAX_BATCH];
+    uint16_t nb_blocks[VIRTIO_MEM_MAX_BATCH];
+} VirtIOMEMBatch;
+
+static bool virtio_mem_batch_add(VirtIOMEM *vmem, VirtIOMEMBatch *batch,
+                                 VirtQueueElement *elem, uint64_t gpa,
+                                 uint16_t nb_blocks, bool plug)
+{
+    if (!batch->nr) {
+        batch->plug = plug;
+        batch->gpa = gpa;
+        batch->size = 0;
+    } else if (batch->nr == VIRTIO_MEM_MAX_BATCH || batch->plug != plug ||
+               gpa != batch->gpa + batch->size) {
+        return false;
+    }
+
+    batch->elems[batch->nr] = elem;
+    batch->nb_blocks[batch->nr] = nb_blocks;
+    batch->nr++;
+    batch->size += nb_blocks * vmem->block_size;
+    return true;
+}
+
+static void virtio_mem_batch_flush(VirtIOMEM *vmem, VirtIOMEMBatch *batch)
 {
-    const uint64_t gpa = le64_to_cpu(req->u.plug.addr);
-    const uint16_t nb_blocks = le16_to_cpu(req->u.plug.nb_blocks);
+    uint64_t gpa = batch->gpa;
+    unsigned int i;
     uint16_t type;
 
-    trace_virtio_mem_plug_request(gpa, nb_blocks);
-    type = virtio_mem_state_change_request(vmem, gpa, nb_blocks, true);
-    virtio_mem_send_response_simple(vmem, elem, type);
+    if (!batch->nr) {
+        return;
+    }
+
+    if (batch->nr > 1) {
+        trace_virtio_mem_batch(batch->gpa, batch->size, batch->nr, batch->plug);
+        type = virtio_mem_state_change_request(vmem, batch->gpa, batch->size,
+                                               batch->plug);
+        if (type == VIRTIO_MEM_RESP_ACK) {
+            struct virtio_mem_resp resp = {
+                .type = cpu_to_le16(VIRTIO_MEM_RESP_ACK),
+            };
+
+            for (i = 0; i < batch->nr; i++) {
+                trace_virtio_mem_send_response(VIRTIO_MEM_RESP_ACK);
+                iov_from_buf(batch->elems[i]->in_sg, batch->elems[i]->in_num,
+                             0, &resp, sizeof(resp));
+                virtqueue_push(vmem->vq, batch->elems[i], sizeof(resp));
+                g_free(batch->elems[i]);
+            }
+            virtio_notify(VIRTIO_DEVICE(vmem), vmem->vq);
+            batch->nr = 0;
+            return;
+        }
+    }
+
+    /* Otherwise, each request succeeds or fails on its own. */
+    for (i = 0; i < batch->nr; i++) {
+        const uint64_t size = batch->nb_blocks[i] * vmem->block_size;
+
+        type = virtio_mem_state_change_request(vmem, gpa, size, batch->plug);
+        virtio_mem_send_response_simple(vmem, batch->elems[i], type);
+        g_free(batch->elems[i]);
+        gpa += size;
+    }
+    batch->nr = 0;
 }
 
-static void virtio_mem_unplug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
-                                      struct virtio_mem_req *req)
+static void virtio_mem_plug_unplug_request(VirtIOMEM *vmem,
+                                           VirtIOMEMBatch *batch,
+                                           VirtQueueElement *elem,
+                                           struct virtio_mem_req *req,
+                                           bool plug)
 {
-    const uint64_t gpa = le64_to_cpu(req->u.unplug.addr);
-    const uint16_t nb_blocks = le16_to_cpu(req->u.unplug.nb_blocks);
-    uint16_t type;
+    uint64_t gpa;
+    uint16_t nb_blocks;
 
-    trace_virtio_mem_unplug_request(gpa, nb_blocks);
-    type = virtio_mem_state_change_request(vmem, gpa, nb_blocks, false);
-    virtio_mem_send_response_simple(vmem, elem, type);
+    if (plug) {
+        gpa = le64_to_cpu(req->u.plug.addr);
+        nb_blocks = le16_to_cpu(req->u.plug.nb_blocks);
+        trace_virtio_mem_plug_request(gpa, nb_blocks);
+    } else {
+        gpa = le64_to_cpu(req->u.unplug.addr);
+        nb_blocks = le16_to_cpu(req->u.unplug.nb_blocks);
+        trace_virtio_mem_unplug_request(gpa, nb_blocks);
+    }
+
+    if (!virtio_mem_batch_add(vmem, batch, elem, gpa, nb_blocks, plug)) {
+        virtio_mem_batch_flush(vmem, batch);
+        virtio_mem_batch_add(vmem, batch, elem, gpa, nb_blocks, plug);
+    }
 }
 
 static void virtio_mem_resize_usable_region(VirtIOMEM *vmem,
@@ -787,6 +880,7 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
 {
     const int len = sizeof(struct virtio_mem_req);
     VirtIOMEM *vmem = VIRTIO_MEM(vdev);
+    VirtIOMEMBatch batch = {};
     VirtQueueElement *elem;
     struct virtio_mem_req req;
     uint16_t type;
@@ -794,7 +888,7 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
     while (true) {
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
-            return;
+            break;
         }
 
         if (iov_to_buf(elem->out_sg, elem->out_num, 0, &req, len) < len) {
@@ -802,7 +896,7 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
                          " size: %d", len);
             virtqueue_detach_element(vq, elem, 0);
             g_free(elem);
-            return;
+            break;
         }
 
         if (iov_size(elem->in_sg, elem->in_num) <
@@ -812,17 +906,21 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
                          iov_size(elem->in_sg, elem->in_num));
             virtqueue_detach_element(vq, elem, 0);
             g_free(elem);
-            return;
+            break;
         }
 
         type = le16_to_cpu(req.type);
+        if (type == VIRTIO_MEM_REQ_PLUG || type == VIRTIO_MEM_REQ_UNPLUG) {
+            /* The batch now owns elem */
+            virtio_mem_plug_unplug_request(vmem, &batch, elem, &req,
+                                           type == VIRTIO_MEM_REQ_PLUG);
+            continue;
+        }
+
+        /* Requests are handled in order */
+        virtio_mem_batch_flush(vmem, &batch);
+
         switch (type) {
-        case VIRTIO_MEM_REQ_PLUG:
-            virtio_mem_plug_request(vmem, elem, &req);
-            break;
-        case VIRTIO_MEM_REQ_UNPLUG:
-            virtio_mem_unplug_request(vmem, elem, &req);
-            break;
         case VIRTIO_MEM_REQ_UNPLUG_ALL:
             virtio_mem_unplug_all_request(vmem, elem);
             break;
@@ -839,6 +937,8 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
 
         g_free(elem);
     }
+
+    virtio_mem_batch_flush(vmem, &batch);
 }
 
 static void virtio_mem_get_config(VirtIODevice *vdev, uint8_t *config_data)
@@ -1249,11 +1349,9 @@ static int virtio_mem_post_load(void *opaque, int version_id)
 static int virtio_mem_prealloc_range_cb(VirtIOMEM *vmem, void *arg,
                                         uint64_t offset, uint64_t size)
 {
-    void *area = memory_region_get_ram_ptr(&vmem->memdev->mr) + offset;
-    int fd = memory_region_get_fd(&vmem->memdev->mr);
     Error *local_err = NULL;
 
-    if (!qemu_prealloc_mem(fd, area, size, 1, NULL, false, &local_err)) {
+    if (!virtio_mem_prealloc(vmem, offset, size, &local_err)) {
         error_report_err(local_err);
         return -ENOMEM;
     }
@@ -21,6 +21,7 @@
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "qemu/target-info.h"
+#include "qemu/thread.h"
 #include "qom/object_interfaces.h"
 #include "hw/core/cpu.h"
 #include "hw/virtio/virtio.h"
@@ -59,6 +60,14 @@
  */
 #define VIRTIO_PCI_VRING_ALIGN         4096
 
+/*
+ * Number of freed elements kept per virtqueue, and the largest element
+ * worth keeping.  Bigger elements come from long descriptor chains which
+ * are rare enough to go through malloc.
+ */
+#define VIRTQUEUE_ELEM_POOL_SIZE       64
+#define VIRTQUEUE_ELEM_POOL_MAX_ALLOC  4096
+
 typedef struct VRingDesc
 {
     uint64_t addr;
@@ -153,6 +162,15 @@ struct VirtQueue
     EventNotifier host_notifier;
     bool host_notifier_enabled;
     QLIST_ENTRY(VirtQueue) node;
+
+    /*
+     * Recently freed elements, reused by virtqueue_pop() to avoid a
+     * malloc/free pair per request.  Elements may be freed from another
+     * thread than the one popping them.
+     */
+    QemuSpin elem_pool_lock;
+    unsigned int elem_pool_num;
+    VirtQueueElement **elem_pool;
 };
 
 const char *virtio_device_names[] = {
@@ -876,7 +894,7 @@ void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
 {
 
     if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
-        virtqueue_packed_rewind(vq, 1);
+        virtqueue_packed_rewind(vq, elem->ndescs);
     } else {
         virtqueue_split_rewind(vq, 1);
     }
@@ -1667,9 +1685,70 @@ void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem)
                                                                         false);
 }
 
-static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+static VirtQueueElement *virtqueue_elem_pool_get(VirtQueue *vq, size_t size)
 {
-    VirtQueueElement *elem;
+    VirtQueueElement *elem = NULL;
+
+    if (size > VIRTQUEUE_ELEM_POOL_MAX_ALLOC) {
+        return NULL;
+    }
+
+    qemu_spin_lock(&vq->elem_pool_lock);
+    if (vq->elem_pool_num) {
+        elem = vq->elem_pool[--vq->elem_pool_num];
+    }
+    qemu_spin_unlock(&vq->elem_pool_lock);
+
+    if (elem && elem->alloc_size < size) {
+        g_free(elem);
+        elem = NULL;
+    }
+    return elem;
+}
+
+/* virtqueue_element_free:
+ * @vq: The #VirtQueue the element was popped from
+ * @opaque: The element, or the device request structure embedding it
+ *
+ * Free an element returned by virtqueue_pop().  The memory is kept for
+ * reuse by a later virtqueue_pop() on @vq.  Calling g_free() on the element
+ * instead is still valid.
+ */
+void virtqueue_element_free(VirtQueue *vq, void *opaque)
+{
+    VirtQueueElement *elem = opaque;
+
+    if (!elem) {
+        return;
+    }
+
+    if (elem->alloc_size <= VIRTQUEUE_ELEM_POOL_MAX_ALLOC) {
+        qemu_spin_lock(&vq->elem_pool_lock);
+        if (vq->elem_pool && vq->elem_pool_num < VIRTQUEUE_ELEM_POOL_SIZE) {
+            vq->elem_pool[vq->elem_pool_num++] = elem;
+            elem = NULL;
+        }
+        qemu_spin_unlock(&vq->elem_pool_lock);
+    }
+
+    g_free(elem);
+}
+
+static void virtqueue_elem_pool_destroy(VirtQueue *vq)
+{
+    qemu_spin_lock(&vq->elem_pool_lock);
+    while (vq->elem_pool_num) {
+        g_free(vq->elem_pool[--vq->elem_pool_num]);
+    }
+    g_clear_pointer(&vq->elem_pool, g_free);
+    qemu_spin_unlock(&vq->elem_pool_lock);
+}
+
+/* @vq may be NULL for elements that don't come from a virtqueue pop */
+static void *virtqueue_alloc_element(VirtQueue *vq, size_t sz,
+                                     unsigned out_num, unsigned in_num)
+{
+    VirtQueueElement *elem = NULL;
     size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
     size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
     size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
@@ -1678,7 +1757,16 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
 
     assert(sz >= sizeof(VirtQueueElement));
-    elem = g_malloc(out_sg_end);
+    if (vq) {
+        elem = virtqueue_elem_pool_get(vq, out_sg_end);
+    }
+    if (!elem) {
+        /* Round up so that the element can be reused for similar requests */
+        size_t alloc_size = pow2ceil(out_sg_end);
+
+        elem = g_malloc(alloc_size);
+        elem->alloc_size = alloc_size;
+    }
     trace_virtqueue_alloc_element(elem, sz, in_num, out_num);
     elem->out_num = out_num;
     elem->in_num = in_num;
@@ -1689,10 +1777,33 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     return elem;
 }
 
-static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+/* Called within rcu_read_lock().  */
+static VRingMemoryRegionCaches *virtqueue_pop_caches(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+
+    if (!caches) {
+        virtio_error(vq->vdev, "Region caches not initialized");
+        return NULL;
+    }
+
+    if (caches->desc.len < vq->vring.num * sizeof(VRingDesc)) {
+        virtio_error(vq->vdev, "Cannot map descriptor ring");
+        return NULL;
+    }
+
+    return caches;
+}
+
+/*
+ * Called within rcu_read_lock(), once the caller knows that a head is
+ * available at vq->last_avail_idx.  The avail event is left to the caller.
+ */
+static VirtQueueElement *
+virtqueue_split_pop_one(VirtQueue *vq, VRingMemoryRegionCaches *caches,
+                        size_t sz)
 {
     unsigned int i, head, max, idx;
-    VRingMemoryRegionCaches *caches;
     MemoryRegionCache indirect_desc_cache;
     MemoryRegionCache *desc_cache;
     int64_t len;
@@ -1706,14 +1817,6 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
 
     address_space_cache_init_empty(&indirect_desc_cache);
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_empty_rcu(vq)) {
-        goto done;
-    }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1728,23 +1831,8 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         goto done;
     }
 
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
     i = head;
 
-    caches = vring_get_region_caches(vq);
-    if (!caches) {
-        virtio_error(vdev, "Region caches not initialized");
-        goto done;
-    }
-
-    if (caches->desc.len < max * sizeof(VRingDesc)) {
-        virtio_error(vdev, "Cannot map descriptor ring");
-        goto done;
-    }
-
     desc_cache = &caches->desc;
     vring_split_desc_read(vdev, &desc, desc_cache, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
@@ -1804,7 +1892,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
     }
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element(vq, sz, out_num, in_num);
     elem->index = head;
     elem->ndescs = 1;
     for (i = 0; i < out_num; i++) {
@@ -1836,10 +1924,81 @@ err_undo_map:
     goto done;
 }
 
-static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+static unsigned int virtqueue_split_pop_batch(VirtQueue *vq, size_t sz,
+                                              void **elems, unsigned int max)
 {
-    unsigned int i, max;
     VRingMemoryRegionCaches *caches;
+    unsigned int n = 0;
+    int num_heads;
+
+    RCU_READ_LOCK_GUARD();
+    if (unlikely(!vq->vring.avail)) {
+        return 0;
+    }
+
+    /* Reads the avail index at most once, and orders the descriptor reads */
+    num_heads = virtqueue_num_heads(vq, vq->last_avail_idx);
+    if (num_heads <= 0) {
+        return 0;
+    }
+
+    caches = virtqueue_pop_caches(vq);
+    if (!caches) {
+        return 0;
+    }
+
+    max = MIN(max, num_heads);
+    while (n < max) {
+        elems[n] = virtqueue_split_pop_one(vq, caches, sz);
+        if (!elems[n]) {
+            break;
+        }
+        n++;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    return n;
+}
+
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+{
+    VRingMemoryRegionCaches *caches;
+    VirtQueueElement *elem;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_empty_rcu(vq)) {
+        return NULL;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    caches = virtqueue_pop_caches(vq);
+    if (!caches) {
+        return NULL;
+    }
+
+    elem = virtqueue_split_pop_one(vq, caches, sz);
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    return elem;
+}
+
+/*
+ * Called within rcu_read_lock(), once the caller knows that a descriptor
+ * is available at vq->last_avail_idx.
+ */
+static VirtQueueElement *
+virtqueue_packed_pop_one(VirtQueue *vq, VRingMemoryRegionCaches *caches,
+                         size_t sz)
+{
+    unsigned int i, max;
     MemoryRegionCache indirect_desc_cache;
     MemoryRegionCache *desc_cache;
     int64_t len;
@@ -1854,11 +2013,6 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 
     address_space_cache_init_empty(&indirect_desc_cache);
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_packed_empty_rcu(vq)) {
-        goto done;
-    }
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1871,17 +2025,6 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 
     i = vq->last_avail_idx;
 
-    caches = vring_get_region_caches(vq);
-    if (!caches) {
-        virtio_error(vdev, "Region caches not initialized");
-        goto done;
-    }
-
-    if (caches->desc.len < max * sizeof(VRingDesc)) {
-        virtio_error(vdev, "Cannot map descriptor ring");
-        goto done;
-    }
-
     desc_cache = &caches->desc;
     vring_packed_desc_read(vdev, &desc, desc_cache, i, true);
     id = desc.id;
@@ -1945,7 +2088,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
     }
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element(vq, sz, out_num, in_num);
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
         elem->out_sg[i] = iov[i];
@@ -1986,6 +2129,59 @@ err_undo_map:
     goto done;
 }
 
+static unsigned int virtqueue_packed_pop_batch(VirtQueue *vq, size_t sz,
+                                               void **elems, unsigned int max)
+{
+    VRingMemoryRegionCaches *caches;
+    unsigned int n = 0;
+    uint16_t flags;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_packed_empty_rcu(vq)) {
+        return 0;
+    }
+
+    caches = virtqueue_pop_caches(vq);
+    if (!caches) {
+        return 0;
+    }
+
+    /*
+     * There is no avail index in a packed ring, the flags of the next
+     * descriptor tell whether more buffers are available.
+     */
+    do {
+        elems[n] = virtqueue_packed_pop_one(vq, caches, sz);
+        if (!elems[n]) {
+            break;
+        }
+        if (++n == max) {
+            break;
+        }
+        vring_packed_desc_read_flags(vq->vdev, &flags, &caches->desc,
+                                     vq->last_avail_idx);
+    } while (is_desc_avail(flags, vq->last_avail_wrap_counter));
+
+    return n;
+}
+
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+{
+    VRingMemoryRegionCaches *caches;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_packed_empty_rcu(vq)) {
+        return NULL;
+    }
+
+    caches = virtqueue_pop_caches(vq);
+    if (!caches) {
+        return NULL;
+    }
+
+    return virtqueue_packed_pop_one(vq, caches, sz);
+}
+
 void *virtqueue_pop(VirtQueue *vq, size_t sz)
 {
     if (virtio_device_disabled(vq->vdev)) {
@@ -1999,6 +2195,25 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     }
 }
 
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    unsigned int n;
+
+    if (virtio_device_disabled(vq->vdev) || !max) {
+        return 0;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        n = virtqueue_packed_pop_batch(vq, sz, elems, max);
+    } else {
+        n = virtqueue_split_pop_batch(vq, sz, elems, max);
+    }
+
+    trace_virtqueue_pop_batch(vq, max, n);
+    return n;
+}
+
 static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
 {
     VRingMemoryRegionCaches *caches;
@@ -2134,7 +2349,7 @@ void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
     assert(ARRAY_SIZE(data.in_addr) >= data.in_num);
     assert(ARRAY_SIZE(data.out_addr) >= data.out_num);
 
-    elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
+    elem = virtqueue_alloc_element(NULL, sz, data.out_num, data.in_num);
     elem->index = data.index;
 
     for (i = 0; i < elem->in_num; i++) {
@@ -2532,6 +2747,9 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
     vdev->vq[i].used_elems = g_new0(VirtQueueElement, queue_size);
+    qemu_spin_init(&vdev->vq[i].elem_pool_lock);
+    vdev->vq[i].elem_pool = g_new(VirtQueueElement *,
+                                  VIRTQUEUE_ELEM_POOL_SIZE);
 
     return &vdev->vq[i];
 }
@@ -2543,6 +2761,7 @@ void virtio_delete_queue(VirtQueue *vq)
     vq->handle_output = NULL;
     g_free(vq->used_elems);
     vq->used_elems = NULL;
+    virtqueue_elem_pool_destroy(vq);
     virtio_virtqueue_reset_region_cache(vq);
 }
 
@@ -4024,6 +4243,7 @@ static void virtio_device_free_virtqueues(VirtIODevice *vdev)
         if (vdev->vq[i].vring.num == 0) {
             break;
         }
+        virtqueue_elem_pool_destroy(&vdev->vq[i]);
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
     }
     g_free(vdev->vq);
@@ -4047,7 +4267,7 @@ static const Property virtio_properties[] = {
                      disable_legacy_check, false),
 };
 
-static int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
+int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int i, n, r, err;
@@ -4117,7 +4337,7 @@ int virtio_device_start_ioeventfd(VirtIODevice *vdev)
     return virtio_bus_start_ioeventfd(vbus);
 }
 
-static void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
+void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int n, r;
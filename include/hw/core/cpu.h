@@ -454,6 +454,10 @@ struct qemu_work_item;
  *    ring is enabled.
  * @kvm_fetch_index: Keeps the index that we last fetched from the per-vCPU
  *    dirty ring structure.
+ * @dirty_ring_full_exits: Number of exits because the KVM dirty ring of
+ *    this CPU was full.
+ * @kvm_mmio_cache: Remembers where the recent MMIO and PIO exits of this
+ *    CPU went to.
  *
  * @neg_align: The CPUState is the common part of a concrete ArchCPU
  * which is allocated when an individual CPU instance is created. As
@@ -538,6 +542,8 @@ struct CPUState {
     struct kvm_dirty_gfn *kvm_dirty_gfns;
     uint32_t kvm_fetch_index;
     uint64_t dirty_pages;
+    uint64_t dirty_ring_full_exits;
+    struct MMIOCache *kvm_mmio_cache;
     int kvm_vcpu_stats_fd;
 
     /* Use by accel-block: CPU is executing an ioctl() */
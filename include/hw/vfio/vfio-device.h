@@ -147,6 +147,7 @@ bool vfio_device_irq_set_signaling(VFIODevice *vbasedev, int index, int subindex
                                    int action, int fd, Error **errp);
 
 void vfio_device_reset_handler(void *opaque);
+extern Notifier vfio_device_exit_notifier;
 bool vfio_device_is_mdev(VFIODevice *vbasedev);
 bool vfio_device_hiod_create_and_realize(VFIODevice *vbasedev,
                                          const char *typename, Error **errp);
@@ -62,12 +62,28 @@ typedef struct VhostUserHostNotifier {
  * @chr: the character backend for the socket
  * @notifiers: GPtrArray of @VhostUserHostnotifier
  * @memory_slots:
+ * @handshake_done: the fields below hold the backend replies to the
+ *     handshake of the current connection, cleared when a vhost_dev is
+ *     cleaned up
+ * @backend_features: reply to VHOST_USER_GET_FEATURES
+ * @protocol_features: reply to VHOST_USER_GET_PROTOCOL_FEATURES
+ * @acked_protocol_features: last VHOST_USER_SET_PROTOCOL_FEATURES sent
+ * @max_queues: reply to VHOST_USER_GET_QUEUE_NUM
+ *
+ * The vhost_devs of a multiqueue device all talk to the same backend,
+ * so only the first one initialized goes through the handshake, the
+ * others reuse its results.
  */
 typedef struct VhostUserState {
     CharBackend *chr;
     GPtrArray *notifiers;
     int memory_slots;
     bool supports_config;
+    bool handshake_done;
+    uint64_t backend_features;
+    uint64_t protocol_features;
+    uint64_t acked_protocol_features;
+    uint64_t max_queues;
 } VhostUserState;
 
 /**
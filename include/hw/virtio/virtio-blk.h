@@ -110,5 +110,6 @@ typedef struct VirtIOBlkClass {
 
 void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq);
 void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status);
+void virtio_blk_free_request(VirtIOBlockReq *req);
 
 #endif
@@ -18,6 +18,7 @@
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
 #include "net/announce.h"
+#include "qapi/qapi-types-virtio.h"
 #include "qemu/option_int.h"
 #include "qom/object.h"
 
@@ -56,6 +57,7 @@ typedef struct virtio_net_conf
     char *duplex_str;
     uint8_t duplex;
     char *primary_id_str;
+    IOThreadVirtQueueMappingList *iothread_vq_mapping_list;
 } virtio_net_conf;
 
 /* Coalesced packets type & status */
@@ -96,6 +98,8 @@ typedef struct VirtioNetRscStat {
     uint32_t purge_failed;
     uint32_t drain_failed;
     uint32_t final_failed;
+    uint32_t csum_failed;
+    uint32_t flow_evicted;
     int64_t  timer;
 } VirtioNetRscStat;
 
@@ -111,16 +115,24 @@ typedef struct VirtioNetRscUnit {
 /* Coalesced segment */
 typedef struct VirtioNetRscSeg {
     QTAILQ_ENTRY(VirtioNetRscSeg) next;
+    QLIST_ENTRY(VirtioNetRscSeg) flow_next;
+    uint32_t flow_hash;
     void *buf;
     size_t size;
     uint16_t packets;
     uint16_t dup_ack;
+    uint16_t mss;           /* payload of the first data packet */
     bool is_coalesced;      /* need recall ipv4 header checksum, mark here */
     VirtioNetRscUnit unit;
     NetClientState *nc;
 } VirtioNetRscSeg;
 
 
+/* Hash buckets of the flow table of a chain, must be a power of 2 */
+#define VIRTIO_NET_RSC_FLOW_BUCKETS 64
+/* Flows cached at once by a chain, the oldest one is drained beyond this */
+#define VIRTIO_NET_RSC_MAX_FLOWS    32
+
 /* Chain is divided by protocol(ipv4/v6) and NetClientInfo */
 typedef struct VirtioNetRscChain {
     QTAILQ_ENTRY(VirtioNetRscChain) next;
@@ -129,7 +141,11 @@ typedef struct VirtioNetRscChain {
     uint8_t  gso_type;
     uint16_t max_payload;
     QEMUTimer *drain_timer;
+    /* cached segments, oldest first */
     QTAILQ_HEAD(, VirtioNetRscSeg) buffers;
+    uint32_t nr_flows;
+    /* cached segments indexed by the hash of their addresses and ports */
+    QLIST_HEAD(, VirtioNetRscSeg) flows[VIRTIO_NET_RSC_FLOW_BUCKETS];
     VirtioNetRscStat stat;
 } VirtioNetRscChain;
 
@@ -155,6 +171,8 @@ typedef struct VirtioNetRssData {
     uint16_t default_queue;
 } VirtioNetRssData;
 
+typedef struct VirtIONetRssPacket VirtIONetRssPacket;
+
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
@@ -164,6 +182,31 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    /* used by software RSS to parse received packets */
+    struct NetRxPkt *rx_pkt;
+    /*
+     * While a batch of packets is received, used rx buffers are only
+     * flushed to the guest at the end of the batch.
+     */
+    bool rx_batching;
+    unsigned int rx_batch_used;
+    /*
+     * NET_BUFSIZE bytes to linearize batched packets that come in several
+     * pieces, allocated on first use.
+     */
+    uint8_t *rx_batch_buf;
+    /*
+     * Packets steered to this queue pair by software RSS from another
+     * thread.  rss_bh receives them in the AioContext of the queue pair,
+     * it is only scheduled while the queue pair is attached to it.
+     */
+    QemuMutex rss_lock;
+    QSIMPLEQ_HEAD(, VirtIONetRssPacket) rss_packets;
+    unsigned int rss_pending;
+    bool rss_attached;
+    QEMUBH *rss_bh;
+    /* reset by the guest, the queue pair stays detached until enabled */
+    bool reset;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -186,6 +229,8 @@ struct VirtIONet {
     uint32_t rsc_timeout;
     uint8_t rsc4_enabled;
     uint8_t rsc6_enabled;
+    /* coalesce TCP segments in QEMU for peers without vnet header */
+    bool guest_gro;
     uint8_t has_ufo;
     uint32_t mergeable_rx_bufs;
     uint8_t promisc;
@@ -227,10 +272,14 @@ struct VirtIONet {
     bool primary_opts_from_json;
     NotifierWithReturn migration_state;
     VirtioNetRssData rss_data;
-    struct NetRxPkt *rx_pkt;
     struct EBPFRSSContext ebpf_rss;
     uint32_t nr_ebpf_rss_fds;
     char **ebpf_rss_fds;
+    /* AioContext of each queue pair, NULL without iothread-vq-mapping */
+    AioContext **vq_aio_context;
+    bool ioeventfd_started;
+    /* the queue pairs are detached by virtio_net_datapath_pause() */
+    bool datapath_paused;
 };
 
 size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
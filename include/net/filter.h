@@ -43,7 +43,13 @@ struct NetFilterClass {
     FilterCleanup *cleanup;
     FilterStatusChanged *status_changed;
     FilterHandleEvent *handle_event;
-    /* mandatory */
+    /*
+     * The filter is implemented by the network backend, e.g. as an eBPF
+     * program attached to a tap device.  Packets never go through
+     * receive_iov, so vhost and multiqueue backends are supported.
+     */
+    bool offloaded;
+    /* mandatory, unless offloaded */
     FilterReceiveIOV *receive_iov;
 };
 
@@ -44,7 +44,28 @@ typedef ssize_t (NetQueueDeliverFunc)(NetClientState *sender,
                                       int iovcnt,
                                       void *opaque);
 
+/* A packet of a batch */
+typedef struct NetPacketIOV {
+    const struct iovec *iov;
+    int iovcnt;
+} NetPacketIOV;
+
+/* Returns the number of packets consumed from the start of the batch,
+ * either delivered or discarded, and stores what a NetQueueDeliverFunc
+ * would have returned for each of them in @rets.  If less than @count,
+ * the next packet must be queued for future redelivery, as for a zero
+ * return from a NetQueueDeliverFunc.
+ */
+typedef int (NetQueueDeliverBatchFunc)(NetClientState *sender,
+                                       unsigned flags,
+                                       const NetPacketIOV *pkts,
+                                       int count,
+                                       ssize_t *rets,
+                                       void *opaque);
+
 NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque);
+void qemu_net_queue_set_deliver_batch(NetQueue *queue,
+                                      NetQueueDeliverBatchFunc *deliver_batch);
 
 void qemu_net_queue_append_iov(NetQueue *queue,
                                NetClientState *sender,
@@ -73,6 +94,13 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+int qemu_net_queue_send_iov_batch(NetQueue *queue,
+                                  NetClientState *sender,
+                                  unsigned flags,
+                                  const NetPacketIOV *pkts,
+                                  int count,
+                                  NetPacketSent *sent_cb);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
@@ -15,6 +15,13 @@
 
 #ifdef CONFIG_LINUX
 void init_async_teardown(void);
+
+/*
+ * Hand @fd over to the teardown process when qemu exits, so that the
+ * resources it holds are released after qemu is gone.  Does nothing if
+ * asynchronous teardown isn't enabled.
+ */
+void async_teardown_add_fd(int fd);
 #endif
 
 #endif
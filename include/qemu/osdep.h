@@ -725,6 +725,40 @@ typedef struct ThreadContext ThreadContext;
 bool qemu_prealloc_mem(int fd, char *area, size_t sz, int max_threads,
                        ThreadContext *tc, bool async, Error **errp);
 
+/**
+ * PreallocArea:
+ * @area: start address of the area to preallocate
+ * @size: the size of the area to preallocate
+ * @tc: context of the threads preallocating the area, NULL if not in use
+ */
+typedef struct PreallocArea {
+    char *area;
+    size_t size;
+    ThreadContext *tc;
+} PreallocArea;
+
+/**
+ * qemu_prealloc_mem_areas:
+ * @fd: the fd mapped into the areas, -1 for anonymous memory
+ * @areas: the areas to preallocate
+ * @nr_areas: the number of areas
+ * @max_threads: maximum number of threads to use for all the areas
+ * @async: request asynchronous preallocation, requires a context for
+ *         each area
+ * @errp: returns an error if this function fails
+ *
+ * Like qemu_prealloc_mem(), for several areas of the same mapping that
+ * are preallocated at once, each by threads created in its own context.
+ * This lets each part of a memory backend bound to several host NUMA
+ * nodes be touched from the CPUs of one of these nodes.  No more than
+ * @max_threads threads are used in total: with fewer threads than areas,
+ * a thread preallocates several areas one after the other.
+ *
+ * Return: true on success, else false setting @errp with error.
+ */
+bool qemu_prealloc_mem_areas(int fd, const PreallocArea *areas, int nr_areas,
+                             int max_threads, bool async, Error **errp);
+
 /**
  * qemu_finish_async_prealloc_mem:
  * @errp: returns an error if this function fails
@@ -735,6 +769,46 @@ bool qemu_prealloc_mem(int fd, char *area, size_t sz, int max_threads,
  */
 bool qemu_finish_async_prealloc_mem(Error **errp);
 
+typedef struct BackgroundPrealloc BackgroundPrealloc;
+
+/**
+ * qemu_prealloc_mem_background:
+ * @fd: the fd mapped into the areas, -1 for anonymous memory
+ * @areas: the areas to preallocate
+ * @nr_areas: the number of areas
+ * @max_threads: maximum number of threads to use for all the areas
+ *
+ * Start preallocating memory like qemu_prealloc_mem_areas(), in threads
+ * that keep running after this function returns and that only use idle
+ * CPU time.  The memory can be used meanwhile, pages that are not
+ * populated yet are faulted in on first access as usual.  The thread
+ * contexts of @areas are only needed until this function returns.
+ *
+ * Return: the background preallocation, to be stopped with
+ * qemu_prealloc_mem_background_stop() before unmapping @areas.  NULL if
+ * this can't be done for the areas, the caller should preallocate them
+ * with qemu_prealloc_mem_areas() instead.
+ */
+BackgroundPrealloc *qemu_prealloc_mem_background(int fd,
+                                                const PreallocArea *areas,
+                                                int nr_areas, int max_threads);
+
+/**
+ * qemu_prealloc_mem_background_progress:
+ * @bp: a background preallocation
+ *
+ * Return: the number of bytes the background preallocation went through.
+ */
+size_t qemu_prealloc_mem_background_progress(BackgroundPrealloc *bp);
+
+/**
+ * qemu_prealloc_mem_background_stop:
+ * @bp: a background preallocation
+ *
+ * Stop the background preallocation if it is not done yet, and free it.
+ */
+void qemu_prealloc_mem_background_stop(BackgroundPrealloc *bp);
+
 /**
  * qemu_get_pid_name:
  * @pid: pid of a process
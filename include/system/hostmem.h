@@ -79,6 +79,9 @@ struct HostMemoryBackend {
     bool guest_memfd, aligned;
     uint32_t prealloc_threads;
     ThreadContext *prealloc_context;
+    bool prealloc_background;
+    BackgroundPrealloc *prealloc_bg;
+    VMChangeStateEntry *prealloc_vmstate;
     DECLARE_BITMAP(host_nodes, MAX_NODES + 1);
     HostMemPolicy policy;
 
@@ -12,6 +12,7 @@
 #include "system/memory.h"
 #include "qapi/qapi-types-common.h"
 #include "qemu/accel.h"
+#include "qemu/interval-tree.h"
 #include "qemu/queue.h"
 #include "system/kvm.h"
 #include "accel/accel-ops.h"
@@ -36,6 +37,9 @@ typedef struct KVMSlot
     ram_addr_t ram_start_offset;
     int guest_memfd;
     hwaddr guest_memfd_offset;
+    /* Nodes in the slot trees of the KVMMemoryListener, while used */
+    IntervalTreeNode gpa_node;
+    IntervalTreeNode hva_node;
 } KVMSlot;
 
 typedef struct KVMMemoryUpdate {
@@ -48,6 +52,11 @@ typedef struct KVMMemoryListener {
     KVMSlot *slots;
     unsigned int nr_slots_used;
     unsigned int nr_slots_allocated;
+    /* Used slots, by guest physical address and by host virtual address */
+    IntervalTreeRoot slots_by_gpa;
+    IntervalTreeRoot slots_by_hva;
+    /* Bitmap of the used entries of slots[] */
+    unsigned long *slots_used;
     int as_id;
     QSIMPLEQ_HEAD(, KVMMemoryUpdate) transaction_add;
     QSIMPLEQ_HEAD(, KVMMemoryUpdate) transaction_del;
@@ -100,6 +109,9 @@ struct KVMDirtyRingReaper {
     QemuThread reaper_thr;
     volatile uint64_t reaper_iteration; /* iteration number of reaper thr */
     volatile enum KVMDirtyRingReaperState reaper_state; /* reap thr state */
+    /* Threads reaping the rings in parallel, NULL to reap them serially */
+    struct ThreadPool *pool;
+    uint32_t threads;
 };
 struct KVMState
 {
@@ -157,6 +169,7 @@ struct KVMState
     uint64_t kvm_dirty_ring_bytes;  /* Size of the per-vcpu dirty ring */
     uint32_t kvm_dirty_ring_size;   /* Number of dirty GFNs per ring */
     bool kvm_dirty_ring_with_bitmap;
+    uint32_t kvm_dirty_ring_reap_threads; /* 0 to pick from the vCPU count */
     uint64_t kvm_eager_split_size;  /* Eager Page Splitting chunk size */
     struct KVMDirtyRingReaper reaper;
     struct KVMMsrEnergy msr_energy;
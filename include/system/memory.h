@@ -1196,11 +1196,18 @@ typedef struct FlatRange FlatRange;
 struct FlatView {
     struct rcu_head rcu;
     unsigned ref;
+    /* Number of roots whose rendering resolved to this view */
+    unsigned roots;
     FlatRange *ranges;
     unsigned nr;
     unsigned nr_allocated;
     struct AddressSpaceDispatch *dispatch;
+    /* Root the view was rendered from, NULL once shared with another root */
     MemoryRegion *root;
+    /* Regions looked at while rendering, the view is stale if one changes */
+    GHashTable *deps;
+    /* Unique among all the views ever rendered */
+    uint64_t serial;
 };
 
 static inline FlatView *address_space_to_flatview(AddressSpace *as)
@@ -2751,6 +2758,50 @@ MemTxResult address_space_rw(AddressSpace *as, hwaddr addr,
                              MemTxAttrs attrs, void *buf,
                              hwaddr len, bool is_write);
 
+#define MMIO_CACHE_ENTRIES 16
+
+typedef struct MMIOCacheEntry {
+    uint64_t fv_serial;
+    hwaddr addr;
+    MemTxAttrs attrs;
+    unsigned len;
+    bool is_write;
+    MemoryRegion *mr;
+    hwaddr mr_addr;
+} MMIOCacheEntry;
+
+/**
+ * MMIOCache: remembers where recent MMIO accesses went
+ *
+ * Devices often have a few hot registers, e.g. virtio notifications, that
+ * a vCPU accesses over and over.  The cache lets these accesses skip the
+ * lookup in the dispatch tree and the checks on the access size.  An entry
+ * is valid as long as the view of the address space it was filled from is
+ * current.  Each vCPU has its own cache, so that it needs no locking.
+ */
+typedef struct MMIOCache {
+    MMIOCacheEntry entries[MMIO_CACHE_ENTRIES];
+} MMIOCache;
+
+/**
+ * address_space_rw_mmio: read from or write to a device register
+ *
+ * Like address_space_rw(), for a single access of a vCPU, looking the
+ * destination up in @cache first.  Accesses that don't go to a single
+ * I/O region in one piece take the usual path.
+ *
+ * @as: #AddressSpace to be accessed
+ * @cache: the #MMIOCache of the vCPU
+ * @addr: address within that address space
+ * @attrs: memory transaction attributes
+ * @buf: buffer with the data transferred
+ * @len: the number of bytes to read or write
+ * @is_write: indicates the transfer direction
+ */
+MemTxResult address_space_rw_mmio(AddressSpace *as, MMIOCache *cache,
+                                  hwaddr addr, MemTxAttrs attrs, void *buf,
+                                  hwaddr len, bool is_write);
+
 /**
  * address_space_write: write to address space.
  *
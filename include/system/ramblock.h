@@ -50,6 +50,12 @@ struct RAMBlock {
     size_t page_size;
     /* dirty bitmap used during migration */
     unsigned long *bmap;
+    /*
+     * Bitmap of pages that the guest reported free (and that were
+     * discarded) since they were last dirtied, allocated on the first
+     * report during migration.  Protected by ram_state.bitmap_mutex.
+     */
+    unsigned long *free_bmap;
 
     /*
      * Below fields are only used by mapped-ram migration
@@ -85,6 +91,13 @@ struct RAMBlock {
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
 
+    /*
+     * Bitmap of host pages not yet saved by a background snapshot.  The
+     * migration thread and the write fault handler threads atomically
+     * clear a bit to claim the page, only the one that succeeds saves it.
+     */
+    unsigned long *wp_unclaimed;
+
     /*
      * RAM block length that corresponds to the used_length on the migration
      * source (after RAM block sizes were synchronized). Especially, after
@@ -0,0 +1,332 @@
+/*
+ * Adaptive tuning of migration settings
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/timer.h"
+#include "exec/target_page.h"
+#include "hw/boards.h"
+#include "qapi/qapi-commands-migration.h"
+#include "system/cpu-throttle.h"
+#include "system/dirtylimit.h"
+#include "autotune.h"
+#include "migration.h"
+#include "migration-stats.h"
+#include "multifd.h"
+#include "options.h"
+#include "trace.h"
+
+/*
+ * The multifd settings are revisited once per period, using what the
+ * channels and the migration thread did during that period:
+ *
+ * - the migration thread waiting for a free channel means the channels
+ *   are the bottleneck: use more of them, or make them cheaper by
+ *   lowering the compression level if they spend their time
+ *   compressing;
+ *
+ * - idle channels mean the bottleneck is elsewhere: release channels,
+ *   and spend the spare CPU time on a better compression ratio if the
+ *   link is the limit.
+ *
+ * Throttling is revisited on each dirty bitmap sync, see
+ * migration_autotune_throttle().
+ */
+#define AUTOTUNE_PERIOD_MS 1000
+
+/* Percentage of time the migration thread waited for a channel */
+#define AUTOTUNE_WAIT_HIGH 10
+#define AUTOTUNE_WAIT_LOW 2
+/* Percentage of time the active channels were busy */
+#define AUTOTUNE_BUSY_LOW 50
+/* Below this ratio compression isn't worth its CPU time */
+#define AUTOTUNE_RATIO_MIN 1.2
+/* Percentage of the bandwidth limit above which we are rate limited */
+#define AUTOTUNE_RATE_LIMITED 90
+
+typedef struct {
+    /* start of the current period, 0 if multifd isn't tuned */
+    int64_t period_start;
+    /* counters at the start of the current period */
+    MultiFDSendTimes times;
+    uint64_t normal_pages;
+    uint64_t multifd_bytes;
+    uint64_t transferred;
+
+    /* active multifd channels */
+    int channels;
+    /* compression level, -1 if the method has no tunable level */
+    int level;
+    int level_min;
+    int level_max;
+    /* per-vCPU dirty rate limit in MB/s, 0 if not in use */
+    uint64_t dirty_limit;
+
+    /* measured during the last period */
+    unsigned int busy;
+    double ratio;
+} MigrationAutotune;
+
+static MigrationAutotune autotune;
+
+static void migration_autotune_snapshot(int64_t now)
+{
+    multifd_send_get_times(&autotune.times);
+    autotune.normal_pages = stat64_get(&mig_stats.normal_pages);
+    autotune.multifd_bytes = stat64_get(&mig_stats.multifd_bytes);
+    autotune.transferred = migration_transferred_bytes();
+    autotune.period_start = now;
+}
+
+/*
+ * Called by the migration thread once the multifd channels are set up.
+ * The settings chosen by the user are the starting point.
+ */
+void migration_autotune_setup(void)
+{
+    memset(&autotune, 0, sizeof(autotune));
+    autotune.level = -1;
+
+    if (!migrate_auto_tune() || !migrate_multifd()) {
+        return;
+    }
+
+    autotune.channels = migrate_multifd_channels();
+
+    switch (migrate_multifd_compression()) {
+    case MULTIFD_COMPRESSION_ZLIB:
+        autotune.level = migrate_multifd_zlib_level();
+        autotune.level_min = 1;
+        autotune.level_max = 9;
+        break;
+#ifdef CONFIG_ZSTD
+    case MULTIFD_COMPRESSION_ZSTD:
+        autotune.level = migrate_multifd_zstd_level();
+        autotune.level_min = 1;
+        /* leave the memory hungry "ultra" levels alone */
+        autotune.level_max = 19;
+        break;
+#endif
+    default:
+        break;
+    }
+
+    migration_autotune_snapshot(qemu_clock_get_ms(QEMU_CLOCK_REALTIME));
+}
+
+/*
+ * Called periodically by the migration thread, after the transfer rate
+ * has been updated.
+ */
+void migration_autotune_update(int64_t now)
+{
+    MultiFDSendTimes times;
+    uint64_t period_ms, period_ns, prepare_ns, write_ns, wait_ns;
+    uint64_t pages_bytes, multifd_bytes, transferred, rate_limit;
+    int channels = autotune.channels;
+    int level = autotune.level;
+    unsigned int wait;
+    bool saturated, cpu_bound, rate_limited;
+
+    if (!autotune.period_start ||
+        now < autotune.period_start + AUTOTUNE_PERIOD_MS ||
+        !multifd_send_get_times(&times)) {
+        return;
+    }
+
+    period_ms = now - autotune.period_start;
+    period_ns = period_ms * SCALE_MS;
+    wait_ns = times.wait_ns - autotune.times.wait_ns;
+    prepare_ns = times.prepare_ns - autotune.times.prepare_ns;
+    write_ns = times.write_ns - autotune.times.write_ns;
+
+    wait = MIN(wait_ns * 100 / period_ns, 100);
+    autotune.busy = MIN((prepare_ns + write_ns) * 100 / (period_ns * channels),
+                        100);
+
+    pages_bytes = (stat64_get(&mig_stats.normal_pages) -
+                   autotune.normal_pages) * qemu_target_page_size();
+    multifd_bytes = stat64_get(&mig_stats.multifd_bytes) -
+                    autotune.multifd_bytes;
+    if (multifd_bytes) {
+        autotune.ratio = (double)pages_bytes / multifd_bytes;
+    }
+
+    /* The rate limit is expressed per BUFFER_DELAY */
+    transferred = migration_transferred_bytes() - autotune.transferred;
+    rate_limit = migration_rate_get();
+    rate_limited = rate_limit != RATE_LIMIT_DISABLED &&
+        transferred * 100 >=
+        rate_limit * (period_ms / BUFFER_DELAY) * AUTOTUNE_RATE_LIMITED;
+
+    saturated = wait >= AUTOTUNE_WAIT_HIGH;
+    cpu_bound = prepare_ns > write_ns;
+
+    if (saturated && channels < migrate_multifd_channels()) {
+        channels++;
+    } else if (wait <= AUTOTUNE_WAIT_LOW &&
+               autotune.busy < AUTOTUNE_BUSY_LOW && channels > 1) {
+        channels--;
+    }
+
+    if (level >= 0) {
+        if (multifd_bytes && autotune.ratio < AUTOTUNE_RATIO_MIN) {
+            /* The data barely compresses, stop burning CPU on it */
+            level = MIN(level, autotune.level_min);
+        } else if (saturated && cpu_bound &&
+                   channels == migrate_multifd_channels()) {
+            level = MAX(level - 1, autotune.level_min);
+        } else if ((saturated && prepare_ns * 2 < write_ns) ||
+                   (rate_limited && autotune.busy < AUTOTUNE_BUSY_LOW)) {
+            /* The link is the limit and the channels have CPU to spare */
+            level = MIN(level + 1, autotune.level_max);
+        }
+    }
+
+    trace_migration_autotune_update(wait, autotune.busy, autotune.ratio * 100,
+                                    rate_limited, channels, level);
+
+    if (channels != autotune.channels) {
+        autotune.channels = channels;
+        multifd_send_set_active_channels(channels);
+    }
+    if (level != autotune.level) {
+        autotune.level = level;
+        multifd_send_set_compress_level(level);
+    }
+
+    migration_autotune_snapshot(now);
+}
+
+static void migration_autotune_cpu_throttle(uint64_t bytes_dirty_period,
+                                            uint64_t bytes_dirty_target)
+{
+    int pct_max = migrate_max_cpu_throttle();
+    int pct_now = cpu_throttle_active() ? cpu_throttle_get_percentage() : 0;
+    int pct_down = pct_now - migrate_cpu_throttle_increment();
+    int pct;
+
+    if (bytes_dirty_period * 2 < bytes_dirty_target) {
+        /*
+         * Well below the target: give the guest some CPU back, slowly
+         * as the dirty rate is noisy.
+         */
+        pct = pct_down;
+    } else if (bytes_dirty_period > bytes_dirty_target) {
+        /*
+         * The dirty rate scales with the CPU time the guest gets, aim
+         * straight at the share that brings it down to the target.
+         */
+        pct = 100 - (100 - pct_now) *
+                    ((double)bytes_dirty_target / bytes_dirty_period);
+    } else {
+        return;
+    }
+
+    pct = MAX(MIN(pct, pct_max), 0);
+    if (pct == pct_now) {
+        return;
+    }
+
+    trace_migration_autotune_cpu_throttle(bytes_dirty_period,
+                                          bytes_dirty_target, pct_now, pct);
+
+    if (!pct) {
+        cpu_throttle_stop();
+    } else {
+        cpu_throttle_set(pct);
+    }
+}
+
+static void migration_autotune_dirty_limit(uint64_t bytes_dirty_period,
+                                           uint64_t bytes_dirty_target,
+                                           int64_t period_ms)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+    uint64_t limit;
+
+    if (!dirtylimit_in_service() && bytes_dirty_period <= bytes_dirty_target) {
+        return;
+    }
+
+    /* Share what the link can absorb between the vCPUs */
+    limit = bytes_dirty_target * 1000 / period_ms / ms->smp.cpus / MiB;
+    limit = MAX(limit, 1);
+
+    /* Ignore small variations of the bandwidth */
+    if (dirtylimit_in_service() &&
+        limit * 10 >= autotune.dirty_limit * 9 &&
+        limit * 10 <= autotune.dirty_limit * 11) {
+        return;
+    }
+
+    autotune.dirty_limit = limit;
+    qmp_set_vcpu_dirty_limit(false, -1, limit, NULL);
+    trace_migration_dirty_limit_guest(limit);
+}
+
+/*
+ * Called on dirty bitmap sync instead of the fixed step throttling, with
+ * the bytes sent and dirtied since the previous call.  The guest is
+ * slowed down just enough for the dirty rate to stay below
+ * throttle-trigger-threshold percent of the bandwidth.
+ */
+void migration_autotune_throttle(uint64_t bytes_xfer_period,
+                                 uint64_t bytes_dirty_period,
+                                 int64_t period_ms)
+{
+    uint64_t threshold = migrate_throttle_trigger_threshold();
+    uint64_t bytes_dirty_target = bytes_xfer_period * threshold / 100;
+    uint64_t bytes_downtime = bytes_xfer_period * migrate_downtime_limit() /
+                              period_ms;
+
+    /*
+     * What is left already fits in the downtime target, the migration
+     * is about to complete.  Don't change anything at this point.
+     */
+    if (stat64_get(&mig_stats.dirty_bytes_last_sync) <= bytes_downtime) {
+        return;
+    }
+
+    if (migrate_auto_converge()) {
+        migration_autotune_cpu_throttle(bytes_dirty_period,
+                                        bytes_dirty_target);
+    } else if (migrate_dirty_limit()) {
+        migration_autotune_dirty_limit(bytes_dirty_period,
+                                       bytes_dirty_target, period_ms);
+    }
+}
+
+MigrationAutotuneInfo *migration_autotune_query(void)
+{
+    MigrationAutotuneInfo *info;
+
+    if (!migrate_auto_tune()) {
+        return NULL;
+    }
+
+    info = g_new0(MigrationAutotuneInfo, 1);
+
+    if (autotune.channels) {
+        info->has_channels = true;
+        info->channels = autotune.channels;
+        info->has_channel_busy = true;
+        info->channel_busy = autotune.busy;
+    }
+    if (autotune.level >= 0) {
+        info->has_compression_level = true;
+        info->compression_level = autotune.level;
+        info->has_compression_ratio = true;
+        info->compression_ratio = autotune.ratio;
+    }
+    if (autotune.dirty_limit) {
+        info->has_vcpu_dirty_limit = true;
+        info->vcpu_dirty_limit = autotune.dirty_limit;
+    }
+
+    return info;
+}
@@ -0,0 +1,20 @@
+/*
+ * Adaptive tuning of migration settings
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_AUTOTUNE_H
+#define QEMU_MIGRATION_AUTOTUNE_H
+
+#include "qapi/qapi-types-migration.h"
+
+void migration_autotune_setup(void);
+void migration_autotune_update(int64_t now);
+void migration_autotune_throttle(uint64_t bytes_xfer_period,
+                                 uint64_t bytes_dirty_period,
+                                 int64_t period_ms);
+MigrationAutotuneInfo *migration_autotune_query(void);
+
+#endif
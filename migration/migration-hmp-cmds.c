@@ -219,8 +219,12 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "\n");
 
         monitor_printf(mon, "    Page Types: \tnormal=%" PRIu64
-                       ", zero=%" PRIu64 "\n",
+                       ", zero=%" PRIu64,
                        info->ram->normal, info->ram->duplicate);
+        if (info->ram->dedup_pages) {
+            monitor_printf(mon, ", dedup=%" PRIu64, info->ram->dedup_pages);
+        }
+        monitor_printf(mon, "\n");
         monitor_printf(mon, "  Page Rates (pps): \ttransfer=%" PRIu64,
                        info->ram->pages_per_second);
         if (info->ram->dirty_pages_rate) {
@@ -243,9 +247,31 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, ", zerocopy_fallbacks=%" PRIu64,
                            info->ram->dirty_sync_missed_zero_copy);
         }
+        if (info->ram->free_page_report_bytes) {
+            monitor_printf(mon, ", free_page_report_bytes=%" PRIu64,
+                           info->ram->free_page_report_bytes);
+        }
         monitor_printf(mon, "\n");
     }
 
+    if (info->multifd_links) {
+        MigrationLinkInfoList *link;
+
+        monitor_printf(mon, "Multifd links:\n");
+        for (link = info->multifd_links; link; link = link->next) {
+            g_autofree char *uri = socket_uri(link->value->addr);
+            g_autofree char *str_transferred =
+                size_to_str(link->value->transferred);
+
+            monitor_printf(mon, "  %s: \tweight=%" PRIu32
+                           ", channels=%" PRIu32
+                           ", transferred=%s, mbps=%0.2f%s\n",
+                           uri, link->value->weight, link->value->channels,
+                           str_transferred, link->value->mbps,
+                           link->value->failed ? " (failed)" : "");
+        }
+    }
+
     if (!show_all) {
         goto out;
     }
@@ -284,6 +310,26 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->dirty_limit_ring_full_time);
     }
 
+    if (info->auto_tune) {
+        MigrationAutotuneInfo *at = info->auto_tune;
+
+        monitor_printf(mon, "Auto-tune:\n");
+        if (at->has_channels) {
+            monitor_printf(mon, "  Multifd channels: %" PRIu32
+                           " (busy %" PRIu32 "%%)\n",
+                           at->channels, at->channel_busy);
+        }
+        if (at->has_compression_level) {
+            monitor_printf(mon, "  Compression level: %" PRIu32
+                           " (ratio %0.2f)\n",
+                           at->compression_level, at->compression_ratio);
+        }
+        if (at->has_vcpu_dirty_limit) {
+            monitor_printf(mon, "  vCPU dirty limit (MB/s): %" PRIu64 "\n",
+                           at->vcpu_dirty_limit);
+        }
+    }
+
     migration_dump_blocktime(mon, info);
 out:
     qapi_free_MigrationInfo(info);
@@ -440,6 +486,47 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
     qapi_free_MigrationParameters(params);
 }
 
+static void hmp_migrate_profile_entries(Monitor *mon,
+                                        MigrationProfileEntryList *list)
+{
+    for (; list; list = list->next) {
+        MigrationProfileEntry *e = list->value;
+
+        monitor_printf(mon, "  %s", e->name);
+        if (e->has_instance_id) {
+            monitor_printf(mon, " (%" PRIu32 ")", e->instance_id);
+        }
+        monitor_printf(mon, ": %" PRIu64 " bytes, %" PRIu64 " us",
+                       e->bytes, e->time);
+        if (e->has_pages) {
+            monitor_printf(mon, ", %" PRIu64 " pages", e->pages);
+        }
+        monitor_printf(mon, "\n");
+    }
+}
+
+void hmp_info_migrate_profile(Monitor *mon, const QDict *qdict)
+{
+    MigrationProfile *profile = qmp_query_migrate_profile(NULL);
+    MigrationProfileRoundList *round;
+
+    for (round = profile->rounds; round; round = round->next) {
+        MigrationProfileRound *r = round->value;
+
+        monitor_printf(mon, "%s, round %" PRIu64 ":\n",
+                       MigrationProfilePhase_str(r->phase), r->round);
+        hmp_migrate_profile_entries(mon, r->sections);
+        hmp_migrate_profile_entries(mon, r->ramblocks);
+    }
+
+    if (profile->load) {
+        monitor_printf(mon, "load:\n");
+        hmp_migrate_profile_entries(mon, profile->load);
+    }
+
+    qapi_free_MigrationProfile(profile);
+}
+
 void hmp_loadvm(Monitor *mon, const QDict *qdict)
 {
     RunState saved_state = runstate_get();
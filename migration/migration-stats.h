@@ -34,6 +34,10 @@
  * one thread).
  */
 typedef struct {
+    /*
+     * Number of pages sent as a reference to an identical page.
+     */
+    Stat64 dedup_pages;
     /*
      * Number of bytes that were dirty last time that we synced with
      * the guest memory.  We use that to calculate the downtime.  As
@@ -60,6 +64,11 @@ typedef struct {
      * guest is stopped.
      */
     Stat64 downtime_bytes;
+    /*
+     * Number of bytes sent as zero pages without reading them, because
+     * the guest reported them free.
+     */
+    Stat64 free_page_report_bytes;
     /*
      * Number of bytes sent through multifd channels.
      */
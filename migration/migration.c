@@ -59,6 +59,7 @@
 #include "net/announce.h"
 #include "qemu/queue.h"
 #include "multifd.h"
+#include "autotune.h"
 #include "threadinfo.h"
 #include "qemu/yank.h"
 #include "system/cpus.h"
@@ -200,6 +201,49 @@ static bool transport_supports_multi_channels(MigrationAddress *addr)
     }
 }
 
+/*
+ * Check the 'multifd' entries of a channel list.  They describe extra
+ * network links for the multifd channels next to the main address.
+ */
+static bool migration_multifd_links_check(MigrationChannelList *channels,
+                                          MigrationAddress *main_addr,
+                                          Error **errp)
+{
+    for (; channels; channels = channels->next) {
+        MigrationChannel *channel = channels->value;
+
+        if (channel->channel_type != MIGRATION_CHANNEL_TYPE_MULTIFD) {
+            if (channel->has_weight) {
+                error_setg(errp, "Channel weight is only valid for "
+                           "'multifd' channels");
+                return false;
+            }
+            continue;
+        }
+
+        if (!migrate_multifd()) {
+            error_setg(errp, "'multifd' channels require the multifd "
+                       "capability");
+            return false;
+        }
+
+        if (main_addr->transport != MIGRATION_ADDRESS_TYPE_SOCKET ||
+            !transport_supports_multi_channels(main_addr) ||
+            !transport_supports_multi_channels(channel->addr)) {
+            error_setg(errp, "'multifd' channels are only supported "
+                       "with socket migration");
+            return false;
+        }
+
+        if (channel->has_weight && !channel->weight) {
+            error_setg(errp, "Channel weight must be greater than 0");
+            return false;
+        }
+    }
+
+    return true;
+}
+
 static bool migration_needs_seekable_channel(void)
 {
     return migrate_mapped_ram();
@@ -648,9 +692,13 @@ int migration_incoming_enable_colo(void)
 void migrate_add_address(SocketAddress *address)
 {
     MigrationIncomingState *mis = migration_incoming_get_current();
+    SocketAddressList **tail = &mis->socket_address_list;
 
-    QAPI_LIST_PREPEND(mis->socket_address_list,
-                      QAPI_CLONE(SocketAddress, address));
+    /* Keep the order of the channels, the main one comes first */
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    QAPI_LIST_APPEND(tail, QAPI_CLONE(SocketAddress, address));
 }
 
 bool migrate_is_uri(const char *uri)
@@ -758,13 +806,27 @@ static void qemu_start_incoming_migration(const char *uri, bool has_channels,
     }
 
     if (channels) {
-        /* To verify that Migrate channel list has only item */
-        if (channels->next) {
-            error_setg(errp, "Channel list must have only one entry, "
-                             "for type 'main'");
+        MigrationChannelList *c;
+
+        /* Besides multifd links, the list has only the main channel */
+        for (c = channels; c; c = c->next) {
+            if (c->value->channel_type == MIGRATION_CHANNEL_TYPE_MULTIFD) {
+                continue;
+            }
+            if (addr) {
+                error_setg(errp, "Channel list must have only one entry, "
+                                 "for type 'main'");
+                return;
+            }
+            addr = c->value->addr;
+        }
+        if (!addr) {
+            error_setg(errp, "Channel list has no main entry");
+            return;
+        }
+        if (!migration_multifd_links_check(channels, addr, errp)) {
             return;
         }
-        addr = channels->value->addr;
     }
 
     if (uri) {
@@ -789,7 +851,7 @@ static void qemu_start_incoming_migration(const char *uri, bool has_channels,
         if (saddr->type == SOCKET_ADDRESS_TYPE_INET ||
             saddr->type == SOCKET_ADDRESS_TYPE_UNIX ||
             saddr->type == SOCKET_ADDRESS_TYPE_VSOCK) {
-            socket_start_incoming_migration(saddr, errp);
+            socket_start_incoming_migration(saddr, channels, errp);
         } else if (saddr->type == SOCKET_ADDRESS_TYPE_FD) {
             fd_start_incoming_migration(saddr->u.fd.str, errp);
         }
@@ -1283,6 +1345,9 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         stat64_get(&mig_stats.dirty_sync_count);
     info->ram->dirty_sync_missed_zero_copy =
         stat64_get(&mig_stats.dirty_sync_missed_zero_copy);
+    info->ram->dedup_pages = stat64_get(&mig_stats.dedup_pages);
+    info->ram->free_page_report_bytes =
+        stat64_get(&mig_stats.free_page_report_bytes);
     info->ram->postcopy_requests =
         stat64_get(&mig_stats.postcopy_requests);
     info->ram->page_size = page_size;
@@ -1292,6 +1357,10 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->downtime_bytes = stat64_get(&mig_stats.downtime_bytes);
     info->ram->postcopy_bytes = stat64_get(&mig_stats.postcopy_bytes);
 
+    /* populate_time_info() has computed the elapsed time already */
+    info->multifd_links = socket_query_outgoing_links(info->total_time);
+    info->auto_tune = migration_autotune_query();
+
     if (migrate_xbzrle()) {
         info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
         info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
@@ -2206,22 +2275,31 @@ void qmp_migrate(const char *uri, bool has_channels,
     }
 
     if (channels) {
-        for ( ; channels; channels = channels->next) {
-            MigrationChannelType type = channels->value->channel_type;
+        MigrationChannelList *c;
 
+        for (c = channels; c; c = c->next) {
+            MigrationChannelType type = c->value->channel_type;
+
+            if (type == MIGRATION_CHANNEL_TYPE_MULTIFD) {
+                /* any number of multifd links */
+                continue;
+            }
             if (channelv[type]) {
                 error_setg(errp, "Channel list has more than one %s entry",
                            MigrationChannelType_str(type));
                 return;
             }
-            channelv[type] = channels->value;
+            channelv[type] = c->value;
         }
         cpr_channel = channelv[MIGRATION_CHANNEL_TYPE_CPR];
-        addr = channelv[MIGRATION_CHANNEL_TYPE_MAIN]->addr;
-        if (!addr) {
+        if (!channelv[MIGRATION_CHANNEL_TYPE_MAIN]) {
             error_setg(errp, "Channel list has no main entry");
             return;
         }
+        addr = channelv[MIGRATION_CHANNEL_TYPE_MAIN]->addr;
+        if (!migration_multifd_links_check(channels, addr, errp)) {
+            return;
+        }
     }
 
     if (uri) {
@@ -2252,6 +2330,8 @@ void qmp_migrate(const char *uri, bool has_channels,
         goto out;
     }
 
+    socket_set_outgoing_links(channels);
+
     /*
      * For cpr-transfer, the target may not be listening yet on the migration
      * channel, because first it must finish cpr_load_state.  The target tells
@@ -3404,6 +3484,8 @@ static void migration_update_counters(MigrationState *s,
 
     update_iteration_initial_status(s);
 
+    migration_autotune_update(current_time);
+
     trace_migrate_transferred(transferred, time_spent,
                               /* Both in unit bytes/ms */
                               bandwidth, switchover_bw / 1000,
@@ -3703,6 +3785,7 @@ static void *migration_thread(void *opaque)
     if (!multifd_send_setup()) {
         goto out;
     }
+    migration_autotune_setup();
 
     bql_lock();
     qemu_savevm_state_header(s->to_dst_file);
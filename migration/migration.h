@@ -29,6 +29,7 @@
 #include "migration/misc.h"
 
 #define  MIGRATION_THREAD_SNAPSHOT          "mig/snapshot"
+#define  MIGRATION_THREAD_SNAPSHOT_WP       "mig/snap/wp_%d"
 #define  MIGRATION_THREAD_DIRTY_RATE        "mig/dirtyrate"
 
 #define  MIGRATION_THREAD_SRC_MAIN          "mig/src/main"
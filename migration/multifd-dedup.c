@@ -0,0 +1,368 @@
+/*
+ * Multifd duplicate page elimination
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitops.h"
+#include "qemu/thread.h"
+#include "system/ramblock.h"
+#include "exec/target_page.h"
+#include "migration.h"
+#include "migration-stats.h"
+#include "multifd.h"
+#include "options.h"
+#include "ram.h"
+#include "trace.h"
+
+/*
+ * Each channel remembers the content hash of the last pages it sent in a
+ * direct-mapped table.  A page whose content matches an entry is sent as
+ * a reference to the earlier page and copied on the destination.
+ *
+ * References never cross channels, and the pages of one channel are
+ * received in order, so the referenced page has arrived when the copy is
+ * done.  It must not have been overwritten by a later copy of it sent
+ * through another channel either.  A page is sent at most once between
+ * two dirty bitmap syncs, as only a sync sets its dirty bit again.  So
+ * each bitmap sync empties the tables, and if references are still in
+ * flight, the channels are synced with the destination before any other
+ * page is sent.
+ *
+ * If the guest modified the referenced page between hashing and sending,
+ * the destination copies the wrong content.  The referenced page is dirty
+ * then, and the bitmap sync marks the duplicate dirty too, see
+ * multifd_dedup_bitmap_sync().  Each channel records the pairs it sends
+ * in its own table, and the bitmap sync goes through those of all the
+ * channels.
+ */
+#define MULTIFD_DEDUP_TABLE_BITS 16
+#define MULTIFD_DEDUP_TABLE_SIZE (1 << MULTIFD_DEDUP_TABLE_BITS)
+
+#define MULTIFD_DEDUP_PRIME64_1 0x9E3779B185EBCA87ULL
+#define MULTIFD_DEDUP_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define MULTIFD_DEDUP_PRIME64_3 0x165667B19E3779F9ULL
+
+typedef struct {
+    uint64_t hash;
+    uint64_t gen;
+    RAMBlock *block;
+    ram_addr_t offset;
+} MultiFDDedupEntry;
+
+/*
+ * A page sent as a reference.  If the referenced page was modified by the
+ * guest between being hashed and being put on the wire, the destination
+ * copies the wrong content, so the duplicate must be sent again whenever
+ * the referenced page turns up dirty.
+ */
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t offset;
+    ram_addr_t ref;
+} MultiFDDedupPair;
+
+struct MultiFDDedupTable {
+    /* entries with a different generation are stale */
+    uint64_t gen;
+    /* value of MultiFDDedupState::epoch when the entries were added */
+    unsigned int epoch;
+    MultiFDDedupEntry *entries;
+    /*
+     * Protects pairs and completed.  Only the bitmap sync takes it from
+     * another thread than the channel's.
+     */
+    QemuMutex lock;
+    GArray *pairs;
+    /*
+     * Pairs below this index were sent before the last multifd sync.
+     * They can be dropped once checked against a bitmap sync, the
+     * remaining ones might still be in flight.
+     */
+    guint completed;
+};
+
+/* Only used by the migration thread, except epoch */
+typedef struct {
+    /* references were in flight at the last bitmap sync */
+    bool sync_needed;
+    /* incremented on each bitmap sync, the tables are then emptied */
+    unsigned int epoch;
+} MultiFDDedupState;
+
+static MultiFDDedupState *multifd_dedup_state;
+
+/*
+ * Tables of all the channels, added and removed with the channels by the
+ * migration thread.
+ */
+static GPtrArray *multifd_dedup_tables;
+
+bool multifd_dedup_enabled(void)
+{
+    return migrate_page_dedup() && migrate_multifd() &&
+           !migrate_multifd_compression() && !migrate_mapped_ram() &&
+           !migrate_postcopy_ram();
+}
+
+/*
+ * 4-lane xxhash64 style hash of a whole page.  The lanes are independent
+ * so the compiler can vectorize the main loop.
+ */
+static uint64_t multifd_dedup_hash(const void *buf, size_t len)
+{
+    const uint64_t *p = buf;
+    uint64_t v[4] = {
+        MULTIFD_DEDUP_PRIME64_1 + MULTIFD_DEDUP_PRIME64_2,
+        MULTIFD_DEDUP_PRIME64_2,
+        0,
+        -MULTIFD_DEDUP_PRIME64_1,
+    };
+    uint64_t h;
+
+    for (size_t i = 0; i < len / sizeof(uint64_t); i += 4) {
+        for (int lane = 0; lane < 4; lane++) {
+            v[lane] += p[i + lane] * MULTIFD_DEDUP_PRIME64_2;
+            v[lane] = rol64(v[lane], 31) * MULTIFD_DEDUP_PRIME64_1;
+        }
+    }
+
+    h = rol64(v[0], 1) + rol64(v[1], 7) + rol64(v[2], 12) + rol64(v[3], 18);
+    h ^= h >> 33;
+    h *= MULTIFD_DEDUP_PRIME64_2;
+    h ^= h >> 29;
+    h *= MULTIFD_DEDUP_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+void multifd_dedup_save_setup(void)
+{
+    if (!multifd_dedup_enabled()) {
+        return;
+    }
+
+    multifd_dedup_state = g_new0(MultiFDDedupState, 1);
+}
+
+void multifd_dedup_save_cleanup(void)
+{
+    g_clear_pointer(&multifd_dedup_state, g_free);
+}
+
+void multifd_dedup_send_setup(MultiFDSendParams *p)
+{
+    if (!multifd_dedup_enabled()) {
+        return;
+    }
+
+    p->dedup = g_new0(MultiFDDedupTable, 1);
+    /* generation 0 is never used, so all entries start out stale */
+    p->dedup->gen = 1;
+    p->dedup->entries = g_new0(MultiFDDedupEntry, MULTIFD_DEDUP_TABLE_SIZE);
+    qemu_mutex_init(&p->dedup->lock);
+    p->dedup->pairs = g_array_new(false, false, sizeof(MultiFDDedupPair));
+
+    if (!multifd_dedup_tables) {
+        multifd_dedup_tables = g_ptr_array_new();
+    }
+    g_ptr_array_add(multifd_dedup_tables, p->dedup);
+}
+
+void multifd_dedup_send_cleanup(MultiFDSendParams *p)
+{
+    if (!p->dedup) {
+        return;
+    }
+
+    g_ptr_array_remove_fast(multifd_dedup_tables, p->dedup);
+    if (!multifd_dedup_tables->len) {
+        g_clear_pointer(&multifd_dedup_tables, g_ptr_array_unref);
+    }
+
+    g_array_free(p->dedup->pairs, true);
+    qemu_mutex_destroy(&p->dedup->lock);
+    g_free(p->dedup->entries);
+    g_clear_pointer(&p->dedup, g_free);
+}
+
+/*
+ * Called by the channel thread on each multifd sync.  From now on pages
+ * may be sent again through another channel, so forget everything.  The
+ * pages recorded so far are on the wire.
+ */
+void multifd_dedup_send_reset(MultiFDSendParams *p)
+{
+    if (!p->dedup) {
+        return;
+    }
+
+    p->dedup->gen++;
+
+    WITH_QEMU_LOCK_GUARD(&p->dedup->lock) {
+        p->dedup->completed = p->dedup->pairs->len;
+    }
+}
+
+/* Called by the migration thread once all channels are synced */
+void multifd_dedup_send_sync_done(void)
+{
+    if (multifd_dedup_state) {
+        multifd_dedup_state->sync_needed = false;
+    }
+}
+
+/*
+ * Called by the migration thread before sending a page.  Returns true if
+ * the channels must be synced with the destination first, because pages
+ * referenced by duplicates in flight may be sent again.
+ */
+bool multifd_dedup_sync_needed(void)
+{
+    return multifd_dedup_state && multifd_dedup_state->sync_needed;
+}
+
+/*
+ * Called from the RAM dirty bitmap sync, after the dirty log has been
+ * merged into the migration bitmap.  Returns the number of duplicate
+ * pages that have been marked dirty again.
+ */
+uint64_t multifd_dedup_bitmap_sync(void)
+{
+    unsigned int page_bits = qemu_target_page_bits();
+    uint64_t dirtied = 0;
+
+    if (!multifd_dedup_state) {
+        return 0;
+    }
+
+    for (guint t = 0; t < multifd_dedup_tables->len; t++) {
+        MultiFDDedupTable *table = g_ptr_array_index(multifd_dedup_tables, t);
+
+        QEMU_LOCK_GUARD(&table->lock);
+
+        for (guint i = 0; i < table->pairs->len; i++) {
+            MultiFDDedupPair *pair = &g_array_index(table->pairs,
+                                                    MultiFDDedupPair, i);
+
+            if (test_bit(pair->ref >> page_bits, pair->block->bmap) &&
+                !test_and_set_bit(pair->offset >> page_bits,
+                                  pair->block->bmap)) {
+                dirtied++;
+            }
+        }
+
+        g_array_remove_range(table->pairs, 0, table->completed);
+        table->completed = 0;
+
+        if (table->pairs->len) {
+            multifd_dedup_state->sync_needed = true;
+        }
+    }
+
+    /* Pages sent before the sync can't be referenced anymore */
+    qatomic_inc(&multifd_dedup_state->epoch);
+
+    return dirtied;
+}
+
+/*
+ * Returns true if @ref can be used as the source of @offset, and records
+ * the pair in @table.  The check and the record are done under the lock
+ * of the table so that a concurrent bitmap sync either sees the pair or
+ * has already set the dirty bit of @ref.
+ */
+static bool multifd_dedup_record(MultiFDDedupTable *table, RAMBlock *rb,
+                                 ram_addr_t offset, ram_addr_t ref)
+{
+    MultiFDDedupPair pair = {
+        .block = rb,
+        .offset = offset,
+        .ref = ref,
+    };
+
+    QEMU_LOCK_GUARD(&table->lock);
+
+    if (test_bit(ref >> qemu_target_page_bits(), rb->bmap)) {
+        /* @ref will be sent again anyway, don't depend on it */
+        return false;
+    }
+
+    g_array_append_val(table->pairs, pair);
+    return true;
+}
+
+/**
+ * multifd_send_dedup_detect: Perform duplicate detection on normal pages.
+ *
+ * Sorts duplicate pages after the remaining normal pages in
+ * p->pages->offset, fills p->pages->dup_ref and updates
+ * p->pages->normal_num and p->pages->dup_num.
+ *
+ * @param p A pointer to the send params.
+ */
+void multifd_send_dedup_detect(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    MultiFDDedupTable *table = p->dedup;
+    RAMBlock *rb = pages->block;
+    uint32_t page_size = multifd_ram_page_size();
+    unsigned int epoch;
+    int i = 0;
+    int j = pages->normal_num - 1;
+
+    pages->dup_num = 0;
+
+    if (!table) {
+        return;
+    }
+
+    epoch = qatomic_read(&multifd_dedup_state->epoch);
+    if (table->epoch != epoch) {
+        table->epoch = epoch;
+        table->gen++;
+    }
+
+    while (i <= j) {
+        ram_addr_t offset = pages->offset[i];
+        uint8_t *host = rb->host + offset;
+        uint64_t hash = multifd_dedup_hash(host, page_size);
+        MultiFDDedupEntry *e =
+            &table->entries[hash & (MULTIFD_DEDUP_TABLE_SIZE - 1)];
+
+        if (e->gen != table->gen || e->hash != hash || e->block != rb ||
+            e->offset == offset ||
+            memcmp(host, rb->host + e->offset, page_size) ||
+            !multifd_dedup_record(table, rb, offset, e->offset)) {
+            e->gen = table->gen;
+            e->hash = hash;
+            e->block = rb;
+            e->offset = offset;
+            i++;
+            continue;
+        }
+
+        pages->offset[i] = pages->offset[j];
+        pages->offset[j] = offset;
+        pages->dup_ref[j] = e->offset;
+        j--;
+    }
+
+    pages->dup_num = pages->normal_num - i;
+    pages->normal_num = i;
+
+    trace_multifd_send_dedup_detect(p->id, pages->normal_num, pages->dup_num);
+}
+
+void multifd_recv_dedup_process(MultiFDRecvParams *p)
+{
+    uint32_t page_size = multifd_ram_page_size();
+
+    for (int i = 0; i < p->dup_num; i++) {
+        memcpy(p->host + p->dup[i], p->host + p->dup_ref[i], page_size);
+        ramblock_recv_bitmap_set_offset(p->block, p->dup[i]);
+    }
+}
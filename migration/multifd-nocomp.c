@@ -29,21 +29,27 @@ static MultiFDSendData *multifd_ram_send;
 void multifd_ram_payload_alloc(MultiFDPages_t *pages)
 {
     pages->offset = g_new0(ram_addr_t, multifd_ram_page_count());
+    if (multifd_dedup_enabled()) {
+        pages->dup_ref = g_new0(ram_addr_t, multifd_ram_page_count());
+    }
 }
 
 void multifd_ram_payload_free(MultiFDPages_t *pages)
 {
     g_clear_pointer(&pages->offset, g_free);
+    g_clear_pointer(&pages->dup_ref, g_free);
 }
 
 void multifd_ram_save_setup(void)
 {
     multifd_ram_send = multifd_send_data_alloc();
+    multifd_dedup_save_setup();
 }
 
 void multifd_ram_save_cleanup(void)
 {
     g_clear_pointer(&multifd_ram_send, multifd_send_data_free);
+    multifd_dedup_save_cleanup();
 }
 
 static void multifd_set_file_bitmap(MultiFDSendParams *p)
@@ -177,16 +183,21 @@ static int multifd_nocomp_recv(MultiFDRecvParams *p, Error **errp)
 
     multifd_recv_zero_page_process(p);
 
-    if (!p->normal_num) {
-        return 0;
+    if (p->normal_num) {
+        for (int i = 0; i < p->normal_num; i++) {
+            p->iov[i].iov_base = p->host + p->normal[i];
+            p->iov[i].iov_len = multifd_ram_page_size();
+            ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+        }
+        if (qio_channel_readv_all(p->c, p->iov, p->normal_num, errp)) {
+            return -1;
+        }
     }
 
-    for (int i = 0; i < p->normal_num; i++) {
-        p->iov[i].iov_base = p->host + p->normal[i];
-        p->iov[i].iov_len = multifd_ram_page_size();
-        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
-    }
-    return qio_channel_readv_all(p->c, p->iov, p->normal_num, errp);
+    /* Duplicates may refer to the normal pages of this very packet */
+    multifd_recv_dedup_process(p);
+
+    return 0;
 }
 
 static void multifd_pages_reset(MultiFDPages_t *pages)
@@ -197,6 +208,7 @@ static void multifd_pages_reset(MultiFDPages_t *pages)
      */
     pages->num = 0;
     pages->normal_num = 0;
+    pages->dup_num = 0;
     pages->block = NULL;
 }
 
@@ -204,22 +216,42 @@ void multifd_ram_fill_packet(MultiFDSendParams *p)
 {
     MultiFDPacket_t *packet = p->packet;
     MultiFDPages_t *pages = &p->data->u.ram;
-    uint32_t zero_num = pages->num - pages->normal_num;
+    uint32_t zero_num = pages->num - pages->normal_num - pages->dup_num;
+    uint32_t dup_start = pages->normal_num;
+    uint32_t zero_start = dup_start + pages->dup_num;
+    int i;
 
     packet->pages_alloc = cpu_to_be32(multifd_ram_page_count());
     packet->normal_pages = cpu_to_be32(pages->normal_num);
     packet->zero_pages = cpu_to_be32(zero_num);
+    packet->dup_pages = cpu_to_be32(pages->dup_num);
 
     if (pages->block) {
         pstrcpy(packet->ramblock, sizeof(packet->ramblock),
                 pages->block->idstr);
     }
 
-    for (int i = 0; i < pages->num; i++) {
-        /* there are architectures where ram_addr_t is 32 bit */
-        uint64_t temp = pages->offset[i];
+    /*
+     * The duplicate pages sit between the normal and zero pages in
+     * pages->offset, but go after the zero pages on the wire so that the
+     * packet layout is unchanged when page-dedup is not used.
+     *
+     * there are architectures where ram_addr_t is 32 bit, hence the casts.
+     */
+    for (i = 0; i < pages->normal_num; i++) {
+        packet->offset[i] = cpu_to_be64((uint64_t)pages->offset[i]);
+    }
+
+    for (int j = zero_start; j < pages->num; j++, i++) {
+        packet->offset[i] = cpu_to_be64((uint64_t)pages->offset[j]);
+    }
+
+    for (int j = dup_start; j < zero_start; j++, i++) {
+        packet->offset[i] = cpu_to_be64((uint64_t)pages->offset[j]);
+    }
 
-        packet->offset[i] = cpu_to_be64(temp);
+    for (int j = dup_start; j < zero_start; j++, i++) {
+        packet->offset[i] = cpu_to_be64((uint64_t)pages->dup_ref[j]);
     }
 
     trace_multifd_send_ram_fill(p->id, pages->normal_num,
@@ -256,7 +288,20 @@ int multifd_ram_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
-    if (p->normal_num == 0 && p->zero_num == 0) {
+    p->dup_num = be32_to_cpu(packet->dup_pages);
+    if (p->dup_num && !p->dup) {
+        error_setg(errp, "multifd: received packet with %u duplicate pages "
+                   "but page-dedup is not enabled", p->dup_num);
+        return -1;
+    }
+    if (p->dup_num > pages_per_packet - p->normal_num - p->zero_num) {
+        error_setg(errp,
+                   "multifd: received packet with %u duplicate pages, expected maximum %u",
+                   p->dup_num, pages_per_packet - p->normal_num - p->zero_num);
+        return -1;
+    }
+
+    if (p->normal_num == 0 && p->zero_num == 0 && p->dup_num == 0) {
         return 0;
     }
 
@@ -294,6 +339,22 @@ int multifd_ram_unfill_packet(MultiFDRecvParams *p, Error **errp)
         p->zero[i] = offset;
     }
 
+    for (i = 0; i < p->dup_num; i++) {
+        uint32_t idx = p->normal_num + p->zero_num + i;
+        uint64_t offset = be64_to_cpu(packet->offset[idx]);
+        uint64_t ref = be64_to_cpu(packet->offset[idx + p->dup_num]);
+
+        if (offset > (p->block->used_length - page_size) ||
+            ref > (p->block->used_length - page_size)) {
+            error_setg(errp, "multifd: offset too long %" PRIu64
+                       " (max " RAM_ADDR_FMT ")",
+                       MAX(offset, ref), p->block->used_length);
+            return -1;
+        }
+        p->dup[i] = offset;
+        p->dup_ref[i] = ref;
+    }
+
     return 0;
 }
 
@@ -41,7 +41,8 @@ static void swap_page_offset(ram_addr_t *pages_offset, int a, int b)
  * multifd_send_zero_page_detect: Perform zero page detection on all pages.
  *
  * Sorts normal pages before zero pages in p->pages->offset and updates
- * p->pages->normal_num.
+ * p->pages->normal_num.  With page-dedup, duplicate pages are further
+ * split from the normal ones, see multifd_send_dedup_detect().
  *
  * @param p A pointer to the send params.
  */
@@ -77,8 +78,12 @@ void multifd_send_zero_page_detect(MultiFDSendParams *p)
     pages->normal_num = i;
 
 out:
+    multifd_send_dedup_detect(p);
+
     stat64_add(&mig_stats.normal_pages, pages->normal_num);
-    stat64_add(&mig_stats.zero_pages, pages->num - pages->normal_num);
+    stat64_add(&mig_stats.dedup_pages, pages->dup_num);
+    stat64_add(&mig_stats.zero_pages,
+               pages->num - pages->normal_num - pages->dup_num);
 }
 
 void multifd_recv_zero_page_process(MultiFDRecvParams *p)
@@ -92,6 +92,21 @@ static void multifd_zlib_send_cleanup(MultiFDSendParams *p, Error **errp)
     p->iov = NULL;
 }
 
+static void multifd_zlib_send_set_level(MultiFDSendParams *p, int level)
+{
+    struct zlib_data *z = p->compress_data;
+    z_stream *zs = &z->zs;
+
+    /*
+     * The previous packet ended with Z_SYNC_FLUSH, so there is nothing
+     * pending and deflateParams() doesn't produce any output.  On
+     * failure we just keep going with the previous level.
+     */
+    zs->avail_out = z->zbuff_len;
+    zs->next_out = z->zbuff;
+    deflateParams(zs, level, Z_DEFAULT_STRATEGY);
+}
+
 static int multifd_zlib_send_prepare(MultiFDSendParams *p, Error **errp)
 {
     MultiFDPages_t *pages = &p->data->u.ram;
@@ -281,6 +296,7 @@ static const MultiFDMethods multifd_zlib_ops = {
     .send_setup = multifd_zlib_send_setup,
     .send_cleanup = multifd_zlib_send_cleanup,
     .send_prepare = multifd_zlib_send_prepare,
+    .send_set_level = multifd_zlib_send_set_level,
     .recv_setup = multifd_zlib_recv_setup,
     .recv_cleanup = multifd_zlib_recv_cleanup,
     .recv = multifd_zlib_recv
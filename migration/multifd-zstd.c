@@ -33,6 +33,8 @@ struct zstd_data {
     uint8_t *zbuff;
     /* size of compressed buffer */
     uint32_t zbuff_len;
+    /* end the current frame with the next packet */
+    bool end_frame;
 };
 
 /* Multifd zstd compression */
@@ -88,6 +90,24 @@ static void multifd_zstd_send_cleanup(MultiFDSendParams *p, Error **errp)
     p->iov = NULL;
 }
 
+static void multifd_zstd_send_set_level(MultiFDSendParams *p, int level)
+{
+    struct zstd_data *z = p->compress_data;
+    size_t ret;
+
+    ret = ZSTD_CCtx_setParameter(z->zcs, ZSTD_c_compressionLevel, level);
+    if (ZSTD_isError(ret)) {
+        /* Keep going with the previous level */
+        return;
+    }
+
+    /*
+     * The new level only applies from the next frame on.  The
+     * destination decodes consecutive frames transparently.
+     */
+    z->end_frame = true;
+}
+
 static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
 {
     MultiFDPages_t *pages = &p->data->u.ram;
@@ -107,7 +127,7 @@ static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
         ZSTD_EndDirective flush = ZSTD_e_continue;
 
         if (i == pages->normal_num - 1) {
-            flush = ZSTD_e_flush;
+            flush = z->end_frame ? ZSTD_e_end : ZSTD_e_flush;
         }
         z->in.src = pages->block->host + pages->offset[i];
         z->in.size = multifd_ram_page_size();
@@ -136,6 +156,7 @@ static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
             return -1;
         }
     }
+    z->end_frame = false;
     p->iov[p->iovs_num].iov_base = z->zbuff;
     p->iov[p->iovs_num].iov_len = z->out.pos;
     p->iovs_num++;
@@ -269,6 +290,7 @@ static const MultiFDMethods multifd_zstd_ops = {
     .send_setup = multifd_zstd_send_setup,
     .send_cleanup = multifd_zstd_send_cleanup,
     .send_prepare = multifd_zstd_send_prepare,
+    .send_set_level = multifd_zstd_send_set_level,
     .recv_setup = multifd_zstd_recv_setup,
     .recv_cleanup = multifd_zstd_recv_cleanup,
     .recv = multifd_zstd_recv
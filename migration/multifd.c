@@ -71,6 +71,24 @@ struct {
     QemuSemaphore channels_created;
     /* send channels ready */
     QemuSemaphore channels_ready;
+    /*
+     * Number of channels multifd_send() may use, 0 for all of them.
+     * Set by the auto-tune logic.
+     */
+    int channels_limit;
+    /* Limit currently applied by multifd_send() */
+    int channels_used;
+    /*
+     * channels_ready posts consumed by multifd_send() for idle channels
+     * above the limit.  Given back when the limit changes.
+     */
+    int channels_parked;
+    /* compression level requested for all channels, -1 for the default */
+    int compress_level;
+    /* where the time goes, used by the auto-tune logic */
+    Stat64 wait_ns;
+    Stat64 prepare_ns;
+    Stat64 write_ns;
     /*
      * Have we already run terminate threads.  There is a race when it
      * happens that we got one error while we are exiting.
@@ -336,6 +354,26 @@ static void multifd_send_kick_main(MultiFDSendParams *p)
     qemu_sem_post(&multifd_send_state->channels_ready);
 }
 
+/*
+ * Returns the number of channels multifd_send() may use.  Must be called
+ * with multifd_send_mutex held.
+ */
+static int multifd_send_active_channels(void)
+{
+    int limit = qatomic_read(&multifd_send_state->channels_limit);
+
+    if (limit != multifd_send_state->channels_used) {
+        /* Give back the idle channels parked under the previous limit */
+        for (; multifd_send_state->channels_parked;
+             multifd_send_state->channels_parked--) {
+            qemu_sem_post(&multifd_send_state->channels_ready);
+        }
+        multifd_send_state->channels_used = limit;
+    }
+
+    return limit ? limit : migrate_multifd_channels();
+}
+
 /*
  * multifd_send() works by exchanging the MultiFDSendData object
  * provided by the caller with an unused MultiFDSendData object from
@@ -352,10 +390,11 @@ static void multifd_send_kick_main(MultiFDSendParams *p)
  */
 bool multifd_send(MultiFDSendData **send_data)
 {
-    int i;
+    int i, channels;
     static int next_channel;
     MultiFDSendParams *p = NULL; /* make happy gcc */
     MultiFDSendData *tmp;
+    int64_t wait_start;
 
     if (multifd_send_should_exit()) {
         return false;
@@ -363,16 +402,20 @@ bool multifd_send(MultiFDSendData **send_data)
 
     QEMU_LOCK_GUARD(&multifd_send_state->multifd_send_mutex);
 
-    /* We wait here, until at least one channel is ready */
-    qemu_sem_wait(&multifd_send_state->channels_ready);
+    channels = multifd_send_active_channels();
+    wait_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     /*
      * next_channel can remain from a previous migration that was
      * using more channels, so ensure it doesn't overflow if the
      * limit is lower now.
      */
-    next_channel %= migrate_multifd_channels();
-    for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
+    next_channel %= channels;
+
+    /* We wait here, until at least one channel is ready */
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+
+    for (i = next_channel;; i = (i + 1) % channels) {
         if (multifd_send_should_exit()) {
             return false;
         }
@@ -382,11 +425,23 @@ bool multifd_send(MultiFDSendData **send_data)
          * sender thread can clear it.
          */
         if (qatomic_read(&p->pending_job) == false) {
-            next_channel = (i + 1) % migrate_multifd_channels();
+            next_channel = (i + 1) % channels;
             break;
         }
+        if ((i + 1) % channels == next_channel &&
+            channels < migrate_multifd_channels()) {
+            /*
+             * Only channels above the limit are idle.  Keep their post
+             * aside rather than spin until an active channel is done.
+             */
+            multifd_send_state->channels_parked++;
+            qemu_sem_wait(&multifd_send_state->channels_ready);
+        }
     }
 
+    stat64_add(&multifd_send_state->wait_ns,
+               qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - wait_start);
+
     /*
      * Make sure we read p->pending_job before all the rest.  Pairs with
      * qatomic_store_release() in multifd_send_thread().
@@ -413,6 +468,41 @@ bool multifd_send(MultiFDSendData **send_data)
     return true;
 }
 
+/* Returns false if multifd isn't set up */
+bool multifd_send_get_times(MultiFDSendTimes *times)
+{
+    if (!multifd_send_state) {
+        memset(times, 0, sizeof(*times));
+        return false;
+    }
+
+    times->wait_ns = stat64_get(&multifd_send_state->wait_ns);
+    times->prepare_ns = stat64_get(&multifd_send_state->prepare_ns);
+    times->write_ns = stat64_get(&multifd_send_state->write_ns);
+    return true;
+}
+
+/* Restrict multifd_send() to the first @channels channels */
+void multifd_send_set_active_channels(int channels)
+{
+    if (!multifd_send_state) {
+        return;
+    }
+
+    qatomic_set(&multifd_send_state->channels_limit,
+                channels < migrate_multifd_channels() ? channels : 0);
+}
+
+/* Ask all channels to switch to compression level @level */
+void multifd_send_set_compress_level(int level)
+{
+    if (!multifd_send_state) {
+        return;
+    }
+
+    qatomic_set(&multifd_send_state->compress_level, level);
+}
+
 /* Multifd send side hit an error; remember it and prepare to quit */
 static void multifd_send_set_error(Error *err)
 {
@@ -519,6 +609,7 @@ static bool multifd_send_cleanup_channel(MultiFDSendParams *p, Error **errp)
     g_clear_pointer(&p->packet_device_state, g_free);
     g_free(p->packet);
     p->packet = NULL;
+    multifd_dedup_send_cleanup(p);
     multifd_send_state->ops->send_cleanup(p, errp);
     assert(!p->iov);
 
@@ -652,9 +743,29 @@ int multifd_send_sync_main(MultiFDSyncReq req)
     }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 
+    multifd_dedup_send_sync_done();
+
     return 0;
 }
 
+/*
+ * Apply the compression level requested by the auto-tune logic.  Only
+ * called from the channel thread, which owns the compression state.
+ */
+static void multifd_send_update_level(MultiFDSendParams *p)
+{
+    int level = qatomic_read(&multifd_send_state->compress_level);
+
+    if (level < 0 || level == p->compress_level ||
+        !multifd_send_state->ops->send_set_level) {
+        return;
+    }
+
+    multifd_send_state->ops->send_set_level(p, level);
+    p->compress_level = level;
+    trace_multifd_send_set_level(p->id, level);
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -691,23 +802,31 @@ static void *multifd_send_thread(void *opaque)
             bool is_device_state = multifd_payload_device_state(p->data);
             size_t total_size;
             int write_flags_masked = 0;
+            int64_t prepare_start, write_start;
 
             p->flags = 0;
             p->iovs_num = 0;
             assert(!multifd_payload_empty(p->data));
 
+            prepare_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
             if (is_device_state) {
                 multifd_device_state_send_prepare(p);
 
                 /* Device state packets cannot be sent via zerocopy */
                 write_flags_masked |= QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
             } else {
+                multifd_send_update_level(p);
                 ret = multifd_send_state->ops->send_prepare(p, &local_err);
                 if (ret != 0) {
                     break;
                 }
             }
 
+            write_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            stat64_add(&multifd_send_state->prepare_ns,
+                       write_start - prepare_start);
+
             /*
              * The packet header in the zerocopy RAM case is accounted for
              * in multifd_nocomp_send_prepare() - where it is actually
@@ -731,7 +850,10 @@ static void *multifd_send_thread(void *opaque)
                 break;
             }
 
+            stat64_add(&multifd_send_state->write_ns,
+                       qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - write_start);
             stat64_add(&mig_stats.multifd_bytes, total_size);
+            socket_link_account(p->link, total_size);
 
             p->next_packet_size = 0;
             multifd_send_data_clear(p->data);
@@ -752,6 +874,9 @@ static void *multifd_send_thread(void *opaque)
              */
             assert(req != MULTIFD_SYNC_NONE);
 
+            /* Pages may be sent by any channel after the sync */
+            multifd_dedup_send_reset(p);
+
             /* Only push the SYNC message if it involves a remote sync */
             if (req == MULTIFD_SYNC_ALL) {
                 p->flags = MULTIFD_FLAG_SYNC;
@@ -763,6 +888,7 @@ static void *multifd_send_thread(void *opaque)
                 }
                 /* p->next_packet_size will always be zero for a SYNC packet */
                 stat64_add(&mig_stats.multifd_bytes, p->packet_len);
+                socket_link_account(p->link, p->packet_len);
             }
 
             qatomic_set(&p->pending_sync, MULTIFD_SYNC_NONE);
@@ -910,11 +1036,13 @@ out:
 
 static bool multifd_new_send_channel_create(gpointer opaque, Error **errp)
 {
+    MultiFDSendParams *p = opaque;
+
     if (!multifd_use_packets()) {
         return file_send_channel_create(opaque, errp);
     }
 
-    socket_send_channel_create(multifd_new_send_channel_async, opaque);
+    socket_send_channel_create(multifd_new_send_channel_async, p, &p->link);
     return true;
 }
 
@@ -922,7 +1050,6 @@ bool multifd_send_setup(void)
 {
     MigrationState *s = migrate_get_current();
     int thread_count, ret = 0;
-    uint32_t page_count = multifd_ram_page_count();
     bool use_packets = multifd_use_packets();
     uint8_t i;
 
@@ -937,6 +1064,7 @@ bool multifd_send_setup(void)
     qemu_sem_init(&multifd_send_state->channels_created, 0);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
     qatomic_set(&multifd_send_state->exiting, 0);
+    multifd_send_state->compress_level = -1;
     multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
 
     for (i = 0; i < thread_count; i++) {
@@ -947,10 +1075,11 @@ bool multifd_send_setup(void)
         qemu_sem_init(&p->sem_sync, 0);
         p->id = i;
         p->data = multifd_send_data_alloc();
+        p->compress_level = -1;
 
         if (use_packets) {
             p->packet_len = sizeof(MultiFDPacket_t)
-                          + sizeof(uint64_t) * page_count;
+                          + sizeof(uint64_t) * multifd_ram_packet_offsets();
             p->packet = g_malloc0(p->packet_len);
             p->packet_device_state = g_malloc0(sizeof(*p->packet_device_state));
             p->packet_device_state->hdr.magic = cpu_to_be32(MULTIFD_MAGIC);
@@ -958,6 +1087,7 @@ bool multifd_send_setup(void)
         }
         p->name = g_strdup_printf(MIGRATION_THREAD_SRC_MULTIFD, i);
         p->write_flags = 0;
+        multifd_dedup_send_setup(p);
 
         if (!multifd_new_send_channel_create(p, &local_err)) {
             migrate_set_error(s, local_err);
@@ -1136,6 +1266,8 @@ static void multifd_recv_cleanup_channel(MultiFDRecvParams *p)
     p->normal = NULL;
     g_free(p->zero);
     p->zero = NULL;
+    g_clear_pointer(&p->dup, g_free);
+    g_clear_pointer(&p->dup_ref, g_free);
     multifd_recv_state->ops->recv_cleanup(p);
 }
 
@@ -1353,7 +1485,7 @@ static void *multifd_recv_thread(void *opaque)
                  * because older QEMUs (<9.0) still send data along with
                  * the SYNC packet.
                  */
-                has_data = p->normal_num || p->zero_num;
+                has_data = p->normal_num || p->zero_num || p->dup_num;
             }
 
             qemu_mutex_unlock(&p->mutex);
@@ -1480,13 +1612,17 @@ int multifd_recv_setup(Error **errp)
 
         if (use_packets) {
             p->packet_len = sizeof(MultiFDPacket_t)
-                + sizeof(uint64_t) * page_count;
+                + sizeof(uint64_t) * multifd_ram_packet_offsets();
             p->packet = g_malloc0(p->packet_len);
             p->packet_dev_state = g_malloc0(sizeof(*p->packet_dev_state));
         }
         p->name = g_strdup_printf(MIGRATION_THREAD_DST_MULTIFD, i);
         p->normal = g_new0(ram_addr_t, page_count);
         p->zero = g_new0(ram_addr_t, page_count);
+        if (multifd_dedup_enabled()) {
+            p->dup = g_new0(ram_addr_t, page_count);
+            p->dup_ref = g_new0(ram_addr_t, page_count);
+        }
     }
 
     for (i = 0; i < thread_count; i++) {
@@ -15,9 +15,11 @@
 
 #include "exec/target_page.h"
 #include "ram.h"
+#include "socket.h"
 
 typedef struct MultiFDRecvData MultiFDRecvData;
 typedef struct MultiFDSendData MultiFDSendData;
+typedef struct MultiFDDedupTable MultiFDDedupTable;
 
 typedef enum {
     /* No sync request */
@@ -49,6 +51,19 @@ bool multifd_queue_page(RAMBlock *block, ram_addr_t offset);
 bool multifd_recv(void);
 MultiFDRecvData *multifd_get_recv_data(void);
 
+typedef struct {
+    /* time the migration thread waited for a free channel */
+    uint64_t wait_ns;
+    /* time the channels spent preparing (e.g. compressing) packets */
+    uint64_t prepare_ns;
+    /* time the channels spent writing packets to the wire */
+    uint64_t write_ns;
+} MultiFDSendTimes;
+
+bool multifd_send_get_times(MultiFDSendTimes *times);
+void multifd_send_set_active_channels(int channels);
+void multifd_send_set_compress_level(int level);
+
 /* Multiple fd's */
 
 #define MULTIFD_MAGIC 0x11223344U
@@ -94,13 +109,17 @@ typedef struct {
     uint64_t packet_num;
     /* zero pages */
     uint32_t zero_pages;
-    uint32_t unused32[1];    /* Reserved for future use */
+    /* duplicate pages, only used with page-dedup */
+    uint32_t dup_pages;
     uint64_t unused64[3];    /* Reserved for future use */
     char ramblock[256];
     /*
      * This array contains the pointers to:
      *  - normal pages (initial normal_pages entries)
      *  - zero pages (following zero_pages entries)
+     *  - duplicate pages (following dup_pages entries)
+     *  - offset of the page each duplicate page is a copy of
+     *    (following dup_pages entries)
      */
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
@@ -120,6 +139,8 @@ typedef struct {
     uint32_t num;
     /* number of normal pages */
     uint32_t normal_num;
+    /* number of duplicate pages, following the normal pages */
+    uint32_t dup_num;
     /*
      * Pointer to the ramblock.  NOTE: it's caller's responsibility to make
      * sure the pointer is always valid!
@@ -127,6 +148,12 @@ typedef struct {
     RAMBlock *block;
     /* offset array of each page, managed by multifd */
     ram_addr_t *offset;
+    /*
+     * For a duplicate page at offset[i], dup_ref[i] is the offset of the
+     * page with the same content that was sent before it.  Only
+     * allocated with page-dedup.
+     */
+    ram_addr_t *dup_ref;
 } MultiFDPages_t;
 
 struct MultiFDRecvData {
@@ -193,6 +220,8 @@ typedef struct {
     bool tls_thread_created;
     /* communication channel */
     QIOChannel *c;
+    /* network link the channel is connected through, if any */
+    SocketLink *link;
     /* packet allocated len */
     uint32_t packet_len;
     /* multifd flags for sending ram */
@@ -234,6 +263,10 @@ typedef struct {
     uint32_t iovs_num;
     /* used for compression methods */
     void *compress_data;
+    /* compression level set through send_set_level, -1 if never set */
+    int compress_level;
+    /* recently sent pages indexed by content, used by page-dedup */
+    MultiFDDedupTable *dedup;
 }  MultiFDSendParams;
 
 typedef struct {
@@ -291,6 +324,12 @@ typedef struct {
     ram_addr_t *zero;
     /* num of zero pages */
     uint32_t zero_num;
+    /* Pages that are a copy of another page, used by page-dedup */
+    ram_addr_t *dup;
+    /* Page each duplicate page is copied from */
+    ram_addr_t *dup_ref;
+    /* num of duplicate pages */
+    uint32_t dup_num;
     /* used for de-compression methods */
     void *compress_data;
     /* Flags for the QIOChannel */
@@ -342,6 +381,16 @@ typedef struct {
      */
     int (*send_prepare)(MultiFDSendParams *p, Error **errp);
 
+    /*
+     * Change the compression level of a channel. Called by the channel
+     * thread between two send_prepare. May be empty if the method has
+     * no tunable level.
+     *
+     * The receiving side must be able to decompress the following
+     * packets without being told about the change.
+     */
+    void (*send_set_level)(MultiFDSendParams *p, int level);
+
     /*
      * The recv_setup, recv_cleanup, recv are only called on the QEMU
      * instance at the migration destination.
@@ -382,6 +431,18 @@ bool multifd_send_prepare_common(MultiFDSendParams *p);
 void multifd_send_zero_page_detect(MultiFDSendParams *p);
 void multifd_recv_zero_page_process(MultiFDRecvParams *p);
 
+bool multifd_dedup_enabled(void);
+void multifd_dedup_save_setup(void);
+void multifd_dedup_save_cleanup(void);
+void multifd_dedup_send_setup(MultiFDSendParams *p);
+void multifd_dedup_send_cleanup(MultiFDSendParams *p);
+void multifd_dedup_send_reset(MultiFDSendParams *p);
+void multifd_send_dedup_detect(MultiFDSendParams *p);
+void multifd_dedup_send_sync_done(void);
+bool multifd_dedup_sync_needed(void);
+uint64_t multifd_dedup_bitmap_sync(void);
+void multifd_recv_dedup_process(MultiFDRecvParams *p);
+
 void multifd_channel_connect(MultiFDSendParams *p, QIOChannel *ioc);
 bool multifd_send(MultiFDSendData **send_data);
 MultiFDSendData *multifd_send_data_alloc(void);
@@ -398,6 +459,15 @@ static inline uint32_t multifd_ram_page_count(void)
     return MULTIFD_PACKET_SIZE / qemu_target_page_size();
 }
 
+/*
+ * Number of offset[] entries in a RAM packet: every duplicate page takes
+ * two entries, its own offset and the offset of the page it copies.
+ */
+static inline uint32_t multifd_ram_packet_offsets(void)
+{
+    return multifd_ram_page_count() * (multifd_dedup_enabled() ? 2 : 1);
+}
+
 void multifd_ram_save_setup(void);
 void multifd_ram_save_cleanup(void);
 int multifd_ram_flush_and_sync(QEMUFile *f);
@@ -203,6 +203,8 @@ const Property migration_properties[] = {
                         MIGRATION_CAPABILITY_SWITCHOVER_ACK),
     DEFINE_PROP_MIG_CAP("x-dirty-limit", MIGRATION_CAPABILITY_DIRTY_LIMIT),
     DEFINE_PROP_MIG_CAP("mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("x-page-dedup", MIGRATION_CAPABILITY_PAGE_DEDUP),
+    DEFINE_PROP_MIG_CAP("x-auto-tune", MIGRATION_CAPABILITY_AUTO_TUNE),
 };
 const size_t migration_properties_count = ARRAY_SIZE(migration_properties);
 
@@ -213,6 +215,13 @@ bool migrate_auto_converge(void)
     return s->capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
 }
 
+bool migrate_auto_tune(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_AUTO_TUNE];
+}
+
 bool migrate_send_switchover_start(void)
 {
     MigrationState *s = migrate_get_current();
@@ -283,6 +292,13 @@ bool migrate_multifd(void)
     return s->capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_page_dedup(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_PAGE_DEDUP];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s = migrate_get_current();
@@ -626,6 +642,38 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
+    if (new_caps[MIGRATION_CAPABILITY_PAGE_DEDUP]) {
+        if (!new_caps[MIGRATION_CAPABILITY_MULTIFD] ||
+            migrate_multifd_compression()) {
+            error_setg(errp, "Page dedup is only available for "
+                       "non-compressed multifd migration");
+            return false;
+        }
+
+        if (new_caps[MIGRATION_CAPABILITY_MAPPED_RAM] ||
+            new_caps[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Page dedup is incompatible with mapped-ram "
+                       "and postcopy");
+            return false;
+        }
+
+        /*
+         * Duplicates may only be sent again once the channels are synced
+         * with the destination, which needs RAM_SAVE_FLAG_MULTIFD_FLUSH.
+         */
+        if (migrate_multifd_flush_after_each_section()) {
+            error_setg(errp, "Page dedup is not available with "
+                       "multifd-flush-after-each-section, as used by "
+                       "machine types 8.0 and older");
+            return false;
+        }
+
+        if (!migrate_page_dedup() && migrate_incoming_started()) {
+            error_setg(errp, "Page dedup must be set before incoming starts");
+            return false;
+        }
+    }
+
     /*
      * On destination side, check the cases that capability is being set
      * after incoming thread has started.
@@ -1151,6 +1199,13 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
     }
 #endif
 
+    if (migrate_page_dedup() &&
+        params->has_multifd_compression && params->multifd_compression) {
+        error_setg(errp,
+                   "Page dedup only available for non-compressed multifd migration");
+        return false;
+    }
+
     if (migrate_mapped_ram() &&
         (migrate_multifd_compression() || migrate_tls())) {
         error_setg(errp,
@@ -26,6 +26,7 @@ extern const size_t migration_properties_count;
 /* capabilities */
 
 bool migrate_auto_converge(void);
+bool migrate_auto_tune(void);
 bool migrate_colo(void);
 bool migrate_dirty_bitmaps(void);
 bool migrate_events(void);
@@ -33,6 +34,7 @@ bool migrate_mapped_ram(void);
 bool migrate_ignore_shared(void);
 bool migrate_late_block_activate(void);
 bool migrate_multifd(void);
+bool migrate_page_dedup(void);
 bool migrate_pause_before_switchover(void);
 bool migrate_postcopy_blocktime(void);
 bool migrate_postcopy_preempt(void);
@@ -0,0 +1,216 @@
+/*
+ * Migration stream profiler
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/lockable.h"
+#include "qapi/clone-visitor.h"
+#include "qapi/qapi-commands-migration.h"
+#include "qapi/qapi-visit-migration.h"
+#include "migration-stats.h"
+#include "profile.h"
+
+/*
+ * Bytes and time are accumulated per device state section and per RAM
+ * block, separately for each round: the setup phase, each iteration
+ * (delimited by dirty bitmap syncs) and the stop-copy phase.
+ *
+ * Entries are looked up by the address of the idstr of the SaveStateEntry
+ * or RAMBlock, which stays valid while the migration is running.
+ */
+#define MIGRATION_PROFILE_ROUNDS_MAX 64
+
+typedef struct {
+    MigrationProfilePhase phase;
+    uint64_t round;
+    /* idstr -> MigrationProfileEntry, in insertion order in the lists */
+    GHashTable *section_index;
+    GPtrArray *sections;
+    GHashTable *ramblock_index;
+    GPtrArray *ramblocks;
+} MigrationProfileRoundState;
+
+typedef struct {
+    QemuMutex lock;
+    /* MigrationProfileRoundState, oldest first */
+    GQueue rounds;
+    GHashTable *load_index;
+    GPtrArray *load;
+} MigrationProfileState;
+
+static MigrationProfileState profile;
+
+static void __attribute__((constructor)) migration_profile_init(void)
+{
+    qemu_mutex_init(&profile.lock);
+    g_queue_init(&profile.rounds);
+    profile.load_index = g_hash_table_new(NULL, NULL);
+    profile.load = g_ptr_array_new_with_free_func(
+        (GDestroyNotify)qapi_free_MigrationProfileEntry);
+}
+
+static void migration_profile_round_free(MigrationProfileRoundState *r)
+{
+    g_hash_table_destroy(r->section_index);
+    g_ptr_array_free(r->sections, true);
+    g_hash_table_destroy(r->ramblock_index);
+    g_ptr_array_free(r->ramblocks, true);
+    g_free(r);
+}
+
+static MigrationProfileRoundState *
+migration_profile_round(MigrationProfilePhase phase)
+{
+    MigrationProfileRoundState *r = g_queue_peek_tail(&profile.rounds);
+    uint64_t round = stat64_get(&mig_stats.dirty_sync_count);
+
+    /* Setup and stop-copy may sync the dirty bitmap, they're one round */
+    if (r && r->phase == phase &&
+        (phase != MIGRATION_PROFILE_PHASE_ITERATE || r->round == round)) {
+        return r;
+    }
+
+    r = g_new0(MigrationProfileRoundState, 1);
+    r->phase = phase;
+    r->round = round;
+    r->section_index = g_hash_table_new(NULL, NULL);
+    r->sections = g_ptr_array_new_with_free_func(
+        (GDestroyNotify)qapi_free_MigrationProfileEntry);
+    r->ramblock_index = g_hash_table_new(NULL, NULL);
+    r->ramblocks = g_ptr_array_new_with_free_func(
+        (GDestroyNotify)qapi_free_MigrationProfileEntry);
+    g_queue_push_tail(&profile.rounds, r);
+
+    if (g_queue_get_length(&profile.rounds) > MIGRATION_PROFILE_ROUNDS_MAX) {
+        migration_profile_round_free(g_queue_pop_head(&profile.rounds));
+    }
+
+    return r;
+}
+
+static MigrationProfileEntry *
+migration_profile_entry(GHashTable *index, GPtrArray *entries,
+                        const char *idstr)
+{
+    MigrationProfileEntry *e = g_hash_table_lookup(index, idstr);
+
+    if (!e) {
+        e = g_new0(MigrationProfileEntry, 1);
+        e->name = g_strdup(idstr);
+        g_hash_table_insert(index, (gpointer)idstr, e);
+        g_ptr_array_add(entries, e);
+    }
+
+    return e;
+}
+
+/*
+ * Called when an outgoing migration, a snapshot or a savevm starts.
+ */
+void migration_profile_save_reset(void)
+{
+    MigrationProfileRoundState *r;
+
+    QEMU_LOCK_GUARD(&profile.lock);
+
+    while ((r = g_queue_pop_head(&profile.rounds))) {
+        migration_profile_round_free(r);
+    }
+}
+
+void migration_profile_save_section(MigrationProfilePhase phase,
+                                    const char *idstr, uint32_t instance_id,
+                                    uint64_t bytes, int64_t time_us)
+{
+    MigrationProfileRoundState *r;
+    MigrationProfileEntry *e;
+
+    QEMU_LOCK_GUARD(&profile.lock);
+
+    r = migration_profile_round(phase);
+    e = migration_profile_entry(r->section_index, r->sections, idstr);
+    e->has_instance_id = true;
+    e->instance_id = instance_id;
+    e->bytes += bytes;
+    e->time += time_us;
+}
+
+void migration_profile_save_ramblock(MigrationProfilePhase phase,
+                                     const char *idstr, uint64_t bytes,
+                                     int64_t time_us, uint64_t pages)
+{
+    MigrationProfileRoundState *r;
+    MigrationProfileEntry *e;
+
+    QEMU_LOCK_GUARD(&profile.lock);
+
+    r = migration_profile_round(phase);
+    e = migration_profile_entry(r->ramblock_index, r->ramblocks, idstr);
+    e->bytes += bytes;
+    e->time += time_us;
+    e->has_pages = true;
+    e->pages += pages;
+}
+
+/*
+ * Called when an incoming migration or a loadvm starts.
+ */
+void migration_profile_load_reset(void)
+{
+    QEMU_LOCK_GUARD(&profile.lock);
+
+    g_hash_table_remove_all(profile.load_index);
+    g_ptr_array_set_size(profile.load, 0);
+}
+
+void migration_profile_load_section(const char *idstr, uint32_t instance_id,
+                                    uint64_t bytes, int64_t time_us)
+{
+    MigrationProfileEntry *e;
+
+    QEMU_LOCK_GUARD(&profile.lock);
+
+    e = migration_profile_entry(profile.load_index, profile.load, idstr);
+    e->has_instance_id = true;
+    e->instance_id = instance_id;
+    e->bytes += bytes;
+    e->time += time_us;
+}
+
+static MigrationProfileEntryList *
+migration_profile_entry_list(GPtrArray *entries)
+{
+    MigrationProfileEntryList *head = NULL, **tail = &head;
+
+    for (guint i = 0; i < entries->len; i++) {
+        QAPI_LIST_APPEND(tail, QAPI_CLONE(MigrationProfileEntry,
+                                          g_ptr_array_index(entries, i)));
+    }
+
+    return head;
+}
+
+MigrationProfile *qmp_query_migrate_profile(Error **errp)
+{
+    MigrationProfile *info = g_new0(MigrationProfile, 1);
+    MigrationProfileRoundList **tail = &info->rounds;
+
+    QEMU_LOCK_GUARD(&profile.lock);
+
+    for (GList *l = profile.rounds.head; l; l = l->next) {
+        MigrationProfileRoundState *r = l->data;
+        MigrationProfileRound *round = g_new0(MigrationProfileRound, 1);
+
+        round->phase = r->phase;
+        round->round = r->round;
+        round->sections = migration_profile_entry_list(r->sections);
+        round->ramblocks = migration_profile_entry_list(r->ramblocks);
+        QAPI_LIST_APPEND(tail, round);
+    }
+    info->load = migration_profile_entry_list(profile.load);
+
+    return info;
+}
@@ -0,0 +1,24 @@
+/*
+ * Migration stream profiler
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_PROFILE_H
+#define QEMU_MIGRATION_PROFILE_H
+
+#include "qapi/qapi-types-migration.h"
+
+void migration_profile_save_reset(void);
+void migration_profile_save_section(MigrationProfilePhase phase,
+                                    const char *idstr, uint32_t instance_id,
+                                    uint64_t bytes, int64_t time_us);
+void migration_profile_save_ramblock(MigrationProfilePhase phase,
+                                     const char *idstr, uint64_t bytes,
+                                     int64_t time_us, uint64_t pages);
+void migration_profile_load_reset(void);
+void migration_profile_load_section(const char *idstr, uint32_t instance_id,
+                                    uint64_t bytes, int64_t time_us);
+
+#endif
@@ -49,6 +49,8 @@ struct QEMUFile {
     int buf_index;
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
+    /* bytes read into buf since the file was opened */
+    uint64_t total_read;
 
     DECLARE_BITMAP(may_free, MAX_IOV_SIZE);
     struct iovec iov[MAX_IOV_SIZE];
@@ -355,6 +357,7 @@ static ssize_t coroutine_mixed_fn qemu_fill_buffer(QEMUFile *f)
 
     if (len > 0) {
         f->buf_size += len;
+        f->total_read += len;
     } else if (len == 0) {
         qemu_file_set_error_obj(f, -EIO, local_error);
     } else {
@@ -805,6 +808,13 @@ uint64_t qemu_file_transferred(QEMUFile *f)
     return ret;
 }
 
+uint64_t qemu_file_consumed(QEMUFile *f)
+{
+    g_assert(!qemu_file_is_writable(f));
+
+    return f->total_read - (f->buf_size - f->buf_index);
+}
+
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
     qemu_put_byte(f, v >> 8);
@@ -45,6 +45,16 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC(QEMUFile, qemu_fclose)
  */
 uint64_t qemu_file_transferred(QEMUFile *f);
 
+/*
+ * qemu_file_consumed:
+ *
+ * Report the number of bytes read from a file opened for reading.
+ * Data that has been buffered but not consumed yet is not included.
+ *
+ * Returns: the total bytes consumed
+ */
+uint64_t qemu_file_consumed(QEMUFile *f);
+
 /*
  * put_buffer without copying the buffer.
  * The buffer should be available till it is sent asynchronously.
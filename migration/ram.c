@@ -56,6 +56,8 @@
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "autotune.h"
+#include "profile.h"
 #include "system/runstate.h"
 #include "rdma.h"
 #include "options.h"
@@ -65,6 +67,8 @@
 #include "hw/boards.h" /* for machine_dump_guest_core() */
 
 #if defined(__linux__)
+#include <poll.h>
+#include "qemu/event_notifier.h"
 #include "qemu/userfaultfd.h"
 #endif /* defined(__linux__) */
 
@@ -432,6 +436,13 @@ struct RAMState {
      * Protected by @bitmap_mutex.
      */
     PageLocationHint page_hint;
+
+    /* RAM block being accounted to the migration profile */
+    RAMBlock *profile_block;
+    /* time, transferred bytes and pages since accounting started */
+    int64_t profile_start;
+    uint64_t profile_bytes;
+    uint64_t profile_pages;
 };
 typedef struct RAMState RAMState;
 
@@ -942,6 +953,16 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
 
     rs->migration_dirty_pages += new_dirty_pages;
     rs->num_dirty_pages_period += new_dirty_pages;
+
+    /*
+     * The guest may have reused reported pages since, don't trust the
+     * report for anything that is dirty.  This can also forget pages
+     * reported after they were dirtied, they are then sent normally.
+     */
+    if (rb->free_bmap) {
+        bitmap_andnot(rb->free_bmap, rb->free_bmap, rb->bmap,
+                      rb->used_length >> TARGET_PAGE_BITS);
+    }
 }
 
 /**
@@ -1035,7 +1056,7 @@ static void migration_dirty_limit_guest(void)
     trace_migration_dirty_limit_guest(quota_dirtyrate);
 }
 
-static void migration_trigger_throttle(RAMState *rs)
+static void migration_trigger_throttle(RAMState *rs, int64_t end_time)
 {
     uint64_t threshold = migrate_throttle_trigger_threshold();
     uint64_t bytes_xfer_period =
@@ -1043,6 +1064,12 @@ static void migration_trigger_throttle(RAMState *rs)
     uint64_t bytes_dirty_period = rs->num_dirty_pages_period * TARGET_PAGE_SIZE;
     uint64_t bytes_dirty_threshold = bytes_xfer_period * threshold / 100;
 
+    if (migrate_auto_tune()) {
+        migration_autotune_throttle(bytes_xfer_period, bytes_dirty_period,
+                                    end_time - rs->time_last_bitmap_sync);
+        return;
+    }
+
     /*
      * The following detection logic can be refined later. For now:
      * Check to see if the ratio between dirtied bytes and the approx.
@@ -1082,6 +1109,8 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
             RAMBLOCK_FOREACH_NOT_IGNORED(block) {
                 ramblock_sync_dirty_bitmap(rs, block);
             }
+            /* Resend duplicates whose source page changed under us */
+            rs->migration_dirty_pages += multifd_dedup_bitmap_sync();
             stat64_set(&mig_stats.dirty_bytes_last_sync, ram_bytes_remaining());
         }
     }
@@ -1093,7 +1122,7 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > rs->time_last_bitmap_sync + 1000) {
-        migration_trigger_throttle(rs);
+        migration_trigger_throttle(rs, end_time);
 
         migration_update_rates(rs, end_time);
 
@@ -1140,6 +1169,13 @@ void ram_release_page(const char *rbname, uint64_t offset)
     ram_discard_range(rbname, offset, TARGET_PAGE_SIZE);
 }
 
+static bool ram_page_reported_free(RAMBlock *block, ram_addr_t offset)
+{
+    unsigned long *free_bmap = qatomic_read(&block->free_bmap);
+
+    return free_bmap && test_bit(offset >> TARGET_PAGE_BITS, free_bmap);
+}
+
 /**
  * save_zero_page: send the zero page to the stream
  *
@@ -1156,11 +1192,11 @@ static int save_zero_page(RAMState *rs, PageSearchStatus *pss,
     QEMUFile *file = pss->pss_channel;
     int len = 0;
 
-    if (migrate_zero_page_detection() == ZERO_PAGE_DETECTION_NONE) {
-        return 0;
-    }
-
-    if (!buffer_is_zero(p, TARGET_PAGE_SIZE)) {
+    if (ram_page_reported_free(pss->block, offset)) {
+        /* Discarded when reported, no need to look at it */
+        stat64_add(&mig_stats.free_page_report_bytes, TARGET_PAGE_SIZE);
+    } else if (migrate_zero_page_detection() == ZERO_PAGE_DETECTION_NONE ||
+               !buffer_is_zero(p, TARGET_PAGE_SIZE)) {
         return 0;
     }
 
@@ -1389,6 +1425,450 @@ static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
 }
 
 #if defined(__linux__)
+/*
+ * Write faults on protected pages are handled by a pool of threads, so
+ * that a vCPU doesn't stall until the migration thread gets to the page:
+ * the handler copies the page into a staging slot and lifts the
+ * protection right away, the migration thread writes the copy to the
+ * stream later on.
+ *
+ * Each host page is saved exactly once, either by the migration thread
+ * or from a staged copy, by whoever claims it first in
+ * RAMBlock::wp_unclaimed.
+ *
+ * Memory that may be backed by transparent huge pages is handled a huge
+ * page at a time: a fault claims every unclaimed page around it, so that
+ * lifting the protection doesn't split the huge page.  Host pages that
+ * don't fit in a slot are left to the migration thread.
+ *
+ * A vCPU waits until its fault is handled, so there is one thread per vCPU
+ * up to RAM_WP_MAX_THREADS.  Each of them can stage RAM_WP_SLOTS_PER_THREAD
+ * faults ahead of the migration thread before waiting for it, a slot takes
+ * up to a huge page of memory.
+ */
+#define RAM_WP_MAX_THREADS 8
+#define RAM_WP_SLOTS_PER_THREAD 4
+
+typedef enum {
+    RAM_WP_SLOT_FREE,
+    RAM_WP_SLOT_FILLING,
+    RAM_WP_SLOT_READY,
+} RAMWPSlotState;
+
+typedef struct {
+    RAMWPSlotState state;
+    RAMBlock *block;
+    /* start of the staged range in the block */
+    ram_addr_t offset;
+    /* host pages of the range that were claimed and copied */
+    unsigned long *staged;
+    unsigned long npages;
+    uint8_t *data;
+} RAMWPSlot;
+
+typedef struct RAMWPFault {
+    RAMBlock *block;
+    ram_addr_t offset;
+    QSIMPLEQ_ENTRY(RAMWPFault) next;
+} RAMWPFault;
+
+typedef struct {
+    int uffd_fd;
+    /* size of a slot, the largest range handled by a fault thread */
+    size_t slot_size;
+    uint8_t *staging;
+    EventNotifier quit;
+    QemuThread *threads;
+    unsigned int nr_threads;
+
+    /* Protects the fields below */
+    QemuMutex lock;
+    /* Signalled when a slot is freed or gets ready */
+    QemuCond cond;
+    bool quitting;
+    /* Slots are filled at tail and saved from head, in order */
+    RAMWPSlot *slots;
+    unsigned int nr_slots;
+    unsigned int head;
+    unsigned int tail;
+    /* Faults on host pages larger than a slot */
+    QSIMPLEQ_HEAD(, RAMWPFault) faults;
+} RAMWriteFaults;
+
+static RAMWriteFaults *ram_wp_faults;
+
+/*
+ * ram_wp_claim: claim the host page at @offset for saving
+ *
+ * Returns true if the caller is the one to save the page
+ */
+static bool ram_wp_claim(RAMBlock *block, ram_addr_t offset)
+{
+    if (!block->wp_unclaimed) {
+        return true;
+    }
+
+    return bitmap_test_and_clear_atomic(block->wp_unclaimed,
+                                        offset / block->page_size, 1);
+}
+
+static size_t ram_wp_fault_size(RAMWriteFaults *wp, RAMBlock *block)
+{
+    /*
+     * Don't touch the neighbours on hugetlbfs, where the host page is the
+     * huge page already, nor in blocks where they might be discarded.
+     */
+    if (block->page_size != qemu_real_host_page_size() ||
+        memory_region_has_ram_discard_manager(block->mr)) {
+        return block->page_size;
+    }
+
+    return wp->slot_size;
+}
+
+static RAMWPSlot *ram_wp_slot_get(RAMWriteFaults *wp)
+{
+    RAMWPSlot *slot;
+
+    QEMU_LOCK_GUARD(&wp->lock);
+
+    while (true) {
+        if (wp->quitting) {
+            return NULL;
+        }
+        slot = &wp->slots[wp->tail % wp->nr_slots];
+        if (slot->state == RAM_WP_SLOT_FREE) {
+            break;
+        }
+        /* All slots are in use, wait for the migration thread */
+        qemu_cond_wait(&wp->cond, &wp->lock);
+    }
+
+    slot->state = RAM_WP_SLOT_FILLING;
+    wp->tail++;
+    return slot;
+}
+
+static void ram_wp_slot_put(RAMWriteFaults *wp, RAMWPSlot *slot)
+{
+    QEMU_LOCK_GUARD(&wp->lock);
+
+    slot->state = RAM_WP_SLOT_READY;
+    qemu_cond_broadcast(&wp->cond);
+}
+
+static void ram_wp_fault(RAMWriteFaults *wp, RAMBlock *block,
+                         ram_addr_t offset)
+{
+    size_t page_size = block->page_size;
+    size_t size = ram_wp_fault_size(wp, block);
+    ram_addr_t start, end, addr;
+    unsigned long i, j, count = 0;
+    RAMWPSlot *slot;
+
+    if (size > wp->slot_size) {
+        RAMWPFault *fault = g_new0(RAMWPFault, 1);
+
+        fault->block = block;
+        fault->offset = QEMU_ALIGN_DOWN(offset, page_size);
+        WITH_QEMU_LOCK_GUARD(&wp->lock) {
+            QSIMPLEQ_INSERT_TAIL(&wp->faults, fault, next);
+        }
+        return;
+    }
+
+    slot = ram_wp_slot_get(wp);
+    if (!slot) {
+        return;
+    }
+
+    start = QEMU_ALIGN_DOWN(offset, size);
+    end = MIN(start + size, block->used_length);
+
+    slot->block = block;
+    slot->offset = start;
+    slot->npages = DIV_ROUND_UP(end - start, page_size);
+    bitmap_zero(slot->staged, slot->npages);
+
+    for (addr = start, i = 0; addr < end; addr += page_size, i++) {
+        if (ram_wp_claim(block, addr)) {
+            memcpy(slot->data + addr - start, block->host + addr, page_size);
+            set_bit(i, slot->staged);
+            count++;
+        }
+    }
+
+    /* The copies are safe, let the guest write */
+    for (i = find_first_bit(slot->staged, slot->npages); i < slot->npages;
+         i = find_next_bit(slot->staged, slot->npages, j)) {
+        j = find_next_zero_bit(slot->staged, slot->npages, i);
+        uffd_change_protection(wp->uffd_fd, block->host + start + i * page_size,
+                               (j - i) * page_size, false, false);
+    }
+
+    trace_ram_write_tracking_fault(block->idstr, offset, count);
+
+    ram_wp_slot_put(wp, slot);
+}
+
+static void *ram_wp_fault_thread(void *opaque)
+{
+    RAMWriteFaults *wp = opaque;
+    struct pollfd pfd[2] = {
+        { .fd = wp->uffd_fd, .events = POLLIN },
+        { .fd = event_notifier_get_fd(&wp->quit), .events = POLLIN },
+    };
+
+    rcu_register_thread();
+
+    while (true) {
+        struct uffd_msg msg;
+        RAMBlock *block;
+        ram_addr_t offset;
+        int res;
+
+        if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: poll failed: %s", __func__, strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        res = uffd_read_events(wp->uffd_fd, &msg, 1);
+        if (res < 0) {
+            break;
+        }
+        /* Another thread was faster */
+        if (!res || msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        block = qemu_ram_block_from_host(
+            (void *)(uintptr_t)msg.arg.pagefault.address, false, &offset);
+        assert(block && (block->flags & RAM_UF_WRITEPROTECT) != 0);
+        ram_wp_fault(wp, block, offset);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * ram_wp_save_slot: write the pages staged in @slot to the stream
+ *
+ * Returns the number of pages written
+ */
+static int ram_wp_save_slot(RAMState *rs, PageSearchStatus *pss,
+                            RAMWPSlot *slot)
+{
+    RAMBlock *block = slot->block;
+    unsigned long i;
+    int pages = 0;
+
+    for (i = find_first_bit(slot->staged, slot->npages); i < slot->npages;
+         i = find_next_bit(slot->staged, slot->npages, i + 1)) {
+        ram_addr_t start = slot->offset + i * block->page_size;
+        ram_addr_t offset;
+
+        for (offset = start; offset < start + block->page_size;
+             offset += TARGET_PAGE_SIZE) {
+            if (migration_bitmap_clear_dirty(rs, block,
+                                             offset >> TARGET_PAGE_BITS)) {
+                pages += save_normal_page(pss, block, offset,
+                                          slot->data + offset - slot->offset,
+                                          false);
+            }
+        }
+    }
+
+    return pages;
+}
+
+/*
+ * ram_wp_save_staged: write the pages copied by the fault threads
+ *
+ * With @wait, also wait for the slots being filled, so that every page
+ * claimed by a fault thread so far has been saved on return.
+ *
+ * Returns the number of pages written
+ *
+ * @rs: current RAM state
+ * @wait: wait for the slots being filled
+ */
+static int ram_wp_save_staged(RAMState *rs, bool wait)
+{
+    RAMWriteFaults *wp = ram_wp_faults;
+    PageSearchStatus *pss = &rs->pss[RAM_CHANNEL_PRECOPY];
+    int pages = 0;
+
+    if (!wp) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&wp->lock);
+    while (wp->head != wp->tail) {
+        RAMWPSlot *slot = &wp->slots[wp->head % wp->nr_slots];
+
+        if (slot->state != RAM_WP_SLOT_READY) {
+            if (!wait) {
+                break;
+            }
+            qemu_cond_wait(&wp->cond, &wp->lock);
+            continue;
+        }
+
+        /* Nobody else touches a ready slot */
+        qemu_mutex_unlock(&wp->lock);
+        pages += ram_wp_save_slot(rs, pss, slot);
+        qemu_mutex_lock(&wp->lock);
+
+        slot->state = RAM_WP_SLOT_FREE;
+        wp->head++;
+        qemu_cond_broadcast(&wp->cond);
+    }
+    qemu_mutex_unlock(&wp->lock);
+
+    return pages;
+}
+
+static RAMBlock *ram_wp_fault_pop(RAMWriteFaults *wp, ram_addr_t *offset)
+{
+    RAMWPFault *fault;
+    RAMBlock *block;
+
+    WITH_QEMU_LOCK_GUARD(&wp->lock) {
+        fault = QSIMPLEQ_FIRST(&wp->faults);
+        if (fault) {
+            QSIMPLEQ_REMOVE_HEAD(&wp->faults, next);
+        }
+    }
+
+    if (!fault) {
+        return NULL;
+    }
+
+    block = fault->block;
+    *offset = fault->offset;
+    g_free(fault);
+    return block;
+}
+
+static void ram_wp_faults_start(RAMState *rs)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+    RAMWriteFaults *wp = g_new0(RAMWriteFaults, 1);
+    RAMBlock *block;
+    int i;
+
+    wp->uffd_fd = rs->uffdio_fd;
+    wp->nr_threads = MIN(ms->smp.cpus, RAM_WP_MAX_THREADS);
+    wp->threads = g_new0(QemuThread, wp->nr_threads);
+    wp->nr_slots = wp->nr_threads * RAM_WP_SLOTS_PER_THREAD;
+    wp->slots = g_new0(RAMWPSlot, wp->nr_slots);
+    wp->slot_size = MAX(QEMU_VMALLOC_ALIGN, qemu_real_host_page_size());
+    wp->staging = g_malloc(wp->slot_size * wp->nr_slots);
+    for (i = 0; i < wp->nr_slots; i++) {
+        wp->slots[i].data = wp->staging + i * wp->slot_size;
+        wp->slots[i].staged =
+            bitmap_new(wp->slot_size / qemu_real_host_page_size());
+    }
+    QSIMPLEQ_INIT(&wp->faults);
+    qemu_mutex_init(&wp->lock);
+    qemu_cond_init(&wp->cond);
+    event_notifier_init(&wp->quit, false);
+
+    /* Only the pages that are part of the snapshot can be claimed */
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+        unsigned long host_pages = block->page_size >> TARGET_PAGE_BITS;
+        unsigned long page;
+
+        if ((block->flags & RAM_UF_WRITEPROTECT) == 0) {
+            continue;
+        }
+
+        block->wp_unclaimed = bitmap_new(DIV_ROUND_UP(block->used_length,
+                                                      block->page_size));
+        for (page = find_first_bit(block->bmap, pages); page < pages;
+             page = find_next_bit(block->bmap, pages, page + 1)) {
+            set_bit(page / host_pages, block->wp_unclaimed);
+        }
+    }
+
+    for (i = 0; i < wp->nr_threads; i++) {
+        g_autofree char *name =
+            g_strdup_printf(MIGRATION_THREAD_SNAPSHOT_WP, i);
+
+        qemu_thread_create(&wp->threads[i], name, ram_wp_fault_thread, wp,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    ram_wp_faults = wp;
+}
+
+static void ram_wp_faults_stop(void)
+{
+    RAMWriteFaults *wp = ram_wp_faults;
+    RAMWPFault *fault;
+    RAMBlock *block;
+    int i;
+
+    if (!wp) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&wp->lock) {
+        wp->quitting = true;
+        qemu_cond_broadcast(&wp->cond);
+    }
+    event_notifier_set(&wp->quit);
+    for (i = 0; i < wp->nr_threads; i++) {
+        qemu_thread_join(&wp->threads[i]);
+    }
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        g_clear_pointer(&block->wp_unclaimed, g_free);
+    }
+
+    while ((fault = QSIMPLEQ_FIRST(&wp->faults))) {
+        QSIMPLEQ_REMOVE_HEAD(&wp->faults, next);
+        g_free(fault);
+    }
+    for (i = 0; i < wp->nr_slots; i++) {
+        g_free(wp->slots[i].staged);
+    }
+    g_free(wp->slots);
+    g_free(wp->threads);
+    g_free(wp->staging);
+    event_notifier_cleanup(&wp->quit);
+    qemu_cond_destroy(&wp->cond);
+    qemu_mutex_destroy(&wp->lock);
+    g_clear_pointer(&ram_wp_faults, g_free);
+}
+
+/*
+ * ram_write_tracking_features: UFFD features used for 'write-tracking'
+ *
+ * Write protection of hugetlbfs and shmem backed memory, and of pages
+ * that are not populated yet, is used when the kernel supports it.
+ */
+static uint64_t ram_write_tracking_features(void)
+{
+    uint64_t features = 0;
+
+    if (uffd_query_features(&features)) {
+        features = 0;
+    }
+
+    return UFFD_FEATURE_PAGEFAULT_FLAG_WP |
+           (features & (UFFD_FEATURE_WP_HUGETLBFS_SHMEM |
+                        UFFD_FEATURE_WP_UNPOPULATED));
+}
+
 /**
  * poll_fault_page: try to get next UFFD write fault page and, if pending fault
  *   is found, return RAM block pointer and page offset
@@ -1410,6 +1890,11 @@ static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
         return NULL;
     }
 
+    /* The fault threads only leave us the pages too large for them */
+    if (ram_wp_faults) {
+        return ram_wp_fault_pop(ram_wp_faults, offset);
+    }
+
     res = uffd_read_events(rs->uffdio_fd, &uffd_msg, 1);
     if (res <= 0) {
         return NULL;
@@ -1478,7 +1963,7 @@ bool ram_write_tracking_compatible(void)
     bool ret = false;
 
     /* Open UFFD file descriptor */
-    uffd_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, false);
+    uffd_fd = uffd_create_fd(ram_write_tracking_features(), false);
     if (uffd_fd < 0) {
         return false;
     }
@@ -1582,6 +2067,11 @@ void ram_write_tracking_prepare(void)
 {
     RAMBlock *block;
 
+    /* Unpopulated pages get protected too, nothing to prepare */
+    if (ram_write_tracking_features() & UFFD_FEATURE_WP_UNPOPULATED) {
+        return;
+    }
+
     RCU_READ_LOCK_GUARD();
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
@@ -1647,7 +2137,7 @@ int ram_write_tracking_start(void)
     RAMBlock *block;
 
     /* Open UFFD file descriptor */
-    uffd_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, true);
+    uffd_fd = uffd_create_fd(ram_write_tracking_features(), true);
     if (uffd_fd < 0) {
         return uffd_fd;
     }
@@ -1678,6 +2168,8 @@ int ram_write_tracking_start(void)
                 block->host, block->max_length);
     }
 
+    ram_wp_faults_start(rs);
+
     return 0;
 
 fail:
@@ -1708,6 +2200,8 @@ void ram_write_tracking_stop(void)
 
     RCU_READ_LOCK_GUARD();
 
+    ram_wp_faults_stop();
+
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         if ((block->flags & RAM_UF_WRITEPROTECT) == 0) {
             continue;
@@ -1730,6 +2224,16 @@ void ram_write_tracking_stop(void)
 #else
 /* No target OS support, stubs just fail or ignore */
 
+static bool ram_wp_claim(RAMBlock *block, ram_addr_t offset)
+{
+    return true;
+}
+
+static int ram_wp_save_staged(RAMState *rs, bool wait)
+{
+    return 0;
+}
+
 static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
 {
     (void) rs;
@@ -1998,7 +2502,8 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss)
     }
 
     if (!migrate_multifd()
-        || migrate_zero_page_detection() == ZERO_PAGE_DETECTION_LEGACY) {
+        || migrate_zero_page_detection() == ZERO_PAGE_DETECTION_LEGACY
+        || ram_page_reported_free(pss->block, offset)) {
         if (save_zero_page(rs, pss, offset)) {
             return 1;
         }
@@ -2166,6 +2671,11 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss)
         return 0;
     }
 
+    if (!ram_wp_claim(pss->block, (ram_addr_t)pss->page << TARGET_PAGE_BITS)) {
+        /* A write fault thread got there first, save its copy */
+        return ram_wp_save_staged(rs, true);
+    }
+
     /* Update host page boundary information */
     pss_host_page_prepare(pss);
 
@@ -2263,6 +2773,20 @@ static int ram_find_and_save_block(RAMState *rs)
         return pages;
     }
 
+    /* Duplicates in flight must be copied before their source is resent */
+    if (multifd_dedup_sync_needed()) {
+        int ret = multifd_ram_flush_and_sync(pss->pss_channel);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /* Pages copied on write faults are waiting in the staging slots */
+    pages = ram_wp_save_staged(rs, false);
+    if (pages) {
+        return pages;
+    }
+
     /*
      * Always keep last_seen_block/last_page valid during this procedure,
      * because find_dirty_block() relies on these values (e.g., we compare
@@ -2313,6 +2837,47 @@ static int ram_find_and_save_block(RAMState *rs)
     return pages;
 }
 
+/*
+ * Time and bytes are accounted to a RAM block when the migration thread
+ * moves on to another block, so that the clock is read once per block
+ * switch rather than once per page.
+ */
+static void ram_profile_flush(RAMState *rs, MigrationProfilePhase phase)
+{
+    int64_t now = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    uint64_t bytes = migration_transferred_bytes();
+
+    if (rs->profile_block && rs->profile_pages) {
+        migration_profile_save_ramblock(phase, rs->profile_block->idstr,
+                                        bytes - rs->profile_bytes,
+                                        now - rs->profile_start,
+                                        rs->profile_pages);
+    }
+
+    rs->profile_start = now;
+    rs->profile_bytes = bytes;
+    rs->profile_pages = 0;
+}
+
+static void ram_profile_start(RAMState *rs)
+{
+    /* The search resumes from there */
+    rs->profile_block = rs->last_seen_block;
+    rs->profile_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    rs->profile_bytes = migration_transferred_bytes();
+    rs->profile_pages = 0;
+}
+
+static void ram_profile_account(RAMState *rs, MigrationProfilePhase phase,
+                                int pages)
+{
+    if (rs->last_seen_block != rs->profile_block) {
+        ram_profile_flush(rs, phase);
+        rs->profile_block = rs->last_seen_block;
+    }
+    rs->profile_pages += pages;
+}
+
 static uint64_t ram_bytes_total_with_ignored(void)
 {
     RAMBlock *block;
@@ -2388,6 +2953,8 @@ static void ram_bitmaps_destroy(void)
         block->bmap = NULL;
         g_free(block->file_bmap);
         block->file_bmap = NULL;
+        g_free(block->free_bmap);
+        block->free_bmap = NULL;
     }
 }
 
@@ -2934,6 +3501,38 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
     }
 }
 
+/*
+ * Called when the guest reported the pages free and they were discarded:
+ * until they are dirtied again, they are sent as zero pages without
+ * reading them, in every iteration.
+ */
+void qemu_guest_free_page_report(void *addr, size_t len)
+{
+    RAMBlock *rb;
+    ram_addr_t offset;
+
+    if (!migration_is_running() || !ram_state) {
+        return;
+    }
+
+    rb = qemu_ram_block_from_host(addr, false, &offset);
+    if (!rb || offset + len > rb->used_length) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&ram_state->bitmap_mutex);
+    /* Not set up yet, or already cleaned up */
+    if (!rb->bmap || migrate_ram_is_ignored(rb)) {
+        return;
+    }
+    if (!rb->free_bmap) {
+        qatomic_set(&rb->free_bmap,
+                    bitmap_new(rb->max_length >> TARGET_PAGE_BITS));
+    }
+    bitmap_set(rb->free_bmap, offset >> TARGET_PAGE_BITS,
+               len >> TARGET_PAGE_BITS);
+}
+
 #define MAPPED_RAM_HDR_VERSION 1
 struct MappedRamHeader {
     uint32_t version;
@@ -3206,6 +3805,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
             t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
             i = 0;
+            ram_profile_start(rs);
             while ((ret = migration_rate_exceeded(f)) == 0 ||
                    postcopy_has_request(rs)) {
                 int pages;
@@ -3227,6 +3827,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
                 }
 
                 rs->target_page_count += pages;
+                ram_profile_account(rs, MIGRATION_PROFILE_PHASE_ITERATE, pages);
 
                 /*
                  * we want to check in the 1st loop, just in case it was the 1st
@@ -3244,6 +3845,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
                 }
                 i++;
             }
+            ram_profile_flush(rs, MIGRATION_PROFILE_PHASE_ITERATE);
         }
     }
 
@@ -3311,6 +3913,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
         /* flush all remaining blocks regardless of rate limiting */
         qemu_mutex_lock(&rs->bitmap_mutex);
+        ram_profile_start(rs);
         while (true) {
             int pages;
 
@@ -3323,7 +3926,9 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
                 qemu_mutex_unlock(&rs->bitmap_mutex);
                 return pages;
             }
+            ram_profile_account(rs, MIGRATION_PROFILE_PHASE_STOP_COPY, pages);
         }
+        ram_profile_flush(rs, MIGRATION_PROFILE_PHASE_STOP_COPY);
         qemu_mutex_unlock(&rs->bitmap_mutex);
 
         ret = rdma_registration_stop(f, RAM_CONTROL_FINISH);
@@ -71,6 +71,7 @@
 #include "yank_functions.h"
 #include "system/qtest.h"
 #include "options.h"
+#include "profile.h"
 
 const unsigned int postcopy_ram_discard_version;
 
@@ -965,11 +966,23 @@ void vmstate_unregister(VMStateIf *obj, const VMStateDescription *vmsd,
 
 static int vmstate_load(QEMUFile *f, SaveStateEntry *se)
 {
+    int64_t start_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    uint64_t start_bytes = qemu_file_consumed(f);
+    int ret;
+
     trace_vmstate_load(se->idstr, se->vmsd ? se->vmsd->name : "(old)");
     if (!se->vmsd) {         /* Old style */
-        return se->ops->load_state(f, se->opaque, se->load_version_id);
+        ret = se->ops->load_state(f, se->opaque, se->load_version_id);
+    } else {
+        ret = vmstate_load_state(f, se->vmsd, se->opaque,
+                                 se->load_version_id);
     }
-    return vmstate_load_state(f, se->vmsd, se->opaque, se->load_version_id);
+
+    migration_profile_load_section(se->idstr, se->instance_id,
+                                   qemu_file_consumed(f) - start_bytes,
+                                   qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                   start_ts);
+    return ret;
 }
 
 static void vmstate_save_old_style(QEMUFile *f, SaveStateEntry *se,
@@ -1024,6 +1037,26 @@ static void save_section_footer(QEMUFile *f, SaveStateEntry *se)
     }
 }
 
+/*
+ * Account what @se wrote to @f since @start_bytes and @start_ts to the
+ * migration profile.
+ */
+static void savevm_profile_section(MigrationProfilePhase phase, QEMUFile *f,
+                                   SaveStateEntry *se, uint64_t start_bytes,
+                                   int64_t start_ts)
+{
+    uint64_t bytes = qemu_file_transferred(f) - start_bytes;
+
+    /* Skipped sections aren't worth reporting */
+    if (!bytes) {
+        return;
+    }
+
+    migration_profile_save_section(phase, se->idstr, se->instance_id, bytes,
+                                   qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                   start_ts);
+}
+
 static int vmstate_save(QEMUFile *f, SaveStateEntry *se, JSONWriter *vmdesc,
                         Error **errp)
 {
@@ -1356,7 +1389,11 @@ int qemu_savevm_state_setup(QEMUFile *f, Error **errp)
     }
 
     trace_savevm_state_setup();
+    migration_profile_save_reset();
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        int64_t start_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        uint64_t start_bytes = qemu_file_transferred(f);
+
         if (se->vmsd && se->vmsd->early_setup) {
             ret = vmstate_save(f, se, vmdesc, errp);
             if (ret) {
@@ -1364,6 +1401,8 @@ int qemu_savevm_state_setup(QEMUFile *f, Error **errp)
                 qemu_file_set_error(f, ret);
                 break;
             }
+            savevm_profile_section(MIGRATION_PROFILE_PHASE_SETUP, f, se,
+                                   start_bytes, start_ts);
             continue;
         }
 
@@ -1383,6 +1422,8 @@ int qemu_savevm_state_setup(QEMUFile *f, Error **errp)
             qemu_file_set_error(f, ret);
             break;
         }
+        savevm_profile_section(MIGRATION_PROFILE_PHASE_SETUP, f, se,
+                               start_bytes, start_ts);
     }
 
     if (ret) {
@@ -1428,6 +1469,8 @@ int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy)
 {
     SaveStateEntry *se;
     bool all_finished = true;
+    int64_t start_ts;
+    uint64_t start_bytes;
     int ret;
 
     trace_savevm_state_iterate();
@@ -1457,12 +1500,16 @@ int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy)
             return 0;
         }
         trace_savevm_section_start(se->idstr, se->section_id);
+        start_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        start_bytes = qemu_file_transferred(f);
 
         save_section_header(f, se, QEMU_VM_SECTION_PART);
 
         ret = se->ops->save_live_iterate(f, se->opaque);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
+        savevm_profile_section(MIGRATION_PROFILE_PHASE_ITERATE, f, se,
+                               start_bytes, start_ts);
 
         if (ret < 0) {
             error_report("failed to save SaveStateEntry with id(name): "
@@ -1576,6 +1623,7 @@ bool qemu_savevm_state_postcopy_prepare(QEMUFile *f, Error **errp)
 int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
     int64_t start_ts_each, end_ts_each;
+    uint64_t start_bytes;
     SaveStateEntry *se;
     bool multifd_device_state = multifd_device_state_supported();
 
@@ -1611,10 +1659,13 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
         }
 
         start_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        start_bytes = qemu_file_transferred(f);
         if (qemu_savevm_complete(se, f) < 0) {
             goto ret_fail_abort_threads;
         }
         end_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        savevm_profile_section(MIGRATION_PROFILE_PHASE_STOP_COPY, f, se,
+                               start_bytes, start_ts_each);
 
         trace_vmstate_downtime_save("iterable", se->idstr, se->instance_id,
                                     end_ts_each - start_ts_each);
@@ -1649,6 +1700,7 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
 {
     MigrationState *ms = migrate_get_current();
     int64_t start_ts_each, end_ts_each;
+    uint64_t start_bytes;
     JSONWriter *vmdesc = ms->vmdesc;
     int vmdesc_len;
     SaveStateEntry *se;
@@ -1665,6 +1717,7 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         }
 
         start_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        start_bytes = qemu_file_transferred(f);
 
         ret = vmstate_save(f, se, vmdesc, &local_err);
         if (ret) {
@@ -1675,6 +1728,8 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         }
 
         end_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        savevm_profile_section(MIGRATION_PROFILE_PHASE_STOP_COPY, f, se,
+                               start_bytes, start_ts_each);
         trace_vmstate_downtime_save("non-iterable", se->idstr, se->instance_id,
                                     end_ts_each - start_ts_each);
     }
@@ -3116,6 +3171,7 @@ int qemu_loadvm_state(QEMUFile *f)
     }
 
     qemu_loadvm_thread_pool_create(mis);
+    migration_profile_load_reset();
 
     ret = qemu_loadvm_state_header(f);
     if (ret) {
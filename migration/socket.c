@@ -18,6 +18,7 @@
 #include "qemu/cutils.h"
 
 #include "qemu/error-report.h"
+#include "qemu/stats64.h"
 #include "qapi/error.h"
 #include "channel.h"
 #include "socket.h"
@@ -31,17 +32,208 @@
 #include "qapi/clone-visitor.h"
 #include "qapi/qapi-visit-sockets.h"
 
+struct SocketLink {
+    SocketAddress *saddr;
+    uint32_t weight;
+    /* smooth weighted round-robin state */
+    int64_t current_weight;
+    /* channels connected through this link */
+    uint32_t channels;
+    /* connecting failed, no new channels are assigned to the link */
+    bool failed;
+    /* bytes sent through this link */
+    Stat64 bytes;
+};
+
 struct SocketOutgoingArgs {
     SocketAddress *saddr;
+    /*
+     * Links for the multifd channels, if any.  They are kept after the
+     * migration finishes so that their statistics can be queried.
+     */
+    SocketLink *links;
+    size_t nlinks;
 } outgoing_args;
 
-void socket_send_channel_create(QIOTaskFunc f, void *data)
+typedef struct {
+    QIOTaskFunc f;
+    void *data;
+    SocketLink **link;
+    SocketLink *cur;
+} SocketLinkConnectData;
+
+static void socket_links_free(void)
+{
+    for (size_t i = 0; i < outgoing_args.nlinks; i++) {
+        qapi_free_SocketAddress(outgoing_args.links[i].saddr);
+    }
+    g_clear_pointer(&outgoing_args.links, g_free);
+    outgoing_args.nlinks = 0;
+}
+
+void socket_set_outgoing_links(MigrationChannelList *channels)
+{
+    MigrationChannelList *c;
+    size_t i = 0;
+
+    socket_links_free();
+
+    for (c = channels; c; c = c->next) {
+        if (c->value->channel_type == MIGRATION_CHANNEL_TYPE_MULTIFD) {
+            outgoing_args.nlinks++;
+        }
+    }
+
+    if (!outgoing_args.nlinks) {
+        return;
+    }
+
+    outgoing_args.links = g_new0(SocketLink, outgoing_args.nlinks);
+    for (c = channels; c; c = c->next) {
+        MigrationChannel *channel = c->value;
+        SocketLink *link;
+
+        if (channel->channel_type != MIGRATION_CHANNEL_TYPE_MULTIFD) {
+            continue;
+        }
+
+        link = &outgoing_args.links[i++];
+        link->saddr = QAPI_CLONE(SocketAddress, &channel->addr->u.socket);
+        link->weight = channel->has_weight ? channel->weight : 1;
+    }
+}
+
+/*
+ * Pick the link for the next channel with smooth weighted round-robin,
+ * which interleaves the links instead of filling them one after the
+ * other.  Returns NULL if no usable link is left.
+ */
+static SocketLink *socket_link_pick(void)
+{
+    SocketLink *best = NULL;
+    int64_t total = 0;
+
+    for (size_t i = 0; i < outgoing_args.nlinks; i++) {
+        SocketLink *link = &outgoing_args.links[i];
+
+        if (link->failed) {
+            continue;
+        }
+
+        link->current_weight += link->weight;
+        total += link->weight;
+        if (!best || link->current_weight > best->current_weight) {
+            best = link;
+        }
+    }
+
+    if (best) {
+        best->current_weight -= total;
+    }
+
+    return best;
+}
+
+static void socket_link_connect(SocketLinkConnectData *data);
+
+static void socket_link_connected(QIOTask *task, gpointer opaque)
+{
+    SocketLinkConnectData *data = opaque;
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(qio_task_get_source(task));
+    Error *err = NULL;
+
+    if (qio_task_propagate_error(task, &err)) {
+        g_autofree char *uri = socket_uri(data->cur->saddr);
+
+        warn_report("migration: multifd link %s failed, "
+                    "trying another link: %s", uri, error_get_pretty(err));
+        error_free(err);
+        data->cur->failed = true;
+        /* The task holds its own reference until we return */
+        object_unref(OBJECT(sioc));
+        socket_link_connect(data);
+        return;
+    }
+
+    data->cur->channels++;
+    trace_migration_socket_link_connected(data->cur - outgoing_args.links,
+                                          data->cur->channels);
+    *data->link = data->cur;
+    data->f(task, data->data);
+    g_free(data);
+}
+
+static void socket_link_connect(SocketLinkConnectData *data)
 {
     QIOChannelSocket *sioc = qio_channel_socket_new();
+
+    data->cur = socket_link_pick();
+    if (!data->cur) {
+        /* All links are down, fall back to the main channel address */
+        *data->link = NULL;
+        qio_channel_socket_connect_async(sioc, outgoing_args.saddr,
+                                         data->f, data->data, NULL, NULL);
+        g_free(data);
+        return;
+    }
+
+    qio_channel_socket_connect_async(sioc, data->cur->saddr,
+                                     socket_link_connected, data, NULL, NULL);
+}
+
+void socket_send_channel_create(QIOTaskFunc f, void *data, SocketLink **link)
+{
+    QIOChannelSocket *sioc;
+
+    if (link && outgoing_args.nlinks) {
+        SocketLinkConnectData *connect_data = g_new0(SocketLinkConnectData, 1);
+
+        connect_data->f = f;
+        connect_data->data = data;
+        connect_data->link = link;
+        socket_link_connect(connect_data);
+        return;
+    }
+
+    if (link) {
+        *link = NULL;
+    }
+
+    sioc = qio_channel_socket_new();
     qio_channel_socket_connect_async(sioc, outgoing_args.saddr,
                                      f, data, NULL, NULL);
 }
 
+void socket_link_account(SocketLink *link, uint64_t bytes)
+{
+    if (link) {
+        stat64_add(&link->bytes, bytes);
+    }
+}
+
+MigrationLinkInfoList *socket_query_outgoing_links(int64_t elapsed_ms)
+{
+    MigrationLinkInfoList *head = NULL, **tail = &head;
+
+    for (size_t i = 0; i < outgoing_args.nlinks; i++) {
+        SocketLink *link = &outgoing_args.links[i];
+        MigrationLinkInfo *info = g_new0(MigrationLinkInfo, 1);
+
+        info->addr = QAPI_CLONE(SocketAddress, link->saddr);
+        info->weight = link->weight;
+        info->channels = link->channels;
+        info->failed = link->failed;
+        info->transferred = stat64_get(&link->bytes);
+        if (elapsed_ms > 0) {
+            /* bytes per millisecond to megabits per second */
+            info->mbps = info->transferred * 8.0 / elapsed_ms / 1000;
+        }
+        QAPI_LIST_APPEND(tail, info);
+    }
+
+    return head;
+}
+
 struct SocketConnectData {
     MigrationState *s;
     char *hostname;
@@ -142,10 +334,12 @@ socket_incoming_migration_end(void *opaque)
 }
 
 void socket_start_incoming_migration(SocketAddress *saddr,
+                                     MigrationChannelList *channels,
                                      Error **errp)
 {
     QIONetListener *listener = qio_net_listener_new();
     MigrationIncomingState *mis = migration_incoming_get_current();
+    MigrationChannelList *c;
     size_t i;
     int num = 1;
 
@@ -162,6 +356,21 @@ void socket_start_incoming_migration(SocketAddress *saddr,
         return;
     }
 
+    /*
+     * Multifd links listen on the same listener, incoming channels are
+     * told apart by their header regardless of the address they use.
+     */
+    for (c = channels; c; c = c->next) {
+        if (c->value->channel_type != MIGRATION_CHANNEL_TYPE_MULTIFD) {
+            continue;
+        }
+        if (qio_net_listener_open_sync(listener, &c->value->addr->u.socket,
+                                       num, errp) < 0) {
+            object_unref(OBJECT(listener));
+            return;
+        }
+    }
+
     mis->transport_data = listener;
     mis->transport_cleanup = socket_incoming_migration_end;
 
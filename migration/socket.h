@@ -20,10 +20,18 @@
 #include "io/channel.h"
 #include "io/task.h"
 #include "qemu/sockets.h"
+#include "qapi/qapi-types-migration.h"
 
-void socket_send_channel_create(QIOTaskFunc f, void *data);
+typedef struct SocketLink SocketLink;
 
-void socket_start_incoming_migration(SocketAddress *saddr, Error **errp);
+void socket_set_outgoing_links(MigrationChannelList *channels);
+void socket_send_channel_create(QIOTaskFunc f, void *data, SocketLink **link);
+void socket_link_account(SocketLink *link, uint64_t bytes);
+MigrationLinkInfoList *socket_query_outgoing_links(int64_t elapsed_ms);
+
+void socket_start_incoming_migration(SocketAddress *saddr,
+                                     MigrationChannelList *channels,
+                                     Error **errp);
 
 void socket_start_outgoing_migration(MigrationState *s,
                                      SocketAddress *saddr, Error **errp);
@@ -51,6 +51,7 @@ typedef struct AFXDPState {
 
     uint32_t             xdp_flags;
     bool                 inhibit;
+    uint32_t             busy_poll_budget;
 
     char                 *map_path;
     int                  map_fd;
@@ -59,16 +60,62 @@ typedef struct AFXDPState {
 
 #define AF_XDP_BATCH_SIZE 64
 
+/* Busy poll timeout for syscalls on the socket, as suggested by the kernel. */
+#define AF_XDP_BUSY_POLL_USECS 20
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
 static void af_xdp_send(void *opaque);
 static void af_xdp_writable(void *opaque);
 
+/*
+ * The io_poll() callback, only used with busy polling in an IOThread.
+ * With preferred busy polling the interrupts of the queue stay masked
+ * and the NAPI context only runs when driven by a syscall on the socket.
+ */
+static bool af_xdp_busy_poll(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    recvfrom(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
+
+    return (s->read_poll && xsk_cons_nb_avail(&s->rx, 1)) ||
+           (s->write_poll && xsk_cons_nb_avail(&s->cq, 1));
+}
+
+/* The io_poll_ready() callback, invoked once af_xdp_busy_poll() succeeds. */
+static void af_xdp_busy_poll_ready(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    if (s->write_poll) {
+        af_xdp_writable(s);
+    }
+    if (s->read_poll) {
+        af_xdp_send(s);
+    }
+}
+
 /* Set the event-loop handlers for the af-xdp backend. */
 static void af_xdp_update_fd_handler(AFXDPState *s)
 {
-    qemu_set_fd_handler(xsk_socket__fd(s->xsk),
-                        s->read_poll ? af_xdp_send : NULL,
-                        s->write_poll ? af_xdp_writable : NULL,
-                        s);
+    IOHandler *fd_read = s->read_poll ? af_xdp_send : NULL;
+    IOHandler *fd_write = s->write_poll ? af_xdp_writable : NULL;
+    bool busy_poll = s->busy_poll_budget && (fd_read || fd_write);
+
+    if (s->nc.aio_context) {
+        aio_set_fd_handler(s->nc.aio_context, xsk_socket__fd(s->xsk),
+                           fd_read, fd_write,
+                           busy_poll ? af_xdp_busy_poll : NULL,
+                           busy_poll ? af_xdp_busy_poll_ready : NULL, s);
+    } else {
+        qemu_set_fd_handler(xsk_socket__fd(s->xsk), fd_read, fd_write, s);
+    }
 }
 
 /* Update the read handler. */
@@ -142,10 +189,11 @@ static void af_xdp_writable(void *opaque)
     qemu_flush_queued_packets(&s->nc);
 }
 
-static ssize_t af_xdp_receive(NetClientState *nc,
-                              const uint8_t *buf, size_t size)
+static ssize_t af_xdp_receive_iov(NetClientState *nc,
+                                  const struct iovec *iov, int iovcnt)
 {
     AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    size_t size = iov_size(iov, iovcnt);
     struct xdp_desc *desc;
     uint32_t idx;
     void *data;
@@ -171,8 +219,9 @@ static ssize_t af_xdp_receive(NetClientState *nc,
     desc->addr = s->pool[--s->n_pool];
     desc->len = size;
 
+    /* Gather the packet straight into the umem frame. */
     data = xsk_umem__get_data(s->buffer, desc->addr);
-    memcpy(data, buf, size);
+    iov_to_buf(iov, iovcnt, 0, data, size);
 
     xsk_ring_prod__submit(&s->tx, 1);
     s->outstanding_tx++;
@@ -184,6 +233,17 @@ static ssize_t af_xdp_receive(NetClientState *nc,
     return size;
 }
 
+static ssize_t af_xdp_receive(NetClientState *nc,
+                              const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_xdp_receive_iov(nc, &iov, 1);
+}
+
 /*
  * Complete a previous send (backend --> guest) and enable the
  * fd_read callback.
@@ -361,6 +421,10 @@ static int af_xdp_socket_create(AFXDPState *s,
         cfg.bind_flags |= XDP_COPY;
     }
 
+    if (opts->has_zero_copy && opts->zero_copy) {
+        cfg.bind_flags |= XDP_ZEROCOPY;
+    }
+
     queue_id = s->nc.queue_index;
     if (opts->has_start_queue && opts->start_queue > 0) {
         queue_id += opts->start_queue;
@@ -403,6 +467,41 @@ static int af_xdp_socket_create(AFXDPState *s,
     return 0;
 }
 
+static int af_xdp_busy_poll_setup(AFXDPState *s, Error **errp)
+{
+    int fd = xsk_socket__fd(s->xsk);
+    int value;
+
+    if (!s->busy_poll_budget) {
+        return 0;
+    }
+
+    value = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+                   &value, sizeof(value))) {
+        goto err;
+    }
+
+    value = AF_XDP_BUSY_POLL_USECS;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value))) {
+        goto err;
+    }
+
+    value = s->busy_poll_budget;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+                   &value, sizeof(value))) {
+        goto err;
+    }
+
+    return 0;
+
+err:
+    error_setg_errno(errp, errno,
+                     "failed to enable busy polling for %s queue_index: %d",
+                     s->ifname, s->nc.queue_index);
+    return -1;
+}
+
 static int af_xdp_update_xsk_map(AFXDPState *s, Error **errp)
 {
     int xsk_fd, idx, error = 0;
@@ -432,13 +531,31 @@ static int af_xdp_update_xsk_map(AFXDPState *s, Error **errp)
     return 0;
 }
 
+/* Move the event-loop handlers to another AioContext. */
+static void af_xdp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    int fd = xsk_socket__fd(s->xsk);
+
+    if (nc->aio_context) {
+        aio_set_fd_handler(nc->aio_context, fd, NULL, NULL, NULL, NULL, NULL);
+    } else {
+        qemu_set_fd_handler(fd, NULL, NULL, NULL);
+    }
+
+    nc->aio_context = ctx;
+    af_xdp_update_fd_handler(s);
+}
+
 /* NetClientInfo methods. */
 static NetClientInfo net_af_xdp_info = {
     .type = NET_CLIENT_DRIVER_AF_XDP,
     .size = sizeof(AFXDPState),
     .receive = af_xdp_receive,
+    .receive_iov = af_xdp_receive_iov,
     .poll = af_xdp_poll,
     .cleanup = af_xdp_cleanup,
+    .set_aio_context = af_xdp_set_aio_context,
 };
 
 static int *parse_socket_fds(const char *sock_fds_str,
@@ -481,6 +598,7 @@ int net_init_af_xdp(const Netdev *netdev,
     const NetdevAFXDPOptions *opts = &netdev->u.af_xdp;
     NetClientState *nc, *nc0 = NULL;
     int32_t map_start_index;
+    int64_t busy_poll_budget;
     unsigned int ifindex;
     uint32_t prog_id = 0;
     g_autofree int *sock_fds = NULL;
@@ -503,6 +621,19 @@ int net_init_af_xdp(const Netdev *netdev,
         return -1;
     }
 
+    if (opts->has_force_copy && opts->force_copy &&
+        opts->has_zero_copy && opts->zero_copy) {
+        error_setg(errp, "'force-copy' and 'zero-copy' are mutually exclusive");
+        return -1;
+    }
+
+    busy_poll_budget = opts->has_busy_poll_budget ? opts->busy_poll_budget : 0;
+    if (busy_poll_budget < 0 || busy_poll_budget > UINT16_MAX) {
+        error_setg(errp, "invalid 'busy-poll-budget' (%" PRIi64 ")",
+                   busy_poll_budget);
+        return -1;
+    }
+
     inhibit = opts->has_inhibit && opts->inhibit;
     if (inhibit && !opts->sock_fds && !opts->map_path) {
         error_setg(errp, "'inhibit=on' requires 'sock-fds' or 'map-path'");
@@ -549,6 +680,7 @@ int net_init_af_xdp(const Netdev *netdev,
         pstrcpy(s->ifname, sizeof(s->ifname), opts->ifname);
         s->ifindex = ifindex;
         s->inhibit = inhibit;
+        s->busy_poll_budget = busy_poll_budget;
 
         s->map_path = g_strdup(opts->map_path);
         s->map_start_index = map_start_index;
@@ -556,6 +688,7 @@ int net_init_af_xdp(const Netdev *netdev,
 
         if (af_xdp_umem_create(s, sock_fds ? sock_fds[i] : -1, &err) ||
             af_xdp_socket_create(s, opts, &err) ||
+            af_xdp_busy_poll_setup(s, &err) ||
             af_xdp_update_xsk_map(s, &err)) {
             goto err;
         }
@@ -20,6 +20,9 @@
 #include "net/eth.h"
 #include "qom/object_interfaces.h"
 #include "qemu/iov.h"
+#include "qemu/lockable.h"
+#include "qemu/stats64.h"
+#include "qemu/thread.h"
 #include "qom/object.h"
 #include "net/queue.h"
 #include "chardev/char-fe.h"
@@ -53,6 +56,8 @@ static NotifierList colo_compare_notifiers =
 #define REGULAR_PACKET_CHECK_MS 1000
 #define DEFAULT_TIME_OUT_MS 3000
 
+#define COLO_COMPARE_MAX_THREADS 64
+
 /* #define DEBUG_COLO_PACKETS */
 
 static QemuMutex colo_compare_mutex;
@@ -101,6 +106,38 @@ typedef struct SendEntry {
     uint8_t *buf;
 } SendEntry;
 
+/*
+ * Connections are spread over shards by their hash.  Each shard is
+ * compared by its own thread, or in the iothread if compare_threads is 0.
+ */
+typedef struct CompareShard {
+    CompareState *s;
+    bool threaded;
+
+    /*
+     * Record the connection that through the NIC
+     * Element type: Connection
+     */
+    GQueue conn_list;
+    /* Record the connection without repetition */
+    GHashTable *connection_track_table;
+    /* primary packets released by the thread, element type: Packet */
+    GQueue released;
+
+    QemuThread thread;
+    /* protects the fields below */
+    QemuMutex lock;
+    QemuCond cond;
+    /* packets from the iothread waiting to be compared */
+    GQueue pri_in;
+    GQueue sec_in;
+    /* primary packets to send to outdev, element type: Packet */
+    GQueue output;
+    bool check_old;
+    bool flush;
+    bool stop;
+} CompareShard;
+
 struct CompareState {
     Object parent;
 
@@ -120,18 +157,28 @@ struct CompareState {
     bool vnet_hdr;
     uint64_t compare_timeout;
     uint32_t expired_scan_cycle;
+    uint32_t compare_threads;
 
-    /*
-     * Record the connection that through the NIC
-     * Element type: Connection
-     */
-    GQueue conn_list;
-    /* Record the connection without repetition */
-    GHashTable *connection_track_table;
+    CompareShard *shards;
+    uint32_t nr_shards;
 
     IOThread *iothread;
     GMainContext *worker_context;
     QEMUTimer *packet_check_timer;
+    /* sends the packets released by the compare threads */
+    QEMUBH *out_bh;
+    bool notify_pending;
+    /* checkpoint flush by the compare threads, in progress or done */
+    bool flushing;
+    bool flush_event;
+    uint32_t flush_pending;
+    bool flush_done;
+
+    /* primary packets released after a successful comparison */
+    Stat64 compared_packets;
+    /* time these packets waited for the secondary, in ms */
+    Stat64 compare_latency_sum;
+    Stat64 compare_latency_max;
 
     QEMUBH *event_bh;
     enum colo_event event;
@@ -182,7 +229,7 @@ static void notify_remote_frame(CompareState *s)
     }
 }
 
-static void colo_compare_inconsistency_notify(CompareState *s)
+static void colo_compare_do_notify(CompareState *s)
 {
     if (s->notify_dev) {
         notify_remote_frame(s);
@@ -192,6 +239,20 @@ static void colo_compare_inconsistency_notify(CompareState *s)
     }
 }
 
+static void colo_compare_inconsistency_notify(CompareState *s)
+{
+    if (s->compare_threads) {
+        /*
+         * The notify chardev and the COLO frame notifiers are only used
+         * from the iothread.
+         */
+        qatomic_set(&s->notify_pending, true);
+        qemu_bh_schedule(s->out_bh);
+    } else {
+        colo_compare_do_notify(s);
+    }
+}
+
 /* Use restricted to colo_insert_packet() */
 static gint seq_sorter(Packet *a, Packet *b, gpointer data)
 {
@@ -237,16 +298,56 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
     return 0;
 }
 
+static void colo_compare_connection(void *opaque, void *user_data);
+
+/*
+ * Called from the thread that compares the shard to queue the packet
+ * to its connection and compare it.
+ */
+static void colo_compare_process(CompareShard *sh, int mode, Packet *pkt)
+{
+    ConnectionKey key;
+    Connection *conn;
+    int ret;
+
+    fill_connection_key(pkt, &key, false);
+
+    conn = connection_get(sh->connection_track_table,
+                          &key,
+                          &sh->conn_list);
+
+    if (!conn->processing) {
+        g_queue_push_tail(&sh->conn_list, conn);
+        conn->processing = true;
+    }
+
+    if (mode == PRIMARY_IN) {
+        ret = colo_insert_packet(&conn->primary_list, pkt, &conn->pack);
+    } else {
+        ret = colo_insert_packet(&conn->secondary_list, pkt, &conn->sack);
+    }
+
+    if (!ret) {
+        trace_colo_compare_drop_packet(colo_mode[mode],
+            "queue size too big, drop packet");
+        packet_destroy(pkt, NULL);
+        pkt = NULL;
+    }
+
+    /* compare packet in the specified connection */
+    colo_compare_connection(conn, sh);
+}
+
 /*
  * Return 0 on success, if return -1 means the pkt
  * is unsupported(arp and ipv6) and will be sent later
  */
-static int packet_enqueue(CompareState *s, int mode, Connection **con)
+static int packet_enqueue(CompareState *s, int mode)
 {
     ConnectionKey key;
+    CompareShard *sh;
     Packet *pkt = NULL;
-    Connection *conn;
-    int ret;
+    GQueue *queue;
 
     if (mode == PRIMARY_IN) {
         pkt = packet_new(s->pri_rs.buf,
@@ -263,31 +364,30 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
         pkt = NULL;
         return -1;
     }
-    fill_connection_key(pkt, &key, false);
 
-    conn = connection_get(s->connection_track_table,
-                          &key,
-                          &s->conn_list);
-
-    if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
-        conn->processing = true;
+    sh = &s->shards[0];
+    if (s->nr_shards > 1) {
+        fill_connection_key(pkt, &key, false);
+        sh = &s->shards[connection_key_hash(&key) % s->nr_shards];
     }
 
-    if (mode == PRIMARY_IN) {
-        ret = colo_insert_packet(&conn->primary_list, pkt, &conn->pack);
-    } else {
-        ret = colo_insert_packet(&conn->secondary_list, pkt, &conn->sack);
+    if (!sh->threaded) {
+        colo_compare_process(sh, mode, pkt);
+        return 0;
     }
 
-    if (!ret) {
+    QEMU_LOCK_GUARD(&sh->lock);
+
+    queue = mode == PRIMARY_IN ? &sh->pri_in : &sh->sec_in;
+    if (g_queue_get_length(queue) > max_queue_size) {
         trace_colo_compare_drop_packet(colo_mode[mode],
-            "queue size too big, drop packet");
+            "compare thread too slow, drop packet");
         packet_destroy(pkt, NULL);
-        pkt = NULL;
+        return 0;
     }
 
-    *con = conn;
+    g_queue_push_tail(queue, pkt);
+    qemu_cond_signal(&sh->cond);
 
     return 0;
 }
@@ -297,10 +397,18 @@ static inline bool after(uint32_t seq1, uint32_t seq2)
         return (int32_t)(seq1 - seq2) > 0;
 }
 
-static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
+/* Send a primary packet to outdev, from the thread that compares it */
+static void colo_compare_output(CompareShard *sh, Packet *pkt)
 {
     int ret;
-    ret = compare_chr_send(s,
+
+    if (sh->threaded) {
+        /* queued to sh->output at the end of the round */
+        g_queue_push_tail(&sh->released, pkt);
+        return;
+    }
+
+    ret = compare_chr_send(sh->s,
                            pkt->data,
                            pkt->size,
                            pkt->vnet_hdr_len,
@@ -309,10 +417,25 @@ static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
     if (ret < 0) {
         error_report("colo send primary packet failed");
     }
-    trace_colo_compare_main("packet same and release packet");
     packet_destroy_partial(pkt, NULL);
 }
 
+static void colo_release_primary_pkt(CompareShard *sh, Packet *pkt)
+{
+    CompareState *s = sh->s;
+    int64_t latency = qemu_clock_get_ms(QEMU_CLOCK_HOST) - pkt->creation_ms;
+
+    /* the host clock can go backwards */
+    latency = MAX(latency, 0);
+
+    stat64_add(&s->compared_packets, 1);
+    stat64_add(&s->compare_latency_sum, latency);
+    stat64_max(&s->compare_latency_max, latency);
+
+    trace_colo_compare_main("packet same and release packet");
+    colo_compare_output(sh, pkt);
+}
+
 /*
  * The IP packets sent by primary and secondary
  * will be compared in here
@@ -396,7 +519,7 @@ static bool colo_mark_tcp_pkt(Packet *ppkt, Packet *spkt,
     return false;
 }
 
-static void colo_compare_tcp(CompareState *s, Connection *conn)
+static void colo_compare_tcp(CompareShard *sh, Connection *conn)
 {
     Packet *ppkt = NULL, *spkt = NULL;
     int8_t mark;
@@ -427,13 +550,13 @@ sec:
     spkt = g_queue_pop_tail(&conn->secondary_list);
 
     if (ppkt->tcp_seq == ppkt->seq_end) {
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(sh, ppkt);
         ppkt = NULL;
     }
 
     if (ppkt && conn->compare_seq && !after(ppkt->seq_end, conn->compare_seq)) {
         trace_colo_compare_main("pri: this packet has compared");
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(sh, ppkt);
         ppkt = NULL;
     }
 
@@ -473,7 +596,7 @@ sec:
 
         if (mark == COLO_COMPARE_FREE_PRIMARY) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(sh, ppkt);
             g_queue_push_tail(&conn->secondary_list, spkt);
             goto pri;
         } else if (mark == COLO_COMPARE_FREE_SECONDARY) {
@@ -482,7 +605,7 @@ sec:
             goto sec;
         } else if (mark == (COLO_COMPARE_FREE_PRIMARY | COLO_COMPARE_FREE_SECONDARY)) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(sh, ppkt);
             packet_destroy(spkt, NULL);
             goto pri;
         }
@@ -495,7 +618,7 @@ sec:
         qemu_hexdump(stderr, "colo-compare spkt", spkt->data, spkt->size);
 #endif
 
-        colo_compare_inconsistency_notify(s);
+        colo_compare_inconsistency_notify(sh->s);
     }
 }
 
@@ -649,19 +772,17 @@ out:
  * if we have some then we have to checkpoint to wake
  * the secondary up.
  */
-static void colo_old_packet_check(void *opaque)
+static void colo_old_packet_check(CompareShard *sh)
 {
-    CompareState *s = opaque;
-
     /*
      * If we find one old packet, stop finding job and notify
      * COLO frame do checkpoint.
      */
-    g_queue_find_custom(&s->conn_list, s,
+    g_queue_find_custom(&sh->conn_list, sh->s,
                         (GCompareFunc)colo_old_packet_check_one_conn);
 }
 
-static void colo_compare_packet(CompareState *s, Connection *conn,
+static void colo_compare_packet(CompareShard *sh, Connection *conn,
                                 int (*HandlePacket)(Packet *spkt,
                                 Packet *ppkt))
 {
@@ -675,7 +796,7 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
                  pkt, (GCompareFunc)HandlePacket);
 
         if (result) {
-            colo_release_primary_pkt(s, pkt);
+            colo_release_primary_pkt(sh, pkt);
             packet_destroy(result->data, NULL);
             g_queue_delete_link(&conn->secondary_list, result);
         } else {
@@ -688,7 +809,7 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
             trace_colo_compare_main("packet different");
             g_queue_push_tail(&conn->primary_list, pkt);
 
-            colo_compare_inconsistency_notify(s);
+            colo_compare_inconsistency_notify(sh->s);
             break;
         }
     }
@@ -702,21 +823,21 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
  */
 static void colo_compare_connection(void *opaque, void *user_data)
 {
-    CompareState *s = user_data;
+    CompareShard *sh = user_data;
     Connection *conn = opaque;
 
     switch (conn->ip_proto) {
     case IPPROTO_TCP:
-        colo_compare_tcp(s, conn);
+        colo_compare_tcp(sh, conn);
         break;
     case IPPROTO_UDP:
-        colo_compare_packet(s, conn, colo_packet_compare_udp);
+        colo_compare_packet(sh, conn, colo_packet_compare_udp);
         break;
     case IPPROTO_ICMP:
-        colo_compare_packet(s, conn, colo_packet_compare_icmp);
+        colo_compare_packet(sh, conn, colo_packet_compare_icmp);
         break;
     default:
-        colo_compare_packet(s, conn, colo_packet_compare_other);
+        colo_compare_packet(sh, conn, colo_packet_compare_other);
         break;
     }
 }
@@ -884,6 +1005,188 @@ static void compare_notify_chr(void *opaque, const uint8_t *buf, int size)
     }
 }
 
+static void colo_flush_packets(void *opaque, void *user_data);
+
+/* Move the packets released by a compare thread to its output queue */
+static void colo_compare_release_output(CompareShard *sh)
+{
+    Packet *pkt;
+
+    if (g_queue_is_empty(&sh->released)) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&sh->lock) {
+        while ((pkt = g_queue_pop_head(&sh->released))) {
+            g_queue_push_tail(&sh->output, pkt);
+        }
+    }
+    qemu_bh_schedule(sh->s->out_bh);
+}
+
+/* Called from the iothread once a COLO frame event is handled */
+static void colo_compare_event_done(void)
+{
+    qemu_mutex_lock(&event_mtx);
+    assert(event_unhandled_count > 0);
+    event_unhandled_count--;
+    qemu_cond_broadcast(&event_complete_cond);
+    qemu_mutex_unlock(&event_mtx);
+}
+
+/* Called from the iothread once the compare threads are done flushing */
+static void colo_compare_flush_done(CompareState *s)
+{
+    s->flushing = false;
+    if (s->flush_event) {
+        s->flush_event = false;
+        colo_compare_event_done();
+    }
+}
+
+/*
+ * Called from the iothread to send the packets released by the
+ * compare threads.
+ */
+static void colo_compare_send_output(void *opaque)
+{
+    CompareState *s = opaque;
+    /* the threads released their last packets before setting it */
+    bool flush_done = qatomic_xchg(&s->flush_done, false);
+    Packet *pkt;
+    int ret;
+
+    for (uint32_t i = 0; i < s->nr_shards; i++) {
+        CompareShard *sh = &s->shards[i];
+        GQueue output;
+
+        WITH_QEMU_LOCK_GUARD(&sh->lock) {
+            output = sh->output;
+            g_queue_init(&sh->output);
+        }
+
+        while ((pkt = g_queue_pop_head(&output))) {
+            ret = compare_chr_send(s,
+                                   pkt->data,
+                                   pkt->size,
+                                   pkt->vnet_hdr_len,
+                                   false,
+                                   true);
+            if (ret < 0) {
+                error_report("colo send primary packet failed");
+            }
+            packet_destroy_partial(pkt, NULL);
+        }
+    }
+
+    if (qatomic_xchg(&s->notify_pending, false)) {
+        colo_compare_do_notify(s);
+    }
+    if (flush_done) {
+        colo_compare_flush_done(s);
+    }
+}
+
+static void *colo_compare_thread(void *opaque)
+{
+    CompareShard *sh = opaque;
+    GQueue pri_in, sec_in;
+    Packet *pkt;
+    bool check_old;
+
+    qemu_mutex_lock(&sh->lock);
+    for (;;) {
+        if (!g_queue_is_empty(&sh->pri_in) || !g_queue_is_empty(&sh->sec_in) ||
+            sh->check_old) {
+            pri_in = sh->pri_in;
+            sec_in = sh->sec_in;
+            g_queue_init(&sh->pri_in);
+            g_queue_init(&sh->sec_in);
+            check_old = sh->check_old;
+            sh->check_old = false;
+            qemu_mutex_unlock(&sh->lock);
+
+            while ((pkt = g_queue_pop_head(&pri_in))) {
+                colo_compare_process(sh, PRIMARY_IN, pkt);
+            }
+            while ((pkt = g_queue_pop_head(&sec_in))) {
+                colo_compare_process(sh, SECONDARY_IN, pkt);
+            }
+            if (check_old) {
+                /* if have old packet we will notify checkpoint */
+                colo_old_packet_check(sh);
+            }
+            colo_compare_release_output(sh);
+
+            qemu_mutex_lock(&sh->lock);
+            continue;
+        }
+
+        if (sh->flush) {
+            sh->flush = false;
+            qemu_mutex_unlock(&sh->lock);
+            g_queue_foreach(&sh->conn_list, colo_flush_packets, sh);
+            colo_compare_release_output(sh);
+
+            /* The last shard to flush lets the iothread complete it */
+            if (qatomic_fetch_dec(&sh->s->flush_pending) == 1) {
+                qatomic_set(&sh->s->flush_done, true);
+                qemu_bh_schedule(sh->s->out_bh);
+            }
+            qemu_mutex_lock(&sh->lock);
+            continue;
+        }
+
+        if (sh->stop) {
+            break;
+        }
+
+        qemu_cond_wait(&sh->cond, &sh->lock);
+    }
+    qemu_mutex_unlock(&sh->lock);
+
+    return NULL;
+}
+
+/*
+ * Called from the iothread on checkpoint: send all primary packets and
+ * drop the secondary ones.  The compare threads flush their shards while
+ * the iothread keeps running, and the COLO frame event, if @event, is
+ * completed once they are all done.  A flush requested while one is in
+ * progress is merged with it.
+ */
+static void colo_compare_flush(CompareState *s, bool event)
+{
+    uint32_t i;
+
+    if (!s->compare_threads) {
+        for (i = 0; i < s->nr_shards; i++) {
+            g_queue_foreach(&s->shards[i].conn_list, colo_flush_packets,
+                            &s->shards[i]);
+        }
+        if (event) {
+            colo_compare_event_done();
+        }
+        return;
+    }
+
+    s->flush_event |= event;
+    if (s->flushing) {
+        return;
+    }
+
+    s->flushing = true;
+    qatomic_set(&s->flush_pending, s->nr_shards);
+    for (i = 0; i < s->nr_shards; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        WITH_QEMU_LOCK_GUARD(&sh->lock) {
+            sh->flush = true;
+            qemu_cond_signal(&sh->cond);
+        }
+    }
+}
+
 /*
  * Check old packet regularly so it can watch for any packets
  * that the secondary hasn't produced equivalents of.
@@ -892,8 +1195,21 @@ static void check_old_packet_regular(void *opaque)
 {
     CompareState *s = opaque;
 
-    /* if have old packet we will notify checkpoint */
-    colo_old_packet_check(s);
+    for (uint32_t i = 0; i < s->nr_shards; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        if (!sh->threaded) {
+            /* if have old packet we will notify checkpoint */
+            colo_old_packet_check(sh);
+            continue;
+        }
+
+        WITH_QEMU_LOCK_GUARD(&sh->lock) {
+            sh->check_old = true;
+            qemu_cond_signal(&sh->cond);
+        }
+    }
+
     timer_mod(s->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) +
               s->expired_scan_cycle);
 }
@@ -943,27 +1259,22 @@ static void colo_compare_timer_del(CompareState *s)
     }
  }
 
-static void colo_flush_packets(void *opaque, void *user_data);
-
 static void colo_compare_handle_event(void *opaque)
 {
     CompareState *s = opaque;
 
     switch (s->event) {
     case COLO_EVENT_CHECKPOINT:
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
-        break;
+        /* completes the event once done */
+        colo_compare_flush(s, true);
+        return;
     case COLO_EVENT_FAILOVER:
         break;
     default:
         break;
     }
 
-    qemu_mutex_lock(&event_mtx);
-    assert(event_unhandled_count > 0);
-    event_unhandled_count--;
-    qemu_cond_broadcast(&event_complete_cond);
-    qemu_mutex_unlock(&event_mtx);
+    colo_compare_event_done();
 }
 
 static void colo_compare_iothread(CompareState *s)
@@ -986,6 +1297,7 @@ static void colo_compare_iothread(CompareState *s)
 
     colo_compare_timer_init(s);
     s->event_bh = aio_bh_new(ctx, colo_compare_handle_event, s);
+    s->out_bh = aio_bh_new(ctx, colo_compare_send_output, s);
 }
 
 static char *compare_get_pri_indev(Object *obj, Error **errp)
@@ -1146,12 +1458,54 @@ static void set_max_queue_size(Object *obj, Visitor *v,
     max_queue_size = value;
 }
 
+static void compare_get_threads(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->compare_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_threads(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    s->compare_threads = value;
+}
+
+static void compare_get_stat(Object *obj, Visitor *v,
+                             const char *name, void *opaque,
+                             Error **errp)
+{
+    uint64_t value = stat64_get(opaque);
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static void compare_get_latency_avg(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint64_t count = stat64_get(&s->compared_packets);
+    uint64_t value = count ? stat64_get(&s->compare_latency_sum) / count : 0;
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
-    Connection *conn = NULL;
 
-    if (packet_enqueue(s, PRIMARY_IN, &conn)) {
+    if (packet_enqueue(s, PRIMARY_IN)) {
         trace_colo_compare_main("primary: unsupported packet in");
         compare_chr_send(s,
                          pri_rs->buf,
@@ -1159,22 +1513,15 @@ static void compare_pri_rs_finalize(SocketReadState *pri_rs)
                          pri_rs->vnet_hdr_len,
                          false,
                          false);
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
     }
 }
 
 static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
     CompareState *s = container_of(sec_rs, CompareState, sec_rs);
-    Connection *conn = NULL;
 
-    if (packet_enqueue(s, SECONDARY_IN, &conn)) {
+    if (packet_enqueue(s, SECONDARY_IN)) {
         trace_colo_compare_main("secondary: unsupported packet in");
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
     }
 }
 
@@ -1196,7 +1543,7 @@ static void compare_notify_rs_finalize(SocketReadState *notify_rs)
                                   notify_rs->buf,
                                   notify_rs->packet_len)) {
         /* colo-compare do checkpoint, flush pri packet and remove sec packet */
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_compare_flush(s, false);
     } else {
         error_report("COLO compare got unsupported instruction");
     }
@@ -1240,6 +1587,7 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
 {
     CompareState *s = COLO_COMPARE(uc);
     Chardev *chr;
+    uint32_t i;
 
     if (!s->pri_indev || !s->sec_indev || !s->outdev || !s->iothread) {
         error_setg(errp, "colo compare needs 'primary_in' ,"
@@ -1253,6 +1601,12 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         return;
     }
 
+    if (s->compare_threads > COLO_COMPARE_MAX_THREADS) {
+        error_setg(errp, "compare_threads must not exceed %d",
+                   COLO_COMPARE_MAX_THREADS);
+        return;
+    }
+
     if (!s->compare_timeout) {
         /* Set default value to 3000 MS */
         s->compare_timeout = DEFAULT_TIME_OUT_MS;
@@ -1311,15 +1665,34 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         g_queue_init(&s->notify_sendco.send_list);
     }
 
-    g_queue_init(&s->conn_list);
+    s->nr_shards = MAX(s->compare_threads, 1);
+    s->shards = g_new0(CompareShard, s->nr_shards);
+    for (i = 0; i < s->nr_shards; i++) {
+        CompareShard *sh = &s->shards[i];
 
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      NULL);
+        sh->s = s;
+        g_queue_init(&sh->conn_list);
+        sh->connection_track_table = g_hash_table_new_full(
+            connection_key_hash, connection_key_equal, g_free, NULL);
+        g_queue_init(&sh->released);
+        qemu_mutex_init(&sh->lock);
+        qemu_cond_init(&sh->cond);
+        g_queue_init(&sh->pri_in);
+        g_queue_init(&sh->sec_in);
+        g_queue_init(&sh->output);
+    }
 
     colo_compare_iothread(s);
 
+    for (i = 0; i < s->compare_threads; i++) {
+        CompareShard *sh = &s->shards[i];
+        g_autofree char *name = g_strdup_printf("colo-compare/%u", i);
+
+        sh->threaded = true;
+        qemu_thread_create(&sh->thread, name, colo_compare_thread, sh,
+                           QEMU_THREAD_JOINABLE);
+    }
+
     qemu_mutex_lock(&colo_compare_mutex);
     if (!colo_compare_active) {
         qemu_mutex_init(&event_mtx);
@@ -1332,19 +1705,13 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
 
 static void colo_flush_packets(void *opaque, void *user_data)
 {
-    CompareState *s = user_data;
+    CompareShard *sh = user_data;
     Connection *conn = opaque;
     Packet *pkt = NULL;
 
     while (!g_queue_is_empty(&conn->primary_list)) {
         pkt = g_queue_pop_tail(&conn->primary_list);
-        compare_chr_send(s,
-                         pkt->data,
-                         pkt->size,
-                         pkt->vnet_hdr_len,
-                         false,
-                         true);
-        packet_destroy_partial(pkt, NULL);
+        colo_compare_output(sh, pkt);
     }
     while (!g_queue_is_empty(&conn->secondary_list)) {
         pkt = g_queue_pop_tail(&conn->secondary_list);
@@ -1389,6 +1756,20 @@ static void colo_compare_init(Object *obj)
                         get_max_queue_size,
                         set_max_queue_size, NULL, NULL);
 
+    object_property_add(obj, "compare_threads", "uint32",
+                        compare_get_threads,
+                        compare_set_threads, NULL, NULL);
+
+    /* statistics, latencies are in ms */
+    object_property_add(obj, "compared_packets", "uint64",
+                        compare_get_stat, NULL, NULL,
+                        &s->compared_packets);
+    object_property_add(obj, "compare_latency_avg", "uint64",
+                        compare_get_latency_avg, NULL, NULL, NULL);
+    object_property_add(obj, "compare_latency_max", "uint64",
+                        compare_get_stat, NULL, NULL,
+                        &s->compare_latency_max);
+
     s->vnet_hdr = false;
     object_property_add_bool(obj, "vnet_hdr_support", compare_get_vnet_hdr,
                              compare_set_vnet_hdr);
@@ -1408,6 +1789,8 @@ static void colo_compare_finalize(Object *obj)
 {
     CompareState *s = COLO_COMPARE(obj);
     CompareState *tmp = NULL;
+    Packet *pkt;
+    uint32_t i;
 
     qemu_mutex_lock(&colo_compare_mutex);
     QTAILQ_FOREACH(tmp, &net_compares, next) {
@@ -1432,7 +1815,21 @@ static void colo_compare_finalize(Object *obj)
 
     colo_compare_timer_del(s);
 
+    for (i = 0; i < s->nr_shards; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        if (sh->threaded) {
+            WITH_QEMU_LOCK_GUARD(&sh->lock) {
+                sh->stop = true;
+                qemu_cond_signal(&sh->cond);
+            }
+            qemu_thread_join(&sh->thread);
+            sh->threaded = false;
+        }
+    }
+
     qemu_bh_delete(s->event_bh);
+    qemu_bh_delete(s->out_bh);
 
     AioContext *ctx = iothread_get_aio_context(s->iothread);
     AIO_WAIT_WHILE(ctx, !s->out_sendco.done);
@@ -1441,18 +1838,30 @@ static void colo_compare_finalize(Object *obj)
     }
 
     /* Release all unhandled packets after compare thead exited */
-    g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+    for (i = 0; i < s->nr_shards; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        while ((pkt = g_queue_pop_head(&sh->output))) {
+            colo_compare_output(sh, pkt);
+        }
+        g_queue_foreach(&sh->conn_list, colo_flush_packets, sh);
+    }
     AIO_WAIT_WHILE(NULL, !s->out_sendco.done);
 
-    g_queue_clear(&s->conn_list);
     g_queue_clear(&s->out_sendco.send_list);
     if (s->notify_dev) {
         g_queue_clear(&s->notify_sendco.send_list);
     }
 
-    if (s->connection_track_table) {
-        g_hash_table_destroy(s->connection_track_table);
+    for (i = 0; i < s->nr_shards; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        g_queue_clear(&sh->conn_list);
+        g_hash_table_destroy(sh->connection_track_table);
+        qemu_mutex_destroy(&sh->lock);
+        qemu_cond_destroy(&sh->cond);
     }
+    g_free(s->shards);
 
     object_unref(OBJECT(s->iothread));
 
@@ -0,0 +1,306 @@
+/*
+ * Netfilter running as an eBPF program in the tap device
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "net/eth.h"
+#include "net/filter.h"
+#include "net/net.h"
+#include "qapi/error.h"
+#include "qapi/qapi-builtin-visit.h"
+#include "qemu/bitops.h"
+#include "qom/object.h"
+#include "ebpf/ebpf_filter.h"
+#include "util.h"
+
+#define TYPE_FILTER_EBPF "filter-ebpf"
+
+OBJECT_DECLARE_SIMPLE_TYPE(FilterEBPFState, FILTER_EBPF)
+
+struct FilterEBPFState {
+    NetFilterState parent_obj;
+
+    struct EBPFFilterContext ctx;
+    bool attached;
+
+    strList *allow_mac;
+    uint16List *allow_vlan;
+    bool allow_multicast;
+    uint64_t rate;
+    uint64_t burst;
+};
+
+static bool filter_ebpf_attach(NetFilterState *nf, bool attach, Error **errp)
+{
+    FilterEBPFState *s = FILTER_EBPF(nf);
+    int prog_fd = attach ? s->ctx.program_fd : -1;
+
+    if (s->attached == attach) {
+        return true;
+    }
+    if (!nf->netdev->info->set_filter_ebpf(nf->netdev, prog_fd)) {
+        if (attach) {
+            error_setg(errp, "Unable to attach the eBPF filter to netdev "
+                       "'%s', it might already have one", nf->netdev_id);
+        } else {
+            error_setg(errp, "Unable to detach the eBPF filter from netdev "
+                       "'%s'", nf->netdev_id);
+        }
+        return false;
+    }
+    s->attached = attach;
+    return true;
+}
+
+static bool filter_ebpf_configure(FilterEBPFState *s, Error **errp)
+{
+    struct EBPFFilterConfig config = {};
+    uint8_t mac[ETH_ALEN];
+    uint32_t nr_macs = 0;
+    strList *m;
+    uint16List *v;
+
+    for (m = s->allow_mac; m; m = m->next) {
+        if (net_parse_macaddr(mac, m->value) < 0) {
+            error_setg(errp, "Invalid MAC address '%s'", m->value);
+            return false;
+        }
+        nr_macs++;
+    }
+
+    if (s->allow_mac) {
+        config.flags |= EBPF_FILTER_MAC;
+        if (s->allow_multicast) {
+            config.flags |= EBPF_FILTER_MULTICAST;
+        }
+    }
+
+    for (v = s->allow_vlan; v; v = v->next) {
+        if (v->value >= EBPF_FILTER_VLAN_IDS) {
+            error_setg(errp, "Invalid VLAN ID %u", v->value);
+            return false;
+        }
+        config.flags |= EBPF_FILTER_VLAN;
+        config.vlans[v->value / 64] |= BIT_ULL(v->value % 64);
+    }
+
+    /* The program computes rate * microseconds over up to a second */
+    if (s->rate > UINT64_MAX / G_USEC_PER_SEC) {
+        error_setg(errp, "Property '%s.rate' is too large",
+                   object_get_typename(OBJECT(s)));
+        return false;
+    }
+    config.rate = s->rate;
+    config.burst = s->burst ? s->burst : s->rate;
+
+    if (!ebpf_filter_load(&s->ctx, nr_macs, errp) ||
+        !ebpf_filter_set_config(&s->ctx, &config, errp)) {
+        return false;
+    }
+
+    for (m = s->allow_mac; m; m = m->next) {
+        net_parse_macaddr(mac, m->value);
+        if (!ebpf_filter_add_mac(&s->ctx, mac, errp)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void filter_ebpf_setup(NetFilterState *nf, Error **errp)
+{
+    FilterEBPFState *s = FILTER_EBPF(nf);
+
+    /*
+     * The tap device runs the program on the packets it hands to QEMU,
+     * the ones it sends are not filtered.
+     */
+    if (nf->direction != NET_FILTER_DIRECTION_TX) {
+        error_setg(errp, "filter-ebpf only supports queue=tx");
+        return;
+    }
+
+    if (!nf->netdev->info->set_filter_ebpf) {
+        error_setg(errp, "netdev '%s' does not support eBPF filters",
+                   nf->netdev_id);
+        return;
+    }
+
+    if (!filter_ebpf_configure(s, errp)) {
+        ebpf_filter_unload(&s->ctx);
+        return;
+    }
+
+    if (nf->on && !filter_ebpf_attach(nf, true, errp)) {
+        ebpf_filter_unload(&s->ctx);
+    }
+}
+
+static void filter_ebpf_cleanup(NetFilterState *nf)
+{
+    FilterEBPFState *s = FILTER_EBPF(nf);
+
+    if (s->attached) {
+        filter_ebpf_attach(nf, false, NULL);
+    }
+    ebpf_filter_unload(&s->ctx);
+}
+
+static void filter_ebpf_status_changed(NetFilterState *nf, Error **errp)
+{
+    filter_ebpf_attach(nf, nf->on, errp);
+}
+
+static bool filter_ebpf_check_created(Object *obj, const char *name,
+                                      Error **errp)
+{
+    if (NETFILTER(obj)->netdev) {
+        error_setg(errp, "Property '%s.%s' can't be changed once the filter "
+                   "is created", object_get_typename(obj), name);
+        return false;
+    }
+    return true;
+}
+
+static void filter_ebpf_get_allow_mac(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    FilterEBPFState *s = FILTER_EBPF(obj);
+
+    visit_type_strList(v, name, &s->allow_mac, errp);
+}
+
+static void filter_ebpf_set_allow_mac(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    FilterEBPFState *s = FILTER_EBPF(obj);
+    strList *list = NULL;
+
+    if (!filter_ebpf_check_created(obj, name, errp) ||
+        !visit_type_strList(v, name, &list, errp)) {
+        return;
+    }
+    qapi_free_strList(s->allow_mac);
+    s->allow_mac = list;
+}
+
+static void filter_ebpf_get_allow_vlan(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    FilterEBPFState *s = FILTER_EBPF(obj);
+
+    visit_type_uint16List(v, name, &s->allow_vlan, errp);
+}
+
+static void filter_ebpf_set_allow_vlan(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    FilterEBPFState *s = FILTER_EBPF(obj);
+    uint16List *list = NULL;
+
+    if (!filter_ebpf_check_created(obj, name, errp) ||
+        !visit_type_uint16List(v, name, &list, errp)) {
+        return;
+    }
+    qapi_free_uint16List(s->allow_vlan);
+    s->allow_vlan = list;
+}
+
+static bool filter_ebpf_get_allow_multicast(Object *obj, Error **errp)
+{
+    return FILTER_EBPF(obj)->allow_multicast;
+}
+
+static void filter_ebpf_set_allow_multicast(Object *obj, bool value,
+                                            Error **errp)
+{
+    if (filter_ebpf_check_created(obj, "allow-multicast", errp)) {
+        FILTER_EBPF(obj)->allow_multicast = value;
+    }
+}
+
+static void filter_ebpf_get_uint64(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    uint64_t *field = opaque;
+
+    visit_type_uint64(v, name, field, errp);
+}
+
+static void filter_ebpf_set_uint64(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    uint64_t value;
+
+    if (!filter_ebpf_check_created(obj, name, errp) ||
+        !visit_type_uint64(v, name, &value, errp)) {
+        return;
+    }
+    *(uint64_t *)opaque = value;
+}
+
+static void filter_ebpf_init(Object *obj)
+{
+    FilterEBPFState *s = FILTER_EBPF(obj);
+
+    ebpf_filter_init(&s->ctx);
+    s->allow_multicast = true;
+
+    object_property_add(obj, "rate", "uint64", filter_ebpf_get_uint64,
+                        filter_ebpf_set_uint64, NULL, &s->rate);
+    object_property_add(obj, "burst", "uint64", filter_ebpf_get_uint64,
+                        filter_ebpf_set_uint64, NULL, &s->burst);
+}
+
+static void filter_ebpf_finalize(Object *obj)
+{
+    FilterEBPFState *s = FILTER_EBPF(obj);
+
+    qapi_free_strList(s->allow_mac);
+    qapi_free_uint16List(s->allow_vlan);
+}
+
+static void filter_ebpf_class_init(ObjectClass *oc, const void *data)
+{
+    NetFilterClass *nfc = NETFILTER_CLASS(oc);
+
+    object_class_property_add(oc, "allow-mac", "strList",
+                              filter_ebpf_get_allow_mac,
+                              filter_ebpf_set_allow_mac, NULL, NULL);
+    object_class_property_add(oc, "allow-vlan", "uint16List",
+                              filter_ebpf_get_allow_vlan,
+                              filter_ebpf_set_allow_vlan, NULL, NULL);
+    object_class_property_add_bool(oc, "allow-multicast",
+                                   filter_ebpf_get_allow_multicast,
+                                   filter_ebpf_set_allow_multicast);
+
+    nfc->offloaded = true;
+    nfc->setup = filter_ebpf_setup;
+    nfc->cleanup = filter_ebpf_cleanup;
+    nfc->status_changed = filter_ebpf_status_changed;
+}
+
+static const TypeInfo filter_ebpf_info = {
+    .name = TYPE_FILTER_EBPF,
+    .parent = TYPE_NETFILTER,
+    .class_init = filter_ebpf_class_init,
+    .instance_init = filter_ebpf_init,
+    .instance_finalize = filter_ebpf_finalize,
+    .instance_size = sizeof(FilterEBPFState),
+};
+
+static void register_types(void)
+{
+    type_register_static(&filter_ebpf_info);
+}
+
+type_init(register_types);
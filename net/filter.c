@@ -235,7 +235,21 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "netdev",
                    "a network backend id");
         return;
-    } else if (queues > 1) {
+    }
+
+    if (nfc->offloaded) {
+        /* All queues share the backend, the first one stands for them */
+        nf->netdev = ncs[0];
+        nfc->setup(nf, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+        QTAILQ_INSERT_TAIL(&nf->netdev->offloaded_filters, nf, next);
+        return;
+    }
+
+    if (queues > 1) {
         error_setg(errp, "multiqueue is not supported");
         return;
     }
@@ -245,6 +259,11 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
         return;
     }
 
+    if (ncs[0]->aio_context) {
+        error_setg(errp, "netdev running in an IOThread is not supported");
+        return;
+    }
+
     if (strcmp(nf->position, "head") && strcmp(nf->position, "tail")) {
         Object *container;
         Object *obj;
@@ -312,9 +331,12 @@ static void netfilter_finalize(Object *obj)
         nfc->cleanup(nf);
     }
 
-    if (nf->netdev && !QTAILQ_EMPTY(&nf->netdev->filters) &&
-        QTAILQ_IN_USE(nf, next)) {
-        QTAILQ_REMOVE(&nf->netdev->filters, nf, next);
+    if (nf->netdev && QTAILQ_IN_USE(nf, next)) {
+        if (nfc->offloaded) {
+            QTAILQ_REMOVE(&nf->netdev->offloaded_filters, nf, next);
+        } else if (!QTAILQ_EMPTY(&nf->netdev->filters)) {
+            QTAILQ_REMOVE(&nf->netdev->filters, nf, next);
+        }
     }
     g_free(nf->netdev_id);
     g_free(nf->position);
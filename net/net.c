@@ -47,6 +47,7 @@
 #include "qemu/iov.h"
 #include "qemu/qemu-print.h"
 #include "qemu/main-loop.h"
+#include "block/aio-wait.h"
 #include "qemu/option.h"
 #include "qemu/keyval.h"
 #include "qapi/error.h"
@@ -259,6 +260,12 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
                                        const struct iovec *iov,
                                        int iovcnt,
                                        void *opaque);
+static int qemu_deliver_packet_iov_batch(NetClientState *sender,
+                                         unsigned flags,
+                                         const NetPacketIOV *pkts,
+                                         int count,
+                                         ssize_t *rets,
+                                         void *opaque);
 
 static void qemu_net_client_setup(NetClientState *nc,
                                   NetClientInfo *info,
@@ -284,9 +291,12 @@ static void qemu_net_client_setup(NetClientState *nc,
     QTAILQ_INSERT_TAIL(&net_clients, nc, next);
 
     nc->incoming_queue = qemu_new_net_queue(qemu_deliver_packet_iov, nc);
+    qemu_net_queue_set_deliver_batch(nc->incoming_queue,
+                                     qemu_deliver_packet_iov_batch);
     nc->destructor = destructor;
     nc->is_datapath = is_datapath;
     QTAILQ_INIT(&nc->filters);
+    QTAILQ_INIT(&nc->offloaded_filters);
 }
 
 NetClientState *qemu_new_net_client(NetClientInfo *info,
@@ -381,9 +391,19 @@ NetClientState *qemu_get_peer(NetClientState *nc, int queue_index)
     return ncs->peer;
 }
 
+static void qemu_net_client_detach_aio_context_bh(void *opaque)
+{
+    qemu_set_aio_context(opaque, NULL);
+}
+
 static void qemu_cleanup_net_client(NetClientState *nc,
                                     bool remove_from_net_clients)
 {
+    if (nc->aio_context) {
+        aio_wait_bh_oneshot(nc->aio_context,
+                            qemu_net_client_detach_aio_context_bh, nc);
+    }
+
     if (remove_from_net_clients) {
         QTAILQ_REMOVE(&net_clients, nc, next);
     }
@@ -427,6 +447,9 @@ void qemu_del_net_client(NetClientState *nc)
     QTAILQ_FOREACH_SAFE(nf, &nc->filters, next, next) {
         object_unparent(OBJECT(nf));
     }
+    QTAILQ_FOREACH_SAFE(nf, &nc->offloaded_filters, next, next) {
+        object_unparent(OBJECT(nf));
+    }
 
     /*
      * If there is a peer NIC, transfer ownership to it.  Delete the client
@@ -608,6 +631,27 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+bool qemu_can_set_aio_context(NetClientState *nc)
+{
+    return nc && QTAILQ_EMPTY(&nc->filters) && nc->info->set_aio_context;
+}
+
+/*
+ * Move the client to @ctx, or back to the main loop if @ctx is NULL.
+ * The caller must make sure that the client's handlers are not running,
+ * for example by calling this from the event loop currently running them.
+ */
+void qemu_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (!nc || nc->aio_context == ctx) {
+        return;
+    }
+
+    assert(nc->info->set_aio_context);
+    nc->info->set_aio_context(nc, ctx);
+    nc->aio_context = ctx;
+}
+
 int qemu_can_receive_packet(NetClientState *nc)
 {
     if (nc->receive_disabled) {
@@ -716,6 +760,55 @@ void qemu_flush_queued_packets(NetClientState *nc)
     qemu_flush_or_purge_queued_packets(nc, false);
 }
 
+typedef struct NetDeferredPacket {
+    NetClientState *sender;
+    unsigned flags;
+    int size;
+    uint8_t buf[];
+} NetDeferredPacket;
+
+static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
+                                                 unsigned flags,
+                                                 const uint8_t *buf, int size,
+                                                 NetPacketSent *sent_cb);
+
+static void qemu_send_packet_deferred_bh(void *opaque)
+{
+    NetDeferredPacket *packet = opaque;
+    NetClientState *sender = packet->sender;
+    AioContext *ctx = sender->aio_context ?: qemu_get_aio_context();
+
+    /* The client may have moved while the packet was in flight */
+    if (ctx != qemu_get_current_aio_context()) {
+        aio_bh_schedule_oneshot(ctx, qemu_send_packet_deferred_bh, packet);
+        return;
+    }
+
+    qemu_send_packet_async_with_flags(sender, packet->flags, packet->buf,
+                                      packet->size, NULL);
+    g_free(packet);
+}
+
+/*
+ * Hand a packet sent from another thread, e.g. a self-announcement from
+ * the main loop, over to the event loop running @sender.
+ */
+static ssize_t qemu_send_packet_deferred(NetClientState *sender,
+                                         unsigned flags,
+                                         const uint8_t *buf, int size)
+{
+    NetDeferredPacket *packet = g_malloc(sizeof(*packet) + size);
+
+    packet->sender = sender;
+    packet->flags = flags;
+    packet->size = size;
+    memcpy(packet->buf, buf, size);
+    aio_bh_schedule_oneshot(sender->aio_context,
+                            qemu_send_packet_deferred_bh, packet);
+
+    return size;
+}
+
 static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
                                                  unsigned flags,
                                                  const uint8_t *buf, int size,
@@ -733,6 +826,13 @@ static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
         return size;
     }
 
+    if (sender->aio_context &&
+        sender->aio_context != qemu_get_current_aio_context()) {
+        /* Completion callbacks must run in the sender's thread */
+        assert(!sent_cb);
+        return qemu_send_packet_deferred(sender, flags, buf, size);
+    }
+
     /* Let filters handle the packet first */
     ret = filter_receive(sender, NET_FILTER_DIRECTION_TX,
                          sender, flags, buf, size, sent_cb);
@@ -861,6 +961,50 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
+static int qemu_deliver_packet_iov_batch(NetClientState *sender,
+                                         unsigned flags,
+                                         const NetPacketIOV *pkts,
+                                         int count,
+                                         ssize_t *rets,
+                                         void *opaque)
+{
+    MemReentrancyGuard *owned_reentrancy_guard;
+    NetClientState *nc = opaque;
+    int i;
+
+    if (!nc->info->receive_iov_batch || nc->link_down ||
+        nc->receive_disabled || (flags & QEMU_NET_PACKET_FLAG_RAW)) {
+        for (i = 0; i < count; i++) {
+            rets[i] = qemu_deliver_packet_iov(sender, flags, pkts[i].iov,
+                                              pkts[i].iovcnt, opaque);
+            if (!rets[i]) {
+                break;
+            }
+        }
+        return i;
+    }
+
+    if (nc->info->type != NET_CLIENT_DRIVER_NIC ||
+        qemu_get_nic(nc)->reentrancy_guard->engaged_in_io) {
+        owned_reentrancy_guard = NULL;
+    } else {
+        owned_reentrancy_guard = qemu_get_nic(nc)->reentrancy_guard;
+        owned_reentrancy_guard->engaged_in_io = true;
+    }
+
+    i = nc->info->receive_iov_batch(nc, pkts, count, rets);
+
+    if (owned_reentrancy_guard) {
+        owned_reentrancy_guard->engaged_in_io = false;
+    }
+
+    if (i < count) {
+        nc->receive_disabled = 1;
+    }
+
+    return i;
+}
+
 ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                 const struct iovec *iov, int iovcnt,
                                 NetPacketSent *sent_cb)
@@ -897,6 +1041,47 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                    iov, iovcnt, sent_cb);
 }
 
+/*
+ * Send @count packets in order, in one go if the peer supports it.
+ *
+ * Returns the number of packets sent.  If less than @count, the next
+ * packet has been queued and @sent_cb will be called once it is sent,
+ * the following ones haven't been looked at.
+ */
+int qemu_sendv_packet_batch_async(NetClientState *sender,
+                                  const NetPacketIOV *pkts, int count,
+                                  NetPacketSent *sent_cb)
+{
+    NetClientState *peer = sender->peer;
+    int i;
+
+    if (sender->link_down || !peer) {
+        return count;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (iov_size(pkts[i].iov, pkts[i].iovcnt) > NET_BUFSIZE) {
+            break;
+        }
+    }
+
+    /* Filters work on single packets */
+    if (i < count || !QTAILQ_EMPTY(&sender->filters) ||
+        !QTAILQ_EMPTY(&peer->filters)) {
+        for (i = 0; i < count; i++) {
+            if (!qemu_sendv_packet_async(sender, pkts[i].iov, pkts[i].iovcnt,
+                                         sent_cb)) {
+                break;
+            }
+        }
+        return i;
+    }
+
+    return qemu_net_queue_send_iov_batch(peer->incoming_queue, sender,
+                                         QEMU_NET_PACKET_FLAG_NONE,
+                                         pkts, count, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -1534,7 +1719,7 @@ void print_net_client(Monitor *mon, NetClientState *nc)
                    nc->queue_index,
                    NetClientDriver_str(nc->info->type),
                    nc->info_str);
-    if (!QTAILQ_EMPTY(&nc->filters)) {
+    if (!QTAILQ_EMPTY(&nc->filters) || !QTAILQ_EMPTY(&nc->offloaded_filters)) {
         monitor_printf(mon, "filters:\n");
     }
     QTAILQ_FOREACH(nf, &nc->filters, next) {
@@ -1543,6 +1728,12 @@ void print_net_client(Monitor *mon, NetClientState *nc)
                        object_get_typename(OBJECT(nf)));
         netfilter_print_info(mon, nf);
     }
+    QTAILQ_FOREACH(nf, &nc->offloaded_filters, next) {
+        monitor_printf(mon, "  - %s: type=%s",
+                       object_get_canonical_path_component(OBJECT(nf)),
+                       object_get_typename(OBJECT(nf)));
+        netfilter_print_info(mon, nf);
+    }
 }
 
 RxFilterInfoList *qmp_query_rx_filter(const char *name, Error **errp)
@@ -1674,6 +1865,11 @@ static void net_vm_change_state_handler(void *opaque, bool running,
     NetClientState *tmp;
 
     QTAILQ_FOREACH_SAFE(nc, &net_clients, next, tmp) {
+        /* Clients running in an IOThread are handled by their device */
+        if (nc->aio_context) {
+            continue;
+        }
+
         if (running) {
             /* Flush queued packets and wake up backends. */
             if (nc->peer && qemu_can_send_packet(nc)) {
@@ -38,8 +38,15 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * A batch is delivered in order and stops at the first packet that the
+ * handler can't take.  Only that packet is queued, the caller must not
+ * send the following ones until the callback has been invoked.
  */
 
+/* Maximum number of packets handed to the handler at once */
+#define NET_QUEUE_BATCH 32
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
@@ -54,6 +61,7 @@ struct NetQueue {
     uint32_t nq_maxlen;
     uint32_t nq_count;
     NetQueueDeliverFunc *deliver;
+    NetQueueDeliverBatchFunc *deliver_batch;
 
     QTAILQ_HEAD(, NetPacket) packets;
 
@@ -78,6 +86,12 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
     return queue;
 }
 
+void qemu_net_queue_set_deliver_batch(NetQueue *queue,
+                                      NetQueueDeliverBatchFunc *deliver_batch)
+{
+    queue->deliver_batch = deliver_batch;
+}
+
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
@@ -182,6 +196,33 @@ static ssize_t qemu_net_queue_deliver_iov(NetQueue *queue,
     return ret;
 }
 
+static int qemu_net_queue_deliver_iov_batch(NetQueue *queue,
+                                            NetClientState *sender,
+                                            unsigned flags,
+                                            const NetPacketIOV *pkts,
+                                            int count,
+                                            ssize_t *rets)
+{
+    int i;
+
+    queue->delivering = 1;
+    if (queue->deliver_batch) {
+        i = queue->deliver_batch(sender, flags, pkts, count, rets,
+                                 queue->opaque);
+    } else {
+        for (i = 0; i < count; i++) {
+            rets[i] = queue->deliver(sender, flags, pkts[i].iov,
+                                     pkts[i].iovcnt, queue->opaque);
+            if (!rets[i]) {
+                break;
+            }
+        }
+    }
+    queue->delivering = 0;
+
+    return i;
+}
+
 ssize_t qemu_net_queue_receive(NetQueue *queue,
                                const uint8_t *data,
                                size_t size)
@@ -243,6 +284,45 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/*
+ * Returns the number of packets sent.  If less than @count, the next
+ * packet has been queued and the following ones haven't been looked at.
+ */
+int qemu_net_queue_send_iov_batch(NetQueue *queue,
+                                  NetClientState *sender,
+                                  unsigned flags,
+                                  const NetPacketIOV *pkts,
+                                  int count,
+                                  NetPacketSent *sent_cb)
+{
+    int sent = 0;
+
+    if (queue->delivering || !qemu_can_send_packet(sender)) {
+        qemu_net_queue_append_iov(queue, sender, flags,
+                                  pkts[0].iov, pkts[0].iovcnt, sent_cb);
+        return 0;
+    }
+
+    while (sent < count) {
+        ssize_t rets[NET_QUEUE_BATCH];
+        int n = MIN(count - sent, NET_QUEUE_BATCH);
+        int done;
+
+        done = qemu_net_queue_deliver_iov_batch(queue, sender, flags,
+                                                pkts + sent, n, rets);
+        sent += done;
+        if (done < n) {
+            qemu_net_queue_append_iov(queue, sender, flags, pkts[sent].iov,
+                                      pkts[sent].iovcnt, sent_cb);
+            return sent;
+        }
+    }
+
+    qemu_net_queue_flush(queue);
+
+    return sent;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -265,29 +345,53 @@ bool qemu_net_queue_flush(NetQueue *queue)
         return false;
 
     while (!QTAILQ_EMPTY(&queue->packets)) {
-        NetPacket *packet;
-        int ret;
+        NetPacket *packets[NET_QUEUE_BATCH];
+        struct iovec iov[NET_QUEUE_BATCH];
+        NetPacketIOV pkts[NET_QUEUE_BATCH];
+        ssize_t rets[NET_QUEUE_BATCH];
+        NetPacket *packet = QTAILQ_FIRST(&queue->packets);
+        NetClientState *sender = packet->sender;
+        unsigned flags = packet->flags;
+        int count = 0, sent, i;
+
+        /*
+         * Take consecutive packets with the same sender and flags off the
+         * queue, so that the handler can't see them if it purges it.
+         */
+        while (packet && count < NET_QUEUE_BATCH &&
+               packet->sender == sender && packet->flags == flags) {
+            QTAILQ_REMOVE(&queue->packets, packet, entry);
+            queue->nq_count--;
 
-        packet = QTAILQ_FIRST(&queue->packets);
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        queue->nq_count--;
-
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
-        if (ret == 0) {
+            packets[count] = packet;
+            iov[count].iov_base = packet->data;
+            iov[count].iov_len = packet->size;
+            pkts[count].iov = &iov[count];
+            pkts[count].iovcnt = 1;
+            count++;
+
+            packet = QTAILQ_FIRST(&queue->packets);
+        }
+
+        sent = qemu_net_queue_deliver_iov_batch(queue, sender, flags,
+                                                pkts, count, rets);
+
+        for (i = count - 1; i >= sent; i--) {
             queue->nq_count++;
-            QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
-            return false;
+            QTAILQ_INSERT_HEAD(&queue->packets, packets[i], entry);
         }
 
-        if (packet->sent_cb) {
-            packet->sent_cb(packet->sender, ret);
+        for (i = 0; i < sent; i++) {
+            if (packets[i]->sent_cb) {
+                packets[i]->sent_cb(sender, rets[i]);
+            }
+
+            g_free(packets[i]);
         }
 
-        g_free(packet);
+        if (sent < count) {
+            return false;
+        }
     }
     return true;
 }
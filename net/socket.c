@@ -50,10 +50,15 @@ static void net_socket_writable(void *opaque);
 
 static void net_socket_update_fd_handler(NetSocketState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll ? s->send_fn : NULL,
-                        s->write_poll ? net_socket_writable : NULL,
-                        s);
+    IOHandler *fd_read = s->read_poll ? s->send_fn : NULL;
+    IOHandler *fd_write = s->write_poll ? net_socket_writable : NULL;
+
+    if (s->nc.aio_context) {
+        aio_set_fd_handler(s->nc.aio_context, s->fd, fd_read, fd_write,
+                           NULL, NULL, s);
+    } else {
+        qemu_set_fd_handler(s->fd, fd_read, fd_write, s);
+    }
 }
 
 static void net_socket_read_poll(NetSocketState *s, bool enable)
@@ -410,11 +415,32 @@ static void net_socket_connect(void *opaque)
     net_socket_read_poll(s, true);
 }
 
+static void net_socket_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    if (s->fd == -1) {
+        nc->aio_context = ctx;
+        return;
+    }
+
+    if (nc->aio_context) {
+        aio_set_fd_handler(nc->aio_context, s->fd, NULL, NULL, NULL, NULL,
+                           NULL);
+    } else {
+        qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    }
+
+    nc->aio_context = ctx;
+    net_socket_update_fd_handler(s);
+}
+
 static NetClientInfo net_socket_info = {
     .type = NET_CLIENT_DRIVER_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive,
     .cleanup = net_socket_cleanup,
+    .set_aio_context = net_socket_set_aio_context,
 };
 
 static NetSocketState *net_socket_fd_init_stream(NetClientState *peer,
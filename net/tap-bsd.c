@@ -255,3 +255,8 @@ int tap_fd_set_steering_ebpf(int fd, int prog_fd)
 {
     return -1;
 }
+
+int tap_fd_set_filter_ebpf(int fd, int prog_fd)
+{
+    return -1;
+}
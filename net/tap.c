@@ -31,6 +31,9 @@
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <net/if.h>
+#ifdef CONFIG_LINUX_IO_URING
+#include <liburing.h>
+#endif
 
 #include "net/eth.h"
 #include "net/net.h"
@@ -65,21 +68,40 @@ static const int kernel_feature_bits[] = {
     VHOST_INVALID_FEATURE_BIT
 };
 
+/* Maximum number of packets written with a single io_uring submission */
+#define TAP_TX_BATCH 64
+/* Maximum number of packets read at once */
+#define TAP_RX_BATCH 16
+/* Maximum number of packets read per tap_send() callback */
+#define TAP_RX_MAX_PACKETS 50
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[NET_BUFSIZE];
+    /* TAP_RX_BATCH receive buffers, NULL until QEMU first reads the tap */
+    uint8_t (*bufs)[NET_BUFSIZE];
+    /* Number of packets found by the last read burst */
+    int rx_last;
+    /* Number of received packets queued by the peer */
+    int rx_queued;
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
     bool has_ufo;
     bool has_uso;
     bool enabled;
+    /* an eBPF filter program is attached to the device */
+    bool filter_ebpf;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+#ifdef CONFIG_LINUX_IO_URING
+    /* Used to batch reads and writes, NULL until the first batch */
+    struct io_uring *ring;
+    bool ring_failed;
+#endif
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -90,10 +112,15 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+    IOHandler *fd_read = s->read_poll && s->enabled ? tap_send : NULL;
+    IOHandler *fd_write = s->write_poll && s->enabled ? tap_writable : NULL;
+
+    if (s->nc.aio_context) {
+        aio_set_fd_handler(s->nc.aio_context, s->fd, fd_read, fd_write,
+                           NULL, NULL, s);
+    } else {
+        qemu_set_fd_handler(s->fd, fd_read, fd_write, s);
+    }
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -151,6 +178,186 @@ static ssize_t tap_receive_iov(NetClientState *nc, const struct iovec *iov,
     return tap_write_packet(s, iovp, iovcnt);
 }
 
+static int tap_write_packets(TAPState *s, const NetPacketIOV *pkts, int count,
+                             ssize_t *rets)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        rets[i] = tap_write_packet(s, pkts[i].iov, pkts[i].iovcnt);
+        if (!rets[i]) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+#ifdef CONFIG_LINUX_IO_URING
+static struct io_uring *tap_get_ring(TAPState *s)
+{
+    if (!s->ring && !s->ring_failed) {
+        s->ring = g_new0(struct io_uring, 1);
+        if (io_uring_queue_init(TAP_TX_BATCH, s->ring, 0)) {
+            g_clear_pointer(&s->ring, g_free);
+            s->ring_failed = true;
+        }
+    }
+
+    return s->ring;
+}
+
+static void tap_free_ring(TAPState *s)
+{
+    if (s->ring) {
+        io_uring_queue_exit(s->ring);
+        g_clear_pointer(&s->ring, g_free);
+    }
+}
+
+/*
+ * Reap the completions of @submitted requests, storing their results in
+ * @res at the index found in their user data.  The requests are submitted
+ * with RWF_NOWAIT, so the kernel completes them before io_uring_submit()
+ * returns instead of waiting for the tap, and they are only peeked at.  If
+ * some were handed to io_uring workers anyway, wait for them, which is
+ * short as they can't block on the tap either, and stop using io_uring
+ * for this tap.  If waiting fails, the requests whose completion is
+ * missing fail with -EIO.
+ */
+static void tap_reap_uring(TAPState *s, int *res, int submitted)
+{
+    struct io_uring_cqe *cqe;
+    int i, ret;
+
+    for (i = 0; i < submitted; i++) {
+        res[i] = -EIO;
+    }
+
+    for (i = 0; i < submitted; i++) {
+        ret = io_uring_peek_cqe(s->ring, &cqe);
+        if (ret == -EAGAIN) {
+            warn_report_once("tap: io_uring does not complete tap I/O inline, "
+                             "falling back to read and writev");
+            s->ring_failed = true;
+            do {
+                ret = io_uring_wait_cqe(s->ring, &cqe);
+            } while (ret == -EINTR);
+        }
+        if (ret < 0) {
+            error_report_once("tap: io_uring completion failed (%d), "
+                              "falling back to read and writev", ret);
+            s->ring_failed = true;
+            break;
+        }
+
+        res[(uintptr_t)io_uring_cqe_get_data(cqe)] = cqe->res;
+        io_uring_cqe_seen(s->ring, cqe);
+    }
+
+    if (s->ring_failed) {
+        tap_free_ring(s);
+    }
+}
+
+/*
+ * Write up to TAP_TX_BATCH packets with a single system call.  The writes
+ * are linked so that they are done in order: a write that fails cancels
+ * the following ones.  A write that would block fails with -EAGAIN, and
+ * the remaining packets wait until the tap is writable.
+ */
+static int tap_write_packets_uring(TAPState *s, const NetPacketIOV *pkts,
+                                   int count, ssize_t *rets)
+{
+    struct io_uring *ring = s->ring;
+    int res[TAP_TX_BATCH];
+    int i, submitted;
+
+    count = MIN(count, TAP_TX_BATCH);
+
+    for (i = 0; i < count; i++) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+        io_uring_prep_writev(sqe, s->fd, pkts[i].iov, pkts[i].iovcnt, -1);
+        sqe->rw_flags = RWF_NOWAIT;
+        io_uring_sqe_set_data(sqe, (void *)(uintptr_t)i);
+        if (i < count - 1) {
+            io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+        }
+    }
+
+    submitted = io_uring_submit(ring);
+    if (submitted < count) {
+        /* The ring is large enough for a batch, something is wrong */
+        error_report_once("tap: io_uring submission failed (%d), "
+                          "falling back to writev", submitted);
+        s->ring_failed = true;
+        if (submitted <= 0) {
+            tap_free_ring(s);
+            return tap_write_packets(s, pkts, count, rets);
+        }
+    }
+
+    tap_reap_uring(s, res, submitted);
+    if (res[0] == -EOPNOTSUPP) {
+        /* No RWF_NOWAIT support, the following writes were cancelled */
+        s->ring_failed = true;
+        tap_free_ring(s);
+        return tap_write_packets(s, pkts, count, rets);
+    }
+
+    for (i = 0; i < submitted; i++) {
+        if (res[i] == -EAGAIN || res[i] == -ECANCELED) {
+            break;
+        }
+        /* Other errors drop the packet, like tap_write_packet() */
+        rets[i] = res[i];
+    }
+
+    if (i < count) {
+        /* The next packet gets queued, retry once the tap is writable */
+        tap_write_poll(s, true);
+    }
+
+    return i;
+}
+#endif
+
+static int tap_receive_iov_batch(NetClientState *nc, const NetPacketIOV *pkts,
+                                 int count, ssize_t *rets)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int i;
+
+    if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+        /* Each packet needs a header prepended, no point in batching */
+        for (i = 0; i < count; i++) {
+            rets[i] = tap_receive_iov(nc, pkts[i].iov, pkts[i].iovcnt);
+            if (!rets[i]) {
+                break;
+            }
+        }
+        return i;
+    }
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (count > 1 && tap_get_ring(s)) {
+        for (i = 0; i < count;) {
+            int n = MIN(count - i, TAP_TX_BATCH);
+            int done = tap_write_packets_uring(s, pkts + i, n, rets + i);
+
+            i += done;
+            if (done < n) {
+                break;
+            }
+        }
+        return i;
+    }
+#endif
+
+    return tap_write_packets(s, pkts, count, rets);
+}
+
 static ssize_t tap_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     struct iovec iov = {
@@ -171,47 +378,165 @@ ssize_t tap_read_packet(int tapfd, uint8_t *buf, int maxlen)
 static void tap_send_completed(NetClientState *nc, ssize_t len)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
-    tap_read_poll(s, true);
+
+    /* Don't read more until all the queued packets are gone */
+    assert(s->rx_queued > 0);
+    if (--s->rx_queued == 0) {
+        tap_read_poll(s, true);
+    }
+}
+
+/*
+ * Read up to @count packets into s->bufs, their sizes go to @sizes.
+ * Returns the number of entries of @sizes that were set, failed reads
+ * have a size <= 0.
+ */
+static int tap_read_packets(TAPState *s, int *sizes, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        sizes[i] = tap_read_packet(s->fd, s->bufs[i], sizeof(s->bufs[i]));
+        if (sizes[i] <= 0) {
+            return i;
+        }
+    }
+
+    return i;
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * Same as tap_read_packets() with a single system call.  The reads can't
+ * be linked, as io_uring breaks links on short reads, but they are done
+ * in order when the kernel completes them inline, see tap_reap_uring().
+ * A read that finds no packet fails with -EAGAIN, and doesn't prevent the
+ * following ones from getting one.
+ */
+static int tap_read_packets_uring(TAPState *s, int *sizes, int count)
+{
+    struct io_uring *ring = s->ring;
+    int i, submitted;
+
+    for (i = 0; i < count; i++) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+        io_uring_prep_read(sqe, s->fd, s->bufs[i], sizeof(s->bufs[i]), -1);
+        sqe->rw_flags = RWF_NOWAIT;
+        io_uring_sqe_set_data(sqe, (void *)(uintptr_t)i);
+    }
+
+    submitted = io_uring_submit(ring);
+    if (submitted < count) {
+        error_report_once("tap: io_uring submission failed (%d), "
+                          "falling back to read", submitted);
+        s->ring_failed = true;
+        if (submitted <= 0) {
+            tap_free_ring(s);
+            return tap_read_packets(s, sizes, count);
+        }
+    }
+
+    tap_reap_uring(s, sizes, submitted);
+    if (sizes[0] == -EOPNOTSUPP) {
+        /* No RWF_NOWAIT support, none of the reads was done */
+        s->ring_failed = true;
+        tap_free_ring(s);
+        return tap_read_packets(s, sizes, count);
+    }
+    return submitted;
+}
+#endif
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
-    int size;
     int packets = 0;
 
-    while (true) {
-        uint8_t *buf = s->buf;
-        uint8_t min_pkt[ETH_ZLEN];
-        size_t min_pktsz = sizeof(min_pkt);
+    if (!s->bufs) {
+        /* Not needed when vhost handles the rx path */
+        s->bufs = g_malloc(TAP_RX_BATCH * sizeof(*s->bufs));
+    }
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
-        }
+    while (packets < TAP_RX_MAX_PACKETS) {
+        uint8_t min_pkt[TAP_RX_BATCH][ETH_ZLEN];
+        struct iovec iov[TAP_RX_BATCH];
+        NetPacketIOV pkts[TAP_RX_BATCH];
+        int sizes[TAP_RX_BATCH];
+        int i, want, n, count = 0, sent;
 
-        if (s->host_vnet_hdr_len && size <= s->host_vnet_hdr_len) {
-            /* Invalid packet */
-            break;
+        /*
+         * Post a couple more reads than there were packets last time,
+         * so that bursts are picked up without wasting reads when idle.
+         */
+        want = MIN(MIN(s->rx_last * 2 + 1, TAP_RX_BATCH),
+                   TAP_RX_MAX_PACKETS - packets);
+#ifdef CONFIG_LINUX_IO_URING
+        if (want > 1 && tap_get_ring(s)) {
+            n = tap_read_packets_uring(s, sizes, want);
+        } else
+#endif
+        {
+            n = tap_read_packets(s, sizes, want);
         }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
-        }
+        for (i = 0; i < n; i++) {
+            uint8_t *buf = s->bufs[i];
+            size_t size = sizes[i];
+            size_t min_pktsz = sizeof(min_pkt[count]);
+
+            if (sizes[i] <= 0) {
+                continue;
+            }
+
+            if (s->host_vnet_hdr_len && size <= s->host_vnet_hdr_len) {
+                /* Invalid packet */
+                continue;
+            }
 
-        if (net_peer_needs_padding(&s->nc)) {
-            if (eth_pad_short_frame(min_pkt, &min_pktsz, buf, size)) {
-                buf = min_pkt;
-                size = min_pktsz;
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
             }
+
+            if (net_peer_needs_padding(&s->nc)) {
+                if (eth_pad_short_frame(min_pkt[count], &min_pktsz,
+                                        buf, size)) {
+                    buf = min_pkt[count];
+                    size = min_pktsz;
+                }
+            }
+
+            iov[count].iov_base = buf;
+            iov[count].iov_len = size;
+            pkts[count].iov = &iov[count];
+            pkts[count].iovcnt = 1;
+            count++;
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
-            tap_read_poll(s, false);
+        s->rx_last = count;
+        if (!count) {
             break;
-        } else if (size < 0) {
+        }
+
+        sent = qemu_sendv_packet_batch_async(&s->nc, pkts, count,
+                                             tap_send_completed);
+        if (sent < count) {
+            /*
+             * The peer can't take more, one packet got queued.  Queue the
+             * others that were already read behind it.  Packets queued
+             * before, if the read poll was re-enabled meanwhile, are still
+             * accounted for.
+             */
+            s->rx_queued++;
+            for (i = sent + 1; i < count; i++) {
+                if (!qemu_sendv_packet_async(&s->nc, pkts[i].iov,
+                                             pkts[i].iovcnt,
+                                             tap_send_completed)) {
+                    s->rx_queued++;
+                }
+            }
+            tap_read_poll(s, false);
             break;
         }
 
@@ -221,8 +546,10 @@ static void tap_send(void *opaque)
          * packets that are processed per tap_send() callback to prevent
          * stalling the guest.
          */
-        packets++;
-        if (packets >= 50) {
+        packets += count;
+
+        if (count < want) {
+            /* Drained, the fd handler runs again when more arrives */
             break;
         }
     }
@@ -326,6 +653,10 @@ static void tap_cleanup(NetClientState *nc)
 
     tap_read_poll(s, false);
     tap_write_poll(s, false);
+#ifdef CONFIG_LINUX_IO_URING
+    tap_free_ring(s);
+#endif
+    g_clear_pointer(&s->bufs, g_free);
     close(s->fd);
     s->fd = -1;
 }
@@ -345,6 +676,22 @@ static bool tap_set_steering_ebpf(NetClientState *nc, int prog_fd)
     return tap_fd_set_steering_ebpf(s->fd, prog_fd) == 0;
 }
 
+static bool tap_set_filter_ebpf(NetClientState *nc, int prog_fd)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_DRIVER_TAP);
+
+    /* The kernel only has room for one filter program per device */
+    if (prog_fd >= 0 && s->filter_ebpf) {
+        return false;
+    }
+    if (tap_fd_set_filter_ebpf(s->fd, prog_fd)) {
+        return false;
+    }
+    s->filter_ebpf = prog_fd >= 0;
+    return true;
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -366,11 +713,27 @@ static VHostNetState *tap_get_vhost_net(NetClientState *nc)
 
 /* fd support */
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    if (nc->aio_context) {
+        aio_set_fd_handler(nc->aio_context, s->fd, NULL, NULL, NULL, NULL,
+                           NULL);
+    } else {
+        qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    }
+
+    nc->aio_context = ctx;
+    tap_update_fd_handler(s);
+}
+
 static NetClientInfo net_tap_info = {
     .type = NET_CLIENT_DRIVER_TAP,
     .size = sizeof(TAPState),
     .receive = tap_receive,
     .receive_iov = tap_receive_iov,
+    .receive_iov_batch = tap_receive_iov_batch,
     .poll = tap_poll,
     .cleanup = tap_cleanup,
     .has_ufo = tap_has_ufo,
@@ -382,7 +745,9 @@ static NetClientInfo net_tap_info = {
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
     .set_steering_ebpf = tap_set_steering_ebpf,
+    .set_filter_ebpf = tap_set_filter_ebpf,
     .get_vhost_net = tap_get_vhost_net,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -21,6 +21,7 @@
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
 #include "qemu/option.h"
+#include "qemu/timer.h"
 #include "trace.h"
 
 static const int user_feature_bits[] = {
@@ -325,6 +326,7 @@ static void net_vhost_user_event(void *opaque, QEMUChrEvent event)
     NetClientState *ncs[MAX_QUEUE_NUM];
     NetVhostUserState *s;
     Chardev *chr;
+    int64_t start;
     int queues;
 
     queues = qemu_find_net_clients_except(name, ncs,
@@ -337,13 +339,17 @@ static void net_vhost_user_event(void *opaque, QEMUChrEvent event)
     trace_vhost_user_event(chr->label, event);
     switch (event) {
     case CHR_EVENT_OPENED:
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         if (vhost_user_start(queues, ncs, s->vhost_user) < 0) {
             qemu_chr_fe_disconnect(&s->chr);
             return;
         }
         s->watch = qemu_chr_fe_add_watch(&s->chr, G_IO_HUP,
                                          net_vhost_user_watch, s);
+        /* Restarts the rings if the guest is running */
         net_client_set_link(ncs, queues, true);
+        trace_vhost_user_started(chr->label, queues,
+                                 qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start);
         s->started = true;
         qapi_event_send_netdev_vhost_user_connected(name, chr->label);
         break;
@@ -698,11 +698,15 @@ static ssize_t vhost_vdpa_net_svq_flush(VhostVDPAState *s, size_t len)
 {
     /* device uses a one-byte length ack for each control command */
     ssize_t dev_written = vhost_vdpa_net_svq_poll(s, len);
-    if (unlikely(dev_written != len)) {
+    if (unlikely(len && dev_written < sizeof(*s->status))) {
         return -EIO;
     }
 
-    /* check the device's ack */
+    /*
+     * check the device's ack.  An in order device may only report the
+     * length written for the last command of a batch, but the acks of the
+     * commands it didn't complete are still VIRTIO_NET_ERR.
+     */
     for (int i = 0; i < len; ++i) {
         if (s->status[i] != VIRTIO_NET_OK) {
             return -EIO;
@@ -758,6 +762,7 @@ static ssize_t vhost_vdpa_net_load_cmd(VhostVDPAState *s,
     iov_copy(&out, 1, out_cursor, 1, 0, cmd_size);
     /* extract the required buffer from the cursor for input */
     iov_copy(&in, 1, in_cursor, 1, 0, sizeof(*s->status));
+    *(virtio_net_ctrl_ack *)in.iov_base = VIRTIO_NET_ERR;
 
     r = vhost_vdpa_net_cvq_add(s, &out, 1, &in, 1);
     if (unlikely(r < 0)) {
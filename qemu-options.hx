@@ -234,6 +234,7 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
     "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
+    "                dirty-ring-reap-threads=n (threads reaping the KVM dirty rings, default 0)\n"
     "                eager-split-size=n (KVM Eager Page Split chunk size, default 0, disabled. ARM only)\n"
     "                notify-vmexit=run|internal-error|disable,notify-window=n (enable notify VM exit and set notify window, x86 only)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n"
@@ -294,6 +295,12 @@ SRST
         is disabled (dirty-ring-size=0).  When enabled, KVM will instead
         record dirty pages in a bitmap.
 
+    ``dirty-ring-reap-threads=n``
+        When the KVM dirty ring is enabled, it sets the number of threads
+        that collect the dirty pages from the rings of the vCPUs in
+        parallel.  The default of 0 uses one thread per 32 vCPUs, up to
+        the number of host CPUs.  Set it to 1 to collect them serially.
+
     ``eager-split-size=n``
         KVM implements dirty page logging at the PAGE_SIZE granularity and
         enabling dirty-logging on a huge-page requires breaking it into
@@ -2946,11 +2953,13 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
 #endif
 #ifdef CONFIG_AF_XDP
     "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
-    "         [,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z]\n"
-    "         [,map-path=/path/to/socket/map][,map-start-index=i]\n"
+    "         [,zero-copy=on|off][,queues=n][,start-queue=m][,inhibit=on|off]\n"
+    "         [,sock-fds=x:y:...:z][,map-path=/path/to/socket/map][,map-start-index=i]\n"
+    "         [,busy-poll-budget=n]\n"
     "                attach to the existing network interface 'name' with AF_XDP socket\n"
     "                use 'mode=MODE' to specify an XDP program attach mode\n"
     "                use 'force-copy=on|off' to force XDP copy mode even if device supports zero-copy (default: off)\n"
+    "                use 'zero-copy=on|off' to fail if the device doesn't support XDP zero-copy mode (default: off)\n"
     "                use 'inhibit=on|off' to inhibit loading of a default XDP program (default: off)\n"
     "                with inhibit=on,\n"
     "                  use 'sock-fds' to provide file descriptors for already open AF_XDP sockets\n"
@@ -2959,6 +2968,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                  and use 'map-start-index' to specify the starting index for the map (default: 0) (Since 10.1)\n"
     "                use 'queues=n' to specify how many queues of a multiqueue interface should be used\n"
     "                use 'start-queue=m' to specify the first queue that should be used\n"
+    "                use 'busy-poll-budget=n' to enable preferred busy polling with a NAPI budget of n (default: 0, disabled)\n"
 #endif
 #ifdef CONFIG_POSIX
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
@@ -3780,7 +3790,7 @@ SRST
         # launch QEMU instance
         |qemu_system| linux.img -nic vde,sock=/tmp/myswitch
 
-``-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off][,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z][,map-path=/path/to/socket/map][,map-start-index=i]``
+``-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off][,zero-copy=on|off][,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z][,map-path=/path/to/socket/map][,map-start-index=i][,busy-poll-budget=n]``
     Configure AF_XDP backend to connect to a network interface 'name'
     using AF_XDP socket.  A specific program attach mode for a default
     XDP program can be forced with 'mode', defaults to best-effort,
@@ -3845,6 +3855,34 @@ SRST
     for insertion into the socket map.  The combination of 'map-path' and
     'sock-fds' together is not supported.
 
+    Packets are received from and transmitted to the guest straight out of
+    and into the UMEM frames.  With 'zero-copy=on' the device has to support
+    XDP zero-copy mode, so the NIC also accesses these frames directly,
+    otherwise the creation of the netdev fails instead of silently falling
+    back to copy mode.
+
+    Each queue of the netdev feeds the queue pair of the same index of a
+    multiqueue virtio-net device, so the RSS configuration of the host
+    interface decides where flows land.  If the guest enables RSS, the
+    virtio-net device steers packets again according to the guest's
+    configuration.
+
+    'busy-poll-budget' enables preferred busy polling of the interface
+    queues with the given NAPI budget.  The device interrupts are then
+    deferred and the queues are driven by the syscalls on the sockets.
+    Busy polling works best with the netdev served by an IOThread through
+    the 'iothread-vq-mapping' property of virtio-net, whose adaptive
+    polling loop then polls the queues.
+
+    .. parsed-literal::
+
+        echo 2 > /sys/class/net/eth0/napi_defer_hard_irqs
+        echo 200000 > /sys/class/net/eth0/gro_flush_timeout
+        |qemu_system| linux.img -object iothread,id=io0,poll-max-ns=50000 \\
+            -device '{"driver":"virtio-net-pci","netdev":"n1","mq":true,
+                      "iothread-vq-mapping":[{"iothread":"io0"}]}' \\
+            -netdev af-xdp,id=n1,ifname=eth0,queues=2,busy-poll-budget=64
+
 ``-netdev vhost-user,chardev=id[,vhostforce=on|off][,queues=n]``
     Establish a vhost-user netdev, backed by a chardev id. The chardev
     should be a unix domain socket backed one. The vhost-user uses a
@@ -5459,6 +5497,14 @@ SRST
     forcefully killed with SIGKILL before the main QEMU process has
     terminated completely.
 
+    When QEMU exits normally, the cleanup process also takes over the
+    iommufd and VFIO container file descriptors, so that unpinning their DMA
+    mappings does not delay the exit of QEMU, and unmaps the guest RAM using
+    several processes in parallel. VFIO devices are released when QEMU
+    exits. With a legacy VFIO container, their groups stay in use until the
+    cleanup process is done; wait for "cleanup/<QEMU_PID>" to exit before
+    reusing them.
+
     ``chroot=dir`` can be used for doing a chroot to the specified directory
     immediately before starting the guest execution. This is especially useful
     in combination with ``user=...``.
@@ -5590,6 +5636,10 @@ SRST
 
         The ``prealloc`` boolean option enables memory preallocation.
 
+        The ``prealloc-background`` boolean option lets the guest start
+        without waiting for the preallocation. The memory is then
+        preallocated while the guest runs, using idle host CPU time.
+
         The ``host-nodes`` option binds the memory range to a list of
         NUMA host nodes.
 
@@ -5899,7 +5949,26 @@ SRST
 
         ``behind``: insert behind the specified filter (default).
 
-    ``-object filter-mirror,id=id,netdev=netdevid,outdev=chardevid,queue=all|rx|tx[,vnet_hdr_support][,position=head|tail|id=<id>][,insert=behind|before]``
+    ``-object filter-ebpf,id=id,netdev=netdevid[,allow-mac.N=mac][,allow-vlan.N=vlanid][,allow-multicast=on|off][,rate=bytes][,burst=bytes][,status=on|off]``
+        Filter the packets sent by the tap netdev netdevid to the guest
+        with an eBPF program run by the host kernel.  The packets don't
+        go through QEMU, so the filter can be used with vhost-net and
+        multiqueue netdevs.  Only one filter-ebpf can be attached to a
+        netdev.
+
+        ``allow-mac.N``: only deliver the frames sent to one of these
+        MAC addresses.  Broadcast and multicast frames are still
+        delivered unless ``allow-multicast=off``.
+
+        ``allow-vlan.N``: only deliver the frames of these VLANs, VLAN
+        ID 0 stands for untagged frames.
+
+        ``rate``: limit the traffic delivered to the guest to this many
+        bytes per second, frames above the limit are dropped.
+        ``burst`` is the size of the bursts allowed above the rate, it
+        defaults to one second worth of traffic.
+
+[,vnet_hdr_support][,position=head|tail|id=<id>][,insert=behind|before]``
         filter-mirror on netdev netdevid,mirror net packet to
         chardevchardevid, if it has the vnet\_hdr\_support flag,
         filter-mirror will mirror packet with vnet\_hdr\_len.
@@ -5931,7 +6000,7 @@ SRST
         stored. The file format is libpcap, so it can be analyzed with
         tools such as tcpdump or Wireshark.
 
-    ``-object colo-compare,id=id,primary_in=chardevid,secondary_in=chardevid,outdev=chardevid,iothread=id[,vnet_hdr_support][,notify_dev=id][,compare_timeout=@var{ms}][,expired_scan_cycle=@var{ms}][,max_queue_size=@var{size}]``
+    ``-object colo-compare,id=id,primary_in=chardevid,secondary_in=chardevid,outdev=chardevid,iothread=id[,vnet_hdr_support][,notify_dev=id][,compare_timeout=@var{ms}][,expired_scan_cycle=@var{ms}][,max_queue_size=@var{size}][,compare_threads=@var{n}]``
         Colo-compare gets packet from primary\_in chardevid and
         secondary\_in, then compare whether the payload of primary packet
         and secondary packet are the same. If same, it will output
@@ -5945,6 +6014,11 @@ SRST
         is to set the period of scanning expired primary node network packets.
         The max\_queue\_size=@var{size} is to set the max compare queue
         size depend on user environment.
+        The compare\_threads=@var{n} option spreads the connections over
+        @var{n} threads that compare their packets, instead of comparing
+        them in the iothread.  The compared\_packets, compare\_latency\_avg
+        and compare\_latency\_max read-only properties report how long
+        primary packets waited for the secondary, in milliseconds.
         If user want to use Xen COLO, need to add the notify\_dev to
         notify Xen colo-frame to do checkpoint.
 
@@ -14,9 +14,18 @@
 #include "qemu/osdep.h"
 #include <dirent.h>
 #include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <sched.h>
 
 #include "qemu/async-teardown.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/notify.h"
+#include "qemu/sockets.h"
+#include "qemu/units.h"
+#include "system/ramblock.h"
+#include "system/system.h"
 
 #ifdef _SC_THREAD_STACK_MIN
 #define CLONE_STACK_SIZE sysconf(_SC_THREAD_STACK_MIN)
@@ -24,24 +33,95 @@
 #define CLONE_STACK_SIZE 16384
 #endif
 
+/*
+ * Guest RAM is unmapped in chunks of this size by up to
+ * ASYNC_TEARDOWN_MAX_WORKERS processes, so that a single large RAM block
+ * is released in parallel too.
+ */
+#define ASYNC_TEARDOWN_CHUNK (1 * GiB)
+#define ASYNC_TEARDOWN_MAX_WORKERS 16
+
+typedef struct AsyncTeardownChunk {
+    void *addr;
+    size_t size;
+} AsyncTeardownChunk;
+
+/*
+ * Filled by qemu when it exits, and only read by the teardown process
+ * once qemu is gone: the two share their address space.
+ */
+static struct {
+    AsyncTeardownChunk *chunks;
+    unsigned nr_chunks;
+    unsigned next_chunk;
+    void *stacks[ASYNC_TEARDOWN_MAX_WORKERS];
+    unsigned nr_workers;
+} teardown;
+
 static pid_t the_ppid;
+/* qemu's end of the socket, the other end belongs to the teardown process */
+static int teardown_fd = -1;
+static int teardown_peer_fd = -1;
+static Notifier teardown_exit_notifier;
 
-static void hup_handler(int signal)
+/*
+ * Receive the file descriptors that qemu hands over, until it exits and
+ * its end of the socket is closed.  They stay open until the teardown
+ * process releases them.
+ */
+static void async_teardown_receive_fds(void)
 {
-    /* Check every second if this process has been reparented. */
-    while (the_ppid == getppid()) {
-        /* sleep() is safe to use in a signal handler. */
-        sleep(1);
+    union {
+        struct cmsghdr cmsg;
+        char control[CMSG_SPACE(sizeof(int))];
+    } u;
+    char c;
+    struct iovec iov = { .iov_base = &c, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = u.control,
+        .msg_controllen = sizeof(u.control),
+    };
+
+    while (recvmsg(teardown_peer_fd, &msg, MSG_CMSG_CLOEXEC) > 0) {
+        msg.msg_controllen = sizeof(u.control);
     }
+}
 
-    /* At this point the parent process has terminated completely. */
+static int async_teardown_worker_fn(void *arg)
+{
+    unsigned i;
+
+    while ((i = qatomic_fetch_inc(&teardown.next_chunk)) < teardown.nr_chunks) {
+        munmap(teardown.chunks[i].addr, teardown.chunks[i].size);
+    }
     _exit(0);
 }
 
+/*
+ * Unmap the guest RAM from several processes sharing the address space,
+ * while this one closes the file descriptors handed over by qemu.  For
+ * VFIO, this is what unpins the DMA mappings.
+ */
+static void async_teardown_release(void)
+{
+    unsigned i;
+
+    for (i = 0; i < teardown.nr_workers; i++) {
+        clone(async_teardown_worker_fn, teardown.stacks[i],
+              CLONE_VM | CLONE_FILES | SIGCHLD, NULL);
+    }
+
+    qemu_close_all_open_fd(NULL, 0);
+
+    while (wait(NULL) > 0) {
+        /* nothing */
+    }
+}
+
 static int async_teardown_fn(void *arg)
 {
-    struct sigaction sa = { .sa_handler = hup_handler };
-    sigset_t hup_signal;
     char name[16];
 
     /* Set a meaningful name for this process. */
@@ -52,30 +132,100 @@ static int async_teardown_fn(void *arg)
      * Close all file descriptors that might have been inherited from the
      * main qemu process when doing clone, needed to make libvirt happy.
      */
-    qemu_close_all_open_fd(NULL, 0);
-
-    /* Set up a handler for SIGHUP and unblock SIGHUP. */
-    sigaction(SIGHUP, &sa, NULL);
-    sigemptyset(&hup_signal);
-    sigaddset(&hup_signal, SIGHUP);
-    sigprocmask(SIG_UNBLOCK, &hup_signal, NULL);
-
-    /* Ask to receive SIGHUP when the parent dies. */
-    prctl(PR_SET_PDEATHSIG, SIGHUP);
+    qemu_close_all_open_fd(&teardown_peer_fd, 1);
 
     /*
-     * Sleep forever, unless the parent process has already terminated. The
-     * only interruption can come from the SIGHUP signal, which in normal
-     * operation is received when the parent process dies.
+     * Wait for the parent process to exit; the socket reaches end of file
+     * when the last of its threads is gone.
      */
-    if (the_ppid == getppid()) {
-        pause();
+    async_teardown_receive_fds();
+
+    /* Check every second if this process has been reparented. */
+    while (the_ppid == getppid()) {
+        sleep(1);
     }
 
     /* At this point the parent process has terminated completely. */
+    async_teardown_release();
     _exit(0);
 }
 
+static int async_teardown_add_ram_block(RAMBlock *rb, void *opaque)
+{
+    GArray *chunks = opaque;
+    uint8_t *host = qemu_ram_get_host_addr(rb);
+    size_t size = qemu_ram_get_max_length(rb);
+    AsyncTeardownChunk chunk;
+    size_t offset;
+
+    /* Only unmap what qemu mapped itself */
+    if (!host || (rb->flags & RAM_PREALLOC)) {
+        return 0;
+    }
+
+    for (offset = 0; offset < size; offset += ASYNC_TEARDOWN_CHUNK) {
+        chunk.addr = host + offset;
+        chunk.size = MIN(size - offset, ASYNC_TEARDOWN_CHUNK);
+        g_array_append_val(chunks, chunk);
+    }
+    return 0;
+}
+
+/*
+ * Called when qemu exits: tell the teardown process what guest RAM it
+ * will unmap, and allocate the stacks of its workers.
+ */
+static void async_teardown_exit(Notifier *n, void *unused)
+{
+    GArray *chunks = g_array_new(false, false, sizeof(AsyncTeardownChunk));
+    unsigned nr_workers;
+    size_t stack_size;
+    unsigned i;
+
+    qemu_ram_foreach_block(async_teardown_add_ram_block, chunks);
+
+    nr_workers = MIN(chunks->len, ASYNC_TEARDOWN_MAX_WORKERS);
+    nr_workers = MIN(nr_workers, sysconf(_SC_NPROCESSORS_ONLN));
+    for (i = 0; i < nr_workers; i++) {
+        stack_size = CLONE_STACK_SIZE;
+        teardown.stacks[i] = (char *)qemu_alloc_stack(&stack_size) +
+                             stack_size;
+    }
+
+    teardown.nr_chunks = chunks->len;
+    teardown.chunks = (AsyncTeardownChunk *)g_array_free(chunks, false);
+    teardown.nr_workers = nr_workers;
+}
+
+void async_teardown_add_fd(int fd)
+{
+    union {
+        struct cmsghdr cmsg;
+        char control[CMSG_SPACE(sizeof(int))];
+    } u = {};
+    char c = 0;
+    struct iovec iov = { .iov_base = &c, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = u.control,
+        .msg_controllen = sizeof(u.control),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    if (teardown_fd < 0 || fd < 0) {
+        return;
+    }
+
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    /* If this fails, qemu closes the file descriptor itself when exiting */
+    sendmsg(teardown_fd, &msg, MSG_NOSIGNAL);
+}
+
 /*
  * Allocate a new stack of a reasonable size, and return a pointer to its top.
  */
@@ -98,6 +248,15 @@ static void *new_stack_for_clone(void)
 void init_async_teardown(void)
 {
     sigset_t all_signals, old_signals;
+    int sv[2];
+
+    if (qemu_socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        error_report("async-teardown: cannot create socket pair: %s",
+                     strerror(errno));
+        exit(1);
+    }
+    teardown_fd = sv[0];
+    teardown_peer_fd = sv[1];
 
     the_ppid = getpid();
 
@@ -105,4 +264,9 @@ void init_async_teardown(void)
     sigprocmask(SIG_BLOCK, &all_signals, &old_signals);
     clone(async_teardown_fn, new_stack_for_clone(), CLONE_VM, NULL);
     sigprocmask(SIG_SETMASK, &old_signals, NULL);
+
+    close(teardown_peer_fd);
+
+    teardown_exit_notifier.notify = async_teardown_exit;
+    qemu_add_exit_notifier(&teardown_exit_notifier);
 }
@@ -22,6 +22,7 @@
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/qemu-print.h"
+#include "qemu/cutils.h"
 #include "qemu/target-info.h"
 #include "qom/object.h"
 #include "trace.h"
@@ -41,6 +42,10 @@
 
 static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
+/* Regions changed by the current transaction */
+static GHashTable *memory_region_update_dirty;
+/* All the views must be rendered again, e.g. dirty logging changed */
+static bool memory_region_update_all;
 static bool ioeventfd_update_pending;
 unsigned int global_dirty_tracking;
 
@@ -51,6 +56,10 @@ static QTAILQ_HEAD(, AddressSpace) address_spaces
     = QTAILQ_HEAD_INITIALIZER(address_spaces);
 
 static GHashTable *flat_views;
+/* The views in flat_views, looked up by their ranges */
+static GHashTable *flat_views_by_content;
+/* The view of a NULL root, kept alive forever */
+static FlatView *empty_view;
 
 typedef struct AddrRange AddrRange;
 
@@ -260,11 +269,14 @@ static bool flatrange_equal(FlatRange *a, FlatRange *b)
 
 static FlatView *flatview_new(MemoryRegion *mr_root)
 {
+    static uint64_t serial;
     FlatView *view;
 
     view = g_new0(FlatView, 1);
     view->ref = 1;
+    view->serial = ++serial;
     view->root = mr_root;
+    view->deps = g_hash_table_new(g_direct_hash, g_direct_equal);
     memory_region_ref(mr_root);
     trace_flatview_new(view, mr_root);
 
@@ -300,6 +312,7 @@ static void flatview_destroy(FlatView *view)
         memory_region_unref(view->ranges[i].mr);
     }
     g_free(view->ranges);
+    g_hash_table_unref(view->deps);
     memory_region_unref(view->root);
     g_free(view);
 }
@@ -313,7 +326,7 @@ void flatview_unref(FlatView *view)
 {
     if (qatomic_fetch_dec(&view->ref) == 1) {
         trace_flatview_destroy_rcu(view, view->root);
-        assert(view->root);
+        assert(view != empty_view);
         call_rcu(view, flatview_destroy, rcu);
     }
 }
@@ -607,6 +620,9 @@ static void render_memory_region(FlatView *view,
     FlatRange fr;
     AddrRange tmp;
 
+    /* Even if it isn't visible, it could become so */
+    g_hash_table_add(view->deps, mr);
+
     if (!mr->enabled) {
         return;
     }
@@ -742,11 +758,76 @@ static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
     return NULL;
 }
 
-/* Render a memory topology into a list of disjoint absolute ranges. */
+static guint flatview_content_hash(gconstpointer key)
+{
+    const FlatView *view = key;
+    guint hash = view->nr;
+    unsigned i;
+
+    for (i = 0; i < view->nr; i++) {
+        FlatRange *fr = &view->ranges[i];
+
+        hash = hash * 31 + g_direct_hash(fr->mr);
+        hash = hash * 31 + int128_getlo(fr->addr.start);
+        hash = hash * 31 + int128_getlo(fr->addr.size);
+        hash = hash * 31 + fr->offset_in_region;
+    }
+    return hash;
+}
+
+static gboolean flatview_content_equal(gconstpointer a, gconstpointer b)
+{
+    const FlatView *view_a = a, *view_b = b;
+    unsigned i;
+
+    if (view_a->nr != view_b->nr) {
+        return false;
+    }
+    for (i = 0; i < view_a->nr; i++) {
+        if (!flatrange_equal(&view_a->ranges[i], &view_b->ranges[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Make @root resolve to @view, which takes a new reference */
+static void flatviews_add(MemoryRegion *root, FlatView *view)
+{
+    flatview_ref(view);
+    if (!view->roots++ && view != empty_view) {
+        g_hash_table_add(flat_views_by_content, view);
+    }
+    g_hash_table_replace(flat_views, root, view);
+}
+
+static void flatviews_remove(gpointer data)
+{
+    FlatView *view = data;
+
+    assert(view->roots);
+    if (!--view->roots &&
+        g_hash_table_lookup(flat_views_by_content, view) == view) {
+        g_hash_table_remove(flat_views_by_content, view);
+    }
+    flatview_unref(view);
+}
+
+/*
+ * Render a memory topology into a list of disjoint absolute ranges.
+ *
+ * Different roots often render to the same ranges, for example the DMA
+ * address spaces of devices behind an IOMMU in passthrough mode.  They
+ * share the view and its dispatch tree.  A view never changes once it is
+ * rendered, an address space whose topology diverges gets a new one.
+ *
+ * A shared view has no root: any of its roots may go away while the others
+ * still use it, so it must not keep the one it was rendered from alive.
+ */
 static FlatView *generate_memory_topology(MemoryRegion *mr)
 {
     int i;
-    FlatView *view;
+    FlatView *view, *shared;
 
     view = flatview_new(mr);
 
@@ -757,6 +838,36 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
     }
     flatview_simplify(view);
 
+    /*
+     * Roots that render no ranges may share a view, but never empty_view:
+     * it lives forever and would inherit dependencies it can't drop.
+     */
+    shared = mr ? g_hash_table_lookup(flat_views_by_content, view) : NULL;
+    if (shared) {
+        GHashTableIter iter;
+        gpointer dep;
+
+        /* The shared view is stale when any of its roots changes */
+        g_hash_table_iter_init(&iter, view->deps);
+        while (g_hash_table_iter_next(&iter, &dep, NULL)) {
+            g_hash_table_add(shared->deps, dep);
+        }
+        trace_flatview_share(shared, mr);
+        if (shared->root) {
+            /*
+             * Drop the reference from the RCU callback that destroys
+             * @view, like any other root.  @mr is alive, as it is being
+             * rendered.
+             */
+            memory_region_unref(view->root);
+            view->root = shared->root;
+            shared->root = NULL;
+        }
+        flatviews_add(mr, shared);
+        flatview_unref(view);
+        return shared;
+    }
+
     view->dispatch = address_space_dispatch_new(view);
     for (i = 0; i < view->nr; i++) {
         MemoryRegionSection mrs =
@@ -764,7 +875,8 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
         flatview_add_to_dispatch(view, &mrs);
     }
     address_space_dispatch_compact(view->dispatch);
-    g_hash_table_replace(flat_views, mr, view);
+    flatviews_add(mr, view);
+    flatview_unref(view);
 
     return view;
 }
@@ -1037,34 +1149,69 @@ static void address_space_update_topology_pass(AddressSpace *as,
 
 static void flatviews_init(void)
 {
-    static FlatView *empty_view;
-
     if (flat_views) {
         return;
     }
 
     flat_views = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
-                                       (GDestroyNotify) flatview_unref);
+                                       flatviews_remove);
+    if (!flat_views_by_content) {
+        flat_views_by_content = g_hash_table_new(flatview_content_hash,
+                                                 flatview_content_equal);
+    }
     if (!empty_view) {
         empty_view = generate_memory_topology(NULL);
         /* We keep it alive forever in the global variable.  */
         flatview_ref(empty_view);
     } else {
-        g_hash_table_replace(flat_views, NULL, empty_view);
-        flatview_ref(empty_view);
+        flatviews_add(NULL, empty_view);
+    }
+}
+
+static gboolean flatview_is_stale(gpointer key, gpointer value,
+                                  gpointer opaque)
+{
+    FlatView *view = value;
+    GHashTableIter iter;
+    gpointer mr;
+
+    g_hash_table_iter_init(&iter, memory_region_update_dirty);
+    while (g_hash_table_iter_next(&iter, &mr, NULL)) {
+        if (g_hash_table_contains(view->deps, mr)) {
+            return true;
+        }
     }
+    return false;
 }
 
-static void flatviews_reset(void)
+static gboolean flatview_is_unused(gpointer key, gpointer value,
+                                   gpointer opaque)
+{
+    FlatView *view = value;
+
+    /* Only referenced by flat_views */
+    return qatomic_read(&view->ref) == view->roots;
+}
+
+/*
+ * Render the views that depend on the regions changed by the transaction,
+ * the others are kept as they are.
+ */
+static void flatviews_update(void)
 {
     AddressSpace *as;
+    unsigned rendered = 0;
 
-    if (flat_views) {
+    if (flat_views && memory_region_update_all) {
         g_hash_table_unref(flat_views);
         flat_views = NULL;
     }
     flatviews_init();
 
+    if (memory_region_update_dirty) {
+        g_hash_table_foreach_remove(flat_views, flatview_is_stale, NULL);
+    }
+
     /* Render unique FVs */
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
@@ -1074,7 +1221,10 @@ static void flatviews_reset(void)
         }
 
         generate_memory_topology(physmr);
+        rendered++;
     }
+
+    trace_flatviews_update(memory_region_update_all, rendered);
 }
 
 static void address_space_set_flatview(AddressSpace *as)
@@ -1133,6 +1283,23 @@ static void address_space_update_topology(AddressSpace *as)
     address_space_set_flatview(as);
 }
 
+/*
+ * Called within a transaction when a change to @mr affects the views
+ * that include it, if @visible.
+ */
+static void memory_region_mark_changed(MemoryRegion *mr, bool visible)
+{
+    if (!visible) {
+        return;
+    }
+    if (!memory_region_update_dirty) {
+        memory_region_update_dirty = g_hash_table_new(g_direct_hash,
+                                                      g_direct_equal);
+    }
+    g_hash_table_add(memory_region_update_dirty, mr);
+    memory_region_update_pending = true;
+}
+
 void memory_region_transaction_begin(void)
 {
     qemu_flush_coalesced_mmio_buffer();
@@ -1149,15 +1316,25 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
-            flatviews_reset();
+            flatviews_update();
 
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+                FlatView *old_view = address_space_to_flatview(as);
+
                 address_space_set_flatview(as);
-                address_space_update_ioeventfds(as);
+                if (ioeventfd_update_pending ||
+                    address_space_to_flatview(as) != old_view) {
+                    address_space_update_ioeventfds(as);
+                }
             }
+            /* Drop the views that no address space uses anymore */
+            g_hash_table_foreach_remove(flat_views, flatview_is_unused, NULL);
+
             memory_region_update_pending = false;
+            memory_region_update_all = false;
+            g_clear_pointer(&memory_region_update_dirty, g_hash_table_unref);
             ioeventfd_update_pending = false;
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
         } else if (ioeventfd_update_pending) {
@@ -2246,7 +2423,7 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    memory_region_mark_changed(mr, mr->enabled);
     memory_region_transaction_commit();
 }
 
@@ -2376,7 +2553,7 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        memory_region_mark_changed(mr, mr->enabled);
         memory_region_transaction_commit();
     }
 }
@@ -2386,7 +2563,7 @@ void memory_region_set_nonvolatile(MemoryRegion *mr, bool nonvolatile)
     if (mr->nonvolatile != nonvolatile) {
         memory_region_transaction_begin();
         mr->nonvolatile = nonvolatile;
-        memory_region_update_pending |= mr->enabled;
+        memory_region_mark_changed(mr, mr->enabled);
         memory_region_transaction_commit();
     }
 }
@@ -2396,7 +2573,7 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
-        memory_region_update_pending |= mr->enabled;
+        memory_region_mark_changed(mr, mr->enabled);
         memory_region_transaction_commit();
     }
 }
@@ -2634,7 +2811,7 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    memory_region_mark_changed(mr, mr->enabled && subregion->enabled);
     memory_region_transaction_commit();
 }
 
@@ -2684,7 +2861,7 @@ void memory_region_del_subregion(MemoryRegion *mr,
     }
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
     memory_region_unref(subregion);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    memory_region_mark_changed(mr, mr->enabled && subregion->enabled);
     memory_region_transaction_commit();
 }
 
@@ -2695,7 +2872,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
-    memory_region_update_pending = true;
+    memory_region_mark_changed(mr, true);
     memory_region_transaction_commit();
 }
 
@@ -2711,7 +2888,7 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
     }
     memory_region_transaction_begin();
     mr->size = s;
-    memory_region_update_pending = true;
+    memory_region_mark_changed(mr, true);
     memory_region_transaction_commit();
 }
 
@@ -2747,7 +2924,7 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    memory_region_mark_changed(mr, mr->enabled);
     memory_region_transaction_commit();
 }
 
@@ -2759,7 +2936,7 @@ void memory_region_set_unmergeable(MemoryRegion *mr, bool unmergeable)
 
     memory_region_transaction_begin();
     mr->unmergeable = unmergeable;
-    memory_region_update_pending |= mr->enabled;
+    memory_region_mark_changed(mr, mr->enabled);
     memory_region_transaction_commit();
 }
 
@@ -2959,6 +3136,7 @@ bool memory_global_dirty_log_start(unsigned int flags, Error **errp)
 
         memory_region_transaction_begin();
         memory_region_update_pending = true;
+        memory_region_update_all = true;
         memory_region_transaction_commit();
     }
     return true;
@@ -2975,6 +3153,7 @@ static void memory_global_dirty_log_do_stop(unsigned int flags)
     if (!global_dirty_tracking) {
         memory_region_transaction_begin();
         memory_region_update_pending = true;
+        memory_region_update_all = true;
         memory_region_transaction_commit();
         MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
     }
@@ -3437,8 +3616,21 @@ struct FlatViewInfo {
     bool dispatch_tree;
     bool owner;
     AccelClass *ac;
+    size_t size;
 };
 
+static size_t flatview_size(FlatView *view)
+{
+    size_t size = sizeof(*view) + view->nr_allocated * sizeof(FlatRange);
+
+#if !defined(CONFIG_USER_ONLY)
+    if (view->dispatch) {
+        size += address_space_dispatch_size(view->dispatch);
+    }
+#endif
+    return size;
+}
+
 static void mtree_print_flatview(gpointer key, gpointer value,
                                  gpointer user_data)
 {
@@ -3446,13 +3638,17 @@ static void mtree_print_flatview(gpointer key, gpointer value,
     GArray *fv_address_spaces = value;
     struct FlatViewInfo *fvi = user_data;
     FlatRange *range = &view->ranges[0];
+    MemoryRegion *root = view->root;
     MemoryRegion *mr;
     int n = view->nr;
     int i;
     AddressSpace *as;
+    size_t size = flatview_size(view);
+    g_autofree char *size_str = size_to_str(size);
 
     qemu_printf("FlatView #%d\n", fvi->counter);
     ++fvi->counter;
+    fvi->size += size;
 
     for (i = 0; i < fv_address_spaces->len; ++i) {
         as = g_array_index(fv_address_spaces, AddressSpace*, i);
@@ -3464,8 +3660,14 @@ static void mtree_print_flatview(gpointer key, gpointer value,
         qemu_printf("\n");
     }
 
+    if (!root && view != empty_view) {
+        /* A shared view, use the root of an address space that has it */
+        as = g_array_index(fv_address_spaces, AddressSpace*, 0);
+        root = memory_region_get_flatview_root(as->root);
+    }
     qemu_printf(" Root memory region: %s\n",
-      view->root ? memory_region_name(view->root) : "(none)");
+      root ? memory_region_name(root) : "(none)");
+    qemu_printf(" Memory: %s, shared by %u roots\n", size_str, view->roots);
 
     if (n <= 0) {
         qemu_printf(MTREE_INDENT "No rendered FlatView\n\n");
@@ -3515,8 +3717,8 @@ static void mtree_print_flatview(gpointer key, gpointer value,
     }
 
 #if !defined(CONFIG_USER_ONLY)
-    if (fvi->dispatch_tree && view->root) {
-        mtree_print_dispatch(view->dispatch, view->root);
+    if (fvi->dispatch_tree && root) {
+        mtree_print_dispatch(view->dispatch, root);
     }
 #endif
 
@@ -3567,6 +3769,11 @@ static void mtree_info_flatview(bool dispatch_tree, bool owner)
 
     /* Print */
     g_hash_table_foreach(views, mtree_print_flatview, &fvi);
+    if (fvi.counter) {
+        g_autofree char *size_str = size_to_str(fvi.size);
+
+        qemu_printf("Total: %d FlatViews, %s\n\n", fvi.counter, size_str);
+    }
 
     /* Free */
     g_hash_table_foreach_remove(views, mtree_info_flatview_free, 0);
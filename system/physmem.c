@@ -2738,6 +2738,14 @@ void address_space_dispatch_free(AddressSpaceDispatch *d)
     g_free(d);
 }
 
+/* Memory used by the dispatch tree, for accounting */
+size_t address_space_dispatch_size(AddressSpaceDispatch *d)
+{
+    return sizeof(*d) +
+           d->map.nodes_nb_alloc * sizeof(Node) +
+           d->map.sections_nb_alloc * sizeof(MemoryRegionSection);
+}
+
 static void do_nothing(CPUState *cpu, run_on_cpu_data d)
 {
 }
@@ -3166,6 +3174,84 @@ MemTxResult address_space_rw(AddressSpace *as, hwaddr addr, MemTxAttrs attrs,
     }
 }
 
+static bool mmio_cache_entry_match(MMIOCacheEntry *e, FlatView *fv,
+                                   hwaddr addr, MemTxAttrs attrs,
+                                   hwaddr len, bool is_write)
+{
+    return e->fv_serial == fv->serial && e->addr == addr &&
+           e->len == len && e->is_write == is_write &&
+           !memcmp(&e->attrs, &attrs, sizeof(attrs));
+}
+
+MemTxResult address_space_rw_mmio(AddressSpace *as, MMIOCache *cache,
+                                  hwaddr addr, MemTxAttrs attrs, void *buf,
+                                  hwaddr len, bool is_write)
+{
+    AddressSpace *target_as = NULL;
+    MemoryRegionSection section;
+    MMIOCacheEntry *e;
+    MemTxResult result;
+    MemoryRegion *mr;
+    hwaddr mr_addr, l;
+    bool release_lock;
+    uint64_t val;
+    FlatView *fv;
+
+    RCU_READ_LOCK_GUARD();
+    fv = address_space_to_flatview(as);
+    e = &cache->entries[(addr ^ (addr >> 12)) % MMIO_CACHE_ENTRIES];
+
+    if (!mmio_cache_entry_match(e, fv, addr, attrs, len, is_write)) {
+        l = len;
+        section = flatview_do_translate(fv, addr, &mr_addr, &l, NULL,
+                                        is_write, true, &target_as, attrs);
+        mr = section.mr;
+
+        /*
+         * Only cache what depends on the view alone: the IOMMU mappings
+         * can change under our feet.
+         */
+        if (target_as || l != len || attrs.memory ||
+            memory_access_is_direct(mr, is_write, attrs) ||
+            memory_access_size(mr, len, mr_addr) != len) {
+            if (is_write) {
+                return flatview_write(fv, addr, attrs, buf, len);
+            } else {
+                return flatview_read(fv, addr, attrs, buf, len);
+            }
+        }
+
+        /* The view holds a reference to the region while it is current */
+        trace_address_space_rw_mmio_fill(addr, len, is_write,
+                                         memory_region_name(mr));
+        *e = (MMIOCacheEntry) {
+            .fv_serial = fv->serial,
+            .addr = addr,
+            .attrs = attrs,
+            .len = len,
+            .is_write = is_write,
+            .mr = mr,
+            .mr_addr = mr_addr,
+        };
+    }
+
+    release_lock = prepare_mmio_access(e->mr);
+    if (is_write) {
+        val = ldn_he_p(buf, len);
+        result = memory_region_dispatch_write(e->mr, e->mr_addr, val,
+                                              size_memop(len), attrs);
+    } else {
+        result = memory_region_dispatch_read(e->mr, e->mr_addr, &val,
+                                             size_memop(len), attrs);
+        stn_he_p(buf, len, val);
+    }
+    if (release_lock) {
+        bql_unlock();
+    }
+
+    return result;
+}
+
 MemTxResult address_space_set(AddressSpace *as, hwaddr addr,
                               uint8_t c, hwaddr len, MemTxAttrs attrs)
 {
@@ -16,10 +16,78 @@
 #include "migration/migration-qmp.h"
 #include "migration/migration-util.h"
 #include "qemu/module.h"
+#include "qobject/qdict.h"
 
 
 static char *tmpfs;
 
+#define AUTO_TUNE_CHANNELS 4
+#define AUTO_TUNE_LEVEL 2
+
+/*
+ * Migrate with auto-tune under the bandwidth limit that keeps migration
+ * from converging.  The channels are then mostly idle and the link is the
+ * limit, so auto-tune must drop channels or raise the compression level.
+ */
+static void test_multifd_tcp_auto_tune(const char *method,
+                                       const char *level_param)
+{
+    MigrateStart args = {
+        .caps[MIGRATION_CAPABILITY_MULTIFD] = true,
+        .caps[MIGRATION_CAPABILITY_AUTO_TUNE] = true,
+    };
+    int64_t channels = AUTO_TUNE_CHANNELS, level = AUTO_TUNE_LEVEL;
+    QTestState *from, *to;
+    QDict *rsp, *info;
+    int tries;
+
+    if (migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "multifd-channels", AUTO_TUNE_CHANNELS);
+    migrate_set_parameter_int(to, "multifd-channels", AUTO_TUNE_CHANNELS);
+    migrate_set_parameter_int(from, level_param, AUTO_TUNE_LEVEL);
+    migrate_set_parameter_int(to, level_param, AUTO_TUNE_LEVEL);
+    migrate_hook_start_precopy_tcp_multifd_common(from, to, method);
+
+    migrate_ensure_non_converge(from);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, to, NULL, NULL, "{}");
+
+    /* The settings are revisited once per second */
+    for (tries = 0; tries < 30; tries++) {
+        sleep(1);
+        rsp = migrate_query_not_failed(from);
+        info = qdict_get_qdict(rsp, "auto-tune");
+        g_assert(info);
+        if (qdict_haskey(info, "channels")) {
+            channels = qdict_get_int(info, "channels");
+            level = qdict_get_int(info, "compression-level");
+        }
+        qobject_unref(rsp);
+
+        if (channels != AUTO_TUNE_CHANNELS || level != AUTO_TUNE_LEVEL) {
+            break;
+        }
+    }
+    g_assert_cmpint(channels, >=, 1);
+    g_assert_cmpint(channels, <=, AUTO_TUNE_CHANNELS);
+    g_assert(channels != AUTO_TUNE_CHANNELS || level != AUTO_TUNE_LEVEL);
+
+    migrate_ensure_converge(from);
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    migrate_end(from, to, true);
+}
+
 #ifdef CONFIG_ZSTD
 static void *
 migrate_hook_start_precopy_tcp_multifd_zstd(QTestState *from,
@@ -43,6 +111,11 @@ static void test_multifd_tcp_zstd(void)
     test_precopy_common(&args);
 }
 
+static void test_multifd_tcp_zstd_auto_tune(void)
+{
+    test_multifd_tcp_auto_tune("zstd", "multifd-zstd-level");
+}
+
 static void test_multifd_postcopy_tcp_zstd(void)
 {
     MigrateCommon args = {
@@ -179,6 +252,11 @@ static void test_multifd_tcp_zlib(void)
     test_precopy_common(&args);
 }
 
+static void test_multifd_tcp_zlib_auto_tune(void)
+{
+    test_multifd_tcp_auto_tune("zlib", "multifd-zlib-level");
+}
+
 static void migration_test_add_compression_smoke(MigrationTestEnv *env)
 {
     migration_test_add("/migration/multifd/tcp/plain/zlib",
@@ -195,9 +273,14 @@ void migration_test_add_compression(MigrationTestEnv *env)
         return;
     }
 
+    migration_test_add("/migration/multifd/tcp/plain/zlib/auto-tune",
+                       test_multifd_tcp_zlib_auto_tune);
+
 #ifdef CONFIG_ZSTD
     migration_test_add("/migration/multifd/tcp/plain/zstd",
                        test_multifd_tcp_zstd);
+    migration_test_add("/migration/multifd/tcp/plain/zstd/auto-tune",
+                       test_multifd_tcp_zstd_auto_tune);
     if (env->has_uffd) {
         migration_test_add("/migration/multifd+postcopy/tcp/plain/zstd",
                            test_multifd_postcopy_tcp_zstd);
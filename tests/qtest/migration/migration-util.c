@@ -120,47 +120,55 @@ char *migrate_get_connect_uri(QTestState *who)
     return connect_uri;
 }
 
-static QDict *
-migrate_get_connect_qdict(QTestState *who)
-{
-    SocketAddressList *addrs;
-    QDict *connect_qdict;
-
-    addrs = migrate_get_socket_address(who);
-    connect_qdict = SocketAddress_to_qdict(addrs->value);
-
-    qapi_free_SocketAddressList(addrs);
-    return connect_qdict;
-}
-
+/*
+ * Replace port 0 in the channels with the ports the destination listens
+ * on.  Channels with a port are matched in order with the listening
+ * addresses, so that the main channel and each multifd link get their
+ * own.  If there are fewer addresses, the first one is used.
+ */
 void migrate_set_ports(QTestState *to, QList *channel_list)
 {
-    g_autoptr(QDict) addr = NULL;
+    SocketAddressList *addrs = NULL;
     QListEntry *entry;
-    const char *addr_port = NULL;
+    int i = 0;
 
     QLIST_FOREACH_ENTRY(channel_list, entry) {
         QDict *channel = qobject_to(QDict, qlist_entry_obj(entry));
         QDict *addrdict = qdict_get_qdict(channel, "addr");
+        g_autoptr(QDict) addr = NULL;
+        SocketAddressList *listen;
+        int n;
 
-        if (!qdict_haskey(addrdict, "port") ||
-            strcmp(qdict_get_str(addrdict, "port"), "0")) {
+        if (!qdict_haskey(addrdict, "port")) {
+            continue;
+        }
+        n = i++;
+        if (strcmp(qdict_get_str(addrdict, "port"), "0")) {
             continue;
         }
 
         /*
-         * Fetch addr only if needed, so tests that are not yet connected to
+         * Fetch addrs only if needed, so tests that are not yet connected to
          * the monitor do not query it.  Such tests cannot use port=0.
          */
-        if (!addr) {
-            addr = migrate_get_connect_qdict(to);
+        if (!addrs) {
+            addrs = migrate_get_socket_address(to);
+        }
+
+        for (listen = addrs; listen->next && n; n--) {
+            listen = listen->next;
+        }
+        if (n) {
+            listen = addrs;
         }
 
+        addr = SocketAddress_to_qdict(listen->value);
         if (qdict_haskey(addr, "port")) {
-            addr_port = qdict_get_str(addr, "port");
-            qdict_put_str(addrdict, "port", addr_port);
+            qdict_put_str(addrdict, "port", qdict_get_str(addr, "port"));
         }
     }
+
+    qapi_free_SocketAddressList(addrs);
 }
 
 bool migrate_watch_for_events(QTestState *who, const char *name,
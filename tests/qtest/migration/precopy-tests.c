@@ -14,17 +14,25 @@
 #include "chardev/char.h"
 #include "crypto/tlscredspsk.h"
 #include "libqtest.h"
+#include "libqos/libqos-malloc.h"
+#include "libqos/pci-pc.h"
+#include "libqos/virtio-pci.h"
 #include "migration/bootfile.h"
 #include "migration/framework.h"
 #include "migration/migration-qmp.h"
 #include "migration/migration-util.h"
 #include "ppc-util.h"
+#include "qapi/error.h"
+#include "qobject/qdict.h"
+#include "qobject/qjson.h"
 #include "qobject/qlist.h"
 #include "qapi-types-migration.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
 #include "qemu/sockets.h"
+#include "qemu/units.h"
+#include "standard-headers/linux/virtio_balloon.h"
 
 
 /*
@@ -51,6 +59,61 @@ static void test_precopy_unix_plain(void)
     test_precopy_common(&args);
 }
 
+static bool migrate_profile_has_entry(QList *entries, const char *name)
+{
+    const QListEntry *e;
+
+    QLIST_FOREACH_ENTRY(entries, e) {
+        QDict *entry = qobject_to(QDict, qlist_entry_obj(e));
+
+        if (!strcmp(qdict_get_str(entry, "name"), name)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void migrate_hook_end_profile(QTestState *from, QTestState *to,
+                                     void *opaque)
+{
+    QDict *rsp, *round = NULL;
+    QList *rounds;
+    const QListEntry *e;
+
+    rsp = qtest_qmp_assert_success_ref(
+        from, "{ 'execute': 'query-migrate-profile' }");
+    rounds = qdict_get_qlist(rsp, "rounds");
+    g_assert(!qlist_empty(rounds));
+
+    QLIST_FOREACH_ENTRY(rounds, e) {
+        round = qobject_to(QDict, qlist_entry_obj(e));
+    }
+    /* The last round is the stop-copy phase, RAM is always part of it */
+    g_assert_cmpstr(qdict_get_str(round, "phase"), ==, "stop-copy");
+    g_assert(migrate_profile_has_entry(qdict_get_qlist(round, "sections"),
+                                       "ram"));
+    qobject_unref(rsp);
+
+    rsp = qtest_qmp_assert_success_ref(
+        to, "{ 'execute': 'query-migrate-profile' }");
+    g_assert(migrate_profile_has_entry(qdict_get_qlist(rsp, "load"), "ram"));
+    qobject_unref(rsp);
+}
+
+static void test_precopy_unix_profile(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .listen_uri = uri,
+        .connect_uri = uri,
+        .live = true,
+        .end_hook = migrate_hook_end_profile,
+    };
+
+    test_precopy_common(&args);
+}
+
 static void test_precopy_unix_suspend_live(void)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -343,6 +406,139 @@ static void test_precopy_fd_file(void)
 }
 #endif /* _WIN32 */
 
+/*
+ * The balloon reports free pages above the memory that the guest writes,
+ * its reporting queue comes after the inflate, deflate and stats queues.
+ */
+#define BALLOON_OPTS "-device virtio-balloon-pci,addr=04.0," \
+                     "free-page-reporting=on"
+#define BALLOON_MEM_START (120 * MiB)
+#define BALLOON_MEM_END (150 * MiB)
+#define BALLOON_REPORTING_VQ 3
+#define BALLOON_REPORT_SIZE (4 * MiB)
+#define QVIRTIO_BALLOON_TIMEOUT_US (30 * 1000 * 1000)
+
+/*
+ * Pages that the guest reports free while migrating are sent as zero
+ * pages without being read, and accounted in free-page-report-bytes.
+ */
+static void test_precopy_unix_free_page_report(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart args = {
+        .opts_source = BALLOON_OPTS,
+        .opts_target = BALLOON_OPTS,
+    };
+    QTestState *from, *to;
+    QGuestAllocator alloc;
+    QPCIBus *bus;
+    QVirtioPCIDevice *dev;
+    QVirtQueue *vq;
+    uint64_t features, addr;
+    uint32_t free_head;
+
+    if (migrate_start(&from, &to, uri, &args)) {
+        return;
+    }
+
+    /* Drive the balloon from the test, the guest has no driver for it */
+    alloc_init(&alloc, 0, BALLOON_MEM_START, BALLOON_MEM_END, 4096);
+    bus = qpci_new_pc(from, &alloc);
+    dev = virtio_pci_new(bus, &(QPCIAddress) { .devfn = QPCI_DEVFN(4, 0) });
+    g_assert_nonnull(dev);
+    qvirtio_pci_device_enable(dev);
+    qvirtio_start_device(&dev->vdev);
+    features = qvirtio_get_features(&dev->vdev);
+    g_assert_true(features & (1ull << VIRTIO_BALLOON_F_REPORTING));
+    qvirtio_set_features(&dev->vdev, features &
+                         ((1ull << VIRTIO_F_VERSION_1) |
+                          (1ull << VIRTIO_BALLOON_F_REPORTING)));
+    vq = qvirtqueue_setup(&dev->vdev, &alloc, BALLOON_REPORTING_VQ);
+    qvirtio_set_driver_ok(&dev->vdev);
+    addr = guest_alloc(&alloc, BALLOON_REPORT_SIZE);
+
+    migrate_ensure_non_converge(from);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, to, uri, NULL, "{}");
+    wait_for_migration_status(from, "active", NULL);
+
+    /* The bulk stage doesn't get that far at the limited bandwidth */
+    free_head = qvirtqueue_add(from, vq, addr, BALLOON_REPORT_SIZE, true,
+                               false);
+    qvirtqueue_kick(from, &dev->vdev, vq, free_head);
+    qvirtio_wait_used_elem(from, &dev->vdev, vq, free_head, NULL,
+                           QVIRTIO_BALLOON_TIMEOUT_US);
+
+    migrate_ensure_converge(from);
+    wait_for_migration_complete(from);
+    g_assert_cmpint(read_ram_property_int(from, "free-page-report-bytes"),
+                    ==, BALLOON_REPORT_SIZE);
+
+    qtest_qmp_eventwait(to, "RESUME");
+    wait_for_serial("dest_serial");
+
+    qvirtqueue_cleanup(dev->vdev.bus, vq, &alloc);
+    qvirtio_pci_device_disable(dev);
+    qos_object_destroy((QOSGraphObject *)dev);
+    qpci_free_pc(bus);
+    alloc_destroy(&alloc);
+
+    migrate_end(from, to, true);
+}
+
+/*
+ * The guest keeps writing its memory while the snapshot is slowly saved:
+ * the pages it writes go through the write fault threads, and the
+ * destination must still get a consistent copy of the memory.
+ */
+static void test_precopy_unix_background_snapshot(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart args = {};
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (migrate_start(&from, &to, uri, &args)) {
+        return;
+    }
+
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate-set-capabilities',"
+                    "  'arguments': { 'capabilities': [ {"
+                    "    'capability': 'background-snapshot',"
+                    "    'state': true } ] } }");
+    if (qdict_haskey(rsp, "error")) {
+        qobject_unref(rsp);
+        g_test_skip("background-snapshot is not supported by the host");
+        migrate_end(from, to, false);
+        return;
+    }
+    qobject_unref(rsp);
+
+    migrate_ensure_non_converge(from);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, to, uri, NULL, "{}");
+
+    /* The guest runs again once its memory is write protected */
+    qtest_qmp_eventwait(from, "RESUME");
+    while (read_ram_property_int(from, "transferred") < 4 * 1024 * 1024) {
+        usleep(1000 * 100);
+    }
+
+    migrate_ensure_converge(from);
+    wait_for_migration_complete(from);
+
+    qtest_qmp_eventwait(to, "RESUME");
+    wait_for_serial("dest_serial");
+
+    migrate_end(from, to, true);
+}
+
 /*
  * The way auto_converge works, we need to do too many passes to
  * run this test.  Auto_converge logic is only run once every
@@ -540,6 +736,37 @@ static void test_multifd_tcp_no_zero_page(void)
     test_precopy_common(&args);
 }
 
+/*
+ * The guest writes the same byte at the start of each page, so most pages
+ * of a pass are identical.
+ */
+static void migrate_hook_end_multifd_tcp_page_dedup(QTestState *from,
+                                                    QTestState *to,
+                                                    void *opaque)
+{
+    g_assert_cmpint(read_ram_property_int(from, "dedup-pages"), >, 0);
+}
+
+static void test_multifd_tcp_page_dedup(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = migrate_hook_start_precopy_tcp_multifd,
+        .end_hook = migrate_hook_end_multifd_tcp_page_dedup,
+        .start = {
+            .caps[MIGRATION_CAPABILITY_MULTIFD] = true,
+            .caps[MIGRATION_CAPABILITY_PAGE_DEDUP] = true,
+        },
+        /*
+         * The guest keeps rewriting pages that are identical except for
+         * one byte, make sure duplicates whose source page changes in
+         * flight are sent again.
+         */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
 static void test_multifd_tcp_channels_none(void)
 {
     MigrateCommon args = {
@@ -558,6 +785,112 @@ static void test_multifd_tcp_channels_none(void)
     test_precopy_common(&args);
 }
 
+/* The main channel and two multifd links, on ports of their own */
+#define MULTIFD_LINKS_CHANNELS                          \
+    "[ { 'channel-type': 'main',"                       \
+    "    'addr': { 'transport': 'socket',"              \
+    "              'type': 'inet',"                     \
+    "              'host': '127.0.0.1',"                \
+    "              'port': '0' } },"                    \
+    "  { 'channel-type': 'multifd',"                    \
+    "    'addr': { 'transport': 'socket',"              \
+    "              'type': 'inet',"                     \
+    "              'host': '127.0.0.1',"                \
+    "              'port': '0' } },"                    \
+    "  { 'channel-type': 'multifd',"                    \
+    "    'weight': 2,"                                  \
+    "    'addr': { 'transport': 'socket',"              \
+    "              'type': 'inet',"                     \
+    "              'host': '127.0.0.1',"                \
+    "              'port': '0' } } ]"
+
+/*
+ * Returns the ports the destination listens on, the one of the main
+ * channel first.
+ */
+static void *
+migrate_hook_start_multifd_tcp_links(QTestState *from, QTestState *to)
+{
+    QObject *channels = qobject_from_json(MULTIFD_LINKS_CHANNELS,
+                                          &error_abort);
+    char **ports = g_new0(char *, 4);
+    const QListEntry *e;
+    QList *listen;
+    QDict *rsp;
+    int i = 0;
+
+    /* Three channels, so that the 1:2 weights split them exactly */
+    migrate_set_parameter_int(from, "multifd-channels", 3);
+    migrate_set_parameter_int(to, "multifd-channels", 3);
+    migrate_set_parameter_str(from, "multifd-compression", "none");
+    migrate_set_parameter_str(to, "multifd-compression", "none");
+
+    migrate_incoming_qmp(to, NULL, channels, "{}");
+
+    rsp = migrate_query(to);
+    listen = qdict_get_qlist(rsp, "socket-address");
+    g_assert_cmpint(qlist_size(listen), ==, 3);
+    QLIST_FOREACH_ENTRY(listen, e) {
+        QDict *addr = qobject_to(QDict, qlist_entry_obj(e));
+
+        ports[i++] = g_strdup(qdict_get_str(addr, "port"));
+    }
+    qobject_unref(rsp);
+
+    /* Each link gets a listener of its own */
+    g_assert_cmpstr(ports[0], !=, ports[1]);
+    g_assert_cmpstr(ports[0], !=, ports[2]);
+    g_assert_cmpstr(ports[1], !=, ports[2]);
+
+    return ports;
+}
+
+static void migrate_hook_end_multifd_tcp_links(QTestState *from,
+                                               QTestState *to, void *opaque)
+{
+    g_auto(GStrv) ports = opaque;
+    QDict *rsp = migrate_query(from);
+    QList *links = qdict_get_qlist(rsp, "multifd-links");
+    const QListEntry *e;
+    QDict *link[2];
+    int i = 0;
+
+    g_assert_cmpint(qlist_size(links), ==, 2);
+    QLIST_FOREACH_ENTRY(links, e) {
+        link[i] = qobject_to(QDict, qlist_entry_obj(e));
+        g_assert_cmpstr(qdict_get_str(qdict_get_qdict(link[i], "addr"),
+                                      "port"), ==, ports[i + 1]);
+        g_assert_false(qdict_get_bool(link[i], "failed"));
+        g_assert_cmpint(qdict_get_int(link[i], "transferred"), >, 0);
+        i++;
+    }
+
+    /* The channels are split 1:2, and the traffic follows them */
+    g_assert_cmpint(qdict_get_int(link[0], "weight"), ==, 1);
+    g_assert_cmpint(qdict_get_int(link[1], "weight"), ==, 2);
+    g_assert_cmpint(qdict_get_int(link[0], "channels"), ==, 1);
+    g_assert_cmpint(qdict_get_int(link[1], "channels"), ==, 2);
+    g_assert_cmpint(qdict_get_int(link[1], "transferred"), >,
+                    qdict_get_int(link[0], "transferred"));
+
+    qobject_unref(rsp);
+}
+
+static void test_multifd_tcp_channels_links(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = migrate_hook_start_multifd_tcp_links,
+        .end_hook = migrate_hook_end_multifd_tcp_links,
+        .live = true,
+        .start = {
+            .caps[MIGRATION_CAPABILITY_MULTIFD] = true,
+        },
+        .connect_channels = MULTIFD_LINKS_CHANNELS,
+    };
+    test_precopy_common(&args);
+}
+
 /*
  * This test does:
  *  source               target
@@ -1247,6 +1580,8 @@ static void migration_test_add_precopy_smoke(MigrationTestEnv *env)
 
     migration_test_add("/migration/precopy/unix/plain",
                        test_precopy_unix_plain);
+    migration_test_add("/migration/precopy/unix/profile",
+                       test_precopy_unix_profile);
 
     migration_test_add("/migration/precopy/tcp/plain", test_precopy_tcp_plain);
     migration_test_add("/migration/multifd/tcp/uri/plain/none",
@@ -1285,6 +1620,15 @@ void migration_test_add_precopy(MigrationTestEnv *env)
     migration_test_add("/migration/precopy/fd/file",
                        test_precopy_fd_file);
 #endif
+#ifdef __linux__
+    migration_test_add("/migration/precopy/unix/background-snapshot",
+                       test_precopy_unix_background_snapshot);
+#endif
+    if (g_str_equal(env->arch, "x86_64") &&
+        qtest_has_device("virtio-balloon-pci")) {
+        migration_test_add("/migration/precopy/unix/free-page-report",
+                           test_precopy_unix_free_page_report);
+    }
 
     /*
      * See explanation why this test is slow on function definition
@@ -1300,10 +1644,14 @@ void migration_test_add_precopy(MigrationTestEnv *env)
     }
     migration_test_add("/migration/multifd/tcp/channels/plain/none",
                        test_multifd_tcp_channels_none);
+    migration_test_add("/migration/multifd/tcp/channels/plain/links",
+                       test_multifd_tcp_channels_links);
     migration_test_add("/migration/multifd/tcp/plain/zero-page/legacy",
                        test_multifd_tcp_zero_page_legacy);
     migration_test_add("/migration/multifd/tcp/plain/zero-page/none",
                        test_multifd_tcp_no_zero_page);
+    migration_test_add("/migration/multifd/tcp/plain/dedup",
+                       test_multifd_tcp_page_dedup);
     if (g_str_equal(env->arch, "x86_64")
         && env->has_kvm && env->has_dirty_ring) {
 
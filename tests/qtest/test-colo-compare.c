@@ -0,0 +1,216 @@
+/*
+ * QTest testcase for colo-compare with compare threads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ *
+ * qemu side                          | test side
+ *                                    |
+ *              +--------------+      |  +------------+
+ *              |              <---------+ primary    |
+ *              |              |      |  +------------+
+ *              |              <---------+ secondary  |
+ *              | colo-compare |      |  +------------+
+ *              |              +---------> outdev     |
+ *              |              |      |  +------------+
+ *              |              <--------->  notify    |
+ *              +--------------+      |  +------------+
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qobject/qdict.h"
+#include "qemu/bswap.h"
+#include "qemu/sockets.h"
+
+#define NR_CONNS 16
+#define UDP_DPORT 5000
+
+typedef struct TestSockets {
+    char *tmpdir;
+    char *paths[4];
+    int pri, sec, out, notify;
+} TestSockets;
+
+/* Ethernet, IPv4 and UDP headers followed by @payload */
+static size_t build_udp_packet(uint8_t *buf, uint16_t sport,
+                               const char *payload)
+{
+    size_t plen = strlen(payload);
+    uint8_t *p = buf;
+
+    memset(p, 0, 14 + 20 + 8);
+    memset(p, 0x52, 12);                /* MAC addresses */
+    p[12] = 0x08;                       /* IPv4 */
+    p += 14;
+
+    p[0] = 0x45;                        /* version 4, 5 words */
+    stw_be_p(p + 2, 20 + 8 + plen);
+    p[8] = 64;                          /* TTL */
+    p[9] = 17;                          /* UDP */
+    stl_be_p(p + 12, 0x0a000001);
+    stl_be_p(p + 16, 0x0a000002);
+    p += 20;
+
+    stw_be_p(p, sport);
+    stw_be_p(p + 2, UDP_DPORT);
+    stw_be_p(p + 4, 8 + plen);
+    p += 8;
+
+    memcpy(p, payload, plen);
+    return 14 + 20 + 8 + plen;
+}
+
+static void send_frame(int fd, const void *buf, uint32_t len)
+{
+    uint32_t be_len = htonl(len);
+
+    g_assert_cmpint(send(fd, &be_len, sizeof(be_len), 0), ==, sizeof(be_len));
+    g_assert_cmpint(send(fd, buf, len, 0), ==, len);
+}
+
+static uint32_t recv_frame(int fd, void *buf, uint32_t size)
+{
+    uint32_t len;
+
+    g_assert_cmpint(recv(fd, &len, sizeof(len), MSG_WAITALL), ==,
+                    sizeof(len));
+    len = ntohl(len);
+    g_assert_cmpint(len, <=, size);
+    g_assert_cmpint(recv(fd, buf, len, MSG_WAITALL), ==, len);
+    return len;
+}
+
+static QTestState *test_start(TestSockets *ts, int threads)
+{
+    QTestState *qts;
+    int i;
+
+    ts->tmpdir = g_dir_make_tmp("colo-compare-test-XXXXXX", NULL);
+    g_assert(ts->tmpdir);
+    for (i = 0; i < ARRAY_SIZE(ts->paths); i++) {
+        ts->paths[i] = g_strdup_printf("%s/sock%d", ts->tmpdir, i);
+    }
+
+    qts = qtest_initf(
+        "-nodefaults "
+        "-object iothread,id=iot0 "
+        "-chardev socket,id=pri,path=%s,server=on,wait=off "
+        "-chardev socket,id=sec,path=%s,server=on,wait=off "
+        "-chardev socket,id=out,path=%s,server=on,wait=off "
+        "-chardev socket,id=notify,path=%s,server=on,wait=off "
+        "-object colo-compare,id=comp0,primary_in=pri,secondary_in=sec,"
+        "outdev=out,notify_dev=notify,iothread=iot0,compare_threads=%d",
+        ts->paths[0], ts->paths[1], ts->paths[2], ts->paths[3], threads);
+
+    ts->pri = unix_connect(ts->paths[0], NULL);
+    g_assert_cmpint(ts->pri, !=, -1);
+    ts->sec = unix_connect(ts->paths[1], NULL);
+    g_assert_cmpint(ts->sec, !=, -1);
+    ts->out = unix_connect(ts->paths[2], NULL);
+    g_assert_cmpint(ts->out, !=, -1);
+    ts->notify = unix_connect(ts->paths[3], NULL);
+    g_assert_cmpint(ts->notify, !=, -1);
+
+    /* send a qmp command to guarantee that 'connected' is setting to true. */
+    qtest_qmp_assert_success(qts, "{ 'execute' : 'query-status'}");
+    return qts;
+}
+
+static void test_stop(QTestState *qts, TestSockets *ts)
+{
+    int i;
+
+    qtest_quit(qts);
+    close(ts->pri);
+    close(ts->sec);
+    close(ts->out);
+    close(ts->notify);
+    for (i = 0; i < ARRAY_SIZE(ts->paths); i++) {
+        unlink(ts->paths[i]);
+        g_free(ts->paths[i]);
+    }
+    rmdir(ts->tmpdir);
+    g_free(ts->tmpdir);
+}
+
+/* Identical packets of many connections are compared and released */
+static void test_compare_threads_match(void)
+{
+    TestSockets ts;
+    QTestState *qts = test_start(&ts, 4);
+    bool seen[NR_CONNS] = { };
+    uint8_t buf[128];
+    QDict *rsp;
+    int i;
+
+    for (i = 0; i < NR_CONNS; i++) {
+        size_t len = build_udp_packet(buf, 1000 + i, "same payload");
+
+        send_frame(ts.pri, buf, len);
+        send_frame(ts.sec, buf, len);
+    }
+
+    /* Connections are compared in different threads, in any order */
+    for (i = 0; i < NR_CONNS; i++) {
+        uint32_t len = recv_frame(ts.out, buf, sizeof(buf));
+        uint16_t sport;
+
+        g_assert_cmpint(len, ==, 14 + 20 + 8 + strlen("same payload"));
+        sport = lduw_be_p(buf + 14 + 20);
+        g_assert_cmpint(sport, >=, 1000);
+        g_assert_cmpint(sport, <, 1000 + NR_CONNS);
+        g_assert_false(seen[sport - 1000]);
+        seen[sport - 1000] = true;
+    }
+
+    rsp = qtest_qmp_assert_success_ref(qts,
+        "{ 'execute': 'qom-get', 'arguments': { 'path': '/objects/comp0',"
+        " 'property': 'compared_packets' } }");
+    g_assert_cmpint(qdict_get_int(rsp, "return"), ==, NR_CONNS);
+    qobject_unref(rsp);
+
+    test_stop(qts, &ts);
+}
+
+/*
+ * A mismatch found by a compare thread asks for a checkpoint from the
+ * iothread, and the checkpoint releases the primary packet.
+ */
+static void test_compare_threads_checkpoint(void)
+{
+    TestSockets ts;
+    QTestState *qts = test_start(&ts, 2);
+    const char checkpoint[] = "COLO_CHECKPOINT";
+    uint8_t pri_buf[128], sec_buf[128], buf[128];
+    size_t pri_len, sec_len;
+    uint32_t len;
+
+    pri_len = build_udp_packet(pri_buf, 2000, "primary");
+    sec_len = build_udp_packet(sec_buf, 2000, "secondary");
+    send_frame(ts.pri, pri_buf, pri_len);
+    send_frame(ts.sec, sec_buf, sec_len);
+
+    len = recv_frame(ts.notify, buf, sizeof(buf));
+    g_assert_cmpint(len, ==, strlen("DO_CHECKPOINT"));
+    g_assert(!memcmp(buf, "DO_CHECKPOINT", len));
+
+    send_frame(ts.notify, checkpoint, strlen(checkpoint));
+
+    len = recv_frame(ts.out, buf, sizeof(buf));
+    g_assert_cmpint(len, ==, pri_len);
+    g_assert(!memcmp(buf, pri_buf, len));
+
+    test_stop(qts, &ts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/colo-compare/threads/match", test_compare_threads_match);
+    qtest_add_func("/colo-compare/threads/checkpoint",
+                   test_compare_threads_checkpoint);
+
+    return g_test_run();
+}
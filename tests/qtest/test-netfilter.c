@@ -174,6 +174,41 @@ static void remove_netdev_with_multi_netfilter(void)
     qobject_unref(response);
 }
 
+/* filter-ebpf only filters what the netdev sends, and needs a tap netdev */
+static void add_ebpf_netfilter(void)
+{
+    static const char *const queues[] = { "all", "rx" };
+    QDict *response;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(queues); i++) {
+        response = qmp("{'execute': 'object-add',"
+                       " 'arguments': {"
+                       "   'qom-type': 'filter-ebpf',"
+                       "   'id': 'qtest-f0',"
+                       "   'netdev': 'qtest-bn0',"
+                       "   'queue': %s"
+                       "}}", queues[i]);
+        g_assert(response);
+        g_assert_cmpstr(qdict_get_str(qdict_get_qdict(response, "error"),
+                                      "desc"),
+                        ==, "filter-ebpf only supports queue=tx");
+        qobject_unref(response);
+    }
+
+    response = qmp("{'execute': 'object-add',"
+                   " 'arguments': {"
+                   "   'qom-type': 'filter-ebpf',"
+                   "   'id': 'qtest-f0',"
+                   "   'netdev': 'qtest-bn0',"
+                   "   'queue': 'tx'"
+                   "}}");
+    g_assert(response);
+    g_assert_cmpstr(qdict_get_str(qdict_get_qdict(response, "error"), "desc"),
+                    ==, "netdev 'qtest-bn0' does not support eBPF filters");
+    qobject_unref(response);
+}
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -186,6 +221,7 @@ int main(int argc, char **argv)
     qtest_add_func("/netfilter/addremove_multi", add_multi_netfilter);
     qtest_add_func("/netfilter/remove_netdev_multi",
                    remove_netdev_with_multi_netfilter);
+    qtest_add_func("/netfilter/ebpf", add_ebpf_netfilter);
 
     args = g_strdup_printf("-nic user,id=qtest-bn0");
     qtest_start(args);
@@ -170,6 +170,8 @@ typedef struct TestServer {
     bool test_fail;
     int test_flags;
     int queues;
+    /* VHOST_USER_GET_QUEUE_NUM requests since the last reset */
+    int get_queue_num;
     struct vhost_user_ops *vu_ops;
 } TestServer;
 
@@ -497,6 +499,7 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
         break;
 
     case VHOST_USER_GET_QUEUE_NUM:
+        s->get_queue_num++;
         msg.flags |= VHOST_USER_REPLY_MASK;
         msg.size = sizeof(m.payload.u64);
         msg.payload.u64 = s->queues;
@@ -958,26 +961,74 @@ static void *vhost_user_test_setup_reconnect(GString *cmd_line, void *arg)
     return s;
 }
 
-static void test_reconnect(void *obj, void *arg, QGuestAllocator *alloc)
+static void test_server_reconnect(TestServer *s)
 {
-    TestServer *s = arg;
     GSource *src;
 
-    if (!wait_for_fds(s)) {
-        return;
-    }
-
-    wait_for_rings_started(s, 2);
-
-    /* reconnect */
+    g_mutex_lock(&s->data_mutex);
     s->fds_num = 0;
     s->rings = 0;
+    s->get_queue_num = 0;
+    g_mutex_unlock(&s->data_mutex);
+
     src = g_idle_source_new();
     g_source_set_callback(src, reconnect_cb, s, NULL);
     g_source_attach(src, s->context);
     g_source_unref(src);
     g_assert(wait_for_fds(s));
+}
+
+static void test_reconnect(void *obj, void *arg, QGuestAllocator *alloc)
+{
+    TestServer *s = arg;
+
+    if (!wait_for_fds(s)) {
+        return;
+    }
+
     wait_for_rings_started(s, 2);
+
+    test_server_reconnect(s);
+    wait_for_rings_started(s, 2);
+}
+
+static void *vhost_user_test_setup_reconnect_multiqueue(GString *cmd_line,
+                                                        void *arg)
+{
+    TestServer *s = vhost_user_test_setup_reconnect(cmd_line, arg);
+
+    s->queues = 2;
+    g_string_append_printf(cmd_line,
+                           " -set netdev.hs0.queues=%d"
+                           " -global virtio-net-pci.vectors=%d",
+                           s->queues, s->queues * 2 + 2);
+
+    return s;
+}
+
+/*
+ * The queue pairs share the handshake of each connection: the backend is
+ * asked once for its queues, and asked again after reconnecting.
+ */
+static void test_reconnect_multiqueue(void *obj, void *arg,
+                                      QGuestAllocator *alloc)
+{
+    TestServer *s = arg;
+
+    if (!wait_for_fds(s)) {
+        return;
+    }
+
+    wait_for_rings_started(s, s->queues * 2);
+    g_mutex_lock(&s->data_mutex);
+    g_assert_cmpint(s->get_queue_num, ==, 1);
+    g_mutex_unlock(&s->data_mutex);
+
+    test_server_reconnect(s);
+    wait_for_rings_started(s, s->queues * 2);
+    g_mutex_lock(&s->data_mutex);
+    g_assert_cmpint(s->get_queue_num, ==, 1);
+    g_mutex_unlock(&s->data_mutex);
 }
 
 static void *vhost_user_test_setup_connect_fail(GString *cmd_line, void *arg)
@@ -1136,6 +1187,11 @@ static void register_vhost_user_test(void)
     qos_add_test("vhost-user/multiqueue",
                  "virtio-net",
                  test_multiqueue, &opts);
+
+    opts.before = vhost_user_test_setup_reconnect_multiqueue;
+    qos_add_test("vhost-user/reconnect/multiqueue",
+                 "virtio-net",
+                 test_reconnect_multiqueue, &opts);
 }
 libqos_init(register_vhost_user_test);
 
@@ -9,6 +9,7 @@
 
 #include "qemu/osdep.h"
 #include "libqtest-single.h"
+#include "qemu/bswap.h"
 #include "qemu/iov.h"
 #include "qemu/module.h"
 #include "qobject/qdict.h"
@@ -144,6 +145,70 @@ static void rx_stop_cont_test(QVirtioDevice *dev,
     guest_free(alloc, req_addr);
 }
 
+#define RX_BURST_PACKETS 8
+
+/*
+ * Packets that arrive while the guest has no rx buffer are queued, and
+ * all of them are received in order once the guest provides buffers.
+ */
+static void rx_burst_test(QVirtioDevice *dev,
+                          QGuestAllocator *alloc, QVirtQueue *vq,
+                          int socket)
+{
+    QTestState *qts = global_qtest;
+    uint64_t req_addr[RX_BURST_PACKETS];
+    uint32_t free_head[RX_BURST_PACKETS];
+    char test[RX_BURST_PACKETS][8];
+    char buffer[64];
+    int len = htonl(sizeof(test[0]));
+    QDict *rsp;
+    int i, ret;
+
+    for (i = 0; i < RX_BURST_PACKETS; i++) {
+        struct iovec iov[] = {
+            {
+                .iov_base = &len,
+                .iov_len = sizeof(len),
+            }, {
+                .iov_base = test[i],
+                .iov_len = sizeof(test[i]),
+            },
+        };
+
+        snprintf(test[i], sizeof(test[i]), "TEST%d", i);
+        ret = iov_send(socket, iov, 2, 0, sizeof(len) + sizeof(test[i]));
+        g_assert_cmpint(ret, ==, sizeof(test[i]) + sizeof(len));
+    }
+
+    /* Make sure QEMU has read the packets before giving it buffers */
+    rsp = qmp("{ 'execute' : 'query-status'}");
+    qobject_unref(rsp);
+
+    for (i = 0; i < RX_BURST_PACKETS; i++) {
+        req_addr[i] = guest_alloc(alloc, 64);
+        free_head[i] = qvirtqueue_add(qts, vq, req_addr[i], 64, true, false);
+    }
+    qvirtqueue_kick(qts, dev, vq, free_head[0]);
+
+    /*
+     * Several buffers may be used with a single interrupt, so poll the
+     * used ring instead of waiting for the ISR of each one.
+     */
+    for (i = 0; i < RX_BURST_PACKETS; i++) {
+        gint64 start_time = g_get_monotonic_time();
+        uint32_t desc_idx;
+
+        while (!qvirtqueue_get_buf(qts, vq, &desc_idx, NULL)) {
+            g_assert(g_get_monotonic_time() - start_time <=
+                     QVIRTIO_NET_TIMEOUT_US);
+        }
+        g_assert_cmpint(desc_idx, ==, free_head[i]);
+        memread(req_addr[i] + VNET_HDR_SIZE, buffer, sizeof(test[i]));
+        g_assert_cmpstr(buffer, ==, test[i]);
+        guest_free(alloc, req_addr[i]);
+    }
+}
+
 static void send_recv_test(void *obj, void *data, QGuestAllocator *t_alloc)
 {
     QVirtioNet *net_if = obj;
@@ -166,6 +231,16 @@ static void stop_cont_test(void *obj, void *data, QGuestAllocator *t_alloc)
     rx_stop_cont_test(dev, t_alloc, rx, sv[0]);
 }
 
+static void burst_test(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *rx = net_if->queues[0];
+    int *sv = data;
+
+    rx_burst_test(dev, t_alloc, rx, sv[0]);
+}
+
 static void hotplug(void *obj, void *data, QGuestAllocator *t_alloc)
 {
     QVirtioPCIDevice *dev = obj;
@@ -261,6 +336,268 @@ static void announce_self(void *obj, void *data, QGuestAllocator *t_alloc)
     };
 }
 
+static void ctrl_rx_promisc(QVirtioDevice *dev, QGuestAllocator *alloc,
+                            QVirtQueue *vq, uint8_t on)
+{
+    QTestState *qts = global_qtest;
+    uint8_t cmd[] = { VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC, on };
+    uint64_t req_addr;
+    uint32_t free_head;
+
+    req_addr = guest_alloc(alloc, sizeof(cmd) + 1);
+    memwrite(req_addr, cmd, sizeof(cmd));
+
+    free_head = qvirtqueue_add(qts, vq, req_addr, sizeof(cmd), false, true);
+    qvirtqueue_add(qts, vq, req_addr + sizeof(cmd), 1, true, false);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_NET_TIMEOUT_US);
+    g_assert_cmpint(readb(req_addr + sizeof(cmd)), ==, VIRTIO_NET_OK);
+
+    guest_free(alloc, req_addr);
+}
+
+/*
+ * The device under test is hotplugged, as the list of the
+ * iothread-vq-mapping property can't be given in the -device options
+ * built by qos.
+ */
+static void iothread_test(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *dev = obj;
+    QTestState *qts = dev->pdev->bus->qts;
+    QPCIAddress addr = { .devfn = QPCI_DEVFN(PCI_SLOT_HP, 0) };
+    QVirtioPCIDevice *hp;
+    QVirtioDevice *vdev;
+    QVirtQueue *rx, *tx, *ctrl;
+    uint64_t features;
+    int *sv = data;
+
+    if (dev->pdev->bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+
+    qtest_qmp_device_add(qts, "virtio-net-pci", "net1",
+                         "{'addr': %s, 'netdev': 'hs1', "
+                         "'iothread-vq-mapping': [{'iothread': 'iot0'}]}",
+                         stringify(PCI_SLOT_HP));
+
+    hp = virtio_pci_new(dev->pdev->bus, &addr);
+    g_assert_nonnull(hp);
+    vdev = &hp->vdev;
+    qvirtio_pci_device_enable(hp);
+    qvirtio_start_device(vdev);
+
+    features = qvirtio_get_features(vdev);
+    features &= ~(QVIRTIO_F_BAD_FEATURE |
+                  (1ull << VIRTIO_RING_F_INDIRECT_DESC) |
+                  (1ull << VIRTIO_RING_F_EVENT_IDX) |
+                  (1ull << VIRTIO_NET_F_MQ));
+    qvirtio_set_features(vdev, features);
+    rx = qvirtqueue_setup(vdev, t_alloc, 0);
+    tx = qvirtqueue_setup(vdev, t_alloc, 1);
+    ctrl = qvirtqueue_setup(vdev, t_alloc, 2);
+    qvirtio_set_driver_ok(vdev);
+
+    rx_test(vdev, t_alloc, rx, sv[0]);
+    tx_test(vdev, t_alloc, tx, sv[0]);
+
+    /* Control commands and stop/cont detach the queue pair meanwhile */
+    ctrl_rx_promisc(vdev, t_alloc, ctrl, 1);
+    rx_test(vdev, t_alloc, rx, sv[0]);
+    rx_stop_cont_test(vdev, t_alloc, rx, sv[0]);
+    tx_test(vdev, t_alloc, tx, sv[0]);
+
+    qvirtqueue_cleanup(vdev->bus, rx, t_alloc);
+    qvirtqueue_cleanup(vdev->bus, tx, t_alloc);
+    qvirtqueue_cleanup(vdev->bus, ctrl, t_alloc);
+    qvirtio_pci_device_disable(hp);
+    g_free(hp->pdev);
+    g_free(hp);
+}
+
+#define PACKED_TX_BATCH 12
+#define PACKED_TX_BIG   (64 * 1024)
+#define PACKED_TX_SMALL 64
+
+/* libqos only drives split rings, the packed descriptors are written here */
+static void packed_tx_add(QTestState *qts, QVirtQueue *vq, uint16_t idx,
+                          bool wrap, uint16_t id, uint64_t addr, uint32_t len)
+{
+    struct vring_packed_desc desc = {
+        .addr = cpu_to_le64(addr),
+        .len = cpu_to_le32(len),
+        .id = cpu_to_le16(id),
+        .flags = cpu_to_le16(wrap << VRING_PACKED_DESC_F_AVAIL |
+                             !wrap << VRING_PACKED_DESC_F_USED),
+    };
+
+    qtest_memwrite(qts, vq->desc + idx * sizeof(desc), &desc, sizeof(desc));
+}
+
+static void packed_tx_wait_used(QTestState *qts, QVirtQueue *vq, uint16_t idx,
+                                bool wrap, uint16_t id)
+{
+    uint16_t mask = 1 << VRING_PACKED_DESC_F_AVAIL |
+                    1 << VRING_PACKED_DESC_F_USED;
+    uint16_t used = wrap << VRING_PACKED_DESC_F_AVAIL |
+                    wrap << VRING_PACKED_DESC_F_USED;
+    gint64 start_time = g_get_monotonic_time();
+    struct vring_packed_desc desc;
+
+    for (;;) {
+        qtest_memread(qts, vq->desc + idx * sizeof(desc), &desc, sizeof(desc));
+        if ((le16_to_cpu(desc.flags) & mask) == used) {
+            break;
+        }
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+    }
+    g_assert_cmpint(le16_to_cpu(desc.id), ==, id);
+}
+
+static void packed_tx_recv(int socket, uint8_t *buffer, uint32_t size,
+                           uint8_t pattern)
+{
+    uint32_t len, i;
+    int ret;
+
+    ret = recv(socket, &len, sizeof(len), MSG_WAITALL);
+    g_assert_cmpint(ret, ==, sizeof(len));
+    len = ntohl(len);
+    g_assert_cmpint(len, ==, size);
+
+    ret = recv(socket, buffer, len, MSG_WAITALL);
+    g_assert_cmpint(ret, ==, len);
+    for (i = 0; i < len; i++) {
+        g_assert_cmpint(buffer[i], ==, pattern);
+    }
+}
+
+/*
+ * When the backend can't take a packet, virtio-net gives back the rest
+ * of the batch it popped.  Do that on a packed ring, one batch after
+ * the other until a batch straddles the end of the ring: the packets
+ * past the end are only sent if both the avail index and the wrap
+ * counter were rewound.
+ */
+static void packed_tx_test(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *dev = obj;
+    QTestState *qts = dev->pdev->bus->qts;
+    QPCIAddress addr = { .devfn = QPCI_DEVFN(PCI_SLOT_HP, 0) };
+    QVirtioPCIDevice *hp;
+    QVirtioDevice *vdev;
+    QVirtQueue *tx;
+    uint64_t features;
+    uint64_t req_addr[PACKED_TX_BATCH];
+    uint32_t req_len[PACKED_TX_BATCH];
+    uint16_t slot[PACKED_TX_BATCH];
+    bool slot_wrap[PACKED_TX_BATCH];
+    uint16_t idx = 0;
+    bool wrap = true;
+    uint8_t *buffer;
+    uint32_t len;
+    int *sv = data;
+    int round, i, ret;
+
+    if (dev->pdev->bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+
+    qtest_qmp_device_add(qts, "virtio-net-pci", "net1",
+                         "{'addr': %s, 'netdev': 'hs1', 'packed': true}",
+                         stringify(PCI_SLOT_HP));
+
+    hp = virtio_pci_new(dev->pdev->bus, &addr);
+    g_assert_nonnull(hp);
+    vdev = &hp->vdev;
+    qvirtio_pci_device_enable(hp);
+    qvirtio_start_device(vdev);
+
+    features = qvirtio_get_features(vdev);
+    g_assert(features & (1ull << VIRTIO_F_RING_PACKED));
+    features &= ~(QVIRTIO_F_BAD_FEATURE |
+                  (1ull << VIRTIO_RING_F_INDIRECT_DESC) |
+                  (1ull << VIRTIO_RING_F_EVENT_IDX) |
+                  (1ull << VIRTIO_NET_F_MQ));
+    qvirtio_set_features(vdev, features);
+    tx = qvirtqueue_setup(vdev, t_alloc, 1);
+    g_assert_cmpint(tx->size % PACKED_TX_BATCH, !=, 0);
+
+    /* qvirtqueue_setup() initialized a split ring, start from an empty one */
+    qtest_memset(qts, tx->desc, 0,
+                 tx->size * sizeof(struct vring_packed_desc));
+    qtest_memset(qts, tx->avail, 0, sizeof(struct vring_packed_desc_event));
+    qtest_memset(qts, tx->used, 0, sizeof(struct vring_packed_desc_event));
+    qvirtio_set_driver_ok(vdev);
+
+    /* Only the first packet of a batch overflows the socket buffer */
+    for (i = 0; i < PACKED_TX_BATCH; i++) {
+        req_len[i] = VNET_HDR_SIZE + (i ? PACKED_TX_SMALL : PACKED_TX_BIG);
+        req_addr[i] = guest_alloc(t_alloc, req_len[i]);
+    }
+    buffer = g_malloc(PACKED_TX_BIG);
+
+    for (round = 0; round <= tx->size / PACKED_TX_BATCH; round++) {
+        QDict *rsp, *status;
+
+        for (i = 0; i < PACKED_TX_BATCH; i++) {
+            qtest_memset(qts, req_addr[i], 0, VNET_HDR_SIZE);
+            qtest_memset(qts, req_addr[i] + VNET_HDR_SIZE, round + i,
+                         req_len[i] - VNET_HDR_SIZE);
+            packed_tx_add(qts, tx, idx, wrap, i, req_addr[i], req_len[i]);
+
+            slot[i] = idx;
+            slot_wrap[i] = wrap;
+            if (++idx == tx->size) {
+                idx = 0;
+                wrap = !wrap;
+            }
+        }
+        vdev->bus->virtqueue_kick(vdev, tx);
+
+        /*
+         * Once the first packet shows up, the device is stuck on it until
+         * the socket is read; peeking leaves it there.  Only that packet
+         * must still be popped.
+         */
+        ret = recv(sv[0], &len, sizeof(len), MSG_PEEK);
+        g_assert_cmpint(ret, ==, sizeof(len));
+
+        rsp = qtest_qmp(qts, "{'execute': 'x-query-virtio-queue-status',"
+                        " 'arguments': {"
+                        " 'path': '/machine/peripheral/net1/virtio-backend',"
+                        " 'queue': 1 } }");
+        g_assert(qdict_haskey(rsp, "return"));
+        status = qdict_get_qdict(rsp, "return");
+        g_assert_cmpint(qdict_get_int(status, "inuse"), ==, 1);
+        g_assert_cmpint(qdict_get_int(status, "last-avail-idx"), ==,
+                        (slot[0] + 1) % tx->size);
+        qobject_unref(rsp);
+
+        for (i = 0; i < PACKED_TX_BATCH; i++) {
+            packed_tx_recv(sv[0], buffer, req_len[i] - VNET_HDR_SIZE,
+                           round + i);
+        }
+        for (i = 0; i < PACKED_TX_BATCH; i++) {
+            packed_tx_wait_used(qts, tx, slot[i], slot_wrap[i], i);
+        }
+    }
+
+    g_free(buffer);
+    for (i = 0; i < PACKED_TX_BATCH; i++) {
+        guest_free(t_alloc, req_addr[i]);
+    }
+    qvirtqueue_cleanup(vdev->bus, tx, t_alloc);
+    qvirtio_pci_device_disable(hp);
+    g_free(hp->pdev);
+    g_free(hp);
+}
+
 static void virtio_net_test_cleanup(void *sockets)
 {
     int *sv = sockets;
@@ -285,6 +622,46 @@ static void *virtio_net_test_setup(GString *cmd_line, void *arg)
     return sv;
 }
 
+static void *virtio_net_test_setup_iothread(GString *cmd_line, void *arg)
+{
+    int ret;
+    int *sv = g_new(int, 2);
+
+    /* hs0 is used by the device created by qos */
+    virtio_net_test_setup(cmd_line, arg);
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+
+    g_string_append_printf(cmd_line,
+                           " -object iothread,id=iot0"
+                           " -netdev socket,fd=%d,id=hs1 ", sv[1]);
+
+    g_test_queue_destroy(virtio_net_test_cleanup, sv);
+    return sv;
+}
+
+static void *virtio_net_test_setup_packed(GString *cmd_line, void *arg)
+{
+    int ret, sndbuf = 4096;
+    int *sv = g_new(int, 2);
+
+    /* hs0 is used by the device created by qos */
+    virtio_net_test_setup(cmd_line, arg);
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+
+    /* Small enough that a single large packet fills it */
+    ret = setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    g_assert_cmpint(ret, ==, 0);
+
+    g_string_append_printf(cmd_line, " -netdev socket,fd=%d,id=hs1 ", sv[1]);
+
+    g_test_queue_destroy(virtio_net_test_cleanup, sv);
+    return sv;
+}
+
 #endif /* _WIN32 */
 
 static void large_tx(void *obj, void *data, QGuestAllocator *t_alloc)
@@ -327,7 +704,12 @@ static void register_virtio_net_test(void)
     qos_add_test("hotplug", "virtio-net-pci", hotplug, &opts);
     qos_add_test("basic", "virtio-net", send_recv_test, &opts);
     qos_add_test("rx_stop_cont", "virtio-net", stop_cont_test, &opts);
+    qos_add_test("rx_burst", "virtio-net", burst_test, &opts);
     qos_add_test("announce-self", "virtio-net", announce_self, &opts);
+    opts.before = virtio_net_test_setup_iothread;
+    qos_add_test("iothread", "virtio-net-pci", iothread_test, &opts);
+    opts.before = virtio_net_test_setup_packed;
+    qos_add_test("packed_tx", "virtio-net-pci", packed_tx_test, &opts);
 #endif
 
     /* These tests do not need a loopback backend.  */
@@ -0,0 +1,85 @@
+/*
+ * Asynchronous teardown file descriptor handover tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <poll.h>
+
+#include "system/async-teardown.c"
+
+/* No guest RAM, and no exit notifiers: the tests only hand over fds */
+int qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque)
+{
+    return 0;
+}
+
+void *qemu_ram_get_host_addr(RAMBlock *rb)
+{
+    g_assert_not_reached();
+}
+
+ram_addr_t qemu_ram_get_max_length(RAMBlock *rb)
+{
+    g_assert_not_reached();
+}
+
+void qemu_add_exit_notifier(Notifier *notify)
+{
+}
+
+/*
+ * A child plays qemu: it hands the write end of @pipe_fds over to the
+ * teardown process and closes its own copy.  The read end only reaches
+ * end of file once the teardown process is done, after the child exited.
+ */
+static void test_add_fd(void)
+{
+    int pipe_fds[2], go_fds[2];
+    struct pollfd pfd;
+    pid_t pid;
+    char c = 0;
+
+    g_assert_cmpint(pipe(pipe_fds), ==, 0);
+    g_assert_cmpint(pipe(go_fds), ==, 0);
+
+    pid = fork();
+    g_assert_cmpint(pid, >=, 0);
+    if (pid == 0) {
+        close(pipe_fds[0]);
+        close(go_fds[1]);
+        init_async_teardown();
+        async_teardown_add_fd(pipe_fds[1]);
+        close(pipe_fds[1]);
+        if (read(go_fds[0], &c, 1) != 1) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    close(pipe_fds[1]);
+    close(go_fds[0]);
+
+    /* The teardown process keeps the file open while the child runs */
+    pfd = (struct pollfd) { .fd = pipe_fds[0], .events = POLLIN };
+    g_assert_cmpint(poll(&pfd, 1, 500), ==, 0);
+
+    g_assert_cmpint(write(go_fds[1], &c, 1), ==, 1);
+    g_assert_cmpint(waitpid(pid, NULL, 0), ==, pid);
+
+    /* ... and closes it once the child is gone */
+    g_assert_cmpint(poll(&pfd, 1, 10 * 1000), ==, 1);
+    g_assert_cmpint(read(pipe_fds[0], &c, 1), ==, 0);
+
+    close(pipe_fds[0]);
+    close(go_fds[1]);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/async-teardown/add-fd", test_add_fd);
+    return g_test_run();
+}
@@ -0,0 +1,203 @@
+/*
+ * Net queue batch delivery tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "net/net.h"
+#include "net/queue.h"
+
+#define MAX_PACKETS 64
+
+typedef struct TestReceiver {
+    /* Number of packets taken before the handler asks for queueing */
+    int accept;
+    /* Size of each batch handed to the handler */
+    int batches[MAX_PACKETS];
+    int nr_batches;
+    /* Senders and first bytes of the packets taken, in order */
+    NetClientState *senders[MAX_PACKETS];
+    uint8_t data[MAX_PACKETS];
+    int nr_packets;
+} TestReceiver;
+
+static ssize_t sent_lens[MAX_PACKETS];
+static int nr_sent;
+
+int qemu_can_send_packet(NetClientState *nc)
+{
+    return 1;
+}
+
+/* Report the first byte of a packet negated, so that it isn't its size */
+static ssize_t test_packet_ret(const struct iovec *iov, int iovcnt)
+{
+    uint8_t byte;
+
+    g_assert_cmpint(iov_to_buf(iov, iovcnt, 0, &byte, 1), ==, 1);
+    return -(ssize_t)byte - 1;
+}
+
+static ssize_t test_deliver(NetClientState *sender, unsigned flags,
+                            const struct iovec *iov, int iovcnt,
+                            void *opaque)
+{
+    g_assert_not_reached();
+}
+
+static int test_deliver_batch(NetClientState *sender, unsigned flags,
+                              const NetPacketIOV *pkts, int count,
+                              ssize_t *rets, void *opaque)
+{
+    TestReceiver *r = opaque;
+    int i;
+
+    g_assert_cmpint(count, >, 0);
+    r->batches[r->nr_batches++] = count;
+
+    for (i = 0; i < count && r->accept; i++, r->accept--) {
+        iov_to_buf(pkts[i].iov, pkts[i].iovcnt, 0, &r->data[r->nr_packets], 1);
+        r->senders[r->nr_packets++] = sender;
+        rets[i] = test_packet_ret(pkts[i].iov, pkts[i].iovcnt);
+    }
+
+    return i;
+}
+
+static void test_sent_cb(NetClientState *sender, ssize_t len)
+{
+    sent_lens[nr_sent++] = len;
+}
+
+static NetQueue *test_queue_new(TestReceiver *r, int accept)
+{
+    NetQueue *queue = qemu_new_net_queue(test_deliver, r);
+
+    memset(r, 0, sizeof(*r));
+    r->accept = accept;
+    nr_sent = 0;
+    qemu_net_queue_set_deliver_batch(queue, test_deliver_batch);
+    return queue;
+}
+
+static void test_packets_init(uint8_t *bufs, struct iovec *iov,
+                              NetPacketIOV *pkts, int count, uint8_t first)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        bufs[i] = first + i;
+        iov[i].iov_base = &bufs[i];
+        iov[i].iov_len = 1;
+        pkts[i].iov = &iov[i];
+        pkts[i].iovcnt = 1;
+    }
+}
+
+static void test_batch_all_sent(void)
+{
+    NetClientState sender = { };
+    TestReceiver r;
+    NetQueue *queue = test_queue_new(&r, INT_MAX);
+    uint8_t bufs[MAX_PACKETS];
+    struct iovec iov[MAX_PACKETS];
+    NetPacketIOV pkts[MAX_PACKETS];
+    int i;
+
+    /* More than a batch, the handler gets it in several parts */
+    test_packets_init(bufs, iov, pkts, 40, 0);
+    g_assert_cmpint(qemu_net_queue_send_iov_batch(queue, &sender, 0, pkts, 40,
+                                                  test_sent_cb), ==, 40);
+    g_assert_cmpint(r.nr_batches, ==, 2);
+    g_assert_cmpint(r.batches[0] + r.batches[1], ==, 40);
+    g_assert_cmpint(r.nr_packets, ==, 40);
+    for (i = 0; i < 40; i++) {
+        g_assert_cmpint(r.data[i], ==, i);
+    }
+    g_assert_cmpint(nr_sent, ==, 0);
+    g_assert_true(qemu_net_queue_flush(queue));
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_batch_queue_and_flush(void)
+{
+    NetClientState sender = { };
+    TestReceiver r;
+    NetQueue *queue = test_queue_new(&r, 2);
+    uint8_t bufs[MAX_PACKETS];
+    struct iovec iov[MAX_PACKETS];
+    NetPacketIOV pkts[MAX_PACKETS];
+
+    /* Only the first packet that isn't taken is queued */
+    test_packets_init(bufs, iov, pkts, 4, 10);
+    g_assert_cmpint(qemu_net_queue_send_iov_batch(queue, &sender, 0, pkts, 4,
+                                                  test_sent_cb), ==, 2);
+    g_assert_cmpint(r.nr_packets, ==, 2);
+    g_assert_false(qemu_net_queue_flush(queue));
+    g_assert_cmpint(nr_sent, ==, 0);
+
+    /* The callback gets the handler's return value, not the size */
+    r.accept = INT_MAX;
+    g_assert_true(qemu_net_queue_flush(queue));
+    g_assert_cmpint(r.nr_packets, ==, 3);
+    g_assert_cmpint(r.data[2], ==, 12);
+    g_assert_cmpint(nr_sent, ==, 1);
+    g_assert_cmpint(sent_lens[0], ==, -13);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_flush_batches(void)
+{
+    NetClientState a = { }, b = { };
+    TestReceiver r;
+    NetQueue *queue = test_queue_new(&r, 0);
+    uint8_t bufs[MAX_PACKETS];
+    struct iovec iov[MAX_PACKETS];
+    NetPacketIOV pkts[MAX_PACKETS];
+    int i;
+
+    /* Queue three packets from a then two from b */
+    test_packets_init(bufs, iov, pkts, 5, 20);
+    for (i = 0; i < 5; i++) {
+        qemu_net_queue_append_iov(queue, i < 3 ? &a : &b, 0,
+                                  pkts[i].iov, pkts[i].iovcnt, test_sent_cb);
+    }
+
+    /* A partial flush puts back what wasn't taken, in order */
+    r.accept = 1;
+    g_assert_false(qemu_net_queue_flush(queue));
+    g_assert_cmpint(r.nr_batches, ==, 1);
+    g_assert_cmpint(r.batches[0], ==, 3);
+    g_assert_cmpint(nr_sent, ==, 1);
+
+    /* Runs from the same sender are handed over as one batch */
+    r.accept = INT_MAX;
+    g_assert_true(qemu_net_queue_flush(queue));
+    g_assert_cmpint(r.nr_batches, ==, 3);
+    g_assert_cmpint(r.batches[1], ==, 2);
+    g_assert_cmpint(r.batches[2], ==, 2);
+    g_assert_cmpint(r.nr_packets, ==, 5);
+    for (i = 0; i < 5; i++) {
+        g_assert_cmpint(r.data[i], ==, 20 + i);
+        g_assert_true(r.senders[i] == (i < 3 ? &a : &b));
+        g_assert_cmpint(sent_lens[i], ==, -21 - i);
+    }
+    g_assert_cmpint(nr_sent, ==, 5);
+
+    qemu_del_net_queue(queue);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/queue/batch/all-sent", test_batch_all_sent);
+    g_test_add_func("/net/queue/batch/queue-and-flush",
+                    test_batch_queue_and_flush);
+    g_test_add_func("/net/queue/batch/flush", test_flush_batches);
+    return g_test_run();
+}
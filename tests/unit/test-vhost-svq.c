@@ -0,0 +1,235 @@
+/*
+ * vhost shadow virtqueue used buffers tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include "hw/virtio/vhost-shadow-virtqueue.c"
+
+#define SVQ_NUM 8
+
+/* The whole address space, mapped 1:1 */
+static const DMAMap identity_map = {
+    .size = HWADDR_MAX,
+    .perm = IOMMU_RW,
+};
+
+const DMAMap *vhost_iova_tree_find_iova(const VhostIOVATree *iova_tree,
+                                        const DMAMap *map)
+{
+    return &identity_map;
+}
+
+const DMAMap *vhost_iova_tree_find_gpa(const VhostIOVATree *iova_tree,
+                                       const DMAMap *map)
+{
+    return &identity_map;
+}
+
+/* Nothing comes from the guest, SVQ buffers are added by the tests */
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    g_assert_not_reached();
+}
+
+void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len)
+{
+    g_assert_not_reached();
+}
+
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
+    g_assert_not_reached();
+}
+
+void virtqueue_flush(VirtQueue *vq, unsigned int count)
+{
+    g_assert_not_reached();
+}
+
+void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
+                     unsigned int len)
+{
+    g_assert_not_reached();
+}
+
+void virtio_queue_set_notification(VirtQueue *vq, int enable)
+{
+    g_assert_not_reached();
+}
+
+int virtio_queue_empty(VirtQueue *vq)
+{
+    g_assert_not_reached();
+}
+
+int virtio_queue_get_num(VirtIODevice *vdev, int n)
+{
+    g_assert_not_reached();
+}
+
+uint16_t virtio_get_queue_index(VirtQueue *vq)
+{
+    g_assert_not_reached();
+}
+
+typedef struct TestSVQ {
+    VirtIODevice vdev;
+    VhostShadowVirtqueue *svq;
+    uint8_t bufs[SVQ_NUM][64];
+    VirtQueueElement *elems[SVQ_NUM];
+} TestSVQ;
+
+/* A split SVQ like vhost_svq_start() sets up, without a guest virtqueue */
+static void test_svq_init(TestSVQ *t, uint64_t features)
+{
+    VhostShadowVirtqueue *svq = vhost_svq_new(NULL, NULL);
+
+    memset(&t->vdev, 0, sizeof(t->vdev));
+    t->vdev.name = "test";
+    t->vdev.guest_features = features;
+
+    event_notifier_init(&svq->hdev_kick, 0);
+    svq->vdev = &t->vdev;
+    svq->in_order = virtio_vdev_has_feature(&t->vdev, VIRTIO_F_IN_ORDER);
+    svq->vring.num = SVQ_NUM;
+    svq->num_free = SVQ_NUM;
+    svq->vring.desc = g_malloc0(vhost_svq_driver_area_size(svq));
+    svq->vring.avail = (void *)((char *)svq->vring.desc +
+                                sizeof(vring_desc_t) * SVQ_NUM);
+    svq->vring.used = g_malloc0(vhost_svq_device_area_size(svq));
+    svq->desc_state = g_new0(SVQDescState, SVQ_NUM);
+    svq->desc_next = g_new0(uint16_t, SVQ_NUM);
+    for (unsigned i = 0; i < SVQ_NUM - 1; i++) {
+        svq->desc_next[i] = i + 1;
+    }
+    t->svq = svq;
+}
+
+static void test_svq_cleanup(TestSVQ *t)
+{
+    VhostShadowVirtqueue *svq = t->svq;
+
+    event_notifier_cleanup(&svq->hdev_kick);
+    g_free(svq->vring.desc);
+    g_free(svq->vring.used);
+    g_free(svq->desc_state);
+    g_free(svq->desc_next);
+    g_free(svq);
+}
+
+/* Make @n device writable buffers available, returning their ids */
+static void test_svq_add(TestSVQ *t, int n, uint16_t *ids)
+{
+    for (int i = 0; i < n; i++) {
+        struct iovec in = {
+            .iov_base = t->bufs[i],
+            .iov_len = sizeof(t->bufs[i]),
+        };
+
+        ids[i] = t->svq->free_head;
+        t->elems[i] = g_new0(VirtQueueElement, 1);
+        g_assert_cmpint(vhost_svq_add(t->svq, NULL, 0, NULL, &in, 1, NULL,
+                                      t->elems[i]), ==, 0);
+    }
+}
+
+/* The device marks buffer @id used with @len bytes written */
+static void test_svq_use(TestSVQ *t, uint16_t id, uint32_t len)
+{
+    vring_used_t *used = t->svq->vring.used;
+    uint16_t idx = le16_to_cpu(used->idx);
+
+    used->ring[idx % SVQ_NUM].id = cpu_to_le32(id);
+    used->ring[idx % SVQ_NUM].len = cpu_to_le32(len);
+    used->idx = cpu_to_le16(idx + 1);
+}
+
+static void test_svq_get(TestSVQ *t, int i, uint32_t expected_len)
+{
+    uint32_t len = UINT32_MAX;
+    VirtQueueElement *elem = vhost_svq_get_buf(t->svq, &len);
+
+    g_assert_true(elem == t->elems[i]);
+    g_assert_cmpint(len, ==, expected_len);
+    g_free(elem);
+}
+
+/* Each used entry reports the length of its own buffer */
+static void test_svq_used(void)
+{
+    TestSVQ t;
+    uint16_t ids[3];
+    uint32_t len;
+
+    test_svq_init(&t, 0);
+    test_svq_add(&t, 3, ids);
+
+    test_svq_use(&t, ids[1], 20);
+    test_svq_use(&t, ids[0], 10);
+    test_svq_get(&t, 1, 20);
+    test_svq_get(&t, 0, 10);
+    g_assert_null(vhost_svq_get_buf(t.svq, &len));
+
+    test_svq_use(&t, ids[2], 30);
+    test_svq_get(&t, 2, 30);
+    g_assert_cmpint(t.svq->num_free, ==, SVQ_NUM);
+
+    test_svq_cleanup(&t);
+}
+
+/*
+ * An in order device marks a batch used with the entry of its last buffer.
+ * The length written in the other ones is unknown, so they report 0.
+ */
+static void test_svq_in_order_batch(void)
+{
+    TestSVQ t;
+    uint16_t ids[4];
+    uint32_t len;
+
+    test_svq_init(&t, BIT_ULL(VIRTIO_F_IN_ORDER));
+    test_svq_add(&t, 4, ids);
+
+    test_svq_use(&t, ids[2], 42);
+    test_svq_get(&t, 0, 0);
+    test_svq_get(&t, 1, 0);
+    test_svq_get(&t, 2, 42);
+    g_assert_null(vhost_svq_get_buf(t.svq, &len));
+
+    test_svq_use(&t, ids[3], 7);
+    test_svq_get(&t, 3, 7);
+    g_assert_cmpint(t.svq->num_free, ==, SVQ_NUM);
+
+    test_svq_cleanup(&t);
+}
+
+/* vhost_svq_poll() only counts what the device reported */
+static void test_svq_in_order_poll(void)
+{
+    TestSVQ t;
+    uint16_t ids[3];
+
+    test_svq_init(&t, BIT_ULL(VIRTIO_F_IN_ORDER));
+    test_svq_add(&t, 3, ids);
+
+    test_svq_use(&t, ids[2], 1);
+    g_assert_cmpint(vhost_svq_poll(t.svq, 3), ==, 1);
+    g_assert_cmpint(t.svq->num_free, ==, SVQ_NUM);
+
+    test_svq_cleanup(&t);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/vhost/svq/used", test_svq_used);
+    g_test_add_func("/vhost/svq/in-order/batch", test_svq_in_order_batch);
+    g_test_add_func("/vhost/svq/in-order/poll", test_svq_in_order_poll);
+    return g_test_run();
+}
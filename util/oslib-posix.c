@@ -62,6 +62,8 @@
 #include "qemu/mmap-alloc.h"
 
 #define MAX_MEM_PREALLOC_THREAD_COUNT 16
+/* Granularity of background preallocation, for progress and cancellation */
+#define BACKGROUND_PREALLOC_CHUNK (64 * MiB)
 
 struct MemsetThread;
 
@@ -74,8 +76,15 @@ typedef struct MemsetContext {
     struct MemsetThread *threads;
     int num_threads;
     QLIST_ENTRY(MemsetContext) next;
+    /* Background preallocation only */
+    bool cancel;
+    size_t populated;
 } MemsetContext;
 
+struct BackgroundPrealloc {
+    MemsetContext *context;
+};
+
 struct MemsetThread {
     char *addr;
     size_t numpages;
@@ -83,6 +92,10 @@ struct MemsetThread {
     QemuThread pgthread;
     sigjmp_buf env;
     MemsetContext *context;
+    /* next range touched by the same thread */
+    struct MemsetThread *next;
+    /* touched by the thread of a previous range, pgthread is unused */
+    bool chained;
 };
 typedef struct MemsetThread MemsetThread;
 
@@ -340,7 +353,7 @@ static void sigbus_handler(int signal)
         for (i = 0; i < sigbus_memset_context->num_threads; i++) {
             MemsetThread *thread = &sigbus_memset_context->threads[i];
 
-            if (qemu_thread_is_self(&thread->pgthread)) {
+            if (!thread->chained && qemu_thread_is_self(&thread->pgthread)) {
                 siglongjmp(thread->env, 1);
             }
         }
@@ -392,21 +405,28 @@ static void *do_touch_pages(void *arg)
     if (sigsetjmp(memset_args->env, 1)) {
         ret = -EFAULT;
     } else {
-        char *addr = memset_args->addr;
-        size_t numpages = memset_args->numpages;
-        size_t hpagesize = memset_args->hpagesize;
-        size_t i;
-        for (i = 0; i < numpages; i++) {
-            /*
-             * Read & write back the same value, so we don't
-             * corrupt existing user/app data that might be
-             * stored.
-             *
-             * 'volatile' to stop compiler optimizing this away
-             * to a no-op
-             */
-            *(volatile char *)addr = *addr;
-            addr += hpagesize;
+        MemsetThread *range;
+
+        for (range = memset_args; range; range = range->next) {
+            char *addr = range->addr;
+            size_t numpages = range->numpages;
+            size_t hpagesize = range->hpagesize;
+            size_t i;
+            for (i = 0; i < numpages; i++) {
+                /*
+                 * Read & write back the same value, so we don't
+                 * corrupt existing user/app data that might be
+                 * stored.
+                 *
+                 * 'volatile' to stop compiler optimizing this away
+                 * to a no-op
+                 */
+                *(volatile char *)addr = *addr;
+                addr += hpagesize;
+            }
+            trace_qemu_prealloc_mem_done(range->addr,
+                                         range->numpages * range->hpagesize,
+                                         0);
         }
     }
     pthread_sigmask(SIG_SETMASK, &oldset, NULL);
@@ -416,8 +436,7 @@ static void *do_touch_pages(void *arg)
 static void *do_madv_populate_write_pages(void *arg)
 {
     MemsetThread *memset_args = (MemsetThread *)arg;
-    const size_t size = memset_args->numpages * memset_args->hpagesize;
-    char * const addr = memset_args->addr;
+    MemsetThread *range;
     int ret = 0;
 
     /* See do_touch_pages(). */
@@ -427,8 +446,55 @@ static void *do_madv_populate_write_pages(void *arg)
     }
     qemu_mutex_unlock(&page_mutex);
 
-    if (size && qemu_madvise(addr, size, QEMU_MADV_POPULATE_WRITE)) {
-        ret = -errno;
+    for (range = memset_args; range && !ret; range = range->next) {
+        const size_t size = range->numpages * range->hpagesize;
+
+        if (size && qemu_madvise(range->addr, size,
+                                 QEMU_MADV_POPULATE_WRITE)) {
+            ret = -errno;
+        }
+        trace_qemu_prealloc_mem_done(range->addr, size, ret);
+    }
+    return (void *)(uintptr_t)ret;
+}
+
+static void *do_madv_populate_write_background(void *arg)
+{
+    MemsetThread *memset_args = (MemsetThread *)arg;
+    MemsetContext *context = memset_args->context;
+    MemsetThread *range;
+    int ret = 0;
+
+#ifdef SCHED_IDLE
+    {
+        struct sched_param param = { 0 };
+
+        /* Only use CPU time that nobody else wants */
+        pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    }
+#endif
+
+    /*
+     * Unlike touching the pages, MADV_POPULATE_WRITE never changes their
+     * content, so the guest may run and fault pages in concurrently.
+     */
+    for (range = memset_args; range && !ret; range = range->next) {
+        const size_t chunk = ROUND_UP(BACKGROUND_PREALLOC_CHUNK,
+                                      range->hpagesize);
+        char *addr = range->addr;
+        char *end = addr + range->numpages * range->hpagesize;
+
+        while (addr < end && !qatomic_read(&context->cancel)) {
+            size_t len = MIN(chunk, end - addr);
+
+            if (qemu_madvise(addr, len, QEMU_MADV_POPULATE_WRITE)) {
+                ret = -errno;
+                break;
+            }
+            qatomic_add(&context->populated, len);
+            addr += len;
+        }
+        trace_qemu_prealloc_mem_done(range->addr, addr - range->addr, ret);
     }
     return (void *)(uintptr_t)ret;
 }
@@ -457,6 +523,9 @@ static int wait_and_free_mem_prealloc_context(MemsetContext *context)
     int i, ret = 0, tmp;
 
     for (i = 0; i < context->num_threads; i++) {
+        if (context->threads[i].chained) {
+            continue;
+        }
         tmp = (uintptr_t)qemu_thread_join(&context->threads[i].pgthread);
 
         if (tmp) {
@@ -468,27 +537,108 @@ static int wait_and_free_mem_prealloc_context(MemsetContext *context)
     return ret;
 }
 
-static int touch_all_pages(char *area, size_t hpagesize, size_t numpages,
-                           int max_threads, ThreadContext *tc, bool async,
+/*
+ * Share @num_threads threads between @areas.  Each area gets one, and the
+ * others are given to the areas in proportion to their size, so that all
+ * areas are touched from their own context.  With fewer threads than
+ * areas, a thread touches several areas one after the other, from the
+ * context of the first one.
+ */
+static void memset_context_create_threads(MemsetContext *context,
+                                          const PreallocArea *areas,
+                                          int nr_areas, size_t hpagesize,
+                                          int num_threads, const char *name,
+                                          void *(*touch_fn)(void *))
+{
+    g_autofree int *area_ranges = g_new(int, nr_areas);
+    size_t numpages = 0, area_numpages, numpages_per_range, leftover;
+    int spare = MAX(num_threads - nr_areas, 0);
+    int nr_ranges = 0, i = 0, j, k;
+    MemsetThread *range;
+    char *addr;
+
+    for (j = 0; j < nr_areas; j++) {
+        numpages += DIV_ROUND_UP(areas[j].size, hpagesize);
+    }
+    for (j = 0; j < nr_areas; j++) {
+        area_numpages = DIV_ROUND_UP(areas[j].size, hpagesize);
+        area_ranges[j] = MIN(1 + spare * area_numpages / numpages,
+                             area_numpages);
+        nr_ranges += area_ranges[j];
+    }
+
+    context->threads = g_new0(MemsetThread, nr_ranges);
+    context->num_threads = nr_ranges;
+
+    for (j = 0; j < nr_areas; j++) {
+        ThreadContext *tc = areas[j].tc;
+
+        if (!area_ranges[j]) {
+            continue;
+        }
+        addr = areas[j].area;
+        area_numpages = DIV_ROUND_UP(areas[j].size, hpagesize);
+        numpages_per_range = area_numpages / area_ranges[j];
+        leftover = area_numpages % area_ranges[j];
+        trace_qemu_prealloc_mem_area(addr, area_numpages * hpagesize,
+                                     area_ranges[j]);
+
+        for (k = 0; k < area_ranges[j]; k++, i++) {
+            range = &context->threads[i];
+            range->addr = addr;
+            range->numpages = numpages_per_range + (k < leftover);
+            range->hpagesize = hpagesize;
+            range->context = context;
+            addr += range->numpages * hpagesize;
+
+            /* Range i is touched by thread i * num_threads / nr_ranges */
+            if (i && i * num_threads / nr_ranges ==
+                     (i - 1) * num_threads / nr_ranges) {
+                range->chained = true;
+                context->threads[i - 1].next = range;
+                continue;
+            }
+
+            if (tc) {
+                thread_context_create_thread(tc, &range->pgthread, name,
+                                             touch_fn, range,
+                                             QEMU_THREAD_JOINABLE);
+            } else {
+                qemu_thread_create(&range->pgthread, name, touch_fn, range,
+                                   QEMU_THREAD_JOINABLE);
+            }
+        }
+    }
+}
+
+static int touch_all_pages(const PreallocArea *areas, int nr_areas,
+                           size_t hpagesize, int max_threads, bool async,
                            bool use_madv_populate_write)
 {
     static gsize initialized = 0;
-    MemsetContext *context = g_malloc0(sizeof(MemsetContext));
-    size_t numpages_per_thread, leftover;
+    MemsetContext *context;
+    size_t numpages = 0;
     void *(*touch_fn)(void *);
-    int ret, i = 0;
-    char *addr = area;
+    int ret, num_threads, j;
 
-    /*
-     * Asynchronous preallocation is only allowed when using MADV_POPULATE_WRITE
-     * and prealloc context for thread placement.
-     */
-    if (!use_madv_populate_write || !tc) {
+    for (j = 0; j < nr_areas; j++) {
+        numpages += DIV_ROUND_UP(areas[j].size, hpagesize);
+        /*
+         * Asynchronous preallocation is only allowed when using
+         * MADV_POPULATE_WRITE and prealloc context for thread placement.
+         */
+        if (!areas[j].tc) {
+            async = false;
+        }
+    }
+    if (!use_madv_populate_write) {
         async = false;
     }
+    if (!numpages) {
+        return 0;
+    }
 
-    context->num_threads =
-        get_memset_num_threads(hpagesize, numpages, max_threads);
+    num_threads = get_memset_num_threads(hpagesize, numpages, max_threads);
 
     if (g_once_init_enter(&initialized)) {
         qemu_mutex_init(&page_mutex);
@@ -501,40 +651,25 @@ static int touch_all_pages(char *area, size_t hpagesize, size_t numpages,
          * Avoid creating a single thread for MADV_POPULATE_WRITE when
          * preallocating synchronously.
          */
-        if (context->num_threads == 1 && !async) {
-            ret = 0;
-            if (qemu_madvise(area, hpagesize * numpages,
-                             QEMU_MADV_POPULATE_WRITE)) {
-                ret = -errno;
+        if (num_threads == 1 && !async) {
+            for (j = 0; j < nr_areas; j++) {
+                if (areas[j].size &&
+                    qemu_madvise(areas[j].area,
+                                 ROUND_UP(areas[j].size, hpagesize),
+                                 QEMU_MADV_POPULATE_WRITE)) {
+                    return -errno;
+                }
             }
-            g_free(context);
-            return ret;
+            return 0;
         }
         touch_fn = do_madv_populate_write_pages;
     } else {
         touch_fn = do_touch_pages;
     }
 
-    context->threads = g_new0(MemsetThread, context->num_threads);
-    numpages_per_thread = numpages / context->num_threads;
-    leftover = numpages % context->num_threads;
-    for (i = 0; i < context->num_threads; i++) {
-        context->threads[i].addr = addr;
-        context->threads[i].numpages = numpages_per_thread + (i < leftover);
-        context->threads[i].hpagesize = hpagesize;
-        context->threads[i].context = context;
-        if (tc) {
-            thread_context_create_thread(tc, &context->threads[i].pgthread,
-                                         "touch_pages",
-                                         touch_fn, &context->threads[i],
-                                         QEMU_THREAD_JOINABLE);
-        } else {
-            qemu_thread_create(&context->threads[i].pgthread, "touch_pages",
-                               touch_fn, &context->threads[i],
-                               QEMU_THREAD_JOINABLE);
-        }
-        addr += context->threads[i].numpages * hpagesize;
-    }
+    context = g_new0(MemsetContext, 1);
+    memset_context_create_threads(context, areas, nr_areas, hpagesize,
+                                  num_threads, "touch_pages", touch_fn);
 
     if (async) {
         /*
@@ -605,6 +740,19 @@ static bool madv_populate_write_possible(char *area, size_t pagesize)
 
 bool qemu_prealloc_mem(int fd, char *area, size_t sz, int max_threads,
                        ThreadContext *tc, bool async, Error **errp)
+{
+    PreallocArea prealloc_area = {
+        .area = area,
+        .size = sz,
+        .tc = tc,
+    };
+
+    return qemu_prealloc_mem_areas(fd, &prealloc_area, 1, max_threads,
+                                   async, errp);
+}
+
+bool qemu_prealloc_mem_areas(int fd, const PreallocArea *areas, int nr_areas,
+                             int max_threads, bool async, Error **errp)
 {
     static gsize initialized;
     int ret;
@@ -617,7 +765,6 @@ bool qemu_prealloc_mem(int fd, char *area, size_t sz, int max_threads,
      */
     size_t hpagesize = qemu_real_host_page_size();
 #endif
-    size_t numpages = DIV_ROUND_UP(sz, hpagesize);
     bool use_madv_populate_write;
     struct sigaction act;
     bool rv = true;
@@ -626,7 +773,8 @@ bool qemu_prealloc_mem(int fd, char *area, size_t sz, int max_threads,
      * Sense on every invocation, as MADV_POPULATE_WRITE cannot be used for
      * some special mappings, such as mapping /dev/mem.
      */
-    use_madv_populate_write = madv_populate_write_possible(area, hpagesize);
+    use_madv_populate_write = madv_populate_write_possible(areas[0].area,
+                                                           hpagesize);
 
     if (!use_madv_populate_write) {
         if (g_once_init_enter(&initialized)) {
@@ -654,7 +802,7 @@ bool qemu_prealloc_mem(int fd, char *area, size_t sz, int max_threads,
     }
 
     /* touch pages simultaneously */
-    ret = touch_all_pages(area, hpagesize, numpages, max_threads, tc, async,
+    ret = touch_all_pages(areas, nr_areas, hpagesize, max_threads, async,
                           use_madv_populate_write);
     if (ret) {
         error_setg_errno(errp, -ret,
@@ -674,6 +822,53 @@ bool qemu_prealloc_mem(int fd, char *area, size_t sz, int max_threads,
     return rv;
 }
 
+BackgroundPrealloc *qemu_prealloc_mem_background(int fd,
+                                                const PreallocArea *areas,
+                                                int nr_areas, int max_threads)
+{
+#ifndef EMSCRIPTEN
+    size_t hpagesize = qemu_fd_getpagesize(fd);
+#else
+    /* See qemu_prealloc_mem_areas(). */
+    size_t hpagesize = qemu_real_host_page_size();
+#endif
+    size_t numpages = 0;
+    BackgroundPrealloc *bp;
+    MemsetContext *context;
+    int j;
+
+    for (j = 0; j < nr_areas; j++) {
+        numpages += DIV_ROUND_UP(areas[j].size, hpagesize);
+    }
+    if (!numpages || !madv_populate_write_possible(areas[0].area, hpagesize)) {
+        return NULL;
+    }
+
+    context = g_new0(MemsetContext, 1);
+    context->all_threads_created = true;
+    memset_context_create_threads(context, areas, nr_areas, hpagesize,
+                                  get_memset_num_threads(hpagesize, numpages,
+                                                         max_threads),
+                                  "prealloc_bg",
+                                  do_madv_populate_write_background);
+
+    bp = g_new0(BackgroundPrealloc, 1);
+    bp->context = context;
+    return bp;
+}
+
+size_t qemu_prealloc_mem_background_progress(BackgroundPrealloc *bp)
+{
+    return qatomic_read(&bp->context->populated);
+}
+
+void qemu_prealloc_mem_background_stop(BackgroundPrealloc *bp)
+{
+    qatomic_set(&bp->context->cancel, true);
+    wait_and_free_mem_prealloc_context(bp->context);
+    g_free(bp);
+}
+
 char *qemu_get_pid_name(pid_t pid)
 {
     char *name = NULL;
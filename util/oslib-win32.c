@@ -278,12 +278,44 @@ bool qemu_prealloc_mem(int fd, char *area, size_t sz, int max_threads,
     return true;
 }
 
+bool qemu_prealloc_mem_areas(int fd, const PreallocArea *areas, int nr_areas,
+                             int max_threads, bool async, Error **errp)
+{
+    int i;
+
+    for (i = 0; i < nr_areas; i++) {
+        if (!qemu_prealloc_mem(fd, areas[i].area, areas[i].size, max_threads,
+                               areas[i].tc, async, errp)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 bool qemu_finish_async_prealloc_mem(Error **errp)
 {
     /* async prealloc not supported, there is nothing to finish */
     return true;
 }
 
+BackgroundPrealloc *qemu_prealloc_mem_background(int fd,
+                                                const PreallocArea *areas,
+                                                int nr_areas, int max_threads)
+{
+    /* background prealloc not supported, it is done in the foreground */
+    return NULL;
+}
+
+size_t qemu_prealloc_mem_background_progress(BackgroundPrealloc *bp)
+{
+    g_assert_not_reached();
+}
+
+void qemu_prealloc_mem_background_stop(BackgroundPrealloc *bp)
+{
+    g_assert_not_reached();
+}
+
 char *qemu_get_pid_name(pid_t pid)
 {
     /* XXX Implement me */